@@ -458,6 +458,8 @@ typedef struct _rfbInteractionCapsMsg {
 #define rfbEnableContinuousUpdates 150
 #define rfbEndOfContinuousUpdates 150
 
+#define rfbRequestKeyframe 160
+
 #define rfbSetDesktopSize 251
 
 #define rfbGIIClient 253
@@ -470,6 +472,7 @@ typedef struct _rfbInteractionCapsMsg {
 #define sig_rfbFileDownloadCancel "FTC_DNCN"
 #define sig_rfbFileUploadFailed "FTC_UPFL"
 #define sig_rfbFileCreateDirRequest "FTC_FCDR"
+#define sig_rfbRequestKeyframe "KEYFRAME"
 #define sig_rfbGIIClient "GII_CLNT"
 
 
@@ -568,10 +571,12 @@ typedef struct _rfbInteractionCapsMsg {
 
 #define rfbEncodingXCursor         0xFFFFFF10
 #define rfbEncodingRichCursor      0xFFFFFF11
+#define rfbEncodingCursorCache     0xFFFFFF12
 #define rfbEncodingPointerPos      0xFFFFFF18
 
 #define rfbEncodingLastRect        0xFFFFFF20
 #define rfbEncodingNewFBSize       0xFFFFFF21
+#define rfbEncodingVideoRegion     0xFFFFFF22
 
 #define rfbEncodingQualityLevel0   0xFFFFFFE0
 #define rfbEncodingQualityLevel1   0xFFFFFFE1
@@ -590,9 +595,11 @@ typedef struct _rfbInteractionCapsMsg {
 #define sig_rfbEncodingCompressLevel0  "COMPRLVL"
 #define sig_rfbEncodingXCursor         "X11CURSR"
 #define sig_rfbEncodingRichCursor      "RCHCURSR"
+#define sig_rfbEncodingCursorCache     "CURCACHE"
 #define sig_rfbEncodingPointerPos      "POINTPOS"
 #define sig_rfbEncodingLastRect        "LASTRECT"
 #define sig_rfbEncodingNewFBSize       "NEWFBSIZ"
+#define sig_rfbEncodingVideoRegion     "VIDEORGN"
 #define sig_rfbEncodingFineQualityLevel0 "FINEQLVL"
 #define sig_rfbEncodingSubsamp1X       "SSAMPLVL"
 #define sig_rfbEncodingQualityLevel0   "JPEGQLVL"
@@ -965,6 +972,73 @@ typedef struct _rfbXCursorColors {
  */
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * CursorCache encoding. A client that supports this pseudo-encoding (in
+ * addition to XCursor and/or RichCursor) keeps rfbCursorCacheSize cursor
+ * shapes, and the server decides which slot each shape occupies. Cursor shape
+ * updates are then sent with this encoding instead of XCursor or RichCursor.
+ * The coordinates in rfbFramebufferUpdateRectHeader hold the hotspot position
+ * (r.x, r.y) and cursor size (r.w, r.h), and an rfbCursorCacheHeader follows
+ * the rectangle header.
+ *
+ * If op is rfbCursorCacheStore, then the header is followed by cursor data in
+ * the format given by the encoding field (rfbEncodingXCursor or
+ * rfbEncodingRichCursor), exactly as if a rectangle of that encoding had been
+ * sent with the same rectangle header. The client sets the cursor and also
+ * stores it in the given slot, replacing any cursor that was there.
+ *
+ * If op is rfbCursorCacheUse, then no other data follows, and the client sets
+ * the cursor to the one stored in the given slot. The encoding field is
+ * unused.
+ *
+ * Empty (hidden) cursors are never cached, and they are always sent using
+ * XCursor or RichCursor. The cache is reset whenever the client sends
+ * SetEncodings or SetPixelFormat, so the server will store each shape again
+ * before referencing it.
+ */
+
+#define rfbCursorCacheSize 32
+
+#define rfbCursorCacheStore 0
+#define rfbCursorCacheUse 1
+
+typedef struct _rfbCursorCacheHeader {
+    CARD8 op;
+    CARD8 pad;
+    CARD16 slot;
+    CARD32 encoding;
+} rfbCursorCacheHeader;
+
+#define sz_rfbCursorCacheHeader 8
+
+
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * VideoRegion encoding. A client that supports this pseudo-encoding also
+ * receives the H.264/RTSP stream of each RandR output, and it composites the
+ * two: within the video region, it displays the H.264 stream of the output
+ * that covers that part of the screen, and everywhere else, it displays the
+ * framebuffer that it maintains from RFB updates. The server does not send
+ * RFB updates for the video region, and it does not send CopyRects whose
+ * source lies in the video region, so the client's framebuffer contents are
+ * undefined there. When part of the screen leaves the video region, the
+ * server sends it as ordinary pixel data in the same framebuffer update that
+ * contains the new video region.
+ *
+ * The coordinates in rfbFramebufferUpdateRectHeader hold the extents of the
+ * video region (all zero if it is empty), and an rfbVideoRegionHeader follows
+ * the rectangle header. The header is followed by nRects rfbRectangle
+ * structures, in framebuffer coordinates, which together make up the new
+ * video region. The region is empty until the first VideoRegion rectangle is
+ * received.
+ */
+
+typedef struct _rfbVideoRegionHeader {
+    CARD32 nRects;
+} rfbVideoRegionHeader;
+
+#define sz_rfbVideoRegionHeader 4
+
+
 /*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * ZRLE - encoding combining Zlib compression, tiling, palettisation and
  * run-length encoding.
@@ -1421,6 +1495,26 @@ typedef struct _rfbEnableContinuousUpdatesMsg {
 
 #define sz_rfbEnableContinuousUpdatesMsg 10
 
+/*-----------------------------------------------------------------------------
+ * RequestKeyframe - ask the server to encode the next frame of one or all of
+ * its H.264 video streams as a keyframe.  A viewer sends this when it detects
+ * a decoding error, so that it can recover without reconnecting.  The server
+ * advertises support for this message in its list of client message
+ * capabilities.
+ */
+
+typedef struct _rfbRequestKeyframeMsg {
+    CARD8 type;                 /* always rfbRequestKeyframe */
+    CARD8 pad1;
+    CARD16 pad2;
+    CARD32 id;                  /* RandR output ID of the stream, or
+                                   rfbKeyframeAllOutputs */
+} rfbRequestKeyframeMsg;
+
+#define sz_rfbRequestKeyframeMsg 8
+
+#define rfbKeyframeAllOutputs 0xFFFFFFFF
+
 /*-----------------------------------------------------------------------------
  * SetDesktopSize
  */
@@ -1640,6 +1734,7 @@ typedef union _rfbClientToServerMsg {
     rfbFileUploadFailedMsg fuf;
     rfbFileCreateDirRequestMsg fcdr;
     rfbEnableContinuousUpdatesMsg ecu;
+    rfbRequestKeyframeMsg rk;
     rfbFenceMsg f;
     rfbSetDesktopSizeMsg sds;
     rfbGIIClientVersionMsg giicv;
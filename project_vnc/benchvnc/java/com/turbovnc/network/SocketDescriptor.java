@@ -178,6 +178,10 @@ public class SocketDescriptor implements FileDescriptor {
     return channel.socket();
   }
 
+  public SocketChannel getChannel() {
+    return channel;
+  }
+
   public SocketAddress getRemoteAddress() {
     if (isConnected())
       return channel.socket().getRemoteSocketAddress();
@@ -21,6 +21,7 @@
 package com.turbovnc.rdr;
 
 import com.turbovnc.network.*;
+import com.turbovnc.vncviewer.VncViewer;
 import java.nio.channels.SelectionKey;
 
 public class FdInStream extends InStream {
@@ -28,6 +29,10 @@ public class FdInStream extends InStream {
   static final int DEFAULT_BUF_SIZE = 131072;
   static final int MIN_BULK_SIZE = 1024;
 
+  // If true, then connected sockets are read by an FdInStreamReader thread.
+  static final boolean PREFETCH =
+    VncViewer.getBooleanProperty("turbovnc.prefetch", true);
+
   static final double getTime() {
     return (double)System.nanoTime() / 1.0e9;
   }
@@ -104,6 +109,8 @@ public class FdInStream extends InStream {
 
   public final void startTiming() {
     timing = true;
+    if (reader != null)
+      reader.setTiming(true);
 
     // Carry over up to 1s worth of previous rate for smoothing.
 
@@ -115,6 +122,14 @@ public class FdInStream extends InStream {
 
   public final void stopTiming() {
     timing = false;
+    if (reader != null) {
+      long[] totals = { timeWaitedIn100us, timedKbits };
+
+      reader.setTiming(false);
+      reader.takeTiming(totals);
+      timeWaitedIn100us = totals[0];
+      timedKbits = totals[1];
+    }
     if (timeWaitedIn100us < timedKbits / 2)
       timeWaitedIn100us = timedKbits / 2;  // upper limit 20Mbit/s
   }
@@ -141,7 +156,7 @@ public class FdInStream extends InStream {
     int bytesToRead;
     while (end < itemSize) {
       bytesToRead = bufSize - end;
-      if (!timing) {
+      if (!timing && reader == null) {
         // When not timing, we must be careful not to read too much
         // extra data into the buffer. Otherwise, the line speed
         // estimation might stay at zero for a long time: All reads
@@ -167,6 +182,20 @@ public class FdInStream extends InStream {
     return nItems;
   }
 
+  // Start the reader thread the first time that data is read from a
+  // connected socket.
+  private FdInStreamReader getReader() {
+    if (reader == null && PREFETCH && fd instanceof SocketDescriptor) {
+      SocketDescriptor sd = (SocketDescriptor)fd;
+      if (sd.isConnected()) {
+        reader = new FdInStreamReader(sd.getChannel(),
+                                      FdInStreamReader.DEFAULT_RING_SIZE);
+        reader.setTiming(timing);
+      }
+    }
+    return reader;
+  }
+
   protected int readWithTimeoutOrCallback(byte[] buf, int bufPtr, int len,
                                           boolean wait) {
     long before = 0;
@@ -174,6 +203,17 @@ public class FdInStream extends InStream {
       before = System.nanoTime();
 
     int n;
+    FdInStreamReader r = getReader();
+    if (r != null) {
+      // The reader thread wakes us when data arrives, so there is no need to
+      // poll the socket using the block callback.  The reader thread also
+      // times the socket reads, since the time spent here is only the time
+      // spent copying from its buffer.
+      return r.read(buf, bufPtr, len, wait,
+                    (timeoutms == 0 && blockCallback != null) ? -1 :
+                    timeoutms);
+    }
+
     while (true) {
       do {
         Integer tv;
@@ -201,24 +241,31 @@ public class FdInStream extends InStream {
 
     if (n == 0) throw new EndOfStream();
 
-    if (timing) {
-      long after = System.nanoTime();
-      long newTimeWaited = (after - before) / 100000;
-      int newKbits = n * 8 / 1000;
+    if (timing) updateTiming(before, n);
 
-      // limit rate to between 10kbit/s and 40Mbit/s
+    return n;
+  }
 
-      if (newTimeWaited > newKbits * 1000) {
-        newTimeWaited = newKbits * 1000;
-      } else if (newTimeWaited < newKbits / 4) {
-        newTimeWaited = newKbits / 4;
-      }
+  private void updateTiming(long before, int n) {
+    timeWaitedIn100us += clampTimeWaited(System.nanoTime() - before, n);
+    timedKbits += n * 8 / 1000;
+  }
 
-      timeWaitedIn100us += newTimeWaited;
-      timedKbits += newKbits;
+  // Return the time waited for a read of n bytes that took the given number
+  // of nanoseconds, in units of 100 us.
+  static long clampTimeWaited(long nanos, int n) {
+    long newTimeWaited = nanos / 100000;
+    int newKbits = n * 8 / 1000;
+
+    // limit rate to between 10kbit/s and 40Mbit/s
+
+    if (newTimeWaited > newKbits * 1000) {
+      newTimeWaited = newKbits * 1000;
+    } else if (newTimeWaited < newKbits / 4) {
+      newTimeWaited = newKbits / 4;
     }
 
-    return n;
+    return newTimeWaited;
   }
 
   private int readWithTimeoutOrCallback(byte[] buf, int bufPtr, int len) {
@@ -230,6 +277,10 @@ public class FdInStream extends InStream {
   }
 
   public void setFd(FileDescriptor fd_) {
+    if (reader != null) {
+      reader.stop();
+      reader = null;
+    }
     fd = fd_;
   }
 
@@ -238,6 +289,7 @@ public class FdInStream extends InStream {
   }
 
   private FileDescriptor fd;
+  private FdInStreamReader reader;
   boolean closeWhenDone;
   protected int timeoutms;
   private FdInStreamBlockCallback blockCallback;
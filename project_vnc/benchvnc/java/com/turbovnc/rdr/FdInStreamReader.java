@@ -0,0 +1,226 @@
+/*
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ */
+
+//
+// FdInStreamReader reads from a SocketChannel on a separate thread, so that
+// the next framebuffer update is received while the current one is being
+// decoded.  The thread waits for the channel to become readable and then
+// reads as much data as is available into a large direct ByteBuffer, which is
+// used as a ring buffer.  FdInStream copies data out of the ring buffer in
+// bulk, waiting for the reader thread (rather than polling the socket) when
+// the ring buffer is empty.  Since the RFB thread no longer waits on the
+// socket, the reader thread also measures the time spent waiting for data,
+// which FdInStream uses to estimate the line speed.
+//
+
+package com.turbovnc.rdr;
+
+import java.io.IOException;
+import java.nio.*;
+import java.nio.channels.*;
+
+class FdInStreamReader implements Runnable {
+
+  static final int DEFAULT_RING_SIZE = 4 * 1024 * 1024;
+  static final int SELECT_TIMEOUT = 100;  // ms
+
+  FdInStreamReader(SocketChannel channel_, int ringSize) {
+    channel = channel_;
+    ring = ByteBuffer.allocateDirect(ringSize);
+    capacity = ring.capacity();
+    consumerView = ring.duplicate();
+    thread = new Thread(this, "FdInStreamReader");
+    thread.setDaemon(true);
+    thread.start();
+  }
+
+  // Reader thread
+  public void run() {
+    ByteBuffer producerView = ring.duplicate();
+    Selector selector = null;
+    long waitStart = System.nanoTime();
+
+    try {
+      selector = Selector.open();
+      channel.register(selector, SelectionKey.OP_READ);
+
+      while (channel.isOpen()) {
+        int start, len;
+
+        synchronized(this) {
+          if (tail - head == capacity) {
+            while (tail - head == capacity && !stopped)
+              wait();
+            // Time spent waiting for the RFB thread isn't network time.
+            waitStart = System.nanoTime();
+          }
+          if (stopped)
+            break;
+          start = (int)(tail % capacity);
+          len = (int)Math.min(capacity - start, capacity - (tail - head));
+        }
+
+        selector.selectedKeys().clear();
+        if (selector.select(SELECT_TIMEOUT) == 0)
+          continue;
+
+        ((Buffer)producerView).limit(start + len);
+        ((Buffer)producerView).position(start);
+        int n = channel.read(producerView);
+        long now = System.nanoTime();
+
+        synchronized(this) {
+          if (n < 0) {
+            eof = true;
+            notifyAll();
+            break;
+          }
+          if (n > 0) {
+            if (timing) {
+              long nanos = now - Math.max(waitStart, timingStart);
+              timeWaitedIn100us += FdInStream.clampTimeWaited(nanos, n);
+              timedKbits += n * 8 / 1000;
+            }
+            tail += n;
+            notifyAll();
+          }
+        }
+        if (n > 0)
+          waitStart = now;
+      }
+    } catch (ClosedChannelException e) {
+      synchronized(this) {
+        eof = true;
+        notifyAll();
+      }
+    } catch (IOException e) {
+      synchronized(this) {
+        error = e.getMessage();
+        notifyAll();
+      }
+    } catch (InterruptedException e) {
+      synchronized(this) {
+        error = e.toString();
+        notifyAll();
+      }
+    } finally {
+      if (selector != null) {
+        try {
+          selector.close();
+        } catch (IOException e) {}
+      }
+      // If the channel was closed by another thread, then the loop exits
+      // without an error or EOF from the channel, and a waiting RFB thread
+      // would never wake up.
+      synchronized(this) {
+        if (error == null && !stopped)
+          eof = true;
+        notifyAll();
+      }
+    }
+  }
+
+  // RFB thread: Copy up to len bytes into buf, waiting for the reader thread
+  // if no data is available and wait is true.  Returns the number of bytes
+  // copied, which is 0 only if no data is available and wait is false.
+  // timeoutms has the same meaning as in FdInStream (-1 = wait indefinitely.)
+  int read(byte[] buf, int bufPtr, int len, boolean wait, int timeoutms) {
+    int available;
+
+    synchronized(this) {
+      long deadline = System.currentTimeMillis() + timeoutms;
+
+      while (tail == head) {
+        if (error != null)
+          throw new WarningException("Read error: " + error);
+        if (eof)
+          throw new EndOfStream();
+        if (!wait)
+          return 0;
+        if (timeoutms == 0)
+          throw new TimedOut();
+        try {
+          if (timeoutms > 0) {
+            long remaining = deadline - System.currentTimeMillis();
+            if (remaining <= 0)
+              throw new TimedOut();
+            wait(remaining);
+          } else {
+            wait();
+          }
+        } catch (InterruptedException e) {
+          throw new SystemException(e.toString());
+        }
+      }
+      available = (int)Math.min(tail - head, (long)len);
+    }
+
+    // The reader thread never writes to the part of the ring buffer between
+    // head and tail, so the data can be copied without holding the lock.
+    int start = (int)(head % capacity);
+    int first = Math.min(available, capacity - start);
+    ((Buffer)consumerView).limit(start + first);
+    ((Buffer)consumerView).position(start);
+    consumerView.get(buf, bufPtr, first);
+    if (available > first) {
+      ((Buffer)consumerView).limit(available - first);
+      ((Buffer)consumerView).position(0);
+      consumerView.get(buf, bufPtr + first, available - first);
+    }
+
+    synchronized(this) {
+      head += available;
+      notifyAll();
+    }
+    return available;
+  }
+
+  synchronized void stop() {
+    stopped = true;
+    notifyAll();
+  }
+
+  // RFB thread: Enable or disable the timing of socket reads.
+  synchronized void setTiming(boolean timing_) {
+    if (timing_ && !timing)
+      timingStart = System.nanoTime();
+    timing = timing_;
+  }
+
+  // RFB thread: Add the time waited and the amount of data received while
+  // timing was enabled to the given totals ({ time waited in units of 100 us,
+  // kilobits }), and reset them.
+  synchronized void takeTiming(long[] totals) {
+    totals[0] += timeWaitedIn100us;
+    totals[1] += timedKbits;
+    timeWaitedIn100us = 0;
+    timedKbits = 0;
+  }
+
+  private SocketChannel channel;
+  private ByteBuffer ring, consumerView;
+  private int capacity;
+  private Thread thread;
+
+  // Protected by the object's monitor.  head and tail are the total number of
+  // bytes that have been consumed and produced, respectively.
+  private long head, tail;
+  private boolean eof, stopped;
+  private String error;
+  private boolean timing;
+  private long timingStart, timeWaitedIn100us, timedKbits;
+}
@@ -67,6 +67,13 @@ public abstract class CMsgHandler {
     cp.supportsContinuousUpdates = true;
   }
 
+  // Called at the end of each update that carries latency benchmarking
+  // results.  inputSendTime is the System.nanoTime() value that the viewer
+  // sent with the input event, and breakdown contains the values of
+  // CMsgReaderV3.LATENCY_FIELDS (in milliseconds.)
+  public void latencyMeasured(long inputSendTime, double[] breakdown) {
+  }
+
   public abstract void enableGII();
   public abstract void giiDeviceCreated(int deviceOrigin);
 
@@ -126,7 +126,7 @@ public abstract class CMsgReader {
                   handler.cp.pf().bigEndian);
     is.readBytes(mask, 0, maskLen);
 
-    handler.setCursor(width, height, hotspot, data, mask);
+    setCursor(width, height, hotspot, data, mask);
   }
 
   protected void readSetXCursor(int width, int height, Point hotspot)
@@ -169,7 +169,59 @@ public abstract class CMsgReader {
       }
     }
 
-    handler.setCursor(width, height, hotspot, cursor, mask);
+    setCursor(width, height, hotspot, cursor, mask);
+  }
+
+  // The CursorCache pseudo-encoding either wraps an XCursor or RichCursor
+  // update, in which case the shape is stored in the given cache slot as well
+  // as being displayed, or it tells us to display a previously stored shape.
+
+  protected void readCursorCache(int width, int height, Point hotspot) {
+    int op = is.readU8();
+    is.skip(1);
+    int slot = is.readU16();
+    int encoding = is.readS32();
+
+    if (slot >= RFB.CURSOR_CACHE_SIZE)
+      throw new ErrorException("Invalid cursor cache slot " + slot);
+
+    if (op == RFB.CURSOR_CACHE_USE) {
+      CachedCursor c = cursorCache[slot];
+      if (c == null)
+        throw new ErrorException("Cursor cache slot " + slot + " is empty");
+      handler.setCursor(c.width, c.height, new Point(c.hotspot.x, c.hotspot.y),
+                        c.data.clone(), c.mask.clone());
+      return;
+    }
+    if (op != RFB.CURSOR_CACHE_STORE)
+      throw new ErrorException("Unknown cursor cache operation " + op);
+
+    cursorCacheSlot = slot;
+    try {
+      if (encoding == RFB.ENCODING_RICH_CURSOR)
+        readSetCursor(width, height, hotspot);
+      else if (encoding == RFB.ENCODING_X_CURSOR)
+        readSetXCursor(width, height, hotspot);
+      else
+        throw new ErrorException("Unknown cursor cache encoding " + encoding);
+    } finally {
+      cursorCacheSlot = -1;
+    }
+  }
+
+  // CConn.setCursor() modifies the hotspot, and the desktop window may hang
+  // onto the pixel data, so the cache keeps its own copies.
+
+  private void setCursor(int width, int height, Point hotspot, int[] data,
+                         byte[] mask) {
+    if (cursorCacheSlot >= 0) {
+      CachedCursor c = new CachedCursor();
+      c.width = width;  c.height = height;
+      c.hotspot = new Point(hotspot.x, hotspot.y);
+      c.data = data.clone();  c.mask = mask.clone();
+      cursorCache[cursorCacheSlot] = c;
+    }
+    handler.setCursor(width, height, hotspot, data, mask);
   }
 
   public int[] getImageBuf(int required) {
@@ -234,5 +286,16 @@ public abstract class CMsgReader {
   protected int[] imageBuf;
   protected int imageBufSize;
 
+  private static class CachedCursor {
+    int width, height;
+    Point hotspot;
+    int[] data;
+    byte[] mask;
+  }
+
+  private CachedCursor[] cursorCache =
+    new CachedCursor[RFB.CURSOR_CACHE_SIZE];
+  private int cursorCacheSlot = -1;
+
   static LogWriter vlog = new LogWriter("CMsgReader");
 }
@@ -121,6 +121,9 @@ public class CMsgReaderV3 extends CMsgReader {
         case RFB.ENCODING_RICH_CURSOR:
           readSetCursor(w, h, new Point(x, y));
           break;
+        case RFB.ENCODING_CURSOR_CACHE:
+          readCursorCache(w, h, new Point(x, y));
+          break;
         case RFB.ENCODING_LAST_RECT:
           nUpdateRectsLeft = 1;   // this rectangle is the last one
           readBenchmarkingResults();
@@ -128,6 +131,9 @@ public class CMsgReaderV3 extends CMsgReader {
         case RFB.ENCODING_CLIENT_REDIRECT:
           readClientRedirect(x, y, w, h);
           break;
+        case RFB.ENCODING_VIDEO_REGION:
+          readVideoRegion();
+          break;
         default:
           readRect(new Rect(x, y, x + w, y + h), encoding);
           break;
@@ -157,6 +163,11 @@ public class CMsgReaderV3 extends CMsgReader {
             double decompression_time = ((double)decode_totalTime)*1e-6;
             double image_trans_ntp = backDelay_ntp;
             double network_decompression = backDelay_ntp - CP;
+            handler.latencyMeasured(inputSendTime, new double[] {
+              RTT, input_transport, server_handling, game_handling, SP, PSI,
+              AL, ALEnd2FCStart, FC, ASF, TBCP, CP, decompression_time,
+              image_trans_ntp, network_decompression
+            });
             System.out.println(java.time.LocalDateTime.now()+","+String.format("%9.02f",RTT)+","+String.format("%9.02f",server_handling)+","+String.format("%9.02f",game_handling)+","+String.format("%9.02f",input_transport)+","+String.format("%9.02f",SP)+","+String.format("%9.02f",PSI)+","+String.format("%9.02f",AL)+","+ String.format("%9.02f",ALEnd2FCStart)+","+String.format("%9.02f",FC)+","+String.format("%9.02f",ASF)+","+String.format("%9.02f",TBCP)+","+String.format("%9.02f",CP)+","+String.format("%9.02f",decompression_time)+","+String.format("%9.02f",image_trans_ntp) +","+String.format("%9.02f", network_decompression)+","+String.format("%9.02f",clientFPS));
         }
 	//spf_last = spf_cur;
@@ -207,6 +218,7 @@ public class CMsgReaderV3 extends CMsgReader {
     long nsBeforeCopy = is.readU64(); //array[10]
     long nsAfterCopy  = is.readU64(); //array[11]
     handle_uTime = nsTinput_send & 0xffffffffL;
+    inputSendTime = nsTinput_send;
     if(handle_uTime != 0xdeadbeefL){
         RTT 		= (double)(System.nanoTime() - nsTinput_send)*1e-6;
         input_transport = ((double)delta)*1e-3;
@@ -231,6 +243,13 @@ public class CMsgReaderV3 extends CMsgReader {
     
   }
 
+  // The viewer does not decode the H.264 streams, so the video region is only
+  // requested in order to receive RFB updates from a server in hybrid mode.
+  void readVideoRegion() {
+    int nRects = is.readU32();
+    is.skip(nRects * 8);
+  }
+
   void readExtendedDesktopSize(int x, int y, int w, int h) {
     int screens, i;
     int id, flags;
@@ -363,5 +382,14 @@ public class CMsgReaderV3 extends CMsgReader {
   double game_handling;
   double input_transport;
   double CP;
+  long inputSendTime;
+
+  // Names of the values passed to CMsgHandler.latencyMeasured()
+  public static final String[] LATENCY_FIELDS = {
+    "rtt", "input_transport", "server_handling", "game_handling", "sp", "psi",
+    "al", "al_end_to_fc_start", "fc", "asf", "tbcp", "cp", "decompression",
+    "image_transport", "network_decompression"
+  };
+
   static LogWriter vlog = new LogWriter("CMsgReaderV3");
 }
@@ -60,6 +60,7 @@ public abstract class CMsgWriter {
       if (!VncViewer.getBooleanProperty("turbovnc.forcexcursor", false))
         encodings[nEncodings++] = RFB.ENCODING_RICH_CURSOR;
       encodings[nEncodings++] = RFB.ENCODING_X_CURSOR;
+      encodings[nEncodings++] = RFB.ENCODING_CURSOR_CACHE;
     }
     if (cp.supportsDesktopResize)
       encodings[nEncodings++] = RFB.ENCODING_NEW_FB_SIZE;
@@ -69,6 +70,8 @@ public abstract class CMsgWriter {
       encodings[nEncodings++] = RFB.ENCODING_DESKTOP_NAME;
     if (cp.supportsClientRedirect)
       encodings[nEncodings++] = RFB.ENCODING_CLIENT_REDIRECT;
+    if (cp.supportsVideoRegion)
+      encodings[nEncodings++] = RFB.ENCODING_VIDEO_REGION;
 
     encodings[nEncodings++] = RFB.ENCODING_LAST_RECT;
     if (opts.continuousUpdates) {
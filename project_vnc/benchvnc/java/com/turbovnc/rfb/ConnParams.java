@@ -34,6 +34,7 @@ public class ConnParams {
     supportsSetDesktopSize = false;  supportsFence = false;
     supportsContinuousUpdates = false;
     supportsClientRedirect = false;
+    supportsVideoRegion = false;
     supportsGII = false;
     name = null;  nEncodings = 0;  encodings = null;
     verStrPos = 0;
@@ -129,6 +130,7 @@ public class ConnParams {
   public boolean supportsContinuousUpdates;
   public boolean supportsLastRect;
   public boolean supportsGII;
+  public boolean supportsVideoRegion;
 
   public boolean supportsSetDesktopSize;
   // CHECKSTYLE VisibilityModifier:ON
@@ -235,6 +235,7 @@ public final class RFB {
   public static final int ENCODING_X_CURSOR              = -240;
   public static final int ENCODING_RICH_CURSOR           = -239;
   public static final int ENCODING_NEW_FB_SIZE           = -223;
+  public static final int ENCODING_VIDEO_REGION          = -222;
 
   // TightVNC-specific
   public static final int ENCODING_COMPRESS_LEVEL_0 = -256;
@@ -252,6 +253,15 @@ public final class RFB {
   public static final int ENCODING_SUBSAMP_GRAY           = -765;
   public static final int ENCODING_SUBSAMP_8X             = -764;
   public static final int ENCODING_SUBSAMP_16X            = -763;
+  public static final int ENCODING_CURSOR_CACHE           = -238;
+
+  //***************************************************************************
+  // CursorCache operations
+  //***************************************************************************
+
+  public static final int CURSOR_CACHE_SIZE  = 32;
+  public static final int CURSOR_CACHE_STORE = 0;
+  public static final int CURSOR_CACHE_USE   = 1;
 
   //***************************************************************************
   // Hextile subencoding types
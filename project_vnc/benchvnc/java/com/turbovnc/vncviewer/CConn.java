@@ -74,14 +74,17 @@ public class CConn extends CConnection implements UserPasswdGetter,
   public CConn(VncViewer viewer_, Socket sock_) {
     sock = sock_;  viewer = viewer_;
     benchmark = viewer.benchFile != null;
+    headless = viewer.latencyReport != null;
     pendingPFChange = false;
     lastServerEncoding = -1;
 
     opts = new Options(VncViewer.opts);
+    if (headless)
+      opts.desktopSize.mode = Options.SIZE_SERVER;
 
     formatChange = false;  encodingChange = false;
     currentEncoding = opts.preferredEncoding;
-    showToolbar = VncViewer.showToolbar.getValue() && !benchmark;
+    showToolbar = VncViewer.showToolbar.getValue() && !benchmark && !headless;
     options = new OptionsDialog(this);
     options.initDialog();
     clipboardDialog = new ClipboardDialog(this);
@@ -100,7 +103,15 @@ public class CConn extends CConnection implements UserPasswdGetter,
     cp.supportsExtendedDesktopSize = true;
     cp.supportsClientRedirect = VncViewer.clientRedirect.getValue();
     cp.supportsDesktopRename = true;
+    // The headless viewer decodes RFB updates but does not decode the H.264
+    // streams.  If the server is sending the streams, then it asks for hybrid
+    // mode in order to receive RFB updates for the non-video areas of the
+    // screen.  (tvncbench disables the streams, so the server sends RFB
+    // updates for the whole screen.)
+    cp.supportsVideoRegion = headless;
     menu = new F8Menu(this);
+    if (headless)
+      latencyBench = new LatencyBenchmark(this, viewer);
 
     if (VncViewer.noUnixLogin.getValue()) {
       Security.disableSecType(RFB.SECTYPE_PLAIN);
@@ -339,6 +350,9 @@ public class CConn extends CConnection implements UserPasswdGetter,
     cp.setPF(pendingPF);
     pendingPFChange = false;
 
+    if (headless)
+      return;
+
     try {
       SwingUtilities.invokeAndWait(new Runnable() {
         public void run() {
@@ -449,6 +463,8 @@ public class CConn extends CConnection implements UserPasswdGetter,
       }
 
       firstUpdate = false;
+      if (latencyBench != null)
+        latencyBench.start();
     }
 
     // A format change has been scheduled, and we have finished decoding and
@@ -527,8 +543,11 @@ public class CConn extends CConnection implements UserPasswdGetter,
                           (double)blitPixels / 1000000.,
                           (double)blitPixels / 1000000. / tBlit,
                           blits);
-        System.out.format("         %.0f pixels/update\n",
-                          (double)blitPixels / (double)blits);
+        System.out.format("         %.0f pixels/update,  %.3f/%.3f ms min/max per update\n",
+                          (double)blitPixels / (double)blits,
+                          tBlitMin * 1000., tBlitMax * 1000.);
+        System.out.format("Paint:   %d paints,  %.3f ms/paint\n", paints,
+                          paints > 0 ? tPaint / (double)paints * 1000. : 0.);
         System.out.format("Time/update:  Recv = %.3f ms,  Decode = %.3f ms,  Blit = %.3f ms\n",
                           sock.inStream().getReadTime() / (double)updates *
                             1000.,
@@ -538,10 +557,10 @@ public class CConn extends CConnection implements UserPasswdGetter,
                           tUpdate / (double)updates * 1000.,
                           (tElapsed - tUpdate) / (double)updates * 1000.);
       }
-      tUpdate = tDecode = tBlit = 0.0;
+      tUpdate = tDecode = tBlit = tBlitMin = tBlitMax = tPaint = 0.0;
       sock.inStream().resetReadTime();
       sock.inStream().resetBytesRead();
-      decodePixels = decodeRect = blitPixels = blits = updates = 0;
+      decodePixels = decodeRect = blitPixels = blits = paints = updates = 0;
       tStart = getTime();
     }
   }
@@ -1758,6 +1777,34 @@ public class CConn extends CConnection implements UserPasswdGetter,
     }
   }
 
+  // Latency benchmark thread: writeBenchmarkKeyEvent() and
+  // writeBenchmarkPointerEvent() send scripted input events and return the
+  // timestamp that was sent with them, or -1 if the event could not be sent.
+  long writeBenchmarkKeyEvent(int keysym, boolean down) {
+    if (state() != RFBSTATE_NORMAL || shuttingDown)
+      return -1;
+    long sendL_nanoTime = (long)System.nanoTime();
+    long sendL_microTime = (long)System.currentTimeMillis() * 1000;
+    writer().writeKeyEvent(keysym, down, sendL_nanoTime, sendL_microTime);
+    return sendL_nanoTime;
+  }
+
+  long writeBenchmarkPointerEvent(int x, int y, int mask) {
+    if (state() != RFBSTATE_NORMAL || shuttingDown)
+      return -1;
+    long sendL_nanoTime = (long)System.nanoTime();
+    long sendL_microTime = (long)System.currentTimeMillis() * 1000;
+    writer().writePointerEvent(new Point(x, y), mask, sendL_nanoTime,
+                               sendL_microTime);
+    return sendL_nanoTime;
+  }
+
+  // RFB thread
+  public void latencyMeasured(long inputSendTime, double[] breakdown) {
+    if (latencyBench != null)
+      latencyBench.measured(inputSendTime, breakdown);
+  }
+
   // KeyEvent.getKeyModifiersText() is unfortunately broken on some platforms.
   String getKeyModifiersText() {
     String str = "";
@@ -2407,10 +2454,12 @@ public class CConn extends CConnection implements UserPasswdGetter,
   boolean keyboardGrabbed;
   GraphicsDevice primaryGD;
 
-  double tDecode, tBlit;
-  long decodePixels, decodeRect, blitPixels, blits;
+  double tDecode, tBlit, tBlitMin, tBlitMax, tPaint;
+  long decodePixels, decodeRect, blitPixels, blits, paints;
   double tDecodeStart, tReadOld;
   boolean benchmark;
+  boolean headless;
+  LatencyBenchmark latencyBench;
 
   double tStart = -1.0, tElapsed, tUpdateStart, tUpdate;
   long updates;
@@ -38,6 +38,7 @@ import java.awt.datatransfer.Clipboard;
 import java.io.BufferedReader;
 import java.lang.reflect.*;
 import java.nio.*;
+import java.util.ArrayList;
 import java.text.AttributedCharacterIterator;
 import java.text.AttributedString;
 import javax.swing.*;
@@ -71,6 +72,10 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
     } else {
       vlog.debug("GraphicsDevice does not support HW acceleration.");
     }
+    useVolatile = VncViewer.getBooleanProperty("turbovnc.volatileimage",
+                                               imgCaps.isAccelerated());
+    if (useVolatile)
+      vlog.debug("Presenting the framebuffer through a VolatileImage.");
     im = new BIPixelBuffer(width, height, cc, this);
 
     cursor = new Cursor();
@@ -228,18 +233,30 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
   }
 
   // RFB thread: Update the actual window with the changed parts of the
-  // framebuffer.
+  // framebuffer.  This is called once per framebuffer update.  The rectangles
+  // that changed during the update are handed to the EDT, which copies only
+  // those rectangles into the VolatileImage, and the bounding box of the
+  // update is then presented.  Updates that arrive before the EDT has
+  // presented the previous one are presented together with it.
   public void updateWindow() {
     double tBlitStart = getTime();
     Rect r = damage;
     cc.blitPixels += r.width() * r.height();
+    if (useVolatile && !damageRects.isEmpty()) {
+      synchronized(pendingUploads) {
+        for (Rect d : damageRects)
+          queueUpload(d);
+      }
+    }
+    damageRects.clear();
     if (!r.isEmpty()) {
+      int x, y, width, height;
       if (cc.cp.width != scaledWidth || cc.cp.height != scaledHeight) {
-        int x = (int)Math.floor(r.tl.x * scaleWidthRatio);
-        int y = (int)Math.floor(r.tl.y * scaleHeightRatio);
+        x = (int)Math.floor(r.tl.x * scaleWidthRatio);
+        y = (int)Math.floor(r.tl.y * scaleHeightRatio);
         // Need one extra pixel to account for rounding.
-        int width = (int)Math.ceil(r.width() * scaleWidthRatio) + 1;
-        int height = (int)Math.ceil(r.height() * scaleHeightRatio) + 1;
+        width = (int)Math.ceil(r.width() * scaleWidthRatio) + 1;
+        height = (int)Math.ceil(r.height() * scaleHeightRatio) + 1;
         if (cc.viewport != null) {
           if (cc.viewport.dx > 0)
             x += cc.viewport.dx;
@@ -250,35 +267,32 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
           if (y + height > scaledHeight + cc.viewport.dy)
             height = scaledHeight + cc.viewport.dy - y;
         }
-        // We don't actually need Java 2D to double-buffer the viewport,
-        // because we're taking care of that ourselves.  This improves
-        // performance on a lot of systems and allows the viewer to achieve
-        // optimal performance under X11 without requiring MIT-SHM pixmaps.
-        if (!swingDB)
-          RepaintManager.currentManager(this).setDoubleBufferingEnabled(false);
-        if (cc.viewer.benchFile != null)
-          paintImmediately(x, y, width, height);
-        else
-          repaint(x, y, width, height);
       } else {
-        int x = r.tl.x;
-        int y = r.tl.y;
+        x = r.tl.x;
+        y = r.tl.y;
+        width = r.width();
+        height = r.height();
         if (cc.viewport != null) {
           if (cc.viewport.dx > 0)
             x += cc.viewport.dx;
           if (cc.viewport.dy > 0)
             y += cc.viewport.dy;
         }
+      }
+      // When benchmarking, each update is painted synchronously, so that the
+      // blit time includes the paint.
+      if (cc.viewer.benchFile != null) {
         if (!swingDB)
           RepaintManager.currentManager(this).setDoubleBufferingEnabled(false);
-        if (cc.viewer.benchFile != null)
-          paintImmediately(x, y, r.width(), r.height());
-        else
-          repaint(x, y, r.width(), r.height());
-      }
+        paintImmediately(x, y, width, height);
+      } else
+        queueRepaint(x, y, width, height);
       damage.clear();
     }
-    cc.tBlit += getTime() - tBlitStart;
+    double tBlit = getTime() - tBlitStart;
+    cc.tBlit += tBlit;
+    if (cc.blits == 0 || tBlit < cc.tBlitMin) cc.tBlitMin = tBlit;
+    if (tBlit > cc.tBlitMax) cc.tBlitMax = tBlit;
     cc.blits += 1;
   }
 
@@ -392,9 +406,73 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
     scaleHeightRatio = (float)scaledHeight / (float)cc.cp.height;
   }
 
+  // EDT: Bring the VolatileImage up to date with the framebuffer, and return
+  // it.  Only the rectangles that have changed since the last paint are
+  // copied, unless the VolatileImage had to be (re)created or its contents
+  // were lost.  Returns the framebuffer image if the VolatileImage can't be
+  // used.
+  private Image syncVolatileImage() {
+    Image src = im.getImage();
+    GraphicsConfiguration gc = getGraphicsConfiguration();
+    int w = im.width(), h = im.height();
+    boolean full = (src != uploadedImage);
+    int status = VolatileImage.IMAGE_INCOMPATIBLE;
+
+    if (gc == null || src == null || w <= 0 || h <= 0)
+      return src;
+    if (vImage != null && vImage.getWidth() == w && vImage.getHeight() == h)
+      status = vImage.validate(gc);
+    if (status == VolatileImage.IMAGE_RESTORED)
+      full = true;
+    else if (status == VolatileImage.IMAGE_INCOMPATIBLE) {
+      if (vImage != null) {
+        vImage.flush();
+        vImage = null;
+      }
+      try {
+        vImage = gc.createCompatibleVolatileImage(w, h);
+      } catch (Exception e) {
+        vlog.debug("Could not create VolatileImage: " + e.getMessage());
+      }
+      if (vImage == null) {
+        useVolatile = false;
+        return src;
+      }
+      vImage.validate(gc);
+      full = true;
+    }
+
+    Rect[] rects;
+    synchronized(pendingUploads) {
+      rects = pendingUploads.toArray(new Rect[pendingUploads.size()]);
+      pendingUploads.clear();
+      if (uploadAll)
+        full = true;
+      uploadAll = false;
+    }
+    Graphics2D vg = vImage.createGraphics();
+    if (full) {
+      vg.drawImage(src, 0, 0, null);
+      uploadedImage = src;
+    } else {
+      for (Rect r : rects)
+        vg.drawImage(src, r.tl.x, r.tl.y, r.br.x, r.br.y,
+                     r.tl.x, r.tl.y, r.br.x, r.br.y, null);
+    }
+    vg.dispose();
+
+    if (vImage.contentsLost()) {
+      uploadedImage = null;
+      return src;
+    }
+    return vImage;
+  }
+
   // EDT
   public void paintComponent(Graphics g) {
+    double tPaintStart = getTime();
     Graphics2D g2 = (Graphics2D)g;
+    Image src = useVolatile ? syncVolatileImage() : im.getImage();
     if (!swingDB &&
         RepaintManager.currentManager(this).isDoubleBufferingEnabled())
       // If double buffering is enabled, then this must be a system-triggered
@@ -405,15 +483,17 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
     if (cc.cp.width != scaledWidth || cc.cp.height != scaledHeight) {
       g2.setRenderingHint(RenderingHints.KEY_INTERPOLATION,
                           RenderingHints.VALUE_INTERPOLATION_BILINEAR);
-      g2.drawImage(im.getImage(), 0, 0, scaledWidth, scaledHeight, null);
+      g2.drawImage(src, 0, 0, scaledWidth, scaledHeight, null);
     } else {
       Rectangle r = g.getClipBounds();
-      g2.drawImage(im.getImage(), r.x, r.y, r.x + r.width, r.y + r.height,
+      g2.drawImage(src, r.x, r.y, r.x + r.width, r.y + r.height,
                    r.x, r.y, r.x + r.width, r.y + r.height, null);
     }
     g2.dispose();
     if (!swingDB)
       RepaintManager.currentManager(this).setDoubleBufferingEnabled(true);
+    cc.tPaint += getTime() - tPaintStart;
+    cc.paints++;
   }
 
   // EDT
@@ -664,6 +744,8 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
       cursorVisible = false;
       im.imageRect(cursorBackingX, cursorBackingY, cursorBacking.width(),
                    cursorBacking.height(), cursorBacking.data);
+      addUpload(cursorBackingX, cursorBackingY, cursorBacking.width(),
+                cursorBacking.height());
     }
   }
 
@@ -700,10 +782,78 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
 
       im.maskRect(cursorLeft, cursorTop, cursor.width(), cursor.height(),
                   (int[])cursor.data, cursor.mask);
+      addUpload(x, y, w, h);
     }
   }
 
-  // RFB thread
+  // The local cursor is drawn into the framebuffer outside of a framebuffer
+  // update, so its rectangle is passed directly to the EDT.
+  private void addUpload(int x, int y, int w, int h) {
+    if (!useVolatile || w <= 0 || h <= 0)
+      return;
+    synchronized(pendingUploads) {
+      queueUpload(new Rect(x, y, x + w, y + h));
+    }
+  }
+
+  // Add a rectangle to the list that the EDT will copy into the VolatileImage
+  // the next time it paints.  The EDT doesn't paint while the window is
+  // minimized or obscured, so if the list grows too long, then it is replaced
+  // by a full upload.  The caller must hold the pendingUploads lock.
+  private void queueUpload(Rect r) {
+    if (uploadAll)
+      return;
+    if (pendingUploads.size() >= MAX_PENDING_UPLOADS) {
+      pendingUploads.clear();
+      uploadAll = true;
+      return;
+    }
+    pendingUploads.add(r);
+  }
+
+  // RFB thread: Add a rectangle (in window coordinates) to the area that the
+  // EDT will paint next, and schedule that paint unless one is already
+  // pending.  Thus, if the EDT falls behind, then successive updates are
+  // presented with a single paint rather than with one paint apiece.
+  private void queueRepaint(int x, int y, int w, int h) {
+    synchronized(pendingUploads) {
+      if (pendingRepaint != null) {
+        pendingRepaint.add(new Rectangle(x, y, w, h));
+        return;
+      }
+      pendingRepaint = new Rectangle(x, y, w, h);
+    }
+    SwingUtilities.invokeLater(presentRunnable);
+  }
+
+  // EDT
+  private final Runnable presentRunnable = new Runnable() {
+    public void run() {
+      Rectangle r;
+      synchronized(pendingUploads) {
+        r = pendingRepaint;
+        pendingRepaint = null;
+      }
+      if (r == null)
+        return;
+      // We don't actually need Java 2D to double-buffer the viewport,
+      // because we're taking care of that ourselves.  This improves
+      // performance on a lot of systems and allows the viewer to achieve
+      // optimal performance under X11 without requiring MIT-SHM pixmaps.
+      if (!swingDB)
+        RepaintManager.currentManager(DesktopWindow.this)
+          .setDoubleBufferingEnabled(false);
+      paintImmediately(r);
+    }
+  };
+
+  // RFB thread: Record a rectangle that changed during the current
+  // framebuffer update.  damage is the bounding box of the update, which is
+  // presented with a single repaint.  damageRects holds the individual
+  // rectangles, which are the only parts of the framebuffer that need to be
+  // copied into the VolatileImage.  Overlapping rectangles are merged, and if
+  // an update has too many rectangles, then they are replaced by the bounding
+  // box.
   void damageRect(int x, int y, int w, int h) {
     if (damage.isEmpty()) {
       damage.setXYWH(x, y, w, h);
@@ -714,6 +864,26 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
       int y2 = Math.max(damage.br.y, y + h);
       damage.setXYWH(x1, y1, x2 - x1, y2 - y1);
     }
+
+    if (!useVolatile || w <= 0 || h <= 0)
+      return;
+    Rect r = new Rect(x, y, x + w, y + h);
+    for (int i = 0; i < damageRects.size(); i++) {
+      Rect d = damageRects.get(i);
+      if (r.enclosedBy(d))
+        return;
+      if (r.overlaps(d)) {
+        r = new Rect(Math.min(r.tl.x, d.tl.x), Math.min(r.tl.y, d.tl.y),
+                     Math.max(r.br.x, d.br.x), Math.max(r.br.y, d.br.y));
+        damageRects.remove(i);
+        i = -1;
+      }
+    }
+    damageRects.add(r);
+    if (damageRects.size() > MAX_DAMAGE_RECTS) {
+      damageRects.clear();
+      damageRects.add(new Rect(damage.tl, damage.br));
+    }
   }
 
   // run() is executed by the setColourMapEntriesTimerThread.  It sleeps for
@@ -826,6 +996,18 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
 
   int lastX, lastY;  // EDT only
   Rect damage = new Rect();
+  static final int MAX_DAMAGE_RECTS = 64;
+  ArrayList<Rect> damageRects = new ArrayList<Rect>();  // RFB thread only
+
+  // VolatileImage (accelerated, where available) through which the
+  // framebuffer is presented
+  volatile boolean useVolatile;
+  VolatileImage vImage;                                 // EDT only
+  Image uploadedImage;                                  // EDT only
+  static final int MAX_PENDING_UPLOADS = 256;
+  final ArrayList<Rect> pendingUploads = new ArrayList<Rect>();
+  boolean uploadAll;             // protected by the pendingUploads lock
+  Rectangle pendingRepaint;      // protected by the pendingUploads lock
 
   static LogWriter vlog = new LogWriter("DesktopWindow");
 }
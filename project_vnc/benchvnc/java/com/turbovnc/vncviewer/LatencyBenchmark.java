@@ -0,0 +1,291 @@
+/*
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ * USA.
+ */
+
+// LatencyBenchmark injects scripted input events into a headless viewer at a
+// fixed rate, matches the latency breakdown that the server sends back with
+// each update to the event that caused it, and writes the per-event results
+// and their percentiles to a JSON report.  Only RFB updates are measured;
+// the H.264/RTSP streams are not received.
+
+package com.turbovnc.vncviewer;
+
+import java.io.*;
+import java.util.*;
+
+import com.turbovnc.rdr.*;
+import com.turbovnc.rfb.*;
+
+class LatencyBenchmark implements Runnable {
+
+  // How long to wait for the results of the last few events
+  static final long STRAGGLER_TIMEOUT = 2000;
+
+  static final class Step {
+    boolean key;
+    int x, y, mask, keysym;
+  }
+
+  static final class Sample {
+    Step step;
+    long sendTime;
+    double[] breakdown;
+  }
+
+  LatencyBenchmark(CConn cc_, VncViewer viewer_) {
+    cc = cc_;  viewer = viewer_;
+    if (viewer.latencyScript != null)
+      script = readScript(viewer.latencyScript);
+  }
+
+  // Script syntax (one step per line, # starts a comment):
+  //   pointer <x> <y> [<button mask>]
+  //   key <keysym>
+  static ArrayList<Step> readScript(String fileName) {
+    ArrayList<Step> steps = new ArrayList<Step>();
+    int lineNum = 0;
+
+    try {
+      BufferedReader in = new BufferedReader(new FileReader(fileName));
+      try {
+        String line;
+        while ((line = in.readLine()) != null) {
+          lineNum++;
+          int comment = line.indexOf('#');
+          if (comment >= 0)
+            line = line.substring(0, comment);
+          String[] tokens = line.trim().split("\\s+");
+          if (tokens.length == 0 || tokens[0].isEmpty())
+            continue;
+
+          Step step = new Step();
+          if (tokens[0].equalsIgnoreCase("pointer") &&
+              (tokens.length == 3 || tokens.length == 4)) {
+            step.x = Integer.parseInt(tokens[1]);
+            step.y = Integer.parseInt(tokens[2]);
+            if (tokens.length == 4)
+              step.mask = Integer.decode(tokens[3]);
+          } else if (tokens[0].equalsIgnoreCase("key") &&
+                     tokens.length == 2) {
+            step.key = true;
+            step.keysym = Integer.decode(tokens[1]);
+          } else
+            throw new NumberFormatException("unknown step");
+          steps.add(step);
+        }
+      } finally {
+        in.close();
+      }
+    } catch (IOException e) {
+      throw new ErrorException("Could not read latency benchmark script:\n" +
+                               e.getMessage());
+    } catch (NumberFormatException e) {
+      throw new ErrorException("Syntax error in latency benchmark script " +
+                               fileName + ", line " + lineNum);
+    }
+    if (steps.isEmpty())
+      throw new ErrorException("Latency benchmark script " + fileName +
+                               " is empty");
+    return steps;
+  }
+
+  // The default script moves the pointer across an 8x8 grid of points that
+  // covers the remote desktop.
+  ArrayList<Step> defaultScript() {
+    ArrayList<Step> steps = new ArrayList<Step>();
+    for (int i = 0; i < 64; i++) {
+      Step step = new Step();
+      step.x = cc.cp.width * (2 * (i % 8) + 1) / 16;
+      step.y = cc.cp.height * (2 * (i / 8) + 1) / 16;
+      steps.add(step);
+    }
+    return steps;
+  }
+
+  // RFB thread: start() is called when the first framebuffer update has been
+  // received.
+  void start() {
+    if (thread != null)
+      return;
+    if (script == null)
+      script = defaultScript();
+    thread = new Thread(this, "LatencyBenchmark");
+    thread.setDaemon(true);
+    thread.start();
+  }
+
+  // RFB thread
+  synchronized void measured(long inputSendTime, double[] breakdown) {
+    Sample sample = pending.remove(inputSendTime);
+    if (sample == null)
+      return;
+    sample.breakdown = breakdown;
+    nMeasured++;
+    notifyAll();
+  }
+
+  long send(Step step) {
+    long sendTime;
+    if (step.key) {
+      sendTime = cc.writeBenchmarkKeyEvent(step.keysym, true);
+      cc.writeBenchmarkKeyEvent(step.keysym, false);
+    } else
+      sendTime = cc.writeBenchmarkPointerEvent(step.x, step.y, step.mask);
+    return sendTime;
+  }
+
+  static void sleepUntil(long nanoTime) throws InterruptedException {
+    long delay;
+    while ((delay = nanoTime - System.nanoTime()) > 0)
+      Thread.sleep(delay / 1000000, (int)(delay % 1000000));
+  }
+
+  public void run() {
+    long period = 1000000000L / viewer.latencyRate;
+    int nWarmup = viewer.latencyWarmup * viewer.latencyRate;
+
+    try {
+      vlog.status("Latency benchmark: " + nWarmup + " warmup events, " +
+                  viewer.latencyCount + " events at " + viewer.latencyRate +
+                  "/s");
+      long next = System.nanoTime();
+      for (int i = 0; i < nWarmup + viewer.latencyCount; i++) {
+        sleepUntil(next);
+        next += period;
+
+        Step step = script.get(i % script.size());
+        long sendTime;
+        synchronized(this) {
+          sendTime = send(step);
+          if (sendTime < 0)
+            break;
+          if (i < nWarmup)
+            continue;
+          Sample sample = new Sample();
+          sample.step = step;
+          sample.sendTime = sendTime;
+          samples.add(sample);
+          pending.put(sendTime, sample);
+        }
+      }
+
+      synchronized(this) {
+        long deadline = System.currentTimeMillis() + STRAGGLER_TIMEOUT;
+        long remaining;
+        while (!pending.isEmpty() &&
+               (remaining = deadline - System.currentTimeMillis()) > 0)
+          wait(remaining);
+        writeReport(viewer.latencyReport);
+        viewer.latencyStatus = nMeasured > 0 ? 0 : 1;
+      }
+    } catch (Exception e) {
+      vlog.error("Latency benchmark failed:");
+      vlog.error("  " + e.toString());
+      viewer.latencyStatus = 1;
+    }
+    cc.close();
+  }
+
+  // Nearest-rank percentile of a sorted array
+  static double percentile(double[] sorted, double p) {
+    int rank = (int)Math.ceil(p / 100.0 * sorted.length);
+    return sorted[Math.max(rank - 1, 0)];
+  }
+
+  static String format(double value) {
+    return String.format(Locale.ROOT, "%.3f", value);
+  }
+
+  void writeReport(String fileName) throws IOException {
+    String[] fields = CMsgReaderV3.LATENCY_FIELDS;
+    ArrayList<Sample> measuredSamples = new ArrayList<Sample>();
+    for (Sample sample : samples)
+      if (sample.breakdown != null)
+        measuredSamples.add(sample);
+    int n = measuredSamples.size();
+
+    PrintWriter out = new PrintWriter(new FileWriter(fileName));
+    try {
+      out.println("{");
+      out.println("  \"width\": " + cc.cp.width + ",");
+      out.println("  \"height\": " + cc.cp.height + ",");
+      out.println("  \"rate\": " + viewer.latencyRate + ",");
+      out.println("  \"warmup_seconds\": " + viewer.latencyWarmup + ",");
+      out.println("  \"events_sent\": " + samples.size() + ",");
+      out.println("  \"events_measured\": " + n + ",");
+      out.println("  \"units\": \"ms\",");
+
+      out.println("  \"summary\": {");
+      for (int f = 0; f < fields.length; f++) {
+        out.print("    \"" + fields[f] + "\": ");
+        if (n == 0) {
+          out.print("null");
+        } else {
+          double[] values = new double[n];
+          double sum = 0.0;
+          for (int i = 0; i < n; i++) {
+            values[i] = measuredSamples.get(i).breakdown[f];
+            sum += values[i];
+          }
+          Arrays.sort(values);
+          out.print("{\"mean\": " + format(sum / n) +
+                    ", \"p50\": " + format(percentile(values, 50)) +
+                    ", \"p90\": " + format(percentile(values, 90)) +
+                    ", \"p99\": " + format(percentile(values, 99)) +
+                    ", \"max\": " + format(values[n - 1]) + "}");
+          if (fields[f].equals("rtt"))
+            System.out.format("Latency benchmark: %d/%d events measured, RTT p50 %s ms, p90 %s ms, p99 %s ms\n",
+                              n, samples.size(), format(percentile(values, 50)),
+                              format(percentile(values, 90)),
+                              format(percentile(values, 99)));
+        }
+        out.println(f < fields.length - 1 ? "," : "");
+      }
+      out.println("  },");
+
+      out.println("  \"events\": [");
+      for (int i = 0; i < samples.size(); i++) {
+        Sample sample = samples.get(i);
+        out.print("    {\"index\": " + i + ", \"type\": \"" +
+                  (sample.step.key ? "key" : "pointer") + "\"");
+        if (sample.breakdown != null) {
+          for (int f = 0; f < fields.length; f++)
+            out.print(", \"" + fields[f] + "\": " +
+                      format(sample.breakdown[f]));
+        } else
+          out.print(", \"measured\": false");
+        out.println(i < samples.size() - 1 ? "}," : "}");
+      }
+      out.println("  ]");
+      out.println("}");
+    } finally {
+      out.close();
+    }
+    if (out.checkError())
+      throw new IOException("Could not write " + fileName);
+    vlog.status("Latency benchmark report written to " + fileName);
+  }
+
+  CConn cc;
+  VncViewer viewer;
+  ArrayList<Step> script;
+  Thread thread;
+  ArrayList<Sample> samples = new ArrayList<Sample>();
+  HashMap<Long, Sample> pending = new HashMap<Long, Sample>();
+  int nMeasured;
+
+  static LogWriter vlog = new LogWriter("LatencyBenchmark");
+}
@@ -477,6 +477,42 @@ public class VncViewer implements Runnable, OptionsDialogCallback {
         continue;
       }
 
+      if (argv[i].equalsIgnoreCase("-latencybench")) {
+        if (++i >= argv.length) usage();
+        latencyReport = argv[i];
+        continue;
+      }
+
+      if (argv[i].equalsIgnoreCase("-latencyscript")) {
+        if (++i >= argv.length) usage();
+        latencyScript = argv[i];
+        continue;
+      }
+
+      if (argv[i].equalsIgnoreCase("-latencyrate")) {
+        if (i < argv.length - 1) {
+          int rate = Integer.parseInt(argv[++i]);
+          if (rate > 0) latencyRate = rate;
+        }
+        continue;
+      }
+
+      if (argv[i].equalsIgnoreCase("-latencycount")) {
+        if (i < argv.length - 1) {
+          int count = Integer.parseInt(argv[++i]);
+          if (count > 0) latencyCount = count;
+        }
+        continue;
+      }
+
+      if (argv[i].equalsIgnoreCase("-latencywarmup")) {
+        if (i < argv.length - 1) {
+          int warmup = Integer.parseInt(argv[++i]);
+          if (warmup >= 0) latencyWarmup = warmup;
+        }
+        continue;
+      }
+
       if (Configuration.setParam(argv[i]))
         continue;
 
@@ -825,13 +861,20 @@ public class VncViewer implements Runnable, OptionsDialogCallback {
                               (double)cc.blitPixels / 1000000. / cc.tBlit,
                               cc.blits,
                               (double)cc.blitPixels / (double)cc.blits);
+            System.out.format("     %.3f ms/update (min %.3f, max %.3f), %d paints, %.3f ms/paint\n",
+                              cc.tBlit / (double)cc.blits * 1000.,
+                              cc.tBlitMin * 1000., cc.tBlitMax * 1000.,
+                              cc.paints,
+                              cc.paints > 0 ?
+                                cc.tPaint / (double)cc.paints * 1000. : 0.);
             tAvg += tTotal;
             tAvgDecode += cc.tDecode;
             tAvgBlit += cc.tBlit;
           }
           System.out.print("\n");
-          cc.tDecode = cc.tBlit = 0.0;
-          cc.decodePixels = cc.decodeRect = cc.blitPixels = cc.blits = 0;
+          cc.tDecode = cc.tBlit = cc.tBlitMin = cc.tBlitMax = cc.tPaint = 0.0;
+          cc.decodePixels = cc.decodeRect = cc.blitPixels = cc.blits =
+            cc.paints = 0;
           benchFile.reset();
           benchFile.resetReadTime();
           cc.reset();
@@ -857,6 +900,9 @@ public class VncViewer implements Runnable, OptionsDialogCallback {
       }
     }
 
+    if (exitStatus == 0)
+      exitStatus = latencyStatus;
+
     if (benchFile != null && benchIter > 1)
       System.out.format("Average          :  %f s (Decode = %f, Blit = %f)\n",
                         tAvg / (double)benchIter,
@@ -1540,6 +1586,11 @@ public class VncViewer implements Runnable, OptionsDialogCallback {
   FileInStream benchFile;
   int benchIter = 1;
   int benchWarmup = 0;
+  String latencyReport, latencyScript;
+  int latencyRate = 10;
+  int latencyCount = 500;
+  int latencyWarmup = 2;
+  volatile int latencyStatus = 0;
   static Options opts;
   static boolean forceAlpha;
   OptionsDialog options;
@@ -2,6 +2,9 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 // TODO: FINISH ERROR CHECKING
 
@@ -20,35 +23,82 @@ error:
   return -1;
 }
 
+// Return the length (in frames) of an intra refresh wave for a stream with the
+// given frame rate.  TVNC_RTSPREFRESH overrides the default of one second's
+// worth of frames, and 0 disables intra refresh.
+static int get_intra_refresh_period(int fps){
+  const char *env = getenv("TVNC_RTSPREFRESH");
+
+  if(env && *env && atoi(env) >= 0) return atoi(env);
+  return fps;
+}
+
+// Set once the encoder has been found to ignore the intra-refresh option, so
+// that later sessions do not try it again.
+static int intra_refresh_unsupported = 0;
+
+// All encoder sessions share one CUDA device, so that opening a session (at
+// startup, or when an output is added or resized) does not have to create a
+// new CUDA context.  If the device cannot be created, then each session creates
+// its own context, as before.
+static AVBufferRef *rtsp_hw_device = NULL;
+static int rtsp_hw_device_failed = 0;
+
+static AVBufferRef *get_rtsp_hw_device(void){
+  if(!rtsp_hw_device && !rtsp_hw_device_failed){
+    if(av_hwdevice_ctx_create(&rtsp_hw_device, AV_HWDEVICE_TYPE_CUDA, NULL, NULL, 0) < 0){
+      fprintf(stderr,"unable to create CUDA device; each encoder will create its own\n");
+      rtsp_hw_device = NULL;
+      rtsp_hw_device_failed = 1;
+    }
+  }
+  return rtsp_hw_device;
+}
+
+// Use NVENC H.264 Codec
+#define RTSP_ENCODER "h264_nvenc"
+// Use CPU H.264 Codec
+// #define RTSP_ENCODER "libx264"
+
+// Return 1 if the encoder turns AVRegionOfInterest side data into a quantizer
+// offset map.  h264_nvenc ignores the side data, so there is no point in
+// computing regions of interest for it.
+int rtsp_rois_supported(void){
+  static const char *const encoders[] = { "libx264", "h264_qsv", NULL };
+  int i;
+
+  for(i = 0; encoders[i]; i++){
+    if(!strcmp(RTSP_ENCODER, encoders[i])) return 1;
+  }
+  return 0;
+}
+
 // Setup the H.264 codec
 AVCodecContext *get_codec_context(int width, int height, int fps, int bitrate)
 {
   AVCodec *codec = NULL;
   AVCodecContext *codec_context = NULL;
   AVDictionary *codec_options = NULL;
+  int refresh = intra_refresh_unsupported ? 0 : get_intra_refresh_period(fps);
 
-  // Use NVECN H.264 Codec
-  const char* encoder_name = "h264_nvenc";
-  if((codec = avcodec_find_encoder_by_name(encoder_name)) == NULL){
+  if((codec = avcodec_find_encoder_by_name(RTSP_ENCODER)) == NULL){
     fprintf(stderr,"unable to find codec\n");
     goto error;    
   }
 
-  // Use CPU H.264 Codec
-  // if((codec = avcodec_find_encoder(AV_CODEC_ID_H264)) == NULL){
-  //     fprintf(stderr,"unable to find codec\n");
-  //     goto error;
-  // }
-
   if((codec_context = avcodec_alloc_context3(codec)) == NULL){
       fprintf(stderr,"unable to allocate codec\n");
       goto error;
   }
+  if(get_rtsp_hw_device())
+    codec_context->hw_device_ctx = av_buffer_ref(rtsp_hw_device);
 
   // Options for NVENC H.264
   av_dict_set(&codec_options, "preset", "llhp", 0);
   av_dict_set(&codec_options, "rc", "cbr_ld_hq", 0);
   av_dict_set(&codec_options, "profile", "high", 0);
+  // Make keyframe requests (see rtsp_request_keyframe()) produce IDR frames.
+  av_dict_set(&codec_options, "forced-idr", "1", 0);
 
   // Options for CPU H.264
   //av_dict_set(&codec_options, "preset", "veryfast", 0);
@@ -56,11 +106,25 @@ AVCodecContext *get_codec_context(int width, int height, int fps, int bitrate)
   //av_dict_set(&codec_options, "threads", "12", 0);
   // av_dict_set(&codec_options, "rtsp_transport", "tcp", 0);
 
+  // Periodic IDR frames cause bit rate spikes, so the stream only contains
+  // the IDR frame at its start and the ones that clients request (see
+  // rtsp_request_keyframe().)  Instead, intra-code a band of macroblocks in
+  // each frame, so that a wave of intra-coded macroblocks sweeps across the
+  // picture every 'refresh' frames.  A client that joins late or loses
+  // packets can then recover within one wave.  Both NVENC and libx264 take
+  // the length of the wave from the GOP size.  Without intra refresh, NVENC
+  // treats a negative GOP size as an infinite GOP.
+  if(refresh > 0){
+    av_dict_set(&codec_options, "intra-refresh", "1", 0);
+    codec_context->gop_size = refresh;
+  } else {
+    codec_context->gop_size = -1;
+  }
+
   codec_context->bit_rate = bitrate;
   codec_context->width = width;
   codec_context->height = height;
   codec_context->time_base= (AVRational){1,fps};
-  codec_context->keyint_min = 999999;
   codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
 
   // Other options that have been tried
@@ -72,8 +136,29 @@ AVCodecContext *get_codec_context(int width, int height, int fps, int bitrate)
       goto error;
   }
 
+  // avcodec_open2() leaves the options that the encoder did not accept in the
+  // dictionary.  If intra refresh is one of them, then the GOP size would
+  // produce an IDR frame every 'refresh' frames, so reopen the encoder with an
+  // infinite GOP.
+  if(refresh > 0 && av_dict_get(codec_options, "intra-refresh", NULL, 0)){
+    fprintf(stderr,"encoder does not support intra refresh; using an infinite GOP\n");
+    intra_refresh_unsupported = 1;
+    av_dict_free(&codec_options);
+    avcodec_close(codec_context);
+    av_buffer_unref(&codec_context->hw_device_ctx);
+    av_free(codec_context);
+    return get_codec_context(width, height, fps, bitrate);
+  }
+
+  av_dict_free(&codec_options);
   return codec_context;
 error:
+  av_dict_free(&codec_options);
+  if(codec_context){
+    avcodec_close(codec_context);
+    av_buffer_unref(&codec_context->hw_device_ctx);
+    av_free(codec_context);
+  }
   return NULL;
 }
 
@@ -106,28 +191,30 @@ error:
   return NULL;
 }
 
-// Open and setup codec and output format
-int init_rtsp_stream(RTSPStream *rtsp_stream, int width, int height, int fps, int bitrate, const char *endpoint){
+// Free the output format of a stream, leaving its codec and frame alone
+static void free_rtsp_muxer(RTSPStream *rtsp_stream){
+
+  if(rtsp_stream->ofmt_ctx && !(rtsp_stream->ofmt_ctx->flags & AVFMT_NOFILE)){
+		avio_close(rtsp_stream->ofmt_ctx->pb);
+  }
+
+  if(rtsp_stream->ofmt_ctx){
+	  avformat_free_context(rtsp_stream->ofmt_ctx);
+  }
 
-  rtsp_stream->codec_ctx = NULL;
-  rtsp_stream->endpoint = NULL;
-  rtsp_stream->frame = NULL;
   rtsp_stream->ofmt_ctx = NULL;
   rtsp_stream->out_stream = NULL;
+}
 
-  av_register_all();
-	avformat_network_init();
-  rtsp_stream->endpoint = endpoint;
+// Setup the output format for a stream whose codec is already open
+static int open_rtsp_muxer(RTSPStream *rtsp_stream, const char *endpoint){
 
-  if((rtsp_stream->codec_ctx = get_codec_context(width, height, fps, bitrate)) == NULL){
-    fprintf(stderr,"unable to obtain encoding context\n");
-    goto error;
-  }
+  rtsp_stream->ofmt_ctx = NULL;
+  rtsp_stream->out_stream = NULL;
+  rtsp_stream->endpoint = endpoint;
 
-  if((rtsp_stream->frame = get_av_frame(rtsp_stream->codec_ctx)) == NULL){
-    fprintf(stderr,"unable to allocate frame\n");
-    goto error;
-  }
+  av_register_all();
+	avformat_network_init();
 
   avformat_alloc_output_context2(&rtsp_stream->ofmt_ctx, NULL, "rtsp", rtsp_stream->endpoint);
 	if (!rtsp_stream->ofmt_ctx) {
@@ -158,25 +245,36 @@ int init_rtsp_stream(RTSPStream *rtsp_stream, int width, int height, int fps, in
   return 0;
 
 error:
+  free_rtsp_muxer(rtsp_stream);
+  return -1;
+}
 
-  if(rtsp_stream->frame){
-    av_freep(&rtsp_stream->frame->data[0]);
-    av_free(rtsp_stream->frame);
-  }
+// Open and setup codec and output format
+int init_rtsp_stream(RTSPStream *rtsp_stream, int width, int height, int fps, int bitrate, const char *endpoint){
 
-  if(rtsp_stream->codec_ctx) {
-    avcodec_close(rtsp_stream->codec_ctx);
-    av_free(rtsp_stream->codec_ctx);
-  }
+  rtsp_stream->codec_ctx = NULL;
+  rtsp_stream->endpoint = NULL;
+  rtsp_stream->frame = NULL;
+  rtsp_stream->ofmt_ctx = NULL;
+  rtsp_stream->out_stream = NULL;
 
-  if(rtsp_stream->ofmt_ctx && !(rtsp_stream->ofmt_ctx->flags & AVFMT_NOFILE)){
-		avio_close(rtsp_stream->ofmt_ctx->pb);
+  if((rtsp_stream->codec_ctx = get_codec_context(width, height, fps, bitrate)) == NULL){
+    fprintf(stderr,"unable to obtain encoding context\n");
+    goto error;
   }
 
-  if(rtsp_stream->ofmt_ctx){
-	  avformat_free_context(rtsp_stream->ofmt_ctx);
+  if((rtsp_stream->frame = get_av_frame(rtsp_stream->codec_ctx)) == NULL){
+    fprintf(stderr,"unable to allocate frame\n");
+    goto error;
   }
 
+  if(open_rtsp_muxer(rtsp_stream, endpoint) < 0)
+    goto error;
+
+  return 0;
+
+error:
+  free_rtsp_stream(rtsp_stream);
   return -1;
 }
 
@@ -189,19 +287,14 @@ int start_rtsp_stream(RTSPStream *rtsp_stream){
   return 0;
 }
 
-// Encode image to frame then packet and sent to RTSP stream
-int write_image_to_rtsp_stream(RTSPStream *rtsp_stream, BMPImage *image){
+// Encode the stream's current frame and send the resulting packet
+static int send_frame_to_rtsp_stream(RTSPStream *rtsp_stream){
 
   int i;
   int bufsize = 1;
   int retval;
   AVPacket pkt;
 
-  if(load_image_into_frame(rtsp_stream->frame, image) < 0){
-      fprintf(stderr,"failed to load image into frame\n");
-      return -1;
-  }
-
   for (i = 0; i < bufsize; i++){
     if(encode_frame_to_packet(rtsp_stream->frame, rtsp_stream->codec_ctx) < 0){
       fprintf(stderr,"failed to encode frame to packet\n");
@@ -226,6 +319,17 @@ int write_image_to_rtsp_stream(RTSPStream *rtsp_stream, BMPImage *image){
   return 0;
 }
 
+// Encode image to frame then packet and sent to RTSP stream
+int write_image_to_rtsp_stream(RTSPStream *rtsp_stream, BMPImage *image){
+
+  if(load_image_into_frame(rtsp_stream->frame, image) < 0){
+      fprintf(stderr,"failed to load image into frame\n");
+      return -1;
+  }
+
+  return send_frame_to_rtsp_stream(rtsp_stream);
+}
+
 // Convert image from BGRA to YUV420P and store in Frame
 int load_image_into_frame(AVFrame *frame, BMPImage *image){
 
@@ -270,16 +374,618 @@ int free_rtsp_stream(RTSPStream *rtsp_stream){
 
   if(rtsp_stream->codec_ctx) {
     avcodec_close(rtsp_stream->codec_ctx);
+    av_buffer_unref(&rtsp_stream->codec_ctx->hw_device_ctx);
     av_free(rtsp_stream->codec_ctx);
   }
 
-  if(rtsp_stream->ofmt_ctx && !(rtsp_stream->ofmt_ctx->flags & AVFMT_NOFILE)){
-		avio_close(rtsp_stream->ofmt_ctx->pb);
+  rtsp_stream->frame = NULL;
+  rtsp_stream->codec_ctx = NULL;
+  free_rtsp_muxer(rtsp_stream);
+
+  return 0;
+}
+
+
+// Multi-output support
+//
+// The X server describes the RandR layout with rtsp_layout_begin(),
+// rtsp_layout_add_output() and rtsp_layout_end() whenever an output is
+// added, removed, moved or resized.  The encoder sessions are reconciled with
+// that layout lazily, the next time a frame is encoded, so an output that
+// only moves keeps its session, and an output that changes size gets a new
+// session at its new native resolution.
+//
+// TVNC_RTSPURL sets the endpoint of the first output (default
+// rtsp://127.0.0.1:5545/live306.)  Other outputs use the same endpoint with
+// "_<output ID>" appended.  TVNC_RTSPFPS and TVNC_RTSPBITRATE are
+// comma-separated lists giving the frame rate and bit rate of each output in
+// layout order.  Outputs beyond the end of a list reuse its last value.  By
+// default, each output is encoded at 60 fps, with 1.5 Mbps per 1280x720 worth
+// of pixels.
+
+#define DEFAULT_RTSP_URL "rtsp://127.0.0.1:5545/live306"
+#define DEFAULT_RTSP_FPS 60
+#define DEFAULT_RTSP_BITRATE 1500000
+
+typedef struct{
+  unsigned int id;
+  int x, y, width, height;
+} RTSPLayoutEntry;
+
+static RTSPLayoutEntry rtsp_layout[MAX_RTSP_OUTPUTS];
+static int rtsp_layout_count = 0, rtsp_layout_pending = 0;
+static int rtsp_layout_valid = 0, rtsp_layout_dirty = 0;
+
+static RTSPOutput rtsp_outputs[MAX_RTSP_OUTPUTS];
+static int num_rtsp_outputs = 0;
+
+static RTSPRoi rtsp_rois[MAX_RTSP_ROIS];
+static int num_rtsp_rois = 0;
+
+// Called (at most once per call to one of the write_*_to_rtsp_outputs()
+// functions) before the first frame that is actually encoded, so that the
+// regions of interest are not computed for frames that pacing skips.
+static void (*rtsp_roi_func)(void) = NULL;
+static int rtsp_rois_stale = 0;
+
+// If an output's session could not be opened (for instance, because the RTSP
+// server was not running yet), then try again after this time.  The interval
+// doubles after each failed attempt, up to RTSP_MAX_RETRY_INTERVAL, so that a
+// server that stays down does not cost the X server a connection attempt every
+// second.
+#define RTSP_RETRY_INTERVAL 1000000000LL
+#define RTSP_MAX_RETRY_INTERVAL 32000000000LL
+static long long rtsp_retry_time = 0;
+static long long rtsp_retry_interval = RTSP_RETRY_INTERVAL;
+
+// Encoder pool
+//
+// Opening an NVENC session takes hundreds of milliseconds, so when an
+// output's session is closed because the output was removed or resized, its
+// encoder (the codec context and frame) is parked in this pool rather than
+// being freed.  A session that is opened later with the same size, frame rate
+// and bit rate (for instance, when a client switches back to the previous
+// resolution) takes the encoder from the pool, so only the RTSP connection
+// has to be set up again.  The oldest encoder is freed when the pool is full.
+#define RTSP_POOL_SIZE 4
+
+typedef struct{
+  AVCodecContext *codec_ctx;
+  AVFrame *frame;
+  int fps, bitrate;
+  long long park_time;
+} RTSPPoolEntry;
+
+static RTSPPoolEntry rtsp_pool[RTSP_POOL_SIZE];
+static int num_rtsp_pool = 0;
+
+static long long rtsp_get_time(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Return entry 'index' of a comma-separated list in an environment variable,
+// or the last entry if the list is shorter, or 'def' if it is unset.
+long rtsp_get_env_param(const char *name, int index, long def){
+  const char *env = getenv(name), *ptr;
+  long value = def;
+  int i;
+
+  if(!env || !*env) return def;
+  for(i = 0, ptr = env; ptr && i <= index; i++){
+    char *end;
+    long tmp = strtol(ptr, &end, 10);
+    if(end != ptr && tmp > 0) value = tmp;
+    ptr = strchr(ptr, ',');
+    if(ptr) ptr++;
   }
+  return value;
+}
 
-  if(rtsp_stream->ofmt_ctx){
-	  avformat_free_context(rtsp_stream->ofmt_ctx);
+void rtsp_layout_begin(void){
+  rtsp_layout_pending = 0;
+}
+
+void rtsp_layout_add_output(unsigned int id, int x, int y, int width, int height){
+  RTSPLayoutEntry *entry;
+
+  if(rtsp_layout_pending >= MAX_RTSP_OUTPUTS){
+    fprintf(stderr,"too many outputs; output %u will not be streamed\n", id);
+    return;
+  }
+  // H.264 with 4:2:0 subsampling requires even dimensions.
+  width &= ~1;
+  height &= ~1;
+  if(width <= 0 || height <= 0) return;
+
+  entry = &rtsp_layout[rtsp_layout_pending++];
+  entry->id = id;
+  entry->x = x;
+  entry->y = y;
+  entry->width = width;
+  entry->height = height;
+}
+
+void rtsp_layout_end(void){
+  rtsp_layout_count = rtsp_layout_pending;
+  rtsp_layout_valid = 1;
+  rtsp_layout_dirty = 1;
+}
+
+static void free_rtsp_pool_entry(RTSPPoolEntry *entry){
+  RTSPStream stream;
+
+  memset(&stream, 0, sizeof(stream));
+  stream.codec_ctx = entry->codec_ctx;
+  stream.frame = entry->frame;
+  free_rtsp_stream(&stream);
+  memset(entry, 0, sizeof(RTSPPoolEntry));
+}
+
+// Move the encoder of a stream into the pool.
+static void park_rtsp_encoder(RTSPStream *stream, int fps, int bitrate){
+  RTSPPoolEntry *entry;
+  int i, oldest = 0;
+
+  if(num_rtsp_pool == RTSP_POOL_SIZE){
+    for(i = 1; i < num_rtsp_pool; i++){
+      if(rtsp_pool[i].park_time < rtsp_pool[oldest].park_time) oldest = i;
+    }
+    free_rtsp_pool_entry(&rtsp_pool[oldest]);
+    rtsp_pool[oldest] = rtsp_pool[--num_rtsp_pool];
+  }
+  entry = &rtsp_pool[num_rtsp_pool++];
+  entry->codec_ctx = stream->codec_ctx;
+  entry->frame = stream->frame;
+  entry->fps = fps;
+  entry->bitrate = bitrate;
+  entry->park_time = rtsp_get_time();
+  stream->codec_ctx = NULL;
+  stream->frame = NULL;
+}
+
+// Take an encoder with the given parameters from the pool.  Returns 0 if one
+// was found.
+static int take_rtsp_encoder(RTSPStream *stream, int width, int height, int fps, int bitrate){
+  int i;
+
+  for(i = 0; i < num_rtsp_pool; i++){
+    RTSPPoolEntry *entry = &rtsp_pool[i];
+
+    if(entry->codec_ctx->width == width && entry->codec_ctx->height == height &&
+       entry->fps == fps && entry->bitrate == bitrate){
+      memset(stream, 0, sizeof(RTSPStream));
+      stream->codec_ctx = entry->codec_ctx;
+      stream->frame = entry->frame;
+      rtsp_pool[i] = rtsp_pool[--num_rtsp_pool];
+      return 0;
+    }
   }
+  return -1;
+}
+
+static void free_rtsp_pool(void){
+  while(num_rtsp_pool > 0)
+    free_rtsp_pool_entry(&rtsp_pool[--num_rtsp_pool]);
+}
 
+// Close an output's session.  If 'park' is set, then its encoder is kept in
+// the pool.
+static void close_rtsp_output(RTSPOutput *output, int park){
+  fprintf(stderr,"ending stream %s\n", output->endpoint);
+  if(output->started) end_rtsp_stream(&output->stream);
+  if(park && output->started && output->stream.codec_ctx && output->stream.frame)
+    park_rtsp_encoder(&output->stream, output->fps, output->bitrate);
+  free_rtsp_stream(&output->stream);
+  if(output->sws_ctx) sws_freeContext(output->sws_ctx);
+  if(output->yuv_sws_ctx) sws_freeContext(output->yuv_sws_ctx);
+  memset(output, 0, sizeof(RTSPOutput));
+}
+
+static int open_rtsp_output(RTSPOutput *output, const RTSPLayoutEntry *entry, int index){
+  const char *url = getenv("TVNC_RTSPURL");
+  long long area = (long long)entry->width * entry->height;
+
+  if(!url || !*url) url = DEFAULT_RTSP_URL;
+  memset(output, 0, sizeof(RTSPOutput));
+  output->id = entry->id;
+  output->x = entry->x;
+  output->y = entry->y;
+  output->width = entry->width;
+  output->height = entry->height;
+  output->fps = (int)rtsp_get_env_param("TVNC_RTSPFPS", index, DEFAULT_RTSP_FPS);
+  output->bitrate = (int)rtsp_get_env_param("TVNC_RTSPBITRATE", index,
+                                            (long)(DEFAULT_RTSP_BITRATE * area / (1280 * 720)));
+  if(index == 0)
+    snprintf(output->endpoint, sizeof(output->endpoint), "%s", url);
+  else
+    snprintf(output->endpoint, sizeof(output->endpoint), "%s_%u", url, entry->id);
+
+  if(take_rtsp_encoder(&output->stream, output->width, output->height,
+                       output->fps, output->bitrate) == 0){
+    // The encoder's reference frames belong to the previous stream.
+    output->force_keyframe = 1;
+  } else {
+    if((output->stream.codec_ctx = get_codec_context(output->width, output->height,
+                                                     output->fps, output->bitrate)) == NULL ||
+       (output->stream.frame = get_av_frame(output->stream.codec_ctx)) == NULL){
+      fprintf(stderr,"unable to create encoder for output %u\n", entry->id);
+      free_rtsp_stream(&output->stream);
+      return -1;
+    }
+  }
+  // If the RTSP server cannot be reached, then keep the encoder in the pool,
+  // so that the next attempt only has to set up the connection.
+  if(open_rtsp_muxer(&output->stream, output->endpoint) < 0 ||
+     start_rtsp_stream(&output->stream) < 0){
+    fprintf(stderr,"unable to create stream for output %u\n", entry->id);
+    park_rtsp_encoder(&output->stream, output->fps, output->bitrate);
+    free_rtsp_stream(&output->stream);
+    return -1;
+  }
+  output->started = 1;
+  fprintf(stderr,"starting stream %s (%dx%d+%d+%d, %d fps, %d bps)\n",
+          output->endpoint, output->width, output->height, output->x,
+          output->y, output->fps, output->bitrate);
   return 0;
 }
+
+// Bring the set of encoder sessions in line with the most recent layout.
+static void sync_rtsp_outputs(int fb_width, int fb_height){
+  RTSPOutput new_outputs[MAX_RTSP_OUTPUTS];
+  int i, j, n = 0;
+
+  rtsp_rois_stale = 1;
+  if(!rtsp_layout_valid){
+    // The layout was never reported, so stream the whole framebuffer.
+    rtsp_layout_begin();
+    rtsp_layout_add_output(0, 0, 0, fb_width, fb_height);
+    rtsp_layout_end();
+  }
+  if(!rtsp_layout_dirty &&
+     (!rtsp_retry_time || rtsp_get_time() < rtsp_retry_time))
+    return;
+  rtsp_layout_dirty = 0;
+
+  // Close the sessions whose output is gone or has changed size, and keep the
+  // others (updating their position.)
+  for(i = 0; i < num_rtsp_outputs; i++){
+    RTSPOutput *output = &rtsp_outputs[i];
+    for(j = 0; j < rtsp_layout_count; j++){
+      if(rtsp_layout[j].id == output->id) break;
+    }
+    if(j == rtsp_layout_count || rtsp_layout[j].width != output->width ||
+       rtsp_layout[j].height != output->height){
+      close_rtsp_output(output, 1);
+    } else {
+      output->x = rtsp_layout[j].x;
+      output->y = rtsp_layout[j].y;
+    }
+  }
+
+  // Rebuild the session table in layout order, opening new sessions as needed.
+  for(j = 0; j < rtsp_layout_count; j++){
+    for(i = 0; i < num_rtsp_outputs; i++){
+      if(rtsp_outputs[i].started && rtsp_outputs[i].id == rtsp_layout[j].id) break;
+    }
+    if(i < num_rtsp_outputs){
+      new_outputs[n++] = rtsp_outputs[i];
+    } else if(open_rtsp_output(&new_outputs[n], &rtsp_layout[j], j) == 0){
+      n++;
+    }
+  }
+  memcpy(rtsp_outputs, new_outputs, sizeof(RTSPOutput) * n);
+  num_rtsp_outputs = n;
+  if(n < rtsp_layout_count){
+    rtsp_retry_time = rtsp_get_time() + rtsp_retry_interval;
+    rtsp_retry_interval *= 2;
+    if(rtsp_retry_interval > RTSP_MAX_RETRY_INTERVAL)
+      rtsp_retry_interval = RTSP_MAX_RETRY_INTERVAL;
+  } else {
+    rtsp_retry_time = 0;
+    rtsp_retry_interval = RTSP_RETRY_INTERVAL;
+  }
+}
+
+// Open the encoder sessions for the current layout now, rather than when the
+// first frame is encoded, so that the first frame is not delayed by the
+// encoder and RTSP startup.  Returns the number of sessions that are open.
+int rtsp_prewarm_outputs(int fb_width, int fb_height){
+  sync_rtsp_outputs(fb_width, fb_height);
+  return num_rtsp_outputs;
+}
+
+// Attach the regions of interest that intersect the output to its frame as
+// AVRegionOfInterest side data.  Returns the number of regions attached.
+static int attach_rtsp_output_rois(RTSPOutput *output){
+  AVFrameSideData *sd;
+  AVRegionOfInterest *roi;
+  int i, n = 0;
+
+  for(i = 0; i < num_rtsp_rois; i++){
+    if(rtsp_rois[i].x2 > output->x && rtsp_rois[i].x1 < output->x + output->width &&
+       rtsp_rois[i].y2 > output->y && rtsp_rois[i].y1 < output->y + output->height)
+      n++;
+  }
+  if(n == 0) return 0;
+
+  if((sd = av_frame_new_side_data(output->stream.frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                  n * sizeof(AVRegionOfInterest))) == NULL)
+    return 0;
+  roi = (AVRegionOfInterest *)sd->data;
+  for(i = 0; i < num_rtsp_rois; i++){
+    const RTSPRoi *r = &rtsp_rois[i];
+
+    if(r->x2 <= output->x || r->x1 >= output->x + output->width ||
+       r->y2 <= output->y || r->y1 >= output->y + output->height)
+      continue;
+    roi->self_size = sizeof(AVRegionOfInterest);
+    roi->left = (r->x1 > output->x ? r->x1 : output->x) - output->x;
+    roi->top = (r->y1 > output->y ? r->y1 : output->y) - output->y;
+    roi->right = (r->x2 < output->x + output->width ? r->x2 : output->x + output->width) -
+                 output->x;
+    roi->bottom = (r->y2 < output->y + output->height ? r->y2 : output->y + output->height) -
+                  output->y;
+    roi->qoffset = (AVRational){ r->qoffset, 100 };
+    roi++;
+  }
+  return n;
+}
+
+// Send the output's current frame to its stream, as an IDR frame if a keyframe
+// has been requested.
+static int send_rtsp_output_frame(RTSPOutput *output){
+  AVFrame *frame = output->stream.frame;
+  int retval, rois;
+
+  if(rtsp_rois_stale && rtsp_roi_func) rtsp_roi_func();
+  rtsp_rois_stale = 0;
+
+  if(output->force_keyframe){
+    frame->pict_type = AV_PICTURE_TYPE_I;
+    output->force_keyframe = 0;
+  }
+  rois = attach_rtsp_output_rois(output);
+  retval = send_frame_to_rtsp_stream(&output->stream);
+  if(rois) av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+  frame->pict_type = AV_PICTURE_TYPE_NONE;
+  return retval;
+}
+
+// Convert one output's worth of 32-bit BGRA pixels, starting at src, and send
+// it to the output's stream.
+static int encode_rtsp_output(RTSPOutput *output, const char *src, int pitch, long long now){
+  const uint8_t *inData[1];
+  int linesize[1];
+
+  if((output->sws_ctx = sws_getCachedContext(output->sws_ctx,
+                                             output->width, output->height, AV_PIX_FMT_BGRA,
+                                             output->width, output->height, output->stream.frame->format,
+                                             SWS_FAST_BILINEAR, NULL, NULL, NULL)) == NULL){
+    fprintf(stderr,"unable to initialize scaling context\n");
+    return -1;
+  }
+
+  inData[0] = (const uint8_t *)src;
+  linesize[0] = pitch;
+  sws_scale(output->sws_ctx, inData, linesize, 0, output->height,
+            output->stream.frame->data, output->stream.frame->linesize);
+
+  output->next_frame_time = now + 1000000000LL / output->fps;
+  return send_rtsp_output_frame(output);
+}
+
+// Crop each output from a 32-bit BGRA framebuffer, and encode it if its frame
+// interval has elapsed.  Outputs that are being fed from GL buffer swaps or Xv
+// images are skipped until the swaps stop for two frame intervals.  Returns
+// the number of outputs that were encoded, or -1 if encoding failed.
+int write_framebuffer_to_rtsp_outputs(const char *fb, int fb_width, int fb_height, int pitch){
+  long long now;
+  int i, n = 0, retval = 0;
+
+  sync_rtsp_outputs(fb_width, fb_height);
+  now = rtsp_get_time();
+
+  for(i = 0; i < num_rtsp_outputs; i++){
+    RTSPOutput *output = &rtsp_outputs[i];
+
+    if(now < output->next_frame_time) continue;
+    if(output->direct_capture_time &&
+       now - output->direct_capture_time < 2000000000LL / output->fps)
+      continue;
+    // The framebuffer may briefly be smaller than the layout while a resize
+    // is in progress.
+    if(output->x < 0 || output->y < 0 || output->x + output->width > fb_width ||
+       output->y + output->height > fb_height)
+      continue;
+
+    if(encode_rtsp_output(output, &fb[output->y * pitch + output->x * 4],
+                          pitch, now) < 0)
+      retval = -1;
+    else
+      n++;
+  }
+
+  return retval < 0 ? retval : n;
+}
+
+// Encode the outputs that lie entirely within a 32-bit BGRA image (such as the
+// back buffer of a fullscreen GL window at swap time) directly from the image,
+// and mark them as captured so that the framebuffer path leaves them alone.
+// (x, y) is the position of the image within the framebuffer.  Returns the
+// number of outputs that were encoded, or -1 if encoding failed.
+int write_image_to_rtsp_outputs(const char *data, int pitch, int x, int y, int width, int height,
+                                int fb_width, int fb_height){
+  long long now;
+  int i, n = 0, retval = 0;
+
+  sync_rtsp_outputs(fb_width, fb_height);
+  now = rtsp_get_time();
+
+  for(i = 0; i < num_rtsp_outputs; i++){
+    RTSPOutput *output = &rtsp_outputs[i];
+
+    if(output->x < x || output->y < y || output->x + output->width > x + width ||
+       output->y + output->height > y + height)
+      continue;
+    output->direct_capture_time = now;
+
+    if(now < output->next_frame_time) continue;
+    if(encode_rtsp_output(output, &data[(output->y - y) * pitch + (output->x - x) * 4],
+                          pitch, now) < 0)
+      retval = -1;
+    else
+      n++;
+  }
+
+  return retval < 0 ? retval : n;
+}
+
+// Offset the planes of a YUV image in one of the formats that the Xv adaptor
+// accepts to pixel (x, y), which must be even.
+static void offset_yuv_planes(enum AVPixelFormat format, const uint8_t *const planes[3],
+                              const int pitches[3], int x, int y, const uint8_t *out[3]){
+  out[0] = out[1] = out[2] = NULL;
+  switch(format){
+  case AV_PIX_FMT_YUV420P:
+    out[0] = planes[0] + y * pitches[0] + x;
+    out[1] = planes[1] + y / 2 * pitches[1] + x / 2;
+    out[2] = planes[2] + y / 2 * pitches[2] + x / 2;
+    break;
+  case AV_PIX_FMT_NV12:
+    out[0] = planes[0] + y * pitches[0] + x;
+    out[1] = planes[1] + y / 2 * pitches[1] + x;
+    break;
+  default:  // AV_PIX_FMT_YUYV422
+    out[0] = planes[0] + y * pitches[0] + x * 2;
+    break;
+  }
+}
+
+// Send one output's worth of a YUV image to the output's stream.  If the image
+// is already YUV420P at the output's resolution, then the encoder reads the
+// image's planes directly.  Otherwise, the image is scaled and/or converted
+// into the output's frame, without ever passing through RGB.
+static int encode_rtsp_output_yuv(RTSPOutput *output, const uint8_t *const planes[3],
+                                  const int pitches[3], enum AVPixelFormat format,
+                                  int src_w, int src_h, long long now){
+  AVFrame *frame = output->stream.frame;
+  int retval, i;
+
+  output->next_frame_time = now + 1000000000LL / output->fps;
+
+  if(format == frame->format && src_w == output->width && src_h == output->height){
+    uint8_t *data[3];
+    int linesize[3];
+
+    // avcodec_send_frame() copies frames that are not reference-counted, so
+    // the image only needs to remain valid until the frame has been sent.
+    for(i = 0; i < 3; i++){
+      data[i] = frame->data[i];  linesize[i] = frame->linesize[i];
+      frame->data[i] = (uint8_t *)planes[i];  frame->linesize[i] = pitches[i];
+    }
+    retval = send_rtsp_output_frame(output);
+    for(i = 0; i < 3; i++){
+      frame->data[i] = data[i];  frame->linesize[i] = linesize[i];
+    }
+    return retval;
+  }
+
+  if((output->yuv_sws_ctx = sws_getCachedContext(output->yuv_sws_ctx,
+                                                 src_w, src_h, format,
+                                                 output->width, output->height, frame->format,
+                                                 SWS_FAST_BILINEAR, NULL, NULL, NULL)) == NULL){
+    fprintf(stderr,"unable to initialize scaling context\n");
+    return -1;
+  }
+  sws_scale(output->yuv_sws_ctx, planes, pitches, 0, src_h, frame->data, frame->linesize);
+
+  return send_rtsp_output_frame(output);
+}
+
+// Encode the outputs that lie entirely within the destination rectangle of an
+// Xv image, straight from the image's YUV planes, and mark them as captured so
+// that the framebuffer path leaves them alone.  The src_w x src_h image is
+// scaled to the width x height rectangle at (x, y) in the framebuffer.
+// Returns the number of outputs that were encoded, or -1 if encoding failed.
+int write_yuv_image_to_rtsp_outputs(const uint8_t *const planes[3], const int pitches[3],
+                                    enum AVPixelFormat format, int src_w, int src_h,
+                                    int x, int y, int width, int height,
+                                    int fb_width, int fb_height){
+  long long now;
+  int i, n = 0, retval = 0;
+
+  if(width <= 0 || height <= 0) return 0;
+
+  sync_rtsp_outputs(fb_width, fb_height);
+  now = rtsp_get_time();
+
+  for(i = 0; i < num_rtsp_outputs; i++){
+    RTSPOutput *output = &rtsp_outputs[i];
+    const uint8_t *out_planes[3];
+    int sx, sy, sw, sh;
+
+    if(output->x < x || output->y < y || output->x + output->width > x + width ||
+       output->y + output->height > y + height)
+      continue;
+    output->direct_capture_time = now;
+
+    if(now < output->next_frame_time) continue;
+
+    // Map the output to the corresponding part of the image.
+    sx = (int)((long long)(output->x - x) * src_w / width) & ~1;
+    sy = (int)((long long)(output->y - y) * src_h / height) & ~1;
+    sw = (int)((long long)output->width * src_w / width);
+    sh = (int)((long long)output->height * src_h / height);
+    if(sw > src_w - sx) sw = src_w - sx;
+    if(sh > src_h - sy) sh = src_h - sy;
+    if(sw < 2 || sh < 2) continue;
+
+    offset_yuv_planes(format, planes, pitches, sx, sy, out_planes);
+    if(encode_rtsp_output_yuv(output, out_planes, pitches, format, sw, sh, now) < 0)
+      retval = -1;
+    else
+      n++;
+  }
+
+  return retval < 0 ? retval : n;
+}
+
+// Encode the next frame of the stream for RandR output 'id' (or of every
+// stream, if id is 0xFFFFFFFF) as an IDR frame.
+void rtsp_request_keyframe(unsigned int id){
+  int i;
+
+  for(i = 0; i < num_rtsp_outputs; i++){
+    if(id == 0xFFFFFFFF || rtsp_outputs[i].id == id)
+      rtsp_outputs[i].force_keyframe = 1;
+  }
+}
+
+// Set the function that computes the regions of interest (by calling
+// rtsp_set_rois()) before a frame is encoded.
+void rtsp_set_roi_func(void (*func)(void)){
+  rtsp_roi_func = func;
+}
+
+// Set the regions of interest for the frames that are encoded from now on.
+// Regions that overlap more than one output apply to each of them.
+void rtsp_set_rois(const RTSPRoi *rois, int count){
+  if(count > MAX_RTSP_ROIS) count = MAX_RTSP_ROIS;
+  if(count > 0) memcpy(rtsp_rois, rois, count * sizeof(RTSPRoi));
+  num_rtsp_rois = count > 0 ? count : 0;
+}
+
+// Teardown all output streams
+void close_rtsp_outputs(void){
+  int i;
+
+  for(i = 0; i < num_rtsp_outputs; i++)
+    close_rtsp_output(&rtsp_outputs[i], 0);
+  num_rtsp_outputs = 0;
+  rtsp_layout_dirty = 1;
+  free_rtsp_pool();
+  av_buffer_unref(&rtsp_hw_device);
+}
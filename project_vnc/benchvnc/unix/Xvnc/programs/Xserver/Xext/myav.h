@@ -1,8 +1,11 @@
 #include <libavutil/imgutils.h>
 #include <libavutil/avconfig.h>
+#include <libavutil/hwcontext.h>
 #include <libswscale/swscale.h>
 #include <libavformat/avformat.h>
 
+#include "rtspoutputs.h"
+
 #pragma pack(push)  // save the original data alignment
 #pragma pack(1)     // Set data alignment to 1 byte boundary
 
@@ -40,6 +43,35 @@ typedef struct{
     const char *endpoint;
 } RTSPStream;
 
+// Region of interest.  The encoders spend more bits on regions with a negative
+// qoffset and fewer bits on regions with a positive qoffset.
+#define MAX_RTSP_ROIS 64
+
+typedef struct{
+    int x1, y1, x2, y2;         // In framebuffer coordinates
+    int qoffset;                // -100 (highest quality) to 100 (lowest)
+} RTSPRoi;
+
+// One encoder session per RandR output.  Each output is cropped from the
+// shared framebuffer and encoded at its native resolution into its own
+// RTSP stream.
+#define MAX_RTSP_OUTPUTS 16
+
+typedef struct{
+    RTSPStream stream;
+    struct SwsContext *sws_ctx;
+    struct SwsContext *yuv_sws_ctx;  // Used for Xv images
+    unsigned int id;            // RandR output ID
+    int x, y, width, height;    // Position and size within the framebuffer
+    int fps, bitrate;
+    int started;
+    long long next_frame_time;  // CLOCK_MONOTONIC, in ns
+    int force_keyframe;         // Encode the next frame as an IDR frame
+    long long direct_capture_time;  // Last time a GL swap or Xv image covered
+                                    // this output
+    char endpoint[256];
+} RTSPOutput;
+
 int init_rtsp_stream(RTSPStream *rtsp_stream, int width, int height, int fps, int bitrate, const char *endpoint);
 AVCodecContext *get_codec_context(int width, int height, int fps, int bitrate);
 AVFrame *get_av_frame(AVCodecContext *codec_context);
@@ -48,4 +80,18 @@ int load_image_into_frame(AVFrame *frame, BMPImage *image);
 int encode_frame_to_packet(AVFrame *frame, AVCodecContext *codec_context);
 int write_image_to_rtsp_stream(RTSPStream *rtsp_stream, BMPImage *image);
 int end_rtsp_stream(RTSPStream *rtsp_stream);
-int free_rtsp_stream(RTSPStream *rtsp_stream);
\ No newline at end of file
+int free_rtsp_stream(RTSPStream *rtsp_stream);
+
+int rtsp_prewarm_outputs(int fb_width, int fb_height);
+int write_framebuffer_to_rtsp_outputs(const char *fb, int fb_width, int fb_height, int pitch);
+int write_image_to_rtsp_outputs(const char *data, int pitch, int x, int y, int width, int height,
+                                int fb_width, int fb_height);
+int write_yuv_image_to_rtsp_outputs(const uint8_t *const planes[3], const int pitches[3],
+                                    enum AVPixelFormat format, int src_w, int src_h,
+                                    int x, int y, int width, int height,
+                                    int fb_width, int fb_height);
+void rtsp_request_keyframe(unsigned int id);
+int rtsp_rois_supported(void);
+void rtsp_set_roi_func(void (*func)(void));
+void rtsp_set_rois(const RTSPRoi *rois, int count);
+void close_rtsp_outputs(void);
@@ -0,0 +1,33 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+// The parts of the RTSP output interface (myav.c) that don't depend on the
+// FFmpeg headers, so that the RFB server can use them.
+
+#ifndef __RTSPOUTPUTS_H__
+#define __RTSPOUTPUTS_H__
+
+void rtsp_layout_begin(void);
+void rtsp_layout_add_output(unsigned int id, int x, int y, int width, int height);
+void rtsp_layout_end(void);
+
+// Return the value for the given output index from a comma-separated list of
+// positive integers in the environment variable, or def if the variable isn't
+// set.  Outputs beyond the end of the list reuse its last value.
+long rtsp_get_env_param(const char *name, int index, long def);
+
+#endif
@@ -98,8 +98,6 @@ in this Software without prior written authorization from The Open Group.
 #include <string.h>
 #include <sys/time.h> 
 //#include <unistd.h>
-static RTSPStream rtsp_stream;
-static BMPImage image;
 /*
 static key_t key; 
 static int shmid; 
@@ -567,15 +565,285 @@ FILE* getLogFilePointer(pid_t cur_pid){
      }
 }
 
+/*
+ * State shared by the paths that feed the RTSP streams: ShmPutImage, which
+ * crops the outputs from the screen pixmap, and GL buffer swaps and Xv images,
+ * which hand over their pixels directly.
+ */
+
+/* 0 = not started, 1 = streaming, -1 = torn down */
+static int rtsp_start = 0;
+static long long rtsp_start_time = 0;
+
+/* Called with a pointer to the capture time (a CARD64, in microseconds, on the
+   same clock as GetTimeInMicros()) whenever a frame has been captured for the
+   encoders. */
+CallbackListPtr ShmCaptureCallback = NULL;
+
+/* Called with a ShmRoiInfoPtr before each frame is encoded, so that the DDX
+   can tell the encoders which parts of the screen deserve more bits.  Only
+   called if ShmEncoderSupportsRois() returns TRUE. */
+CallbackListPtr ShmRoiCallback = NULL;
+
+/* Called with a ShmEncodeInfoPtr after each frame has been encoded, so that
+   the DDX can keep statistics. */
+CallbackListPtr ShmEncodeCallback = NULL;
+
+static long long
+ShmEncodeTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Returns FALSE if the H.264/RTSP streams have been disabled by setting
+ * TVNC_RTSP=0, in which case nothing is encoded and RFB viewers receive the
+ * whole framebuffer.
+ */
+Bool
+ShmEncodingEnabled(void)
+{
+    static int enabled = -1;
+
+    if (enabled < 0) {
+        const char *env = getenv("TVNC_RTSP");
+
+        enabled = !env || strcmp(env, "0");
+    }
+    return enabled ? TRUE : FALSE;
+}
+
+/*
+ * Returns TRUE if the video encoder makes use of regions of interest.
+ */
+Bool
+ShmEncoderSupportsRois(void)
+{
+    return ShmEncodingEnabled() && rtsp_rois_supported() ? TRUE : FALSE;
+}
+
+/* Called by the encoders before the first frame of each image that is
+   actually encoded. */
+static void
+ShmUpdateRois(void)
+{
+    ShmRoiInfoRec info;
+    RTSPRoi rois[SHM_MAX_ROIS];
+    int i;
+
+    info.nRois = 0;
+    if (ShmRoiCallback)
+        CallCallbacks(&ShmRoiCallback, &info);
+    for (i = 0; i < info.nRois && i < SHM_MAX_ROIS; i++) {
+        rois[i].x1 = info.rois[i].box.x1;
+        rois[i].y1 = info.rois[i].box.y1;
+        rois[i].x2 = info.rois[i].box.x2;
+        rois[i].y2 = info.rois[i].box.y2;
+        rois[i].qoffset = info.rois[i].qoffset;
+    }
+    rtsp_set_rois(rois, i);
+}
+
+/* Returns FALSE once the streams have been torn down. */
+static Bool
+ShmBeginEncode(void)
+{
+    if (rtsp_start < 0)
+        return FALSE;
+    if (rtsp_start == 0) {
+        rtsp_start_time = ShmEncodeTime();
+        rtsp_start = 1;
+    }
+    return TRUE;
+}
+
+static void
+ShmEndEncode(long long proc_time, int nCaptured)
+{
+    long long end_time = ShmEncodeTime();
+
+    if (nCaptured > 0) {
+        CARD64 ust = proc_time / 1000;
+
+        CallCallbacks(&ShmCaptureCallback, &ust);
+
+        /* Images for which pacing skipped every output are not logged. */
+        fprintf(stderr, "encode_time %f ms\n",
+                (end_time - proc_time) / 1000000.);
+    }
+
+    if (ShmEncodeCallback) {
+        ShmEncodeInfoRec info;
+
+        info.encodeTime = end_time - proc_time;
+        info.nEncoded = nCaptured;
+        CallCallbacks(&ShmEncodeCallback, &info);
+    }
+
+    // Teardown the streams after 2 minutes.
+    if (end_time - rtsp_start_time > 120000000000LL) {
+        close_rtsp_outputs();
+        rtsp_start = -1;
+    }
+}
+
+/*
+ * Encode each RandR output of the screen into its own RTSP stream, cropping
+ * from the screen pixmap after the image has been drawn.
+ */
+static void
+ShmEncodeOutputs(ScreenPtr pScreen)
+{
+    PixmapPtr pPixmap;
+    long long proc_time;
+    int n;
+
+    pPixmap = (*pScreen->GetScreenPixmap) (pScreen);
+    if (!pPixmap || pPixmap->drawable.bitsPerPixel != 32)
+        return;
+    if (!ShmBeginEncode())
+        return;
+
+    proc_time = ShmEncodeTime();
+    n = write_framebuffer_to_rtsp_outputs((const char *) pPixmap->devPrivate.ptr,
+                                          pPixmap->drawable.width,
+                                          pPixmap->drawable.height,
+                                          pPixmap->devKind);
+    ShmEndEncode(proc_time, n);
+}
+
+/*
+ * Returns TRUE if the w x h area at (x, y) within a window is entirely visible
+ * on the screen, in which case box is set to that area in screen coordinates.
+ * Content drawn to the area can only be encoded directly if no other window
+ * covers it.
+ */
+static Bool
+ShmWindowAreaVisible(DrawablePtr pDraw, int x, int y, int w, int h,
+                     BoxPtr box)
+{
+    WindowPtr pWin = (WindowPtr) pDraw;
+
+    if (pDraw->type != DRAWABLE_WINDOW || pDraw->bitsPerPixel != 32 ||
+        !pWin->realized)
+        return FALSE;
+#ifdef COMPOSITE
+    if (pWin->redirectDraw != RedirectDrawNone)
+        return FALSE;
+#endif
+
+    box->x1 = pDraw->x + x;
+    box->y1 = pDraw->y + y;
+    box->x2 = box->x1 + w;
+    box->y2 = box->y1 + h;
+    return RegionContainsRect(&pWin->clipList, box) == rgnIN;
+}
+
+/*
+ * Called by the GLX swrast loader with the back buffer of a GL window that is
+ * being swapped.  The RandR outputs that the window covers are encoded straight
+ * from the back buffer, so fullscreen GL applications reach the encoder at
+ * their swap boundaries without being read back from the screen pixmap, and
+ * ShmEncodeOutputs() leaves those outputs alone while the swaps continue.
+ */
+void
+ShmEncodeSwapBuffers(DrawablePtr pDraw, int x, int y, int w, int h, char *data)
+{
+    BoxRec box;
+    long long proc_time;
+    int n;
+
+    if (!ShmWindowAreaVisible(pDraw, x, y, w, h, &box))
+        return;
+    if (!ShmBeginEncode())
+        return;
+
+    proc_time = ShmEncodeTime();
+    n = write_image_to_rtsp_outputs(data, PixmapBytePad(w, pDraw->depth),
+                                    box.x1, box.y1, w, h,
+                                    pDraw->pScreen->width,
+                                    pDraw->pScreen->height);
+    if (n != 0)
+        ShmEndEncode(proc_time, n);
+}
+
+/*
+ * Called by the Xv adaptor (hw/vnc/vncxv.c) after it has drawn a YUV image
+ * into the w x h area at (x, y) within a window.  The RandR outputs that the
+ * area covers are encoded straight from the image's planes, so video players
+ * that use Xv reach the encoder without a round trip through RGB, and
+ * ShmEncodeOutputs() leaves those outputs alone while the images continue.
+ * planes[] and pitches[] describe the src_w x src_h part of the image that
+ * was drawn, and format is its AVPixelFormat.
+ */
+void
+ShmEncodeXvImage(DrawablePtr pDraw, int x, int y, int w, int h,
+                 const unsigned char *const planes[3], const int pitches[3],
+                 int format, int src_w, int src_h)
+{
+    BoxRec box;
+    long long proc_time;
+    int n;
+
+    if (!ShmWindowAreaVisible(pDraw, x, y, w, h, &box))
+        return;
+    if (!ShmBeginEncode())
+        return;
+
+    proc_time = ShmEncodeTime();
+    n = write_yuv_image_to_rtsp_outputs(planes, pitches,
+                                        (enum AVPixelFormat) format,
+                                        src_w, src_h, box.x1, box.y1, w, h,
+                                        pDraw->pScreen->width,
+                                        pDraw->pScreen->height);
+    if (n != 0)
+        ShmEndEncode(proc_time, n);
+}
+
+/*
+ * Encode the next frame of the RTSP stream for RandR output id (or of all
+ * streams, if id is 0xFFFFFFFF) as a keyframe.  Called when an RFB viewer
+ * reports that it could not decode a stream.
+ */
+void
+ShmRequestKeyframe(CARD32 id)
+{
+    rtsp_request_keyframe(id);
+}
+
+/*
+ * Open the RTSP encoder sessions as soon as the server is idle after startup,
+ * rather than when the first image is put, so that the first frame that an
+ * application draws is not held up by encoder and RTSP startup.  The RandR
+ * layout has been reported to the encoders by then.  TVNC_RTSPPREWARM=0
+ * disables this.
+ */
+static Bool
+ShmPrewarmEncoders(ClientPtr client, void *closure)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    PixmapPtr pPixmap = (*pScreen->GetScreenPixmap) (pScreen);
+    long long start_time;
+    int n;
+
+    if (!pPixmap || pPixmap->drawable.bitsPerPixel != 32 || rtsp_start != 0)
+        return TRUE;
+
+    start_time = ShmEncodeTime();
+    n = rtsp_prewarm_outputs(pPixmap->drawable.width,
+                             pPixmap->drawable.height);
+    ErrorF("Opened %d RTSP encoder session%s in %.1f ms\n", n,
+           n == 1 ? "" : "s", (ShmEncodeTime() - start_time) / 1000000.);
+    return TRUE;
+}
+
 static int
 ProcShmPutImage(ClientPtr client)
 {
 
-    // Some hard coded screen size, need to get desktop size from rfb
-    static int rtsp_start = 0;
-    int myw = 1280;
-    int myh = 720;
-
     VncServerFrameNum++;
     long long tmp_time2=0;
     if(VncServerFrameNum >= 60){//61
@@ -656,43 +924,6 @@ ProcShmPutImage(ClientPtr client)
         return BadValue;
     }
 
-    static  struct timespec start;
-    struct timespec end;
-    static  float start_time = 0, end_time = 0, diff_time;
-    float proc_time;
-
-    // Start the stream
-    if(rtsp_start == 0 && init_rtsp_stream(&rtsp_stream, myw, myh, 
-                60, 1500000, "rtsp://127.0.0.1:5545/live306") == 0){
-        start_rtsp_stream(&rtsp_stream);
-        image.header.width_px = myw;
-        image.header.height_px = myh;
-        rtsp_start++;
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        start_time = start.tv_sec*1000000000 + start.tv_nsec;
-        fprintf(stderr, "starting stream\n");
-    }
-
-    // Calculates encoding time in ms and sends image to rtsp stream
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    proc_time = end.tv_sec*1000000000 + end.tv_nsec;
-    if (rtsp_start == 1 && stuff->totalWidth == myw && stuff->totalHeight == myh){
-        image.data = &shmdesc->addr[0];
-        write_image_to_rtsp_stream(&rtsp_stream, &image);
-    } 
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    end_time = end.tv_sec*1000000000 + end.tv_nsec;
-    diff_time = end_time - start_time;
-    fprintf(stderr, "encode_time %f ms\n", (end_time-proc_time)/1000000);
-
-    // Teardown the stream after 2 minutes.
-    if(diff_time > 120000000000 && rtsp_start == 1){
-        fprintf(stderr, "ending stream\n");
-        end_rtsp_stream(&rtsp_stream);
-        free_rtsp_stream(&rtsp_stream);
-        rtsp_start = -1;
-    }
-
     if ((((stuff->format == ZPixmap) && (stuff->srcX == 0)) ||
          ((stuff->format != ZPixmap) &&
           (stuff->srcX < screenInfo.bitmapScanlinePad) &&
@@ -710,11 +941,8 @@ ProcShmPutImage(ClientPtr client)
         if((shmdesc->addr[0] & 0xff)==0xde && (shmdesc->addr[1] & 0xff)==0xad && 
            (shmdesc->addr[2] & 0xff)==0xbe && (shmdesc->addr[3] & 0xff)==0xef){
 
-            // Uncomment to send frames only on user input, used to measure RTT (Input Delay)
-            // if (rtsp_start == 1 && stuff->totalWidth == myw && stuff->totalHeight == myh){
-            //     image.data = &shmdesc->addr[0];
-            //     write_image_to_rtsp_stream(&rtsp_stream, &image);
-            // } 
+            // To send frames only on user input (used to measure RTT/Input
+            // Delay), move the call to ShmEncodeOutputs() here.
 
            appreqID = ((shmdesc->addr[4] & 0xff) << 24 | (shmdesc->addr[5] & 0xff) << 16 | 
                        (shmdesc->addr[6] & 0xff) << 8 | (shmdesc->addr[7] & 0xff)) & 0xffffffff;
@@ -745,6 +973,9 @@ ProcShmPutImage(ClientPtr client)
                       stuff->dstX, stuff->dstY, shmdesc->addr + stuff->offset);
     }
 
+    if (pDraw->type == DRAWABLE_WINDOW)
+        ShmEncodeOutputs(pDraw->pScreen);
+
     if (stuff->sendEvent) {
         xShmCompletionEvent ev = {
             .type = ShmCompletionCode,
@@ -1678,4 +1909,20 @@ ShmExtensionInit(void)
         SetResourceTypeErrorValue(ShmSegType, BadShmSegCode);
         EventSwapVector[ShmCompletionCode] = (EventSwapPtr) SShmCompletionEvent;
     }
+
+    if (!ShmEncodingEnabled()) {
+        ErrorF("H.264/RTSP streams disabled\n");
+        rtsp_start = -1;
+        return;
+    }
+
+    if (ShmEncoderSupportsRois())
+        rtsp_set_roi_func(ShmUpdateRois);
+
+    {
+        const char *env = getenv("TVNC_RTSPPREWARM");
+
+        if (!env || strcmp(env, "0"))
+            QueueWorkProc(ShmPrewarmEncoders, NULL, NULL);
+    }
 }
@@ -28,6 +28,7 @@
 #include "screenint.h"
 #include "pixmap.h"
 #include "gc.h"
+#include "miscstruct.h"
 
 #define XSHM_PUT_IMAGE_ARGS \
     DrawablePtr		/* dst */, \
@@ -86,6 +87,54 @@ extern _X_EXPORT void
 extern _X_EXPORT void
  ShmRegisterFbFuncs(ScreenPtr pScreen);
 
+extern _X_EXPORT void
+ ShmEncodeSwapBuffers(DrawablePtr pDraw, int x, int y, int w, int h,
+                      char *data);
+
+extern _X_EXPORT void
+ ShmEncodeXvImage(DrawablePtr pDraw, int x, int y, int w, int h,
+                  const unsigned char *const planes[3], const int pitches[3],
+                  int format, int src_w, int src_h);
+
+extern _X_EXPORT void
+ ShmRequestKeyframe(CARD32 id);
+
+extern _X_EXPORT CallbackListPtr ShmCaptureCallback;
+
+/* Regions of interest for the video encoders, in screen coordinates.  qoffset
+   is a quality offset from -100 (highest quality) to 100 (lowest quality.) */
+
+#define SHM_MAX_ROIS 64
+
+typedef struct _ShmRoi {
+    BoxRec box;
+    int qoffset;
+} ShmRoiRec;
+
+typedef struct _ShmRoiInfo {
+    int nRois;
+    ShmRoiRec rois[SHM_MAX_ROIS];
+} ShmRoiInfoRec, *ShmRoiInfoPtr;
+
+extern _X_EXPORT CallbackListPtr ShmRoiCallback;
+
+extern _X_EXPORT Bool
+ ShmEncodingEnabled(void);
+
+extern _X_EXPORT Bool
+ ShmEncoderSupportsRois(void);
+
+/* Passed to ShmEncodeCallback after each frame has been handed to the video
+   encoders.  encodeTime is in nanoseconds, and nEncoded is the number of
+   outputs that were encoded, or -1 if encoding failed. */
+
+typedef struct _ShmEncodeInfo {
+    CARD64 encodeTime;
+    int nEncoded;
+} ShmEncodeInfoRec, *ShmEncodeInfoPtr;
+
+extern _X_EXPORT CallbackListPtr ShmEncodeCallback;
+
 extern _X_EXPORT RESTYPE ShmSegType;
 extern _X_EXPORT int ShmCompletionCode;
 extern _X_EXPORT int BadShmSegCode;
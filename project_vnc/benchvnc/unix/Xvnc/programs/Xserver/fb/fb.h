@@ -1104,6 +1104,18 @@ extern _X_EXPORT void
 
 #define fbPolyRectangle	miPolyRectangle
 
+/*
+ * fbmt.c
+ */
+
+typedef void (*FbBandProc) (void *closure, int y, int height);
+
+extern _X_EXPORT void
+ fbSetNumThreads(int n);
+
+extern _X_EXPORT Bool
+ fbParallelBands(int y, int width, int height, FbBandProc proc, void *closure);
+
 /*
  * fbpict.c
  */
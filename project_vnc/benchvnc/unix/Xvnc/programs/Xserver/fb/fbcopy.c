@@ -28,6 +28,47 @@
 
 #include "fb.h"
 
+typedef struct {
+    CARD8 alu;
+    FbBits pm;
+    FbBits *src, *dst;
+    FbStride srcStride, dstStride;
+    int srcBpp, dstBpp;
+    int srcXoff, srcYoff, dstXoff, dstYoff;
+    int dx, dy;
+    Bool reverse, upsidedown;
+    BoxPtr pbox;
+} FbCopyNtoNBox;
+
+static void
+fbCopyNtoNRows(void *closure, int y1, int height)
+{
+    FbCopyNtoNBox *c = closure;
+    BoxPtr pbox = c->pbox;
+    int y2 = y1 + height;
+
+#ifndef FB_ACCESS_WRAPPER       /* pixman_blt() doesn't support accessors yet */
+    if (c->pm == FB_ALLONES && c->alu == GXcopy && !c->reverse &&
+        !c->upsidedown) {
+        if (pixman_blt
+            ((uint32_t *) c->src, (uint32_t *) c->dst, c->srcStride,
+             c->dstStride, c->srcBpp, c->dstBpp,
+             (pbox->x1 + c->dx + c->srcXoff), (y1 + c->dy + c->srcYoff),
+             (pbox->x1 + c->dstXoff), (y1 + c->dstYoff),
+             (pbox->x2 - pbox->x1), (y2 - y1)))
+            return;
+    }
+#endif
+    fbBlt(c->src + (y1 + c->dy + c->srcYoff) * c->srcStride,
+          c->srcStride,
+          (pbox->x1 + c->dx + c->srcXoff) * c->srcBpp,
+          c->dst + (y1 + c->dstYoff) * c->dstStride,
+          c->dstStride,
+          (pbox->x1 + c->dstXoff) * c->dstBpp,
+          (pbox->x2 - pbox->x1) * c->dstBpp,
+          (y2 - y1), c->alu, c->pm, c->dstBpp, c->reverse, c->upsidedown);
+}
+
 void
 fbCopyNtoN(DrawablePtr pSrcDrawable,
            DrawablePtr pDstDrawable,
@@ -37,46 +78,39 @@ fbCopyNtoN(DrawablePtr pSrcDrawable,
            int dx,
            int dy, Bool reverse, Bool upsidedown, Pixel bitplane, void *closure)
 {
-    CARD8 alu = pGC ? pGC->alu : GXcopy;
-    FbBits pm = pGC ? fbGetGCPrivate(pGC)->pm : FB_ALLONES;
-    FbBits *src;
-    FbStride srcStride;
-    int srcBpp;
-    int srcXoff, srcYoff;
-    FbBits *dst;
-    FbStride dstStride;
-    int dstBpp;
-    int dstXoff, dstYoff;
+    FbCopyNtoNBox c;
 
-    fbGetDrawable(pSrcDrawable, src, srcStride, srcBpp, srcXoff, srcYoff);
-    fbGetDrawable(pDstDrawable, dst, dstStride, dstBpp, dstXoff, dstYoff);
+    c.alu = pGC ? pGC->alu : GXcopy;
+    c.pm = pGC ? fbGetGCPrivate(pGC)->pm : FB_ALLONES;
+    c.dx = dx;
+    c.dy = dy;
+    c.reverse = reverse;
+    c.upsidedown = upsidedown;
+
+    fbGetDrawable(pSrcDrawable, c.src, c.srcStride, c.srcBpp, c.srcXoff,
+                  c.srcYoff);
+    fbGetDrawable(pDstDrawable, c.dst, c.dstStride, c.dstBpp, c.dstXoff,
+                  c.dstYoff);
 
     while (nbox--) {
-#ifndef FB_ACCESS_WRAPPER       /* pixman_blt() doesn't support accessors yet */
-        if (pm == FB_ALLONES && alu == GXcopy && !reverse && !upsidedown) {
-            if (!pixman_blt
-                ((uint32_t *) src, (uint32_t *) dst, srcStride, dstStride,
-                 srcBpp, dstBpp, (pbox->x1 + dx + srcXoff),
-                 (pbox->y1 + dy + srcYoff), (pbox->x1 + dstXoff),
-                 (pbox->y1 + dstYoff), (pbox->x2 - pbox->x1),
-                 (pbox->y2 - pbox->y1)))
-                goto fallback;
-            else
-                goto next;
+        Bool overlap = FALSE;
+
+        /* A box whose source and destination overlap has to be copied in
+           order (which is what reverse and upsidedown specify), so it can't
+           be split into bands that are copied concurrently. */
+        if (c.src == c.dst) {
+            int sx = pbox->x1 + dx + c.srcXoff, sy = pbox->y1 + dy + c.srcYoff;
+            int tx = pbox->x1 + c.dstXoff, ty = pbox->y1 + c.dstYoff;
+            int w = pbox->x2 - pbox->x1, h = pbox->y2 - pbox->y1;
+
+            overlap = sx < tx + w && tx < sx + w && sy < ty + h && ty < sy + h;
         }
- fallback:
-#endif
-        fbBlt(src + (pbox->y1 + dy + srcYoff) * srcStride,
-              srcStride,
-              (pbox->x1 + dx + srcXoff) * srcBpp,
-              dst + (pbox->y1 + dstYoff) * dstStride,
-              dstStride,
-              (pbox->x1 + dstXoff) * dstBpp,
-              (pbox->x2 - pbox->x1) * dstBpp,
-              (pbox->y2 - pbox->y1), alu, pm, dstBpp, reverse, upsidedown);
-#ifndef FB_ACCESS_WRAPPER
- next:
-#endif
+
+        c.pbox = pbox;
+        if (overlap || reverse || upsidedown ||
+            !fbParallelBands(pbox->y1, pbox->x2 - pbox->x1,
+                             pbox->y2 - pbox->y1, fbCopyNtoNRows, &c))
+            fbCopyNtoNRows(&c, pbox->y1, pbox->y2 - pbox->y1);
         pbox++;
     }
     fbFinishAccess(pDstDrawable);
@@ -108,8 +108,9 @@ fbStipple(FbBits * dst, FbStride dstStride,
     }
 }
 
-void
-fbFill(DrawablePtr pDrawable, GCPtr pGC, int x, int y, int width, int height)
+static void
+fbFillRows(DrawablePtr pDrawable, GCPtr pGC, int x, int y, int width,
+           int height)
 {
     FbBits *dst;
     FbStride dstStride;
@@ -220,6 +221,29 @@ fbFill(DrawablePtr pDrawable, GCPtr pGC, int x, int y, int width, int height)
     fbFinishAccess(pDrawable);
 }
 
+typedef struct {
+    DrawablePtr pDrawable;
+    GCPtr pGC;
+    int x, width;
+} FbFillBand;
+
+static void
+fbFillBand(void *closure, int y, int height)
+{
+    FbFillBand *f = closure;
+
+    fbFillRows(f->pDrawable, f->pGC, f->x, y, f->width, height);
+}
+
+void
+fbFill(DrawablePtr pDrawable, GCPtr pGC, int x, int y, int width, int height)
+{
+    FbFillBand f = { pDrawable, pGC, x, width };
+
+    if (!fbParallelBands(y, width, height, fbFillBand, &f))
+        fbFillRows(pDrawable, pGC, x, y, width, height);
+}
+
 void
 fbSolidBoxClipped(DrawablePtr pDrawable,
                   RegionPtr pClip,
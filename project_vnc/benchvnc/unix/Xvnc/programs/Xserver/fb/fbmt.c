@@ -0,0 +1,165 @@
+/*
+ * fbmt.c - render large fb operations using multiple threads
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * Large rendering operations (full-window composites, fills, and blits) are
+ * split into horizontal bands, which are rendered concurrently by a pool of
+ * worker threads and the dispatch thread.  Each band writes to a disjoint set
+ * of destination scanlines, so the bands can be rendered in any order as long
+ * as the source of the operation is not also being written.  Operations that
+ * cover fewer than FB_MT_MIN_PIXELS pixels are rendered inline, since the cost
+ * of waking the workers would outweigh the benefit.
+ */
+
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "fb.h"
+
+#define FB_MT_MAX_THREADS   16
+#define FB_MT_MIN_PIXELS    (256 * 256)
+#define FB_MT_MIN_ROWS      16
+
+static int fbNumThreads = 1;
+
+static pthread_t fbThreads[FB_MT_MAX_THREADS];
+static int fbNumWorkers = 0;
+static pthread_mutex_t fbMTMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fbMTStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fbMTDone = PTHREAD_COND_INITIALIZER;
+
+/* The current job.  Protected by fbMTMutex. */
+static FbBandProc fbJobProc;
+static void *fbJobClosure;
+static int fbJobY, fbJobHeight, fbJobBands, fbJobNextBand, fbJobPending;
+static unsigned long fbJobGeneration = 0;
+
+static void
+fbRunBand(int band)
+{
+    int y = fbJobY + fbJobHeight * band / fbJobBands;
+    int h = fbJobY + fbJobHeight * (band + 1) / fbJobBands - y;
+
+    (*fbJobProc) (fbJobClosure, y, h);
+}
+
+static void *
+fbWorkerThread(void *arg)
+{
+    unsigned long generation = 0;
+
+    pthread_mutex_lock(&fbMTMutex);
+    for (;;) {
+        while (fbJobGeneration == generation)
+            pthread_cond_wait(&fbMTStart, &fbMTMutex);
+        generation = fbJobGeneration;
+
+        while (fbJobNextBand < fbJobBands) {
+            int band = fbJobNextBand++;
+
+            pthread_mutex_unlock(&fbMTMutex);
+            fbRunBand(band);
+            pthread_mutex_lock(&fbMTMutex);
+            if (--fbJobPending == 0)
+                pthread_cond_signal(&fbMTDone);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Set the number of threads (including the dispatch thread) that render large
+ * operations.  The worker threads are started the first time that they are
+ * needed.
+ */
+void
+fbSetNumThreads(int n)
+{
+    fbNumThreads = max(1, min(n, FB_MT_MAX_THREADS));
+}
+
+/*
+ * Render the rows y to y + height - 1 of an operation that is width pixels
+ * wide, by calling proc for each of several bands of rows, concurrently.
+ * Returns FALSE without calling proc if the operation is too small to benefit
+ * from multithreading, in which case the caller should render it inline.
+ */
+Bool
+fbParallelBands(int y, int width, int height, FbBandProc proc, void *closure)
+{
+    int nBands, band;
+
+    if (fbNumThreads < 2 || width <= 0 ||
+        (long) width * height < FB_MT_MIN_PIXELS)
+        return FALSE;
+    nBands = min(fbNumThreads, height / FB_MT_MIN_ROWS);
+    if (nBands < 2)
+        return FALSE;
+
+    pthread_mutex_lock(&fbMTMutex);
+    if (fbNumWorkers < fbNumThreads - 1) {
+        sigset_t set, oldSet;
+
+        /* Signals are handled by the dispatch thread. */
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &oldSet);
+        while (fbNumWorkers < fbNumThreads - 1) {
+            if (pthread_create(&fbThreads[fbNumWorkers], NULL, fbWorkerThread,
+                               NULL) != 0)
+                break;
+            fbNumWorkers++;
+        }
+        pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+    }
+    if (fbNumWorkers < 1) {
+        pthread_mutex_unlock(&fbMTMutex);
+        return FALSE;
+    }
+
+    fbJobProc = proc;
+    fbJobClosure = closure;
+    fbJobY = y;
+    fbJobHeight = height;
+    fbJobBands = min(nBands, fbNumWorkers + 1);
+    fbJobNextBand = 0;
+    fbJobPending = fbJobBands;
+    fbJobGeneration++;
+    pthread_cond_broadcast(&fbMTStart);
+
+    /* The dispatch thread renders bands as well, until none are left. */
+    while (fbJobNextBand < fbJobBands) {
+        band = fbJobNextBand++;
+        pthread_mutex_unlock(&fbMTMutex);
+        fbRunBand(band);
+        pthread_mutex_lock(&fbMTMutex);
+        fbJobPending--;
+    }
+    while (fbJobPending > 0)
+        pthread_cond_wait(&fbMTDone, &fbMTMutex);
+    pthread_mutex_unlock(&fbMTMutex);
+
+    return TRUE;
+}
@@ -35,6 +35,22 @@
 #include "mipict.h"
 #include "fbpict.h"
 
+typedef struct {
+    CARD8 op;
+    pixman_image_t *src, *mask, *dest;
+    int xSrc, ySrc, xMask, yMask, xDst, yDst, width;
+} FbCompositeBand;
+
+static void
+fbCompositeBand(void *closure, int y, int height)
+{
+    FbCompositeBand *c = closure;
+
+    pixman_image_composite(c->op, c->src, c->mask, c->dest,
+                           c->xSrc, c->ySrc + y, c->xMask, c->yMask + y,
+                           c->xDst, c->yDst + y, c->width, height);
+}
+
 void
 fbComposite(CARD8 op,
             PicturePtr pSrc,
@@ -59,10 +75,22 @@ fbComposite(CARD8 op,
     dest = image_from_pict(pDst, TRUE, &dst_xoff, &dst_yoff);
 
     if (src && dest && !(pMask && !mask)) {
-        pixman_image_composite(op, src, mask, dest,
-                               xSrc + src_xoff, ySrc + src_yoff,
-                               xMask + msk_xoff, yMask + msk_yoff,
-                               xDst + dst_xoff, yDst + dst_yoff, width, height);
+        FbCompositeBand c = {
+            op, src, mask, dest, xSrc + src_xoff, ySrc + src_yoff,
+            xMask + msk_xoff, yMask + msk_yoff, xDst + dst_xoff,
+            yDst + dst_yoff, width
+        };
+        uint32_t *dstBits = pixman_image_get_data(dest);
+
+        /* pixman validates images lazily, the first time that they are used,
+           so do that here (with an empty operation) before the images are
+           shared between threads.  The bands can't be rendered concurrently
+           if the source or mask is the destination. */
+        pixman_image_composite(op, src, mask, dest, 0, 0, 0, 0, 0, 0, 0, 0);
+        if (pixman_image_get_data(src) == dstBits ||
+            (mask && pixman_image_get_data(mask) == dstBits) ||
+            !fbParallelBands(0, width, height, fbCompositeBand, &c))
+            fbCompositeBand(&c, 0, height);
     }
 
     free_pixman_pict(pSrc, src);
@@ -43,6 +43,7 @@
 #include "pixmapstr.h"
 #include "gcstruct.h"
 #include "os.h"
+#include "shmint.h"
 
 #include "glxserver.h"
 #include "glxutil.h"
@@ -337,6 +338,8 @@ swrastPutImage(__DRIdrawable * draw, int op,
     ValidateGC(pDraw, gc);
 
     gc->ops->PutImage(pDraw, gc, pDraw->depth, x, y, w, h, 0, ZPixmap, data);
+    if (op == __DRI_SWRAST_IMAGE_OP_SWAP)
+        ShmEncodeSwapBuffers(pDraw, x, y, w, h, data);
     if (cx != lastGLContext) {
         lastGLContext = cx;
         cx->makeCurrent(cx);
@@ -0,0 +1,472 @@
+/*
+ * coalesce.c - simplify update regions using an encoding cost model
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * An update region with many small rectangles is expensive to send, because
+ * each rectangle has a header and (with most encodings) a fixed amount of
+ * setup work.  Collapsing the whole region to its bounding box avoids that,
+ * but it can also turn two small changes in opposite corners of the screen
+ * into a full-screen update.  The functions in this file instead merge
+ * rectangles only when the estimated cost of the pixels that a merge adds is
+ * less than the estimated cost of the rectangle that it saves, and they keep
+ * merging the cheapest pairs beyond that point only as far as is necessary to
+ * meet a limit on the number of rectangles.
+ */
+
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rfb.h"
+
+
+/*
+ * Rough per-pixel and per-rectangle costs of each encoding, in bits.  The
+ * per-rectangle cost includes the rectangle header as well as the
+ * subencoding header and compression overhead that each rectangle incurs
+ * (for instance, the JPEG headers and Huffman tables that Tight sends with
+ * each JPEG subrectangle.)
+ */
+
+static const struct {
+    int encoding;
+    rfbCoalesceCost cost;
+} costs[] = {
+    { rfbEncodingRaw,     { 32,   96 } },
+    { rfbEncodingRRE,     {  8,  256 } },
+    { rfbEncodingCoRRE,   {  8,  256 } },
+    { rfbEncodingHextile, {  8,  512 } },
+    { rfbEncodingZlib,    {  4, 2048 } },
+    { rfbEncodingZRLE,    {  4, 2048 } },
+    { rfbEncodingZYWRLE,  {  2, 2048 } },
+    { rfbEncodingTight,   {  2, 8192 } }
+};
+
+
+void rfbGetCoalesceCost(int encoding, rfbCoalesceCost *cost)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(costs) / sizeof(costs[0])); i++) {
+        if (costs[i].encoding == encoding) {
+            *cost = costs[i].cost;
+            return;
+        }
+    }
+    *cost = costs[0].cost;
+}
+
+
+/*
+ * The boxes in a region are stored as a list of bands, each of which has a
+ * range of y coordinates and a sorted list of non-overlapping x spans.  The
+ * simplification works on the bands directly, using two kinds of merges:
+ * filling the gap between two adjacent spans in a band, and joining two
+ * adjacent bands (along with any vertical gap between them) into one band
+ * containing the union of their spans.  Because the result is still a valid
+ * list of bands, the number of rectangles that it produces is known exactly,
+ * which would not be the case if arbitrary boxes were merged and the region
+ * code then had to split the merged boxes into bands again.
+ */
+
+typedef struct {
+    int y1, y2;
+    int nSpans;
+    int *x;                             /* x1, x2 of each span */
+    int prev, next;                     /* adjacent live bands, or -1 */
+    unsigned version;                   /* incremented when the band changes */
+    Bool dead;
+} Band;
+
+typedef struct {
+    long key;                           /* cost change per rectangle saved */
+    int band;
+    Bool join;                          /* TRUE = join band with next band */
+    unsigned version, nextVersion;
+    int next;
+} MergeCandidate;
+
+typedef struct {
+    Band *bands;
+    MergeCandidate *heap;
+    int heapSize, heapMax;
+    int *scratch;
+    int nRects, maxRects;
+    const rfbCoalesceCost *cost;
+} Coalescer;
+
+
+static void HeapPush(Coalescer *c, MergeCandidate *cand)
+{
+    int i;
+
+    if (c->heapSize >= c->heapMax) {
+        MergeCandidate *heap;
+
+        c->heapMax *= 2;
+        heap = (MergeCandidate *)rfbAlloc(c->heapMax * sizeof(MergeCandidate));
+        memcpy(heap, c->heap, c->heapSize * sizeof(MergeCandidate));
+        free(c->heap);
+        c->heap = heap;
+    }
+
+    i = c->heapSize++;
+    while (i > 0 && c->heap[(i - 1) / 2].key > cand->key) {
+        c->heap[i] = c->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    c->heap[i] = *cand;
+}
+
+
+static void HeapPop(Coalescer *c, MergeCandidate *cand)
+{
+    MergeCandidate last = c->heap[--c->heapSize];
+    int i = 0, child;
+
+    *cand = c->heap[0];
+    while ((child = i * 2 + 1) < c->heapSize) {
+        if (child + 1 < c->heapSize &&
+            c->heap[child + 1].key < c->heap[child].key)
+            child++;
+        if (c->heap[child].key >= last.key)
+            break;
+        c->heap[i] = c->heap[child];
+        i = child;
+    }
+    c->heap[i] = last;
+}
+
+
+static long SpanWidth(int *x, int nSpans)
+{
+    long width = 0;
+    int i;
+
+    for (i = 0; i < nSpans; i++)
+        width += x[i * 2 + 1] - x[i * 2];
+    return width;
+}
+
+
+/* Store the union of two sorted span lists in out, and return the number of
+   spans in the union.  Spans that overlap or touch are combined. */
+
+static int UnionSpans(int *a, int na, int *b, int nb, int *out)
+{
+    int ia = 0, ib = 0, n = 0;
+
+    while (ia < na || ib < nb) {
+        int *span;
+
+        if (ib >= nb || (ia < na && a[ia * 2] <= b[ib * 2]))
+            span = &a[(ia++) * 2];
+        else
+            span = &b[(ib++) * 2];
+        if (n > 0 && span[0] <= out[n * 2 - 1])
+            out[n * 2 - 1] = max(out[n * 2 - 1], span[1]);
+        else {
+            out[n * 2] = span[0];
+            out[n * 2 + 1] = span[1];
+            n++;
+        }
+    }
+    return n;
+}
+
+
+/* Queue the cheapest gap merge in band i. */
+
+static void QueueGapMerge(Coalescer *c, int i)
+{
+    Band *band = &c->bands[i];
+    MergeCandidate cand;
+    int k, minGap = -1;
+
+    for (k = 0; k < band->nSpans - 1; k++) {
+        int gap = band->x[k * 2 + 2] - band->x[k * 2 + 1];
+
+        if (minGap < 0 || gap < minGap)
+            minGap = gap;
+    }
+    if (minGap < 0)
+        return;
+
+    cand.key = (long)minGap * (band->y2 - band->y1) * c->cost->pixelCost -
+               c->cost->rectCost;
+    cand.band = i;
+    cand.join = FALSE;
+    cand.version = band->version;
+    cand.next = -1;
+    cand.nextVersion = 0;
+    HeapPush(c, &cand);
+}
+
+
+/* Queue the merge of band i with the band that follows it, if that would
+   save any rectangles.  While the region has too many rectangles, also queue
+   joins that save none (for instance, joining two bands whose spans don't
+   overlap), keyed by the cost of the pixels that they add, since they allow
+   the gap merges that follow to save rectangles. */
+
+static void QueueBandMerge(Coalescer *c, int i)
+{
+    Band *band = &c->bands[i], *next;
+    MergeCandidate cand;
+    long added;
+    int n, saved;
+
+    if (band->next < 0)
+        return;
+    next = &c->bands[band->next];
+
+    n = UnionSpans(band->x, band->nSpans, next->x, next->nSpans, c->scratch);
+    saved = band->nSpans + next->nSpans - n;
+    if (saved <= 0 && c->nRects <= c->maxRects)
+        return;
+    added = SpanWidth(c->scratch, n) * (next->y2 - band->y1) -
+            SpanWidth(band->x, band->nSpans) * (band->y2 - band->y1) -
+            SpanWidth(next->x, next->nSpans) * (next->y2 - next->y1);
+
+    if (saved > 0)
+        cand.key = added * c->cost->pixelCost / saved - c->cost->rectCost;
+    else
+        cand.key = added * c->cost->pixelCost;
+    cand.band = i;
+    cand.join = TRUE;
+    cand.version = band->version;
+    cand.next = band->next;
+    cand.nextVersion = next->version;
+    HeapPush(c, &cand);
+}
+
+
+/* Fill the narrowest gap in band i.  Returns the number of rectangles
+   saved. */
+
+static int MergeGap(Coalescer *c, int i)
+{
+    Band *band = &c->bands[i];
+    int k, best = 0;
+
+    for (k = 1; k < band->nSpans - 1; k++) {
+        if (band->x[k * 2 + 2] - band->x[k * 2 + 1] <
+            band->x[best * 2 + 2] - band->x[best * 2 + 1])
+            best = k;
+    }
+    band->x[best * 2 + 1] = band->x[best * 2 + 3];
+    memmove(&band->x[best * 2 + 2], &band->x[best * 2 + 4],
+            (band->nSpans - best - 2) * 2 * sizeof(int));
+    band->nSpans--;
+    band->version++;
+    return 1;
+}
+
+
+/* Join band i with the band that follows it.  Returns the number of
+   rectangles saved. */
+
+static int MergeBands(Coalescer *c, int i)
+{
+    Band *band = &c->bands[i], *next = &c->bands[band->next];
+    int n, saved, *x;
+
+    n = UnionSpans(band->x, band->nSpans, next->x, next->nSpans, c->scratch);
+    saved = band->nSpans + next->nSpans - n;
+    x = (int *)rfbAlloc(n * 2 * sizeof(int));
+    memcpy(x, c->scratch, n * 2 * sizeof(int));
+    free(band->x);
+    band->x = x;
+    band->nSpans = n;
+    band->y2 = next->y2;
+    band->next = next->next;
+    if (band->next >= 0)
+        c->bands[band->next].prev = i;
+    band->version++;
+
+    free(next->x);
+    next->x = NULL;
+    next->nSpans = 0;
+    next->dead = TRUE;
+    next->version++;
+    return saved;
+}
+
+
+/*
+ * Replace the region with a superset of it that has no more than maxRects
+ * rectangles and (according to the cost model) costs less to encode.
+ */
+
+Bool rfbCoalesceRegion(RegionPtr region, int maxRects,
+                       const rfbCoalesceCost *cost)
+{
+    Coalescer c;
+    RegionRec result;
+    BoxPtr rects = RegionRects(region), boxes;
+    int nRects = RegionNumRects(region), nBands = 0, i, j, k;
+    Bool retval = TRUE;
+
+    if (nRects <= 1)
+        return TRUE;
+    if (maxRects < 1)
+        maxRects = 1;
+
+    /* Split the region into bands */
+    c.bands = (Band *)rfbAlloc(nRects * sizeof(Band));
+    for (i = 0; i < nRects; i = j) {
+        Band *band = &c.bands[nBands];
+
+        for (j = i; j < nRects && rects[j].y1 == rects[i].y1; j++);
+        band->y1 = rects[i].y1;
+        band->y2 = rects[i].y2;
+        band->nSpans = j - i;
+        band->x = (int *)rfbAlloc((j - i) * 2 * sizeof(int));
+        for (k = i; k < j; k++) {
+            band->x[(k - i) * 2] = rects[k].x1;
+            band->x[(k - i) * 2 + 1] = rects[k].x2;
+        }
+        band->prev = nBands - 1;
+        band->next = j < nRects ? nBands + 1 : -1;
+        band->version = 0;
+        band->dead = FALSE;
+        nBands++;
+    }
+
+    c.cost = cost;
+    c.nRects = nRects;
+    c.maxRects = maxRects;
+    c.scratch = (int *)rfbAlloc(nRects * 2 * sizeof(int));
+    c.heapSize = 0;
+    c.heapMax = nBands * 2;
+    c.heap = (MergeCandidate *)rfbAlloc(c.heapMax * sizeof(MergeCandidate));
+    for (i = 0; i < nBands; i++) {
+        QueueGapMerge(&c, i);
+        QueueBandMerge(&c, i);
+    }
+
+    /* Perform the merges in order of increasing cost per rectangle saved,
+       until none of the remaining merges reduces the total cost and there are
+       few enough rectangles.  Merges whose bands have changed since they were
+       queued are requeued when they reach the top of the heap. */
+    while (c.heapSize > 0) {
+        MergeCandidate cand;
+        Band *band;
+
+        HeapPop(&c, &cand);
+        band = &c.bands[cand.band];
+        if (band->dead)
+            continue;
+        if (cand.version != band->version ||
+            (cand.join && (band->next != cand.next ||
+                           c.bands[cand.next].version != cand.nextVersion))) {
+            if (cand.join)
+                QueueBandMerge(&c, cand.band);
+            else
+                QueueGapMerge(&c, cand.band);
+            continue;
+        }
+        if (cand.key >= 0 && c.nRects <= maxRects)
+            break;
+
+        if (cand.join)
+            c.nRects -= MergeBands(&c, cand.band);
+        else
+            c.nRects -= MergeGap(&c, cand.band);
+        QueueGapMerge(&c, cand.band);
+        QueueBandMerge(&c, cand.band);
+        if (band->prev >= 0)
+            QueueBandMerge(&c, band->prev);
+    }
+
+    nRects = c.nRects;
+    boxes = (BoxPtr)rfbAlloc(nRects * sizeof(BoxRec));
+    for (i = 0, j = 0; i >= 0 && i < nBands; i = c.bands[i].next) {
+        Band *band = &c.bands[i];
+
+        for (k = 0; k < band->nSpans; k++, j++) {
+            boxes[j].x1 = band->x[k * 2];
+            boxes[j].y1 = band->y1;
+            boxes[j].x2 = band->x[k * 2 + 1];
+            boxes[j].y2 = band->y2;
+        }
+    }
+
+    if (!RegionInitBoxes(&result, boxes, j) || !RegionCopy(region, &result))
+        retval = FALSE;
+    RegionUninit(&result);
+
+    /* The merges above should always be able to meet the limit, but if they
+       didn't, then the limit is still enforced by falling back to the
+       bounding box. */
+    if (retval && RegionNumRects(region) > maxRects) {
+        BoxRec extents = *RegionExtents(region);
+
+        RegionReset(region, &extents);
+    }
+
+    free(boxes);
+    for (i = 0; i < nBands; i++)
+        free(c.bands[i].x);
+    free(c.bands);
+    free(c.scratch);
+    free(c.heap);
+    return retval;
+}
+
+
+/*
+ * If TVNC_DAMAGETRACE is set, then append the rectangles in each update region
+ * to the file that it names, for use with coalescebench.  Each line of the
+ * file is one update:  nrects x1 y1 x2 y2 [x1 y1 x2 y2 ...]
+ */
+
+void rfbWriteDamageTrace(RegionPtr region)
+{
+    static FILE *file = NULL;
+    static Bool initialized = FALSE;
+    BoxPtr rects = RegionRects(region);
+    int i, n = RegionNumRects(region);
+
+    if (!initialized) {
+        char *env = getenv("TVNC_DAMAGETRACE");
+
+        initialized = TRUE;
+        if (env && strlen(env) > 0) {
+            if ((file = fopen(env, "a")) == NULL)
+                rfbLogPerror("Could not open damage trace file");
+            else
+                rfbLog("Writing damage trace to %s\n", env);
+        }
+    }
+    if (!file || !RegionNotEmpty(region))
+        return;
+
+    fprintf(file, "%d", n);
+    for (i = 0; i < n; i++)
+        fprintf(file, " %d %d %d %d", rects[i].x1, rects[i].y1, rects[i].x2,
+                rects[i].y2);
+    fprintf(file, "\n");
+    fflush(file);
+}
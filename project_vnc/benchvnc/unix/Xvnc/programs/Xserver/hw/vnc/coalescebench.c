@@ -0,0 +1,383 @@
+/*
+ * coalescebench.c - compare update region simplification strategies
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * Usage: coalescebench [-maxrects n] [trace-file ...]
+ *
+ * Replays damage traces recorded by Xvnc (set TVNC_DAMAGETRACE to the name of
+ * a file in Xvnc's environment) and, for each encoding's cost model, compares
+ * sending each update region as-is, collapsing regions with more than n
+ * rectangles to their bounding box (the previous behavior), and the
+ * cost-model simplification in coalesce.c.  If no trace files are given, then
+ * a few synthetic traces are used instead.  For each strategy, the program
+ * prints the number of rectangles and pixels sent, the estimated encoded size
+ * according to the cost model, and the time spent simplifying each update.
+ * The program also verifies that the cost model never produces more than n
+ * rectangles, and it exits with a non-zero status if it does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include "rfb.h"
+
+
+/* coalesce.c and the region functions need these server symbols. */
+
+BoxRec RegionEmptyBox = { 0, 0, 0, 0 };
+RegDataRec RegionEmptyData = { 0, 0 };
+
+void rfbLog(char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void rfbLogPerror(char *str)
+{
+    perror(str);
+}
+
+void *rfbAlloc(size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+
+typedef struct {
+    const char *name;
+    int nUpdates;
+    RegionRec *updates;
+} Trace;
+
+static const struct {
+    const char *name;
+    int encoding;
+} encodings[] = {
+    { "Raw", rfbEncodingRaw },
+    { "Hextile", rfbEncodingHextile },
+    { "ZRLE", rfbEncodingZRLE },
+    { "Tight", rfbEncodingTight }
+};
+
+enum { STRATEGY_NONE, STRATEGY_BOUNDS, STRATEGY_COST, NSTRATEGIES };
+
+static const char *strategyNames[NSTRATEGIES] = {
+    "As-is", "Bounding box", "Cost model"
+};
+
+
+static double GetTime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec * 0.000001;
+}
+
+
+static void AddUpdate(Trace *trace, RegionPtr region)
+{
+    if (!(trace->nUpdates & 255))
+        trace->updates =
+            (RegionRec *)realloc(trace->updates,
+                                 (trace->nUpdates + 256) * sizeof(RegionRec));
+    if (!trace->updates) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(1);
+    }
+    RegionNull(&trace->updates[trace->nUpdates]);
+    RegionCopy(&trace->updates[trace->nUpdates], region);
+    trace->nUpdates++;
+}
+
+
+static void AddBox(RegionPtr region, int x1, int y1, int x2, int y2)
+{
+    BoxRec box;
+    RegionRec tmp;
+
+    box.x1 = x1;  box.y1 = y1;  box.x2 = x2;  box.y2 = y2;
+    RegionInit(&tmp, &box, 1);
+    RegionUnion(region, region, &tmp);
+    RegionUninit(&tmp);
+}
+
+
+static Bool ReadTrace(Trace *trace, const char *fileName)
+{
+    FILE *file = fopen(fileName, "r");
+    int n;
+
+    if (!file) {
+        perror(fileName);
+        return FALSE;
+    }
+    memset(trace, 0, sizeof(Trace));
+    trace->name = fileName;
+
+    while (fscanf(file, "%d", &n) == 1) {
+        RegionRec region;
+        int i, x1, y1, x2, y2;
+
+        RegionNull(&region);
+        for (i = 0; i < n; i++) {
+            if (fscanf(file, "%d %d %d %d", &x1, &y1, &x2, &y2) != 4) {
+                fprintf(stderr, "%s: truncated update\n", fileName);
+                RegionUninit(&region);
+                fclose(file);
+                return FALSE;
+            }
+            AddBox(&region, x1, y1, x2, y2);
+        }
+        AddUpdate(trace, &region);
+        RegionUninit(&region);
+    }
+
+    fclose(file);
+    return TRUE;
+}
+
+
+/* Two small widgets (for instance, a clock and a blinking cursor) in opposite
+   corners of a 1920x1080 screen */
+
+static void CornersTrace(Trace *trace)
+{
+    int i;
+
+    trace->name = "Synthetic: opposite corners";
+    for (i = 0; i < 500; i++) {
+        RegionRec region;
+
+        RegionNull(&region);
+        AddBox(&region, 1800, 4, 1900, 20);
+        AddBox(&region, 40 + (i % 60) * 8, 700, 42 + (i % 60) * 8, 716);
+        AddUpdate(trace, &region);
+        RegionUninit(&region);
+    }
+}
+
+
+/* Text being typed into a terminal, with glyph-sized damage spread over
+   several lines */
+
+static void TextTrace(Trace *trace)
+{
+    int i, j;
+
+    trace->name = "Synthetic: text";
+    srand(0);
+    for (i = 0; i < 500; i++) {
+        RegionRec region;
+
+        RegionNull(&region);
+        for (j = 0; j < 150; j++) {
+            int line = rand() % 40, col = rand() % 160;
+
+            AddBox(&region, 10 + col * 8, 30 + line * 18, 18 + col * 8,
+                   46 + line * 18);
+        }
+        AddUpdate(trace, &region);
+        RegionUninit(&region);
+    }
+}
+
+
+/* Randomly-placed small and medium-sized changes all over the screen */
+
+static void ScatterTrace(Trace *trace)
+{
+    int i, j;
+
+    trace->name = "Synthetic: scattered";
+    srand(1);
+    for (i = 0; i < 500; i++) {
+        RegionRec region;
+        int n = 1 + rand() % 300;
+
+        RegionNull(&region);
+        for (j = 0; j < n; j++) {
+            int w = 1 + rand() % 64, h = 1 + rand() % 64;
+            int x = rand() % (1920 - w), y = rand() % (1080 - h);
+
+            AddBox(&region, x, y, x + w, y + h);
+        }
+        AddUpdate(trace, &region);
+        RegionUninit(&region);
+    }
+}
+
+
+/* A staircase of rectangles running diagonally across the screen, with no
+   two rectangles sharing a band or overlapping horizontally.  No merge of
+   adjacent bands saves any rectangles on its own, so this exercises the
+   enforcement of the rectangle limit. */
+
+static void StaircaseTrace(Trace *trace)
+{
+    int i, j;
+
+    trace->name = "Synthetic: staircase";
+    for (i = 0; i < 100; i++) {
+        RegionRec region;
+        int n = 50 + i * 4;
+
+        RegionNull(&region);
+        for (j = 0; j < n; j++) {
+            int x = j * 1900 / n, y = j * 1060 / n;
+
+            AddBox(&region, x, y, x + 1900 / n / 2 + 1, y + 1060 / n / 2 + 1);
+        }
+        AddUpdate(trace, &region);
+        RegionUninit(&region);
+    }
+}
+
+
+static void Simplify(int strategy, RegionPtr region, int maxRects,
+                     const rfbCoalesceCost *cost)
+{
+    if (strategy == STRATEGY_BOUNDS) {
+        if (RegionNumRects(region) > maxRects) {
+            BoxRec extents = *RegionExtents(region);
+
+            RegionReset(region, &extents);
+        }
+    } else if (strategy == STRATEGY_COST)
+        rfbCoalesceRegion(region, maxRects, cost);
+}
+
+
+static Bool RunTrace(Trace *trace, int maxRects)
+{
+    int e, s, i;
+    Bool retval = TRUE;
+
+    printf("%s (%d updates):\n", trace->name, trace->nUpdates);
+    if (!trace->nUpdates)
+        return TRUE;
+
+    for (e = 0; e < (int)(sizeof(encodings) / sizeof(encodings[0])); e++) {
+        rfbCoalesceCost cost;
+
+        rfbGetCoalesceCost(encodings[e].encoding, &cost);
+        printf("  %s:\n", encodings[e].name);
+
+        for (s = 0; s < NSTRATEGIES; s++) {
+            double rects = 0., pixels = 0., bits = 0., elapsed = 0.;
+            int overLimit = 0;
+
+            for (i = 0; i < trace->nUpdates; i++) {
+                RegionRec region;
+                BoxPtr boxes;
+                double start;
+                int j, n;
+
+                RegionNull(&region);
+                RegionCopy(&region, &trace->updates[i]);
+                start = GetTime();
+                Simplify(s, &region, maxRects, &cost);
+                elapsed += GetTime() - start;
+
+                n = RegionNumRects(&region);
+                boxes = RegionRects(&region);
+                rects += n;
+                if (s == STRATEGY_COST && n > maxRects)
+                    overLimit++;
+                for (j = 0; j < n; j++)
+                    pixels += (double)(boxes[j].x2 - boxes[j].x1) *
+                              (double)(boxes[j].y2 - boxes[j].y1);
+                RegionUninit(&region);
+            }
+            bits = pixels * cost.pixelCost + rects * cost.rectCost;
+
+            printf("    %-12s  %8.1f rects  %8.3f Mpixels  %9.3f Mbits  %8.2f us/update\n",
+                   strategyNames[s], rects / trace->nUpdates,
+                   pixels / trace->nUpdates / 1000000.,
+                   bits / trace->nUpdates / 1000000.,
+                   elapsed / trace->nUpdates * 1000000.);
+            if (overLimit) {
+                printf("    %s: %d UPDATES EXCEED %d RECTANGLES\n",
+                       strategyNames[s], overLimit, maxRects);
+                retval = FALSE;
+            }
+        }
+    }
+    return retval;
+}
+
+
+int main(int argc, char **argv)
+{
+    int maxRects = 100, i, nTraces = 0, retval = 0;
+    Trace *traces;
+
+    traces = (Trace *)rfbAlloc((argc + 4) * sizeof(Trace));
+    memset(traces, 0, (argc + 4) * sizeof(Trace));
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-maxrects") && i < argc - 1) {
+            maxRects = atoi(argv[++i]);
+            if (maxRects < 1) {
+                fprintf(stderr, "USAGE: %s [-maxrects n] [trace-file ...]\n",
+                        argv[0]);
+                return 1;
+            }
+        } else {
+            if (!ReadTrace(&traces[nTraces], argv[i]))
+                return 1;
+            nTraces++;
+        }
+    }
+    if (!nTraces) {
+        CornersTrace(&traces[nTraces++]);
+        TextTrace(&traces[nTraces++]);
+        ScatterTrace(&traces[nTraces++]);
+        StaircaseTrace(&traces[nTraces++]);
+    }
+
+    for (i = 0; i < nTraces; i++) {
+        if (!RunTrace(&traces[i], maxRects))
+            retval = 1;
+    }
+
+    for (i = 0; i < nTraces; i++) {
+        int j;
+
+        for (j = 0; j < traces[i].nUpdates; j++)
+            RegionUninit(&traces[i].updates[j]);
+        free(traces[i].updates);
+    }
+    free(traces);
+    return retval;
+}
@@ -101,6 +101,68 @@ static Bool EmptyMask(CursorBitsPtr bits)
 }
 
 
+/*
+ * Cursor shape cache.  The server keeps a hash of each cursor shape that it
+ * has asked the client to store, so that cursors that are reused (including
+ * the frames of animated cursors) can be sent as a 20-byte reference rather
+ * than as a complete shape.
+ */
+
+#define FNV64_INIT  0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+static CARD64 HashBytes(CARD64 hash, const void *buf, int len)
+{
+    const CARD8 *ptr = (const CARD8 *)buf;
+
+    while (len--) {
+        hash ^= *ptr++;
+        hash *= FNV64_PRIME;
+    }
+    return hash;
+}
+
+
+static CARD64 HashCursor(rfbClientPtr cl, CursorPtr pCursor)
+{
+    CursorBitsPtr bits = pCursor->bits;
+    int params[6], n = BitmapBytePad(bits->width) * bits->height;
+    unsigned short colors[6];
+    CARD64 hash = FNV64_INIT;
+
+    params[0] = bits->width;  params[1] = bits->height;
+    params[2] = bits->xhot;  params[3] = bits->yhot;
+    params[4] = cl->useRichCursorEncoding;
+    params[5] = 0;
+    colors[0] = pCursor->foreRed;  colors[1] = pCursor->foreGreen;
+    colors[2] = pCursor->foreBlue;  colors[3] = pCursor->backRed;
+    colors[4] = pCursor->backGreen;  colors[5] = pCursor->backBlue;
+
+#ifdef ARGB_CURSOR
+    if (bits->argb) params[5] = 1;
+#endif
+    hash = HashBytes(hash, params, sizeof(params));
+    hash = HashBytes(hash, colors, sizeof(colors));
+    hash = HashBytes(hash, bits->source, n);
+    hash = HashBytes(hash, bits->mask, n);
+#ifdef ARGB_CURSOR
+    if (bits->argb)
+        hash = HashBytes(hash, bits->argb,
+                         bits->width * bits->height * sizeof(CARD32));
+#endif
+
+    return hash;
+}
+
+
+void rfbResetCursorCache(rfbClientPtr cl)
+{
+    memset(cl->cursorCacheHash, 0, sizeof(cl->cursorCacheHash));
+    memset(cl->cursorCacheTime, 0, sizeof(cl->cursorCacheTime));
+    cl->cursorCacheClock = 0;
+}
+
+
 /*
  * Send cursor shape either in X-style format or in client pixel format.
  */
@@ -110,6 +172,9 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
     CursorPtr pCursor;
     rfbFramebufferUpdateRectHeader rect;
     rfbXCursorColors colors;
+    rfbCursorCacheHeader cache;
+    CARD64 hash = 0;
+    int cacheSlot = -1, cacheBytes = 0;
     int saved_ublen;
     int bitmapRowBytes, paddedRowBytes, maskBytes, dataBytes;
     int i, j;
@@ -156,15 +221,66 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
         (pCursor->bits->width * pCursor->bits->height *
          (cl->format.bitsPerPixel / 8)) : maskBytes;
 
+    /* If the client already has this shape in its cursor cache, then tell it
+       to use the cached copy.  Otherwise, ask it to store the shape in the
+       least recently used slot. */
+
+    if (cl->enableCursorCache) {
+        unsigned int oldest = (unsigned int)-1;
+
+        hash = HashCursor(cl, pCursor);
+        for (i = 0; i < rfbCursorCacheSize; i++) {
+            if (cl->cursorCacheTime[i] != 0 &&
+                cl->cursorCacheHash[i] == hash)
+                break;
+            if (cl->cursorCacheTime[i] < oldest) {
+                oldest = cl->cursorCacheTime[i];
+                cacheSlot = i;
+            }
+        }
+        cacheBytes = sz_rfbCursorCacheHeader;
+        cache.pad = 0;
+        cache.encoding = rect.encoding;
+        rect.encoding = Swap32IfLE(rfbEncodingCursorCache);
+
+        if (i < rfbCursorCacheSize) {
+            if (ublen + sz_rfbFramebufferUpdateRectHeader +
+                sz_rfbCursorCacheHeader > UPDATE_BUF_SIZE) {
+                if (!rfbSendUpdateBuf(cl))
+                    return FALSE;
+            }
+            rect.r.x = Swap16IfLE(pCursor->bits->xhot);
+            rect.r.y = Swap16IfLE(pCursor->bits->yhot);
+            rect.r.w = Swap16IfLE(pCursor->bits->width);
+            rect.r.h = Swap16IfLE(pCursor->bits->height);
+            memcpy(&updateBuf[ublen], (char *)&rect,
+                   sz_rfbFramebufferUpdateRectHeader);
+            ublen += sz_rfbFramebufferUpdateRectHeader;
+
+            cache.op = rfbCursorCacheUse;
+            cache.slot = Swap16IfLE((CARD16)i);
+            memcpy(&updateBuf[ublen], (char *)&cache, sz_rfbCursorCacheHeader);
+            ublen += sz_rfbCursorCacheHeader;
+
+            cl->cursorCacheTime[i] = ++cl->cursorCacheClock;
+            cl->rfbCursorShapeBytesSent += sz_rfbFramebufferUpdateRectHeader +
+                                           sz_rfbCursorCacheHeader;
+            cl->rfbCursorShapeUpdatesSent++;
+            cl->rfbCursorCacheHits++;
+
+            return TRUE;
+        }
+    }
+
     /* Send buffer contents if needed. */
 
-    if (ublen + sz_rfbFramebufferUpdateRectHeader +
+    if (ublen + sz_rfbFramebufferUpdateRectHeader + cacheBytes +
         sz_rfbXCursorColors + maskBytes + dataBytes > UPDATE_BUF_SIZE) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
 
-    if (ublen + sz_rfbFramebufferUpdateRectHeader +
+    if (ublen + sz_rfbFramebufferUpdateRectHeader + cacheBytes +
         sz_rfbXCursorColors + maskBytes + dataBytes > UPDATE_BUF_SIZE) {
         return FALSE;           /* FIXME. */
     }
@@ -182,6 +298,13 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
            sz_rfbFramebufferUpdateRectHeader);
     ublen += sz_rfbFramebufferUpdateRectHeader;
 
+    if (cacheSlot >= 0) {
+        cache.op = rfbCursorCacheStore;
+        cache.slot = Swap16IfLE((CARD16)cacheSlot);
+        memcpy(&updateBuf[ublen], (char *)&cache, sz_rfbCursorCacheHeader);
+        ublen += sz_rfbCursorCacheHeader;
+    }
+
     /* Prepare actual cursor data (depends on encoding used). */
 
     if (!cl->useRichCursorEncoding) {
@@ -286,6 +409,11 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
     }
 #endif
 
+    if (cacheSlot >= 0) {
+        cl->cursorCacheHash[cacheSlot] = hash;
+        cl->cursorCacheTime[cacheSlot] = ++cl->cursorCacheClock;
+    }
+
     /* Update statistics. */
 
     cl->rfbCursorShapeBytesSent += (ublen - saved_ublen);
@@ -1,10 +1,12 @@
 /*
- * draw.c - drawing routines for the RFB X server.  This is a set of
- * wrappers around the standard MI/MFB/CFB drawing routines which work out
- * to a fair approximation the region of the screen being modified by the
- * drawing.  If the RFB client is ready then the modified region of the screen
- * is sent to the client, otherwise the modified region will simply grow with
- * each drawing request until the client is ready.
+ * draw.c - change tracking for the RFB X server.  The regions of the screen
+ * modified by drawing operations are accumulated in a single Damage object on
+ * the screen pixmap, and the accumulated damage is distributed to the modified
+ * region of each client only when an update is about to be sent.  If the RFB
+ * client is ready then the modified region of the screen is sent to the
+ * client, otherwise the modified region will simply grow with each drawing
+ * request until the client is ready.  CopyArea and CopyWindow are wrapped so
+ * that copies can be sent as CopyRects.
  *
  * Modified for XFree86 4.x by Alan Hourihane <alanh@fairlite.demon.co.uk>
  */
@@ -71,6 +73,7 @@ in this Software without prior written authorization from the X Consortium.
 #include "rfb.h"
 #include "fb.h"
 #include "misc.h"
+#include "damage.h"
 
 #ifndef STOP_BENCH
 #include "timetrack.h"
@@ -79,6 +82,7 @@ in this Software without prior written authorization from the X Consortium.
 
 extern WindowPtr *WindowTable;  /* Why isn't this in a header file? */
 int rfbDeferUpdateTime = 40;  /* ms */
+Bool rfbAdaptiveDefer = TRUE;
 
 #ifndef STOP_BENCH
 //extern int timeTrackerItem;
@@ -128,39 +132,7 @@ static inline Bool is_visible(DrawablePtr drawable)
 
 #define TRC(x)  /* (rfbLog x) */
 
-/* ADD_TO_MODIFIED_REGION adds the given region to the modified region for each
-   client */
-
-#define ADD_TO_MODIFIED_REGION(pScreen, reg) {  \
-    rfbClientPtr cl;  \
-    BoxRec *box = REGION_EXTENTS(pScreen, reg);  \
-    if ((box->x2 - box->x1) * (box->y2 - box->y1) != 0)  \
-        for (cl = rfbClientHead; cl; cl = cl->next) {  \
-            if (!prfb->dontSendFramebufferUpdate ||  \
-                !cl->enableCursorShapeUpdates) {  \
-                REGION_UNION((pScreen), &cl->modifiedRegion,  \
-                             &cl->modifiedRegion, reg);  \
-            }  \
-        }  \
-}
-
-/* ADD_TO_ALR_REGION adds the given region to the ALR-eligible region for each
-   client */
-
-#define ADD_TO_ALR_REGION(pScreen, reg) {  \
-    rfbClientPtr cl;  \
-    BoxRec *box = REGION_EXTENTS(pScreen, reg);  \
-    if ((box->x2 - box->x1) * (box->y2 - box->y1) != 0)  \
-        for (cl = rfbClientHead; cl; cl = cl->next) {  \
-            if (!prfb->dontSendFramebufferUpdate ||  \
-                !cl->enableCursorShapeUpdates) {  \
-                REGION_UNION((pScreen), &cl->alrEligibleRegion,  \
-                             &cl->alrEligibleRegion, reg);  \
-            }  \
-        }  \
-}
-
-/* SCHEDULE_FB_UPDATE is used at the end of each drawing routine to schedule an
+/* SCHEDULE_FB_UPDATE is used when the framebuffer changes to schedule an
    update to be sent to each client if there is one pending and the client is
    ready for it.  */
 
@@ -169,11 +141,24 @@ static inline Bool is_visible(DrawablePtr drawable)
       rfbClientPtr cl, nextCl;  \
       for (cl = rfbClientHead; cl; cl = nextCl) {  \
           nextCl = cl->next;  \
-          if (!cl->deferredUpdateScheduled && FB_UPDATE_PENDING(cl))  \
-              rfbScheduleDeferredUpdate(cl);  \
+          if (FB_UPDATE_PENDING(cl)) {  \
+              if (!cl->deferredUpdateScheduled)  \
+                  rfbScheduleDeferredUpdate(cl);  \
+              else  \
+                  cl->burstEnd = gettime();  \
+          }  \
       }  \
   }
 
+/* Change tracking state.  rfbDamage accumulates the region of the screen
+   pixmap that has been modified since the last call to rfbFlushDamage(), and
+   alrDamage accumulates the part of it that was drawn with PutImage. */
+
+static DamagePtr rfbDamage = NULL;
+static PixmapPtr rfbDamagePixmap = NULL;
+static RegionRec alrDamage;
+static Bool copyInProgress = FALSE;
+
 /* function prototypes */
 
 static void rfbScheduleDeferredUpdate(rfbClientPtr cl);
@@ -270,21 +255,10 @@ void ClipToScreen(ScreenPtr pScreen, RegionPtr pRegion)
 Bool rfbCloseScreen(ScreenPtr pScreen)
 {
     rfbFBInfoPtr prfb = &rfbFB;
-#ifdef RENDER
-    PictureScreenPtr    ps;
-#endif
 
     pScreen->CloseScreen = prfb->CloseScreen;
     pScreen->CreateGC = prfb->CreateGC;
     pScreen->CopyWindow = prfb->CopyWindow;
-    pScreen->ClearToBackground = prfb->ClearToBackground;
-#ifdef RENDER
-    ps = GetPictureScreenIfSet(pScreen);
-    if (ps) {
-        ps->Composite = prfb->Composite;
-        ps->Glyphs = prfb->Glyphs;
-    }
-#endif
     pScreen->InstallColormap = prfb->InstallColormap;
     pScreen->UninstallColormap = prfb->UninstallColormap;
     pScreen->ListInstalledColormaps = prfb->ListInstalledColormaps;
@@ -293,6 +267,12 @@ Bool rfbCloseScreen(ScreenPtr pScreen)
 
     TRC((stderr, "Unwrapped screen functions\n"));
 
+    /* The Damage layer destroys rfbDamage when the screen pixmap is
+       destroyed. */
+    rfbDamage = NULL;
+    rfbDamagePixmap = NULL;
+    REGION_UNINIT(pScreen, &alrDamage);
+
     return (*pScreen->CloseScreen) (pScreen);
 }
 
@@ -332,7 +312,8 @@ Bool rfbCreateGC(GCPtr pGC)
  * this call - a separate PaintWindowBackground/Border will be called to do
  * that.  If the client will accept CopyRect messages then use rfbCopyRegion to
  * optimise the pending screen changes into a single "copy region" plus the
- * ordinary modified region.
+ * ordinary modified region.  The Damage layer also reports the destination of
+ * the copy, so it is subtracted from the accumulated damage afterwards.
  */
 
 void rfbCopyWindow(WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr pOldRegion)
@@ -344,6 +325,11 @@ void rfbCopyWindow(WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr pOldRegion)
 
     TRC((stderr, "rfbCopyWindow called\n"));
 
+    /* rfbCopyRegion() needs to know which parts of the source are out of date
+       on the client. */
+    copyInProgress = TRUE;
+    rfbFlushDamage(pScreen);
+
     dx = pWin->drawable.x - ptOldOrg.x;
     dy = pWin->drawable.y - ptOldOrg.y;
 
@@ -372,52 +358,17 @@ void rfbCopyWindow(WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr pOldRegion)
         }
     }
 
-    REGION_UNINIT(pSrc->pScreen, &dstRegion);
-
     (*pScreen->CopyWindow) (pWin, ptOldOrg, pOldRegion);
 
-    SCHEDULE_FB_UPDATE(pScreen, prfb);
-
-    SCREEN_EPILOGUE(CopyWindow, rfbCopyWindow);
-}
-
-
-/*
- * ClearToBackground - when generateExposures is false, the region being
- * modified is the given rectangle (clipped to the "window clip region").
- */
-
-void rfbClearToBackground(WindowPtr pWin, int x, int y, int w, int h,
-                          Bool generateExposures)
-{
-    RegionRec tmpRegion;
-    BoxRec box;
-    SCREEN_PROLOGUE(pWin->drawable.pScreen, ClearToBackground);
-
-    TRC((stderr, "rfbClearToBackground called\n"));
-
-    if (!generateExposures) {
-        box.x1 = x + pWin->drawable.x;
-        box.y1 = y + pWin->drawable.y;
-        box.x2 = w ? (box.x1 + w) : (pWin->drawable.x + pWin->drawable.width);
-        box.y2 = h ? (box.y1 + h) : (pWin->drawable.y + pWin->drawable.height);
-
-        SAFE_REGION_INIT(pScreen, &tmpRegion, &box, 0);
-
-        REGION_INTERSECT(pScreen, &tmpRegion, &tmpRegion, &pWin->clipList);
+    if (rfbDamage)
+        DamageSubtract(rfbDamage, &dstRegion);
+    copyInProgress = FALSE;
 
-        ADD_TO_MODIFIED_REGION(pScreen, &tmpRegion);
+    REGION_UNINIT(pScreen, &dstRegion);
 
-        REGION_UNINIT(pScreen, &tmpRegion);
-    }
-
-    (*pScreen->ClearToBackground) (pWin, x, y, w, h, generateExposures);
-
-    if (!generateExposures) {
-        SCHEDULE_FB_UPDATE(pScreen, prfb);
-    }
+    SCHEDULE_FB_UPDATE(pScreen, prfb);
 
-    SCREEN_EPILOGUE(ClearToBackground, rfbClearToBackground);
+    SCREEN_EPILOGUE(CopyWindow, rfbCopyWindow);
 }
 
 
@@ -536,12 +487,14 @@ static void rfbCopyClip(GCPtr pgcDst, GCPtr pgcSrc)
  *
  * Note that these routines will only have been wrapped for drawing to
  * viewable windows so we don't need to check each time that the drawable
- * is a viewable window.
+ * is a viewable window.  The Damage layer tracks the regions modified by the
+ * GC ops, so only CopyArea (which can be sent as a CopyRect) and PutImage
+ * (which determines the region eligible for ALR) need to do anything more
+ * than call the wrapped op.
  */
 /****************************************************************************/
 
 #define GC_OP_PROLOGUE(pDrawable, pGC)  \
-    rfbFBInfoPtr prfb = &rfbFB;  \
     rfbGCPtr pGCPrivate = (rfbGCPtr)dixLookupPrivate(&(pGC)->devPrivates,  \
                                                      &rfbGCKey);  \
     const GCFuncs *oldFuncs = pGC->funcs;  \
@@ -554,10 +507,6 @@ static void rfbCopyClip(GCPtr pgcDst, GCPtr pgcSrc)
     (pGC)->ops = &rfbGCOps;
 
 
-/*
- * FillSpans - being very safe - assume the entire clip region is damaged.
- */
-
 static void rfbFillSpans(DrawablePtr pDrawable, GCPtr pGC,
                          int nInit,            /* number of spans to fill */
                          DDXPointPtr pptInit,  /* pointer to list of start points */
@@ -565,65 +514,25 @@ static void rfbFillSpans(DrawablePtr pDrawable, GCPtr pGC,
                          int fSorted)
 {
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbFillSpans called\n"));
-
-    if (pDrawable->type == DRAWABLE_WINDOW) {
-      RegionRec changed;
-      REGION_INIT(pDrawable->pScreen, &changed, NullBox, 0);
-      REGION_COPY(pDrawable->pScreen, &changed, pGC->pCompositeClip);
-      REGION_INTERSECT(pDrawable->pScreen, &changed, &changed,
-                       &((WindowPtr)pDrawable)->borderClip);
-      ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &changed);
-      REGION_UNINIT(pDrawable->pScreen, &changed);
-    } else {
-      ADD_TO_MODIFIED_REGION(pDrawable->pScreen, pGC->pCompositeClip);
-    }
-
     (*pGC->ops->FillSpans) (pDrawable, pGC, nInit, pptInit, pwidthInit,
                             fSorted);
-
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * SetSpans - being very safe - assume the entire clip region is damaged.
- */
-
 static void rfbSetSpans(DrawablePtr pDrawable, GCPtr pGC, char *psrc,
                         register DDXPointPtr ppt, int *pwidth, int nspans,
                         int fSorted)
 {
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbSetSpans called\n"));
-
-    if (pDrawable->type == DRAWABLE_WINDOW) {
-      RegionRec changed;
-      REGION_INIT(pDrawable->pScreen, &changed, NullBox, 0);
-      REGION_COPY(pDrawable->pScreen, &changed, pGC->pCompositeClip);
-      REGION_INTERSECT(pDrawable->pScreen, &changed, &changed,
-                       &((WindowPtr)pDrawable)->borderClip);
-      ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &changed);
-      REGION_UNINIT(pDrawable->pScreen, &changed);
-    } else {
-      ADD_TO_MODIFIED_REGION(pDrawable->pScreen, pGC->pCompositeClip);
-    }
-
     (*pGC->ops->SetSpans) (pDrawable, pGC, psrc, ppt, pwidth, nspans, fSorted);
-
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
 /*
- * PutImage - the region being modified is the rectangle of the
- * PutImage (clipped to the window clip region).
+ * PutImage - the rectangle of the PutImage (clipped to the window clip
+ * region) is eligible for automatic lossless refresh.
  */
 
 static void rfbPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
@@ -635,38 +544,25 @@ static void rfbPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
     GC_OP_PROLOGUE(pDrawable, pGC);
 
     TRC((stderr, "rfbPutImage called\n"));
-    /*
-    #ifndef STOP_BENCH
-    if(timeTracker[0].valid == 0xdeadbeef){
-	appreqID = timeTracker[0].eventID;	
-	timeTrackerItem = timeTracker[0].array[0];
-	t2p_microTime_back_clear = 0xdeadbeef;
-	timeTracker[0].valid = 0;
-    }
-    #endif
-    */
-    box.x1 = x + pDrawable->x;
-    box.y1 = y + pDrawable->y;
-    box.x2 = box.x1 + w;
-    box.y2 = box.y1 + h;
 
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
+    if (rfbAutoLosslessRefresh > 0.0) {
+        box.x1 = x + pDrawable->x;
+        box.y1 = y + pDrawable->y;
+        box.x2 = box.x1 + w;
+        box.y2 = box.y1 + h;
+
+        SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
 
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
+        REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
+                         pGC->pCompositeClip);
 
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-    ADD_TO_ALR_REGION(pDrawable->pScreen, &tmpRegion);
+        REGION_UNION(pDrawable->pScreen, &alrDamage, &alrDamage, &tmpRegion);
 
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
+        REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
+    }
 
     (*pGC->ops->PutImage) (pDrawable, pGC, depth, x, y, w, h, leftPad, format,
                            pBits);
-    //pid_t cur_pid = getpid();
-    //pid_t cur_tid = syscall(SYS_gettid);
-    //fprintf(stderr, "PID:%d, TID:%d, print in draw, Time: %lld\n", cur_pid, cur_tid, gettime_nanoTime());
-
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
 
     GC_OP_EPILOGUE(pGC);
 }
@@ -677,13 +573,15 @@ static void rfbPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
  * to the window clip region).
  * If the client will accept CopyRect messages then use rfbCopyRegion
  * to optimise the pending screen changes into a single "copy region" plus
- * the ordinary modified region.
+ * the ordinary modified region.  Copies from offscreen drawables are left to
+ * the Damage layer.
  */
 
 static RegionPtr rfbCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
                              int srcx, int srcy, int w, int h,
                              int dstx, int dsty)
 {
+    rfbFBInfoPtr prfb = &rfbFB;
     rfbClientPtr cl;
     RegionPtr rgn;
     RegionRec srcRegion, dstRegion;
@@ -692,6 +590,16 @@ static RegionPtr rfbCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
 
     TRC((stderr, "rfbCopyArea called\n"));
 
+    if (!is_visible(pSrc)) {
+        rgn = (*pGC->ops->CopyArea) (pSrc, pDst, pGC, srcx, srcy, w, h,
+                                     dstx, dsty);
+        GC_OP_EPILOGUE(pGC);
+        return rgn;
+    }
+
+    copyInProgress = TRUE;
+    rfbFlushDamage(pDst->pScreen);
+
     box.x1 = dstx + pDst->x;
     box.y1 = dsty + pDst->y;
     box.x2 = box.x1 + w;
@@ -701,46 +609,44 @@ static RegionPtr rfbCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
     REGION_INTERSECT(pDst->pScreen, &dstRegion, &dstRegion,
                      pGC->pCompositeClip);
 
-    if (is_visible(pSrc)) {
-        box.x1 = srcx + pSrc->x;
-        box.y1 = srcy + pSrc->y;
-        box.x2 = box.x1 + w;
-        box.y2 = box.y1 + h;
+    box.x1 = srcx + pSrc->x;
+    box.y1 = srcy + pSrc->y;
+    box.x2 = box.x1 + w;
+    box.y2 = box.y1 + h;
 
-        for (cl = rfbClientHead; cl; cl = cl->next) {
-            if (cl->useCopyRect) {
-                SAFE_REGION_INIT(pSrc->pScreen, &srcRegion, &box, 0);
-                if (pSrc->type == DRAWABLE_WINDOW &&
-                    REGION_NOTEMPTY(pScreen, &((WindowPtr)pSrc)->clipList)) {
-                    REGION_INTERSECT(pSrc->pScreen, &srcRegion, &srcRegion,
-                                     &((WindowPtr)pSrc)->clipList);
-                }
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        if (cl->useCopyRect) {
+            SAFE_REGION_INIT(pSrc->pScreen, &srcRegion, &box, 0);
+            if (pSrc->type == DRAWABLE_WINDOW &&
+                REGION_NOTEMPTY(pScreen, &((WindowPtr)pSrc)->clipList)) {
+                REGION_INTERSECT(pSrc->pScreen, &srcRegion, &srcRegion,
+                                 &((WindowPtr)pSrc)->clipList);
+            }
 
-                if (!prfb->dontSendFramebufferUpdate ||
-                    !cl->enableCursorShapeUpdates)
-                    rfbCopyRegion(pSrc->pScreen, cl, &srcRegion, &dstRegion,
-                                  dstx + pDst->x - srcx - pSrc->x,
-                                  dsty + pDst->y - srcy - pSrc->y);
+            if (!prfb->dontSendFramebufferUpdate ||
+                !cl->enableCursorShapeUpdates)
+                rfbCopyRegion(pSrc->pScreen, cl, &srcRegion, &dstRegion,
+                              dstx + pDst->x - srcx - pSrc->x,
+                              dsty + pDst->y - srcy - pSrc->y);
 
-                REGION_UNINIT(pSrc->pScreen, &srcRegion);
+            REGION_UNINIT(pSrc->pScreen, &srcRegion);
 
-            } else {
+        } else {
 
-                REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
-                             &dstRegion);
-            }
+            REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
+                         &dstRegion);
         }
-
-    } else {
-
-        ADD_TO_MODIFIED_REGION(pDst->pScreen, &dstRegion);
     }
 
-    REGION_UNINIT(pDst->pScreen, &dstRegion);
-
     rgn = (*pGC->ops->CopyArea) (pSrc, pDst, pGC, srcx, srcy, w, h,
                                  dstx, dsty);
 
+    if (rfbDamage)
+        DamageSubtract(rfbDamage, &dstRegion);
+    copyInProgress = FALSE;
+
+    REGION_UNINIT(pDst->pScreen, &dstRegion);
+
     SCHEDULE_FB_UPDATE(pDst->pScreen, prfb);
 
     GC_OP_EPILOGUE(pGC);
@@ -749,990 +655,297 @@ static RegionPtr rfbCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
 }
 
 
-/*
- * CopyPlane - the region being modified is the destination rectangle (clipped
- * to the window clip region).
- */
-
 static RegionPtr rfbCopyPlane(DrawablePtr pSrc, DrawablePtr pDst,
                               register GCPtr pGC, int srcx, int srcy,
                               int w, int h, int dstx, int dsty,
                               unsigned long plane)
 {
     RegionPtr rgn;
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDst, pGC);
-
-    TRC((stderr, "rfbCopyPlane called\n"));
-
-    box.x1 = dstx + pDst->x;
-    box.y1 = dsty + pDst->y;
-    box.x2 = box.x1 + w;
-    box.y2 = box.y1 + h;
-
-    SAFE_REGION_INIT(pDst->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDst->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDst->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDst->pScreen, &tmpRegion);
-
     rgn = (*pGC->ops->CopyPlane) (pSrc, pDst, pGC, srcx, srcy, w, h,
                                   dstx, dsty, plane);
-
-    SCHEDULE_FB_UPDATE(pDst->pScreen, prfb);
-
     GC_OP_EPILOGUE(pGC);
-
     return rgn;
 }
 
 
-/*
- * PolyPoint - find the smallest rectangle which encloses the points drawn
- * (and clip).
- */
-
 static void rfbPolyPoint(DrawablePtr pDrawable, GCPtr pGC,
                          int mode,  /* Origin or Previous */
                          int npt, xPoint *pts)
 {
-    int i;
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolyPoint called\n"));
-
-    if (npt) {
-        int minX = pts[0].x, maxX = pts[0].x;
-        int minY = pts[0].y, maxY = pts[0].y;
-
-        if (mode == CoordModePrevious) {
-            int x = pts[0].x, y = pts[0].y;
-
-            for (i = 1; i < npt; i++) {
-                x += pts[i].x;
-                y += pts[i].y;
-                if (x < minX) minX = x;
-                if (x > maxX) maxX = x;
-                if (y < minY) minY = y;
-                if (y > maxY) maxY = y;
-            }
-        } else {
-            for (i = 1; i < npt; i++) {
-                if (pts[i].x < minX) minX = pts[i].x;
-                if (pts[i].x > maxX) maxX = pts[i].x;
-                if (pts[i].y < minY) minY = pts[i].y;
-                if (pts[i].y > maxY) maxY = pts[i].y;
-            }
-        }
-
-        box.x1 = minX + pDrawable->x;
-        box.y1 = minY + pDrawable->y;
-        box.x2 = maxX + 1 + pDrawable->x;
-        box.y2 = maxY + 1 + pDrawable->y;
-
-        SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-        REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-        REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-    }
-
     (*pGC->ops->PolyPoint) (pDrawable, pGC, mode, npt, pts);
-
-    if (npt) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * PolyLines - take the union of bounding boxes around each line (and clip).
- */
-
 static void rfbPolylines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
                          DDXPointPtr ppts)
 {
-    RegionPtr tmpRegion;
-    xRectangle *rects;
-    int i, extra, nlines, lw;
-    int x1, x2, y1, y2;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolylines called\n"));
-
-    if (npt) {
-        lw = pGC->lineWidth;
-        if (lw == 0)
-            lw = 1;
-
-        if (npt == 1) {
-            nlines = 1;
-            rects = (xRectangle *)rfbAlloc(sizeof(xRectangle));
-
-            rects[0].x = ppts[0].x - lw + pDrawable->x;  /* being safe here */
-            rects[0].y = ppts[0].y - lw + pDrawable->y;
-            rects[0].width = 2 * lw;
-            rects[0].height = 2 * lw;
-        } else {
-            nlines = npt - 1;
-            rects = (xRectangle *)rfbAlloc(nlines * sizeof(xRectangle));
-
-            /*
-             * mitered joins can project quite a way from
-             * the line end; the 11 degree miter limit limits
-             * this extension to lw / (2 * tan(11/2)), rounded up
-             * and converted to int yields 6 * lw
-             */
-
-            if (pGC->joinStyle == JoinMiter) {
-                extra = 6 * lw;
-            } else {
-                extra = lw / 2;
-            }
-
-            x1 = ppts[0].x + pDrawable->x;
-            y1 = ppts[0].y + pDrawable->y;
-
-            for (i = 0; i < nlines; i++) {
-                if (mode == CoordModeOrigin) {
-                    x2 = pDrawable->x + ppts[i + 1].x;
-                    y2 = pDrawable->y + ppts[i + 1].y;
-                } else {
-                    x2 = x1 + ppts[i + 1].x;
-                    y2 = y1 + ppts[i + 1].y;
-                }
-
-                if (x1 > x2) {
-                    rects[i].x = x2 - extra;
-                    rects[i].width = x1 - x2 + 1 + 2 * extra;
-                } else {
-                    rects[i].x = x1 - extra;
-                    rects[i].width = x2 - x1 + 1 + 2 * extra;
-                }
-
-                if (y1 > y2) {
-                    rects[i].y = y2 - extra;
-                    rects[i].height = y1 - y2 + 1 + 2 * extra;
-                } else {
-                    rects[i].y = y1 - extra;
-                    rects[i].height = y2 - y1 + 1 + 2 * extra;
-                }
-
-                x1 = x2;
-                y1 = y2;
-            }
-        }
-        tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, nlines, rects,
-                                    CT_NONE);
-        REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-        REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-        free((char *)rects);
-    }
-
     (*pGC->ops->Polylines) (pDrawable, pGC, mode, npt, ppts);
-
-    if (npt) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * PolySegment - take the union of bounding boxes around each segment (and
- * clip).
- */
-
 static void rfbPolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg,
                            xSegment *segs)
 {
-    RegionPtr tmpRegion;
-    xRectangle *rects;
-    int i, extra, lw;
-
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolySegment called\n"));
-
-    if (nseg) {
-        rects = (xRectangle *)rfbAlloc(nseg * sizeof(xRectangle));
-
-        lw = pGC->lineWidth;
-        if (lw == 0)
-            lw = 1;
-
-        extra = lw / 2;
-
-        for (i = 0; i < nseg; i++) {
-            if (segs[i].x1 > segs[i].x2) {
-                rects[i].x = segs[i].x2 - extra + pDrawable->x;
-                rects[i].width = segs[i].x1 - segs[i].x2 + 1 + 2 * extra;
-            } else {
-                rects[i].x = segs[i].x1 - extra + pDrawable->x;
-                rects[i].width = segs[i].x2 - segs[i].x1 + 1 + 2 * extra;
-            }
-
-            if (segs[i].y1 > segs[i].y2) {
-                rects[i].y = segs[i].y2 - extra + pDrawable->y;
-                rects[i].height = segs[i].y1 - segs[i].y2 + 1 + 2 * extra;
-            } else {
-                rects[i].y = segs[i].y1 - extra + pDrawable->y;
-                rects[i].height = segs[i].y2 - segs[i].y1 + 1 + 2 * extra;
-            }
-        }
-
-        tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, nseg, rects, CT_NONE);
-        REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-        REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-        free((char *)rects);
-    }
-
     (*pGC->ops->PolySegment) (pDrawable, pGC, nseg, segs);
-
-    if (nseg) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * PolyRectangle (rectangle outlines) - take the union of bounding boxes
- * around each line (and clip).
- */
-
 static void rfbPolyRectangle(DrawablePtr pDrawable, GCPtr pGC, int nrects,
                              xRectangle *rects)
 {
-    int i, extra, lw;
-    RegionPtr tmpRegion;
-    xRectangle *regRects;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolyRectangle called\n"));
-
-    if (nrects) {
-        regRects = (xRectangle *)rfbAlloc(nrects * 4 *sizeof(xRectangle));
-
-        lw = pGC->lineWidth;
-        if (lw == 0)
-            lw = 1;
-
-        extra = lw / 2;
-
-        for (i = 0; i < nrects; i++) {
-            regRects[i * 4].x = rects[i].x - extra + pDrawable->x;
-            regRects[i * 4].y = rects[i].y - extra + pDrawable->y;
-            regRects[i * 4].width = rects[i].width + 1 + 2 * extra;
-            regRects[i * 4].height = 1 + 2 * extra;
-
-            regRects[i * 4 + 1].x = rects[i].x - extra + pDrawable->x;
-            regRects[i * 4 + 1].y = rects[i].y - extra + pDrawable->y;
-            regRects[i * 4 + 1].width = 1 + 2 * extra;
-            regRects[i * 4 + 1].height = rects[i].height + 1 + 2 * extra;
-
-            regRects[i * 4 + 2].x =
-                rects[i].x + rects[i].width - extra + pDrawable->x;
-            regRects[i * 4 + 2].y = rects[i].y - extra + pDrawable->y;
-            regRects[i * 4 + 2].width = 1 + 2 * extra;
-            regRects[i * 4 + 2].height = rects[i].height + 1 + 2 * extra;
-
-            regRects[i * 4 + 3].x = rects[i].x - extra + pDrawable->x;
-            regRects[i * 4 + 3].y =
-                rects[i].y + rects[i].height - extra + pDrawable->y;
-            regRects[i * 4 + 3].width = rects[i].width + 1 + 2 * extra;
-            regRects[i * 4 + 3].height = 1 + 2 * extra;
-        }
-
-        tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, nrects * 4,
-                                    regRects, CT_NONE);
-        REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-        REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-        free((char *)regRects);
-    }
-
     (*pGC->ops->PolyRectangle) (pDrawable, pGC, nrects, rects);
-
-    if (nrects) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * PolyArc - take the union of bounding boxes around each arc (and clip).
- * Bounding boxes assume each is a full circle / ellipse.
- */
-
 static void rfbPolyArc(DrawablePtr pDrawable, register GCPtr pGC, int narcs,
                        xArc *arcs)
 {
-    int i, extra, lw;
-    RegionPtr tmpRegion;
-    xRectangle *rects;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolyArc called\n"));
-
-    if (narcs) {
-        rects = (xRectangle *)rfbAlloc(narcs * sizeof(xRectangle));
-
-        lw = pGC->lineWidth;
-        if (lw == 0)
-            lw = 1;
-
-        extra = lw / 2;
-
-        for (i = 0; i < narcs; i++) {
-            rects[i].x = arcs[i].x - extra + pDrawable->x;
-            rects[i].y = arcs[i].y - extra + pDrawable->y;
-            rects[i].width = arcs[i].width + lw;
-            rects[i].height = arcs[i].height + lw;
-        }
-
-        tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, narcs, rects, CT_NONE);
-        REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-        REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-        free((char *)rects);
-    }
-
     (*pGC->ops->PolyArc) (pDrawable, pGC, narcs, arcs);
-
-    if (narcs) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * FillPolygon - take bounding box around polygon (and clip).
- */
-
 static void rfbFillPolygon(register DrawablePtr pDrawable, register GCPtr pGC,
                            int shape, int mode, int count, DDXPointPtr pts)
 {
-    int i;
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbFillPolygon called\n"));
-
-    if (count) {
-        int minX = pts[0].x, maxX = pts[0].x;
-        int minY = pts[0].y, maxY = pts[0].y;
-
-        if (mode == CoordModePrevious) {
-            int x = pts[0].x, y = pts[0].y;
-
-            for (i = 1; i < count; i++) {
-                x += pts[i].x;
-                y += pts[i].y;
-                if (x < minX) minX = x;
-                if (x > maxX) maxX = x;
-                if (y < minY) minY = y;
-                if (y > maxY) maxY = y;
-            }
-        } else {
-            for (i = 1; i < count; i++) {
-                if (pts[i].x < minX) minX = pts[i].x;
-                if (pts[i].x > maxX) maxX = pts[i].x;
-                if (pts[i].y < minY) minY = pts[i].y;
-                if (pts[i].y > maxY) maxY = pts[i].y;
-            }
-        }
-
-        box.x1 = minX + pDrawable->x;
-        box.y1 = minY + pDrawable->y;
-        box.x2 = maxX + 1 + pDrawable->x;
-        box.y2 = maxY + 1 + pDrawable->y;
-
-        SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-        REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-        REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-    }
-
     (*pGC->ops->FillPolygon) (pDrawable, pGC, shape, mode, count, pts);
-
-    if (count) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * PolyFillRect - take the union of the given rectangles (and clip).
- */
-
 static void rfbPolyFillRect(DrawablePtr pDrawable, GCPtr pGC, int nrects,
                             xRectangle *rects)
 {
-    RegionPtr tmpRegion;
-    xRectangle *regRects;
-    int i;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolyFillRect called\n"));
-
-    if (nrects) {
-        regRects = (xRectangle *)rfbAlloc(nrects * sizeof(xRectangle));
-
-        for (i = 0; i < nrects; i++) {
-            regRects[i].x = rects[i].x + pDrawable->x;
-            regRects[i].y = rects[i].y + pDrawable->y;
-            regRects[i].width = rects[i].width;
-            regRects[i].height = rects[i].height;
-        }
-
-        tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, nrects, regRects,
-                                    CT_NONE);
-        REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-        REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-        free((char *)regRects);
-    }
-
     (*pGC->ops->PolyFillRect) (pDrawable, pGC, nrects, rects);
-
-    if (nrects) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * PolyFillArc - take the union of bounding boxes around each arc (and clip).
- * Bounding boxes assume each is a full circle / ellipse.
- */
-
 static void rfbPolyFillArc(DrawablePtr pDrawable, GCPtr pGC, int narcs,
                            xArc *arcs)
 {
-    int i, extra, lw;
-    RegionPtr tmpRegion;
-    xRectangle *rects;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolyFillArc called\n"));
-
-    if (narcs) {
-        rects = (xRectangle *)rfbAlloc(narcs * sizeof(xRectangle));
-
-        lw = pGC->lineWidth;
-        if (lw == 0)
-            lw = 1;
-
-        extra = lw / 2;
-
-        for (i = 0; i < narcs; i++) {
-            rects[i].x = arcs[i].x - extra + pDrawable->x;
-            rects[i].y = arcs[i].y - extra + pDrawable->y;
-            rects[i].width = arcs[i].width + lw;
-            rects[i].height = arcs[i].height + lw;
-        }
-
-        tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, narcs, rects, CT_NONE);
-        REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-        REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-        free((char *)rects);
-    }
-
     (*pGC->ops->PolyFillArc) (pDrawable, pGC, narcs, arcs);
-
-    if (narcs) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * Get a rough bounding box around n characters of the given font.
- */
-
-static void GetTextBoundingBox(DrawablePtr pDrawable, FontPtr font, int x,
-                               int y, int n, BoxPtr pbox)
-{
-    int maxAscent, maxDescent, maxCharWidth;
-
-    if (FONTASCENT(font) > FONTMAXBOUNDS(font, ascent))
-        maxAscent = FONTASCENT(font);
-    else
-        maxAscent = FONTMAXBOUNDS(font, ascent);
-
-    if (FONTDESCENT(font) > FONTMAXBOUNDS(font, descent))
-        maxDescent = FONTDESCENT(font);
-    else
-        maxDescent = FONTMAXBOUNDS(font, descent);
-
-    if (FONTMAXBOUNDS(font, rightSideBearing) >
-        FONTMAXBOUNDS(font, characterWidth))
-        maxCharWidth = FONTMAXBOUNDS(font, rightSideBearing);
-    else
-        maxCharWidth = FONTMAXBOUNDS(font, characterWidth);
-
-    pbox->x1 = pDrawable->x + x;
-    pbox->y1 = pDrawable->y + y - maxAscent;
-    pbox->x2 = pbox->x1 + maxCharWidth * n;
-    pbox->y2 = pbox->y1 + maxAscent + maxDescent;
-
-    if (FONTMINBOUNDS(font, leftSideBearing) < 0) {
-        pbox->x1 += FONTMINBOUNDS(font, leftSideBearing);
-    }
-}
-
-
-/*
- * PolyText8 - use rough bounding box.
- */
-
 static int rfbPolyText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
                         int count, char *chars)
 {
     int ret;
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolyText8 called '%.*s'\n", count, chars));
-
-    if (count) {
-        GetTextBoundingBox(pDrawable, pGC->font, x, y, count, &box);
-
-        SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-        REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-        REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-    }
-
     ret = (*pGC->ops->PolyText8) (pDrawable, pGC, x, y, count, chars);
-
-    if (count) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
     return ret;
 }
 
 
-/*
- * PolyText16 - use rough bounding box.
- */
-
 static int rfbPolyText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
                          int count, unsigned short *chars)
 {
     int ret;
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolyText16 called\n"));
-
-    if (count) {
-        GetTextBoundingBox(pDrawable, pGC->font, x, y, count, &box);
-
-        SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-        REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-        REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-    }
-
     ret = (*pGC->ops->PolyText16) (pDrawable, pGC, x, y, count, chars);
-
-    if (count) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
     return ret;
 }
 
 
-/*
- * ImageText8 - use rough bounding box.
- */
-
 static void rfbImageText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
                           int count, char *chars)
 {
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbImageText8 called '%.*s'\n", count, chars));
-
-    if (count) {
-        GetTextBoundingBox(pDrawable, pGC->font, x, y, count, &box);
-
-        SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-        REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-        REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-    }
-
     (*pGC->ops->ImageText8) (pDrawable, pGC, x, y, count, chars);
-
-    if (count) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * ImageText16 - use rough bounding box.
- */
-
 static void rfbImageText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
                            int count, unsigned short *chars)
 {
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbImageText16 called\n"));
-
-    if (count) {
-        GetTextBoundingBox(pDrawable, pGC->font, x, y, count, &box);
-
-        SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-        REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-        REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-    }
-
     (*pGC->ops->ImageText16) (pDrawable, pGC, x, y, count, chars);
-
-    if (count) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * ImageGlyphBlt - use rough bounding box.
- */
-
 static void rfbImageGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
                              unsigned int nglyph,
                              CharInfoPtr *ppci,   /* array of character info */
                              pointer pglyphBase)  /* start of array of glyphs */
 {
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbImageGlyphBlt called\n"));
-
-    if (nglyph) {
-        GetTextBoundingBox(pDrawable, pGC->font, x, y, nglyph, &box);
-
-        SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-        REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-        REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-    }
-
     (*pGC->ops->ImageGlyphBlt) (pDrawable, pGC, x, y, nglyph, ppci,
                                 pglyphBase);
-
-    if (nglyph) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * PolyGlyphBlt - use rough bounding box.
- */
-
 static void rfbPolyGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
                             unsigned int nglyph,
                             CharInfoPtr *ppci,   /* array of character info */
                             pointer pglyphBase)  /* start of array of glyphs */
 {
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPolyGlyphBlt called\n"));
-
-    if (nglyph) {
-        GetTextBoundingBox(pDrawable, pGC->font, x, y, nglyph, &box);
-
-        SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-        REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                         pGC->pCompositeClip);
-
-        ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-        REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-    }
-
     (*pGC->ops->PolyGlyphBlt) (pDrawable, pGC, x, y, nglyph, ppci, pglyphBase);
-
-    if (nglyph) {
-        SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-    }
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-/*
- * PushPixels - be fairly safe - region modified is intersection of the given
- * rectangle with the window clip region.
- */
-
 static void rfbPushPixels(GCPtr pGC, PixmapPtr pBitMap, DrawablePtr pDrawable,
                           int w, int h, int x, int y)
 {
-    RegionRec tmpRegion;
-    BoxRec box;
     GC_OP_PROLOGUE(pDrawable, pGC);
-
-    TRC((stderr, "rfbPushPixels called\n"));
-
-    box.x1 = x + pDrawable->x;
-    box.y1 = y + pDrawable->y;
-    box.x2 = box.x1 + w;
-    box.y2 = box.y1 + h;
-
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-
     (*pGC->ops->PushPixels) (pGC, pBitMap, pDrawable, w, h, x, y);
-
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
     GC_OP_EPILOGUE(pGC);
 }
 
 
-#ifdef RENDER
+/****************************************************************************/
+/*
+ * Change tracking
+ */
+/****************************************************************************/
+
+/*
+ * rfbDamageReport() is called by the Damage layer after each drawing operation
+ * that modifies the screen.  The damage has already been accumulated in
+ * rfbDamage, so all that remains is to schedule updates.
+ */
 
-void rfbComposite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
-                  INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
-                  INT16 xDst, INT16 yDst, CARD16 width, CARD16 height)
+static void rfbDamageReport(DamagePtr pDamage, RegionPtr pRegion,
+                            void *closure)
 {
-    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    ScreenPtr pScreen = (ScreenPtr)closure;
     rfbFBInfoPtr prfb = &rfbFB;
-    RegionRec tmpRegion, fbRegion;
-    BoxRec box;
-    PictureScreenPtr ps = GetPictureScreen(pScreen);
-
-    if (is_visible(pDst->pDrawable)) {
-        box.x1 = max(pDst->pDrawable->x + xDst, 0);
-        box.y1 = max(pDst->pDrawable->y + yDst, 0);
-        box.x2 = box.x1 + width;
-        box.y2 = box.y1 + height;
-
-        REGION_INIT(pScreen, &tmpRegion, &box, 0);
-
-        box.x1 = 0;
-        box.y1 = 0;
-        box.x2 = pScreen->width;
-        box.y2 = pScreen->height;
 
-        REGION_INIT(pScreen, &fbRegion, &box, 0);
-
-        REGION_INTERSECT(pScreen, &tmpRegion, &tmpRegion, &fbRegion);
-
-        ADD_TO_MODIFIED_REGION(pScreen, &tmpRegion);
+    if (!rfbClientHead) {
+        DamageEmpty(pDamage);
+        return;
     }
 
-    ps->Composite = prfb->Composite;
-    (*ps->Composite) (op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
-                      xDst, yDst, width, height);
-    ps->Composite = rfbComposite;
+    /* The copy wrappers schedule the update themselves. */
+    if (copyInProgress)
+        return;
 
-    if (is_visible(pDst->pDrawable)) {
-        SCHEDULE_FB_UPDATE(pScreen, prfb);
-
-        REGION_UNINIT(pScreen, &tmpRegion);
-    }
+    SCHEDULE_FB_UPDATE(pScreen, prfb);
 }
 
 
-static int GlyphCount(int nlist, GlyphListPtr list, GlyphPtr * glyphs)
+/*
+ * rfbFlushDamage() distributes the damage that has accumulated since the last
+ * call to the modified and ALR-eligible regions of each client.  It is called
+ * before an update is sent and before anything else that needs the clients'
+ * regions to be current.
+ */
+
+void rfbFlushDamage(ScreenPtr pScreen)
 {
-    int count;
+    PixmapPtr pPixmap;
+    RegionPtr damage;
+    rfbClientPtr cl;
 
-    count = 0;
-    while (nlist--) {
-        count += list->len;
-        list++;
+    if (!rfbDamage)
+        return;
+
+    /* The screen pixmap is replaced when the screen is resized. */
+    pPixmap = (*pScreen->GetScreenPixmap) (pScreen);
+    if (pPixmap != rfbDamagePixmap) {
+        if (rfbDamagePixmap)
+            DamageUnregister(rfbDamage);
+        rfbDamagePixmap = pPixmap;
+        if (rfbDamagePixmap)
+            DamageRegister(&rfbDamagePixmap->drawable, rfbDamage);
     }
 
-    return count;
-}
-
+    damage = DamageRegion(rfbDamage);
+    if (!REGION_NOTEMPTY(pScreen, damage))
+        return;
+    ClipToScreen(pScreen, damage);
+    ClipToScreen(pScreen, &alrDamage);
 
-static RegionPtr GlyphsToRegion(ScreenPtr pScreen, int nlist,
-                                GlyphListPtr list, GlyphPtr *glyphs)
-{
-    int n;
-    GlyphPtr glyph;
-    int x, y;
-
-    int nrects = GlyphCount(nlist, list, glyphs);
-    xRectangle rects[nrects];
-    xRectanglePtr rect;
-
-    x = 0;
-    y = 0;
-    rect = &rects[0];
-    while (nlist--) {
-        x += list->xOff;
-        y += list->yOff;
-        n = list->len;
-        list++;
-        while (n--) {
-            glyph = *glyphs++;
-            rect->x = x - glyph->info.x;
-            rect->y = y - glyph->info.y;
-            rect->width = glyph->info.width;
-            rect->height = glyph->info.height;
-            x += glyph->info.xOff;
-            y += glyph->info.yOff;
-            rect++;
-        }
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
+                     damage);
+        if (rfbAutoLosslessRefresh > 0.0 &&
+            REGION_NOTEMPTY(pScreen, &alrDamage))
+            REGION_UNION(pScreen, &cl->alrEligibleRegion,
+                         &cl->alrEligibleRegion, &alrDamage);
     }
 
-    return RECTS_TO_REGION(pScreen, nrects, rects, CT_NONE);
+    DamageEmpty(rfbDamage);
+    REGION_EMPTY(pScreen, &alrDamage);
 }
 
 
-/* Glyphs - Glyph-specific version of Composite (caches and whatnot) */
+/*
+ * rfbAddCursorRegion() is called by the sprite code after it removes or draws
+ * the cursor.  Cursor drawing is internal to the server, so it isn't recorded
+ * in rfbDamage, and clients that render the cursor themselves must not be sent
+ * the area under it.
+ */
 
-void rfbGlyphs(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
-               PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc, int nlists,
-               GlyphListPtr lists, GlyphPtr *glyphs)
+void rfbAddCursorRegion(ScreenPtr pScreen, BoxPtr pBox)
 {
-    ScreenPtr pScreen = pDst->pDrawable->pScreen;
-    rfbFBInfoPtr prfb = &rfbFB;
-    RegionRec *tmpRegion = NULL;
-    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    RegionRec tmpRegion;
+    rfbClientPtr cl;
 
-    if (is_visible(pDst->pDrawable)) {
-        BoxRec fbBox;
-        RegionRec fbRegion;
+    SAFE_REGION_INIT(pScreen, &tmpRegion, pBox, 0);
+    ClipToScreen(pScreen, &tmpRegion);
 
-        tmpRegion = GlyphsToRegion(pScreen, nlists, lists, glyphs);
-        REGION_TRANSLATE(pScreen, tmpRegion,
-                         pDst->pDrawable->x, pDst->pDrawable->y);
+    if (REGION_NOTEMPTY(pScreen, &tmpRegion)) {
+        for (cl = rfbClientHead; cl; cl = cl->next) {
+            if (!cl->enableCursorShapeUpdates)
+                REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
+                             &tmpRegion);
+        }
+    }
 
-        fbBox.x1 = 0;
-        fbBox.y1 = 0;
-        fbBox.x2 = rfbFB.width;
-        fbBox.y2 = rfbFB.height;
-        REGION_INIT(pScreen, &fbRegion, &fbBox, 0);
+    REGION_UNINIT(pScreen, &tmpRegion);
+}
 
-        REGION_INTERSECT(pScreen, tmpRegion, tmpRegion, &fbRegion);
 
-        REGION_UNINIT(pScreen, &fbRegion);
+Bool rfbDamagePending(void)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
 
-        ADD_TO_MODIFIED_REGION(pScreen, tmpRegion);
+    return rfbDamage && REGION_NOTEMPTY(pScreen, DamageRegion(rfbDamage));
+}
 
-        REGION_DESTROY(pScreen, tmpRegion);
-    }
 
-    ps->Glyphs = prfb->Glyphs;
-    (*ps->Glyphs) (op, pSrc, pDst, maskFormat, xSrc, ySrc, nlists, lists,
-                   glyphs);
-    ps->Glyphs = rfbGlyphs;
+/*
+ * rfbDamageInit() is called before the RFB screen functions are wrapped, so
+ * the Damage layer's wrappers are called from within ours.
+ */
 
-    if (is_visible(pDst->pDrawable)) {
-        SCHEDULE_FB_UPDATE(pScreen, prfb);
-    }
+Bool rfbDamageInit(ScreenPtr pScreen)
+{
+    if (!DamageSetup(pScreen))
+        return FALSE;
+    rfbDamage = DamageCreate(rfbDamageReport, NULL, DamageReportRawRegion,
+                             FALSE, pScreen, pScreen);
+    if (!rfbDamage)
+        return FALSE;
+    DamageSetReportAfterOp(rfbDamage, TRUE);
+    rfbDamagePixmap = NULL;
+    REGION_INIT(pScreen, &alrDamage, NullBox, 0);
+
+    return TRUE;
 }
 
-#endif  /* RENDER */
-
 
 /****************************************************************************/
 /*
@@ -1861,6 +1074,89 @@ static void rfbCopyRegion(ScreenPtr pScreen, rfbClientPtr cl, RegionPtr src,
 }
 
 
+/*
+ * Adaptive update deferral
+ *
+ * Applications tend to draw in bursts:  a frame of video or animation, a
+ * screenful of scrolled text, or the response to a keystroke.  The ideal
+ * deferral time is just long enough to coalesce all of the drawing in a burst
+ * into one update.  Deferring longer than that only adds latency, and
+ * deferring for so long that the update can't be sent before the application
+ * starts drawing its next frame causes frames to be dropped or split.  Thus,
+ * for each client, we measure the duration of each burst (the time from the
+ * first change to the framebuffer to the last change before the update is
+ * sent), the interval between the starts of successive bursts (the
+ * application's frame cadence), and the time that it takes to send an update,
+ * and we defer each update by the smoothed burst duration, limited so that
+ * the update is sent before the next frame is due.  If drawing resumes
+ * immediately after an update was sent, then the update probably split a
+ * burst, so the burst estimate is doubled.  rfbDeferUpdateTime (-deferupdate)
+ * is the upper limit, and the first update after an input event is sent
+ * immediately, so that keystroke echo and pointer feedback aren't delayed.
+ */
+
+#define MIN_DEFER_TIME    1.     /* ms */
+#define BURST_MARGIN      1.     /* ms */
+#define INPUT_WINDOW    100.     /* ms */
+#define MAX_CADENCE    1000.     /* ms */
+
+#define SMOOTH(avg, sample)  \
+    ((avg) < 0. ? (sample) : (avg) * 0.75 + (sample) * 0.25)
+
+static double rfbAdaptiveDeferTime(rfbClientPtr cl, double now)
+{
+    double defer;
+
+    if (cl->burstStart > 0.) {
+        double interval = (now - cl->burstStart) * 1000.;
+
+        if (interval < MAX_CADENCE)
+            cl->drawInterval = SMOOTH(cl->drawInterval, interval);
+        else
+            cl->drawInterval = -1.;
+    }
+    if (cl->lastUpdateEnd > 0. &&
+        (now - cl->lastUpdateEnd) * 1000. < BURST_MARGIN)
+        cl->burstTime = SMOOTH(cl->burstTime, cl->deferUpdateTime * 2.);
+    cl->burstStart = now;
+
+    if (cl->inputPending) {
+        cl->inputPending = FALSE;
+        if ((now - cl->lastInputTime) * 1000. < INPUT_WINDOW)
+            return 0.;
+    }
+
+    if (cl->burstTime < 0.)
+        return (double)rfbDeferUpdateTime;
+    defer = cl->burstTime + BURST_MARGIN;
+    if (cl->drawInterval > 0.)
+        defer = min(defer, cl->drawInterval - max(cl->sendTime, 0.) -
+                    BURST_MARGIN);
+    return max(MIN_DEFER_TIME, min(defer, (double)rfbDeferUpdateTime));
+}
+
+
+/* Send an update and measure how long it took and how long the burst of
+   drawing that it contains lasted. */
+
+static Bool rfbSendDeferredUpdate(rfbClientPtr cl)
+{
+    double start = gettime(), end;
+    Bool status;
+
+    status = rfbSendFramebufferUpdate(cl);
+    end = gettime();
+    if (rfbAdaptiveDefer) {
+        cl->sendTime = SMOOTH(cl->sendTime, (end - start) * 1000.);
+        if (cl->deferredUpdateScheduled)
+            cl->burstTime = SMOOTH(cl->burstTime,
+                                   (cl->burstEnd - cl->burstStart) * 1000.);
+        cl->lastUpdateEnd = end;
+    }
+    return status;
+}
+
+
 /*
  * rfbDeferredUpdateCallback() is called when a client's deferredUpdateTimer
  * goes off.
@@ -1873,7 +1169,7 @@ static CARD32 rfbDeferredUpdateCallback(OsTimerPtr timer, CARD32 now,
     BOOL status = TRUE;
 
     if (cl->deferredUpdateScheduled && FB_UPDATE_PENDING(cl))
-        status = rfbSendFramebufferUpdate(cl);
+        status = rfbSendDeferredUpdate(cl);
 
     if (status) cl->deferredUpdateScheduled = FALSE;
     return 0;
@@ -1887,14 +1183,21 @@ static CARD32 rfbDeferredUpdateCallback(OsTimerPtr timer, CARD32 now,
 
 static void rfbScheduleDeferredUpdate(rfbClientPtr cl)
 {
-    if (rfbDeferUpdateTime != 0) {
+    double now = gettime(), defer = (double)rfbDeferUpdateTime;
+
+    if (rfbDeferUpdateTime != 0 && rfbAdaptiveDefer)
+        defer = rfbAdaptiveDeferTime(cl, now);
+
+    cl->deferUpdateTime = defer;
+    if (defer > 0.) {
         cl->deferredUpdateTimer = TimerSet(cl->deferredUpdateTimer, 0,
-                                           rfbDeferUpdateTime,
+                                           (CARD32)(defer + 0.5),
                                            rfbDeferredUpdateCallback, cl);
         cl->deferredUpdateScheduled = TRUE;
-        cl->deferredUpdateStart = gettime();
+        cl->deferredUpdateStart = now;
+        cl->burstEnd = now;
     } else {
-        rfbSendFramebufferUpdate(cl);
+        rfbSendDeferredUpdate(cl);
     }
 }
 
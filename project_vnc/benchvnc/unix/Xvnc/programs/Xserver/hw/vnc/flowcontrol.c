@@ -351,6 +351,28 @@ Bool rfbIsCongested(rfbClientPtr cl)
 }
 
 
+/*
+ * rfbCongestionWindowSpare returns the number of bytes that can be sent to a
+ * specific client before its congestion window is full, or -1 if the client
+ * doesn't support flow control.
+ */
+int rfbCongestionWindowSpare(rfbClientPtr cl)
+{
+    int inFlight;
+
+    if (!cl->enableFence)
+        return -1;
+
+    if (rfbIsCongested(cl))
+        return 0;
+
+    inFlight = cl->sockOffset - cl->ackedOffset;
+    if (inFlight >= (int)cl->congWindow)
+        return 0;
+    return (int)cl->congWindow - inFlight;
+}
+
+
 /*
  * rfbSendEndOfCU sends an end of Continuous Updates message to a specific
  * client
@@ -78,7 +78,9 @@ static void httpSockNotify(int fd, int ready, void *data);
 
 
 /*
- * httpInitSockets sets up the TCP socket to listen for HTTP connections.
+ * httpInitSockets sets up the TCP socket to listen for HTTP connections.  The
+ * HTTP server is started if it has files to serve (-httpd) or if the metrics
+ * endpoint (see metrics.c) is enabled.
  */
 
 void httpInitSockets()
@@ -90,12 +92,13 @@ void httpInitSockets()
 
     done = TRUE;
 
-    if (!httpDir)
+    if (!httpDir && !rfbMetrics)
         return;
 
     if (rfbAuthDisableHTTP) {
        rfbLog("NOTICE: HTTP server disabled per system policy\n");
        httpDir = NULL;
+       rfbMetrics = FALSE;
        return;
     }
 
@@ -105,7 +108,10 @@ void httpInitSockets()
 
     rfbLog("Listening for HTTP connections on TCP port %d\n", httpPort);
 
-    rfbLog("  URL http://%s:%d\n", rfbThisHost, httpPort);
+    if (httpDir)
+        rfbLog("  URL http://%s:%d\n", rfbThisHost, httpPort);
+    if (rfbMetrics)
+        rfbLog("  Metrics URL http://%s:%d/metrics\n", rfbThisHost, httpPort);
 
     if ((httpListenSock = ListenOnTCPPort(httpPort)) < 0) {
         rfbLogPerror("ListenOnTCPPort");
@@ -124,7 +130,7 @@ static void httpSockNotify(int fd, int ready, void *data)
     char addrStr[INET6_ADDRSTRLEN];
 #endif
 
-    if (!httpDir)
+    if (!httpDir && !rfbMetrics)
         return;
 
     if ((httpSock >= 0) && fd == httpSock) {
@@ -207,12 +213,12 @@ static void httpProcessInput()
 
     user = getpwuid(getuid());
 
-    if (strlen(httpDir) > 255) {
+    if (httpDir && strlen(httpDir) > 255) {
         rfbLog("-httpd directory too long\n");
         httpCloseSock();
         return;
     }
-    strcpy(fullFname, httpDir);
+    strcpy(fullFname, httpDir ? httpDir : "");
     fname = &fullFname[strlen(fullFname)];
     maxFnameLen = 511 - strlen(fullFname);
 
@@ -265,6 +271,14 @@ static void httpProcessInput()
         return;
     }
 
+    /* Metrics are scraped frequently, so the requests aren't logged. */
+
+    if (rfbMetrics && strcmp(fname, "/metrics") == 0) {
+        rfbMetricsWrite(&cl);
+        httpCloseSock();
+        return;
+    }
+
     if (fname[0] != '/') {
         rfbLog("httpd: filename didn't begin with '/'\n");
         WriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
@@ -283,6 +297,12 @@ static void httpProcessInput()
     rfbLog("httpd: get '%s' for %s\n", fname + 1,
            sockaddr_string(&addr, addrStr, INET6_ADDRSTRLEN));
 
+    if (!httpDir) {
+        WriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
+        httpCloseSock();
+        return;
+    }
+
     /* Extract parameters from the URL string if necessary */
 
     params[0] = '\0';
@@ -0,0 +1,501 @@
+/*
+ * hybrid.c - send video regions using H.264 and everything else using RFB
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * Normally, the H.264/RTSP streams carry the whole framebuffer, and RFB
+ * updates are blocked.  That wastes bandwidth on text and UI elements, which
+ * Tight encodes losslessly in a fraction of the bits, whereas sending video
+ * through Tight wastes CPU time.  Clients that support the VideoRegion
+ * pseudo-encoding (see rfbproto.h) get the best of both: we divide the screen
+ * into 64x64 tiles, classify each tile based on how often it changes and what
+ * its content looks like, and send the video region (the union of the tiles
+ * that contain video) to the client.  The client displays the H.264 streams
+ * within the video region and RFB updates everywhere else, and
+ * rfbSendFramebufferUpdate() leaves the video region out of RFB updates.
+ *
+ * A tile is considered to contain video if it has changed during most of the
+ * recent classification intervals, its content is photographic (many colors,
+ * few runs of identical pixels, and few sharp edges), and at least two of its
+ * neighbors are also video candidates, so that blinking cursors, spinners,
+ * and other small animations stay in RFB.  A video tile leaves the video
+ * region when it stops changing or its content stops looking photographic.
+ *
+ * While a hybrid client is connected, roi.c also tells the H.264 encoders to
+ * spend as few bits as possible outside of the video region.
+ *
+ * Hybrid mode is disabled unless -hybrid is specified.  Each output is still
+ * encoded in its entirety at a constant bit rate, and the encoder that ships
+ * (h264_nvenc) ignores region-of-interest hints, so the area outside of the
+ * video region still costs H.264 bits.  A hybrid session therefore sends
+ * those bits in addition to the RFB updates for the same area.
+ */
+
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "rfb.h"
+#include "damage.h"
+#include "shmint.h"
+
+
+Bool rfbHybrid = FALSE;
+RegionRec rfbVideoRegion;
+
+#define TILE_SIZE        64
+#define TICK_MS          100  /* Classification interval */
+#define HISTORY_MASK     0xFFFF  /* Look back 16 intervals (1.6 seconds) */
+#define ENTER_CHANGES    8    /* Changes in the last 16 intervals required to
+                                 enter the video region */
+#define LEAVE_CHANGES    2    /* Changes in the last 16 intervals below which a
+                                 tile leaves the video region */
+#define LEAVE_SYNTHETIC  3    /* Number of consecutive non-photographic
+                                 samples after which a tile leaves the video
+                                 region */
+
+#define MIN_COLORS       96   /* Distinct colors in a photographic tile */
+#define COLOR_TABLE_SIZE 256
+#define EDGE_THRESHOLD   64   /* Luma difference that counts as a sharp edge */
+
+typedef struct {
+    CARD32 history;   /* Bit n is set if the tile changed n intervals ago */
+    Bool candidate;   /* Changes often and looks photographic */
+    Bool video;       /* Part of the video region */
+    int synthetic;    /* Consecutive non-photographic samples */
+} TileRec, *TilePtr;
+
+static TileRec *tiles = NULL;
+static int tilesX = 0, tilesY = 0, tileFBWidth = 0, tileFBHeight = 0;
+static DamagePtr hybridDamage = NULL;
+static PixmapPtr hybridPixmap = NULL;
+static OsTimerPtr hybridTimer = NULL;
+static Bool hybridTimerRunning = FALSE;
+
+
+static int CountBits(CARD32 x)
+{
+    int n = 0;
+
+    for (; x; x &= x - 1) n++;
+    return n;
+}
+
+
+static inline int Luma(CARD32 pix)
+{
+    return ((pix >> rfbServerFormat.redShift & 0xFF) * 2 +
+            (pix >> rfbServerFormat.greenShift & 0xFF) * 5 +
+            (pix >> rfbServerFormat.blueShift & 0xFF)) >> 3;
+}
+
+
+/* Returns TRUE if the tile looks like photographic content (video, as
+   opposed to text or UI elements.)  Every other pixel of every other row is
+   sampled, and the color count stops at MIN_COLORS. */
+
+static Bool IsPhotographic(int x, int y, int w, int h)
+{
+    int pitch = rfbFB.paddedWidthInBytes, i, j, colors = 0, flat = 0,
+        edges = 0, samples = 0;
+    CARD32 table[COLOR_TABLE_SIZE];
+    Bool used[COLOR_TABLE_SIZE];
+
+    memset(used, 0, sizeof(used));
+
+    for (j = 0; j < h; j += 2) {
+        CARD32 *row = (CARD32 *)&rfbFB.pfbMemory[(y + j) * pitch + x * 4];
+
+        for (i = 2; i < w; i += 2) {
+            CARD32 pix = row[i] & 0xFFFFFF, prev = row[i - 2] & 0xFFFFFF;
+
+            if (pix == prev)
+                flat++;
+            else if (abs(Luma(pix) - Luma(prev)) > EDGE_THRESHOLD)
+                edges++;
+            samples++;
+
+            if (colors < MIN_COLORS) {
+                int slot = (pix * 0x9E3779B1) >> 24;
+
+                while (used[slot] && table[slot] != pix)
+                    slot = (slot + 1) & (COLOR_TABLE_SIZE - 1);
+                if (!used[slot]) {
+                    used[slot] = TRUE;
+                    table[slot] = pix;
+                    colors++;
+                }
+            }
+        }
+    }
+
+    return colors >= MIN_COLORS && flat < samples / 4 && edges < samples / 8;
+}
+
+
+static void ResetTiles(void)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+
+    free(tiles);
+    tileFBWidth = rfbFB.width;
+    tileFBHeight = rfbFB.height;
+    tilesX = (tileFBWidth + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (tileFBHeight + TILE_SIZE - 1) / TILE_SIZE;
+    tiles = (TileRec *)rfbAlloc0(tilesX * tilesY * sizeof(TileRec));
+    REGION_EMPTY(pScreen, &rfbVideoRegion);
+}
+
+
+static void GetTileBox(int tx, int ty, BoxPtr box)
+{
+    box->x1 = tx * TILE_SIZE;
+    box->y1 = ty * TILE_SIZE;
+    box->x2 = min(box->x1 + TILE_SIZE, tileFBWidth);
+    box->y2 = min(box->y1 + TILE_SIZE, tileFBHeight);
+}
+
+
+/* Build a region from the video tiles, merging horizontal runs of tiles so
+   that pixman has less to do. */
+
+static void BuildVideoRegion(RegionPtr region)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    int tx, ty;
+
+    REGION_EMPTY(pScreen, region);
+    for (ty = 0; ty < tilesY; ty++) {
+        int runStart = -1;
+
+        for (tx = 0; tx <= tilesX; tx++) {
+            Bool video = tx < tilesX && tiles[ty * tilesX + tx].video;
+
+            if (video && runStart < 0)
+                runStart = tx;
+            else if (!video && runStart >= 0) {
+                BoxRec first, last, run;
+                RegionRec tmpRegion;
+
+                GetTileBox(runStart, ty, &first);
+                GetTileBox(tx - 1, ty, &last);
+                run.x1 = first.x1;  run.y1 = first.y1;
+                run.x2 = last.x2;  run.y2 = last.y2;
+                REGION_INIT(pScreen, &tmpRegion, &run, 1);
+                REGION_UNION(pScreen, region, region, &tmpRegion);
+                REGION_UNINIT(pScreen, &tmpRegion);
+                runStart = -1;
+            }
+        }
+    }
+}
+
+
+static int CountCandidateNeighbors(int tx, int ty)
+{
+    int n = 0;
+
+    if (tx > 0 && tiles[ty * tilesX + tx - 1].candidate) n++;
+    if (tx < tilesX - 1 && tiles[ty * tilesX + tx + 1].candidate) n++;
+    if (ty > 0 && tiles[(ty - 1) * tilesX + tx].candidate) n++;
+    if (ty < tilesY - 1 && tiles[(ty + 1) * tilesX + tx].candidate) n++;
+    return n;
+}
+
+
+/* Tell the hybrid clients about a new video region.  Parts of the screen
+   that left the video region have to be sent using RFB, since the client's
+   framebuffer is out of date there. */
+
+static void VideoRegionChanged(RegionPtr oldRegion)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    rfbClientPtr cl, nextCl;
+    RegionRec leftRegion;
+
+    REGION_INIT(pScreen, &leftRegion, NullBox, 0);
+    REGION_SUBTRACT(pScreen, &leftRegion, oldRegion, &rfbVideoRegion);
+
+    for (cl = rfbClientHead; cl; cl = nextCl) {
+        nextCl = cl->next;
+        if (!cl->enableVideoRegion)
+            continue;
+        REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
+                     &leftRegion);
+        cl->pendingVideoRegion = TRUE;
+        if (!cl->deferredUpdateScheduled)
+            rfbSendFramebufferUpdate(cl);
+    }
+
+    REGION_UNINIT(pScreen, &leftRegion);
+}
+
+
+static Bool AnyHybridClients(void)
+{
+    rfbClientPtr cl;
+
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        if (cl->enableVideoRegion)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+static CARD32 HybridTimerCallback(OsTimerPtr timer, CARD32 time, pointer arg)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    PixmapPtr pPixmap = (*pScreen->GetScreenPixmap) (pScreen);
+    RegionPtr damage;
+    Bool changed = FALSE;
+    int tx, ty;
+
+    if (!AnyHybridClients()) {
+        if (hybridPixmap)
+            DamageUnregister(hybridDamage);
+        hybridPixmap = NULL;
+        ResetTiles();
+        hybridTimerRunning = FALSE;
+        return 0;
+    }
+
+    /* The screen pixmap is replaced when the screen is resized. */
+    if (pPixmap != hybridPixmap) {
+        if (hybridPixmap)
+            DamageUnregister(hybridDamage);
+        hybridPixmap = pPixmap;
+        if (hybridPixmap)
+            DamageRegister(&hybridPixmap->drawable, hybridDamage);
+        DamageEmpty(hybridDamage);
+    }
+    if (rfbFB.width != tileFBWidth || rfbFB.height != tileFBHeight) {
+        RegionRec oldRegion;
+
+        REGION_INIT(pScreen, &oldRegion, NullBox, 0);
+        REGION_COPY(pScreen, &oldRegion, &rfbVideoRegion);
+        ResetTiles();
+        VideoRegionChanged(&oldRegion);
+        REGION_UNINIT(pScreen, &oldRegion);
+        return TICK_MS;
+    }
+
+    damage = DamageRegion(hybridDamage);
+    for (ty = 0; ty < tilesY; ty++) {
+        for (tx = 0; tx < tilesX; tx++) {
+            TilePtr tile = &tiles[ty * tilesX + tx];
+            BoxRec box;
+
+            GetTileBox(tx, ty, &box);
+            tile->history <<= 1;
+            if (RECT_IN_REGION(pScreen, damage, &box) != rgnOUT) {
+                tile->history |= 1;
+
+                /* Only look at the content if the tile could change
+                   state. */
+                if (CountBits(tile->history & HISTORY_MASK) >= ENTER_CHANGES ||
+                    tile->video) {
+                    if (IsPhotographic(box.x1, box.y1, box.x2 - box.x1,
+                                       box.y2 - box.y1)) {
+                        tile->candidate = TRUE;
+                        tile->synthetic = 0;
+                    } else {
+                        tile->candidate = FALSE;
+                        tile->synthetic++;
+                    }
+                }
+            }
+            if (CountBits(tile->history & HISTORY_MASK) < ENTER_CHANGES)
+                tile->candidate = FALSE;
+        }
+    }
+    DamageEmpty(hybridDamage);
+
+    for (ty = 0; ty < tilesY; ty++) {
+        for (tx = 0; tx < tilesX; tx++) {
+            TilePtr tile = &tiles[ty * tilesX + tx];
+            int changes = CountBits(tile->history & HISTORY_MASK);
+
+            if (!tile->video && tile->candidate &&
+                changes >= ENTER_CHANGES &&
+                CountCandidateNeighbors(tx, ty) >= 2) {
+                tile->video = TRUE;
+                changed = TRUE;
+            } else if (tile->video && (changes < LEAVE_CHANGES ||
+                                       tile->synthetic >= LEAVE_SYNTHETIC)) {
+                tile->video = tile->candidate = FALSE;
+                tile->synthetic = 0;
+                changed = TRUE;
+            }
+        }
+    }
+
+    if (changed) {
+        RegionRec oldRegion;
+
+        REGION_INIT(pScreen, &oldRegion, NullBox, 0);
+        REGION_COPY(pScreen, &oldRegion, &rfbVideoRegion);
+        BuildVideoRegion(&rfbVideoRegion);
+        VideoRegionChanged(&oldRegion);
+        REGION_UNINIT(pScreen, &oldRegion);
+    }
+
+    return TICK_MS;
+}
+
+
+/*
+ * rfbHybridStart() is called when a client enables the VideoRegion
+ * pseudo-encoding.  The classifier runs only while hybrid clients are
+ * connected.
+ */
+
+void rfbHybridStart(rfbClientPtr cl)
+{
+    cl->pendingVideoRegion = TRUE;
+    if (!hybridTimerRunning && hybridDamage) {
+        hybridTimer = TimerSet(hybridTimer, 0, TICK_MS, HybridTimerCallback,
+                               NULL);
+        hybridTimerRunning = TRUE;
+    }
+}
+
+
+Bool rfbHybridActive(void)
+{
+    return hybridTimerRunning;
+}
+
+
+/*
+ * Remove the video region from a hybrid client's update.  Parts of the copy
+ * region whose source lies in the video region are moved to the update region,
+ * since the client's framebuffer is out of date there.
+ */
+
+void rfbHybridClipUpdate(rfbClientPtr cl, RegionPtr updateRegion,
+                         RegionPtr copyRegion, int dx, int dy)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    RegionRec tmpRegion;
+
+    if (!REGION_NOTEMPTY(pScreen, &rfbVideoRegion))
+        return;
+
+    if (REGION_NOTEMPTY(pScreen, copyRegion)) {
+        REGION_INIT(pScreen, &tmpRegion, NullBox, 0);
+        REGION_COPY(pScreen, &tmpRegion, &rfbVideoRegion);
+        REGION_TRANSLATE(pScreen, &tmpRegion, dx, dy);
+        REGION_INTERSECT(pScreen, &tmpRegion, &tmpRegion, copyRegion);
+        REGION_SUBTRACT(pScreen, copyRegion, copyRegion, &tmpRegion);
+        REGION_UNION(pScreen, updateRegion, updateRegion, &tmpRegion);
+        REGION_UNINIT(pScreen, &tmpRegion);
+        REGION_SUBTRACT(pScreen, copyRegion, copyRegion, &rfbVideoRegion);
+    }
+    REGION_SUBTRACT(pScreen, updateRegion, updateRegion, &rfbVideoRegion);
+}
+
+
+/*
+ * Send the video region (VideoRegion pseudo-encoding.)
+ */
+
+Bool rfbSendVideoRegion(rfbClientPtr cl)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    rfbFramebufferUpdateRectHeader rect;
+    rfbVideoRegionHeader vr;
+    BoxPtr extents = REGION_EXTENTS(pScreen, &rfbVideoRegion);
+    BoxPtr boxes = REGION_RECTS(&rfbVideoRegion);
+    int i, n = REGION_NUM_RECTS(&rfbVideoRegion);
+
+    if (ublen + sz_rfbFramebufferUpdateRectHeader +
+        sz_rfbVideoRegionHeader > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    rect.encoding = Swap32IfLE(rfbEncodingVideoRegion);
+    if (n > 0) {
+        rect.r.x = Swap16IfLE(extents->x1);
+        rect.r.y = Swap16IfLE(extents->y1);
+        rect.r.w = Swap16IfLE(extents->x2 - extents->x1);
+        rect.r.h = Swap16IfLE(extents->y2 - extents->y1);
+    } else
+        rect.r.x = rect.r.y = rect.r.w = rect.r.h = 0;
+    memcpy(&updateBuf[ublen], (char *)&rect,
+           sz_rfbFramebufferUpdateRectHeader);
+    ublen += sz_rfbFramebufferUpdateRectHeader;
+
+    vr.nRects = Swap32IfLE(n);
+    memcpy(&updateBuf[ublen], (char *)&vr, sz_rfbVideoRegionHeader);
+    ublen += sz_rfbVideoRegionHeader;
+
+    for (i = 0; i < n; i++) {
+        rfbRectangle r;
+
+        if (ublen + sz_rfbRectangle > UPDATE_BUF_SIZE) {
+            if (!rfbSendUpdateBuf(cl))
+                return FALSE;
+        }
+        r.x = Swap16IfLE(boxes[i].x1);
+        r.y = Swap16IfLE(boxes[i].y1);
+        r.w = Swap16IfLE(boxes[i].x2 - boxes[i].x1);
+        r.h = Swap16IfLE(boxes[i].y2 - boxes[i].y1);
+        memcpy(&updateBuf[ublen], (char *)&r, sz_rfbRectangle);
+        ublen += sz_rfbRectangle;
+    }
+
+    cl->pendingVideoRegion = FALSE;
+    return TRUE;
+}
+
+
+Bool rfbHybridInit(ScreenPtr pScreen)
+{
+    REGION_INIT(pScreen, &rfbVideoRegion, NullBox, 0);
+    if (!rfbHybrid)
+        return TRUE;
+
+    if (!ShmEncodingEnabled()) {
+        rfbLog("Hybrid mode requires the H.264/RTSP streams\n");
+        rfbHybrid = FALSE;
+        return TRUE;
+    }
+
+    if (rfbServerFormat.bitsPerPixel != 32) {
+        rfbLog("Hybrid H.264/RFB encoding requires a 32-bit framebuffer\n");
+        rfbHybrid = FALSE;
+        return TRUE;
+    }
+
+    if (!DamageSetup(pScreen))
+        return FALSE;
+    hybridDamage = DamageCreate(NULL, NULL, DamageReportNone, TRUE, pScreen,
+                                pScreen);
+    if (!hybridDamage)
+        return FALSE;
+    hybridPixmap = NULL;
+    ResetTiles();
+
+    return TRUE;
+}
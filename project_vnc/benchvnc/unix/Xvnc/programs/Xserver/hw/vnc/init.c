@@ -209,6 +209,11 @@ int ddxProcessArgument(int argc, char *argv[], int i)
         return 2;
     }
 
+    if (strcasecmp(argv[i], "-noadaptivedefer") == 0) {
+        rfbAdaptiveDefer = FALSE;
+        return 1;
+    }
+
     if (strcasecmp(argv[i], "-desktop") == 0) {  /* -desktop desktop-name */
         if (i + 1 >= argc) UseMsg();
         desktopName = argv[i + 1];
@@ -237,6 +242,11 @@ int ddxProcessArgument(int argc, char *argv[], int i)
         return 2;
     }
 
+    if (strcasecmp(argv[i], "-metrics") == 0) {
+        rfbMetrics = TRUE;
+        return 1;
+    }
+
     if (strcasecmp(argv[i], "-idletimeout") == 0) {  /* -idletimeout sec */
         if (i + 1 >= argc) UseMsg();
         rfbIdleTimeout = atoi(argv[i + 1]);
@@ -554,6 +564,16 @@ int ddxProcessArgument(int argc, char *argv[], int i)
         return 1;
     }
 
+    if (strcasecmp(argv[i], "-hybrid") == 0) {
+        rfbHybrid = TRUE;
+        return 1;
+    }
+
+    if (strcasecmp(argv[i], "-nohybrid") == 0) {
+        rfbHybrid = FALSE;
+        return 1;
+    }
+
     if (strcasecmp(argv[i], "-nomt") == 0) {
         rfbMT = FALSE;
         return 1;
@@ -564,6 +584,11 @@ int ddxProcessArgument(int argc, char *argv[], int i)
         return 1;
     }
 
+    if (strcasecmp(argv[i], "-noscrolldetect") == 0) {
+        rfbScrollDetect = FALSE;
+        return 1;
+    }
+
     if (strcasecmp(argv[i], "-nthreads") == 0) {
         if (i + 1 >= argc) UseMsg();
         rfbNumThreads = atoi(argv[i + 1]);
@@ -663,6 +688,22 @@ static int numFormats = 6;
 #endif
 
 
+/*
+ * Large RENDER, fill, and copy operations are split among the same number of
+ * threads that the Tight encoder uses (see rfbGetNumThreads()), so they are
+ * controlled by the same options and environment variables.
+ */
+
+static void InitRenderThreads(void)
+{
+    int nt = rfbGetNumThreads();
+
+    fbSetNumThreads(nt);
+    if (nt > 1)
+        rfbLog("Using %d threads for large rendering operations\n", nt);
+}
+
+
 void InitOutput(ScreenInfo *screenInfo, int argc, char **argv)
 {
     int i;
@@ -698,6 +739,9 @@ void InitOutput(ScreenInfo *screenInfo, int argc, char **argv)
     if (inetdSock == -1)
         httpInitSockets();
 
+    if (serverGeneration == 1)
+        InitRenderThreads();
+
     /* Initialize pixmap formats */
 
     screenInfo->imageByteOrder = IMAGE_BYTE_ORDER;
@@ -740,9 +784,6 @@ static Bool rfbScreenInit(ScreenPtr pScreen, int argc, char **argv)
     char *pbits;
     VisualPtr vis;
     extern int monitorResolution;
-#ifdef RENDER
-    PictureScreenPtr    ps;
-#endif
     BOOL bigEndian = !(*(char *)&rfbEndianTest);
 
     if (monitorResolution != 0) {
@@ -887,17 +928,13 @@ static Bool rfbScreenInit(ScreenPtr pScreen, int argc, char **argv)
     prfb->cursorIsDrawn = FALSE;
     prfb->dontSendFramebufferUpdate = FALSE;
 
+    /* This wraps the screen and GC functions, so it must be called before we
+       wrap them. */
+    if (!rfbDamageInit(pScreen)) return FALSE;
+
     prfb->CloseScreen = pScreen->CloseScreen;
     prfb->CreateGC = pScreen->CreateGC;
     prfb->CopyWindow = pScreen->CopyWindow;
-    prfb->ClearToBackground = pScreen->ClearToBackground;
-#ifdef RENDER
-    ps = GetPictureScreenIfSet(pScreen);
-    if (ps) {
-        prfb->Composite = ps->Composite;
-        prfb->Glyphs = ps->Glyphs;
-    }
-#endif
     prfb->InstallColormap = pScreen->InstallColormap;
     prfb->UninstallColormap = pScreen->UninstallColormap;
     prfb->ListInstalledColormaps = pScreen->ListInstalledColormaps;
@@ -907,13 +944,6 @@ static Bool rfbScreenInit(ScreenPtr pScreen, int argc, char **argv)
     pScreen->CloseScreen = rfbCloseScreen;
     pScreen->CreateGC = rfbCreateGC;
     pScreen->CopyWindow = rfbCopyWindow;
-    pScreen->ClearToBackground = rfbClearToBackground;
-#ifdef RENDER
-    if (ps) {
-        ps->Composite = rfbComposite;
-        ps->Glyphs = rfbGlyphs;
-    }
-#endif
     pScreen->InstallColormap = rfbInstallColormap;
     pScreen->UninstallColormap = rfbUninstallColormap;
     pScreen->ListInstalledColormaps = rfbListInstalledColormaps;
@@ -959,6 +989,18 @@ static Bool rfbScreenInit(ScreenPtr pScreen, int argc, char **argv)
     if (!vncRRInit(pScreen)) return FALSE;
 #endif
 
+#ifdef PRESENT
+    if (!vncPresentInit(pScreen)) return FALSE;
+#endif
+
+#ifdef XV
+    if (!vncXvInit(pScreen)) return FALSE;
+#endif
+
+    if (!rfbHybridInit(pScreen)) return FALSE;
+    if (!rfbRoiInit(pScreen)) return FALSE;
+    if (!rfbMetricsInit(pScreen)) return FALSE;
+
     rfbLog("Maximum clipboard transfer size: %d bytes\n", rfbMaxClipboard);
 
     return ret;
@@ -1591,7 +1633,9 @@ void ddxUseMsg()
     ErrorF("-alwaysshared          always treat new clients as shared\n");
     ErrorF("-capture F             capture the data sent to the first connected viewer to\n");
     ErrorF("                       a file (F).\n");
-    ErrorF("-deferupdate time      time in ms to defer updates (default 40)\n");
+    ErrorF("-deferupdate time      maximum time in ms to defer updates (default 40)\n");
+    ErrorF("-noadaptivedefer       always defer updates for the -deferupdate time, rather\n");
+    ErrorF("                       than adapting it to the rate at which the screen changes\n");
     ErrorF("-desktop name          VNC desktop name (default x11)\n");
     ErrorF("-disconnect            disconnect existing clients when a new non-shared\n"
            "                       connection comes in, rather than refusing the new\n"
@@ -1605,6 +1649,7 @@ void ddxUseMsg()
     ErrorF("-localhost             only allow connections from localhost\n");
     ErrorF("-maxclipboard B        set max. clipboard transfer size to B bytes\n");
     ErrorF("                       (default: %d)\n", rfbMaxClipboard);
+    ErrorF("-metrics               serve live statistics at /metrics using the HTTP server\n");
     ErrorF("-nevershared           never treat new clients as shared\n");
     ErrorF("-noclipboardrecv       disable client->server clipboard synchronization\n");
     ErrorF("-noclipboardsend       disable server->client clipboard synchronization\n");
@@ -1662,8 +1707,13 @@ void ddxUseMsg()
     ErrorF("-alrsamp S             specify chroma subsampling factor for automatic lossless\n");
     ErrorF("                       refresh JPEG images (S = 1x, 2x, 4x, or gray)\n");
     ErrorF("-economictranslate     less memory hungry translation\n");
+    ErrorF("-hybrid                allow viewers to combine the H.264 streams with RFB\n");
+    ErrorF("                       updates (hybrid mode)\n");
+    ErrorF("-nohybrid              do not allow hybrid mode (default)\n");
     ErrorF("-interframe            always use interframe comparison\n");
     ErrorF("-nointerframe          never use interframe comparison\n");
+    ErrorF("-noscrolldetect        do not use interframe comparison to detect scrolled\n");
+    ErrorF("                       content and send it using CopyRect\n");
     ErrorF("-nomt                  disable multithreaded encoding\n");
     ErrorF("-nthreads N            specify number of threads (1 <= N <= %d) to use with\n",
            MAX_ENCODING_THREADS);
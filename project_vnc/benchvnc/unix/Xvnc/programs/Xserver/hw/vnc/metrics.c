@@ -0,0 +1,387 @@
+/*
+ * metrics.c - export live server statistics in Prometheus text format
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * The per-client statistics in stats.c are only logged when a client
+ * disconnects.  With -metrics, the built-in HTTP server (httpd.c) also
+ * answers GET /metrics with the current values of those statistics, along
+ * with flow control state and histograms of the time taken to encode each
+ * framebuffer update, the size of each update, and the time taken by the
+ * H.264/RTSP encoders (reported by Xext/shm.c through ShmEncodeCallback.)
+ * Counters are never reset while a client is connected, so rates (such as
+ * input events per second) can be computed by the scraper.
+ */
+
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "rfb.h"
+#include "shmint.h"
+
+
+Bool rfbMetrics = FALSE;
+
+#define HEADER_STR "HTTP/1.0 200 OK\r\n"  \
+    "Content-Type: text/plain; version=0.0.4\r\n"
+
+/* Upper bounds of the histogram buckets, in seconds and bytes.  The last
+   bucket of each histogram is +Inf. */
+static const double timeBounds[METRICS_BUCKETS - 1] = {
+    0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0
+};
+static const double byteBounds[METRICS_BUCKETS - 1] = {
+    256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216,
+    67108864, 268435456
+};
+
+static rfbHistogram encodeTime[MAX_ENCODINGS];
+static rfbHistogram rtspEncodeTime;
+static long long rtspFramesEncoded = 0;
+static long long rtspEncodeFailures = 0;
+
+typedef struct {
+    char *data;
+    size_t len, size;
+} MetricsBuf;
+
+
+static void Observe(rfbHistogram *hist, const double *bounds, double value)
+{
+    int i;
+
+    for (i = 0; i < METRICS_BUCKETS - 1 && value > bounds[i]; i++);
+    hist->counts[i]++;
+    hist->total++;
+    hist->sum += value;
+}
+
+
+static void Append(MetricsBuf *buf, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    while (1) {
+        va_start(args, format);
+        n = vsnprintf(&buf->data[buf->len], buf->size - buf->len, format,
+                      args);
+        va_end(args);
+        if (n < 0)
+            return;
+        if ((size_t)n < buf->size - buf->len)
+            break;
+        buf->size = max(buf->size * 2, buf->len + n + 1);
+        buf->data = (char *)rfbRealloc(buf->data, buf->size);
+    }
+    buf->len += n;
+}
+
+
+static void AppendHeader(MetricsBuf *buf, const char *name, const char *type,
+                         const char *help)
+{
+    Append(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+/* labels must be empty or end with a comma. */
+
+static void AppendHistogram(MetricsBuf *buf, const char *name,
+                            const char *labels, rfbHistogram *hist,
+                            const double *bounds)
+{
+    long long count = 0;
+    int i;
+
+    for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+        count += hist->counts[i];
+        /* %g would round large byte counts (1048576 becomes 1.04858e+06), so
+           print whole-number bounds as integers. */
+        if (bounds[i] == (double)(long long)bounds[i])
+            Append(buf, "%s_bucket{%sle=\"%lld\"} %lld\n", name, labels,
+                   (long long)bounds[i], count);
+        else
+            Append(buf, "%s_bucket{%sle=\"%g\"} %lld\n", name, labels,
+                   bounds[i], count);
+    }
+    Append(buf, "%s_bucket{%sle=\"+Inf\"} %lld\n", name, labels, hist->total);
+    if (labels[0]) {
+        /* Strip the trailing comma */
+        Append(buf, "%s_sum{%.*s} %f\n", name, (int)strlen(labels) - 1, labels,
+               hist->sum);
+        Append(buf, "%s_count{%.*s} %lld\n", name, (int)strlen(labels) - 1,
+               labels, hist->total);
+    } else {
+        Append(buf, "%s_sum %f\n%s_count %lld\n", name, hist->sum, name,
+               hist->total);
+    }
+}
+
+
+static void rfbMetricsEncoded(CallbackListPtr *list, void *closure,
+                              void *data)
+{
+    ShmEncodeInfoPtr info = (ShmEncodeInfoPtr)data;
+
+    if (info->nEncoded < 0) {
+        rtspEncodeFailures++;
+        return;
+    }
+    rtspFramesEncoded += info->nEncoded;
+    Observe(&rtspEncodeTime, timeBounds, (double)info->encodeTime / 1.e9);
+}
+
+
+/*
+ * rfbMetricsRecordUpdate is called by rfbSendFramebufferUpdate() after it
+ * has encoded and queued a framebuffer update.
+ */
+
+void rfbMetricsRecordUpdate(rfbClientPtr cl, double encodeSeconds,
+                            long long bytes)
+{
+    if (cl->preferredEncoding >= 0 && cl->preferredEncoding < MAX_ENCODINGS)
+        Observe(&encodeTime[cl->preferredEncoding], timeBounds,
+                encodeSeconds);
+    Observe(&cl->rfbUpdateBytes, byteBounds, (double)bytes);
+}
+
+
+static void ClientLabels(rfbClientPtr cl, char *labels, size_t size)
+{
+    snprintf(labels, size, "client=\"%d\",host=\"%s\"", cl->sock,
+             cl->host ? cl->host : "");
+}
+
+
+static void AppendClientMetrics(MetricsBuf *buf)
+{
+    rfbClientPtr cl;
+    char labels[256];
+    int i;
+
+    AppendHeader(buf, "tvnc_client_bytes_sent_total", "counter",
+                 "Bytes sent in framebuffer updates, by encoding");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels));
+        for (i = 0; i < MAX_ENCODINGS; i++) {
+            if (cl->rfbRectanglesSent[i] == 0)
+                continue;
+            Append(buf, "tvnc_client_bytes_sent_total{%s,encoding=\"%s\"} "
+                   "%lld\n", labels, rfbEncodingName(i), cl->rfbBytesSent[i]);
+        }
+        Append(buf, "tvnc_client_bytes_sent_total{%s,encoding=\"cursor\"} "
+               "%lld\n", labels,
+               cl->rfbCursorShapeBytesSent + cl->rfbCursorPosBytesSent);
+    }
+
+    AppendHeader(buf, "tvnc_client_rectangles_sent_total", "counter",
+                 "Rectangles sent in framebuffer updates, by encoding");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels));
+        for (i = 0; i < MAX_ENCODINGS; i++) {
+            if (cl->rfbRectanglesSent[i] == 0)
+                continue;
+            Append(buf, "tvnc_client_rectangles_sent_total{%s,encoding=\"%s\"}"
+                   " %d\n", labels, rfbEncodingName(i),
+                   cl->rfbRectanglesSent[i]);
+        }
+    }
+
+    AppendHeader(buf, "tvnc_client_raw_bytes_equivalent_total", "counter",
+                 "Bytes that the framebuffer updates would have used with "
+                 "Raw encoding");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_raw_bytes_equivalent_total{%s} %lld\n",
+               labels, cl->rfbRawBytesEquivalent);
+    }
+
+    AppendHeader(buf, "tvnc_client_updates_sent_total", "counter",
+                 "Framebuffer updates sent");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_updates_sent_total{%s} %d\n", labels,
+               cl->rfbFramebufferUpdateMessagesSent);
+    }
+
+    AppendHeader(buf, "tvnc_client_updates_deferred_total", "counter",
+                 "Framebuffer updates postponed because the network or the "
+                 "send queue was congested");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_updates_deferred_total{%s} %d\n", labels,
+               cl->rfbUpdatesDeferred);
+    }
+
+    AppendHeader(buf, "tvnc_client_key_events_total", "counter",
+                 "Key events received");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_key_events_total{%s} %d\n", labels,
+               cl->rfbKeyEventsRcvd);
+    }
+
+    AppendHeader(buf, "tvnc_client_pointer_events_total", "counter",
+                 "Pointer events received");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_pointer_events_total{%s} %d\n", labels,
+               cl->rfbPointerEventsRcvd);
+    }
+
+    AppendHeader(buf, "tvnc_client_congestion_window_bytes", "gauge",
+                 "Congestion window");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_congestion_window_bytes{%s} %u\n", labels,
+               cl->congWindow);
+    }
+
+    AppendHeader(buf, "tvnc_client_in_flight_bytes", "gauge",
+                 "Bytes sent but not yet acknowledged by the client");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_in_flight_bytes{%s} %d\n", labels,
+               cl->sockOffset - cl->ackedOffset);
+    }
+
+    AppendHeader(buf, "tvnc_client_base_rtt_seconds", "gauge",
+                 "Lowest round-trip time measured since the client connected");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        if (cl->baseRTT == (unsigned)-1)
+            continue;
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_base_rtt_seconds{%s} %f\n", labels,
+               (double)cl->baseRTT / 1000.);
+    }
+
+    AppendHeader(buf, "tvnc_client_rtt_seconds", "gauge",
+                 "Lowest round-trip time measured during the last round trip");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        if (cl->minRTT == (unsigned)-1)
+            continue;
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_rtt_seconds{%s} %f\n", labels,
+               (double)cl->minRTT / 1000.);
+    }
+
+    AppendHeader(buf, "tvnc_client_send_queue_bytes", "gauge",
+                 "Bytes waiting in the sender thread's queue");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        size_t queued = 0;
+
+        if (cl->senderRunning) {
+            pthread_mutex_lock(&cl->senderMutex);
+            queued = cl->sendQueued;
+            pthread_mutex_unlock(&cl->senderMutex);
+        }
+        ClientLabels(cl, labels, sizeof(labels));
+        Append(buf, "tvnc_client_send_queue_bytes{%s} %lu\n", labels,
+               (unsigned long)queued);
+    }
+
+    AppendHeader(buf, "tvnc_client_update_bytes", "histogram",
+                 "Size of each framebuffer update");
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+        ClientLabels(cl, labels, sizeof(labels) - 1);
+        strcat(labels, ",");
+        AppendHistogram(buf, "tvnc_client_update_bytes", labels,
+                        &cl->rfbUpdateBytes, byteBounds);
+    }
+}
+
+
+/*
+ * rfbMetricsWrite sends an HTTP response containing the current metrics to
+ * the HTTP client.
+ */
+
+void rfbMetricsWrite(rfbClientPtr httpClient)
+{
+    MetricsBuf buf;
+    rfbClientPtr cl;
+    char str[256], labels[64];
+    int i, nClients = 0;
+
+    buf.size = 16384;
+    buf.len = 0;
+    buf.data = (char *)rfbAlloc(buf.size);
+    buf.data[0] = '\0';
+
+    for (cl = rfbClientHead; cl; cl = cl->next)
+        nClients++;
+    AppendHeader(&buf, "tvnc_clients", "gauge", "Connected viewers");
+    Append(&buf, "tvnc_clients %d\n", nClients);
+
+    AppendClientMetrics(&buf);
+
+    AppendHeader(&buf, "tvnc_update_encode_seconds", "histogram",
+                 "Time taken to encode and queue each framebuffer update, "
+                 "by encoding");
+    for (i = 0; i < MAX_ENCODINGS; i++) {
+        if (encodeTime[i].total == 0)
+            continue;
+        snprintf(labels, sizeof(labels), "encoding=\"%s\",",
+                 rfbEncodingName(i));
+        AppendHistogram(&buf, "tvnc_update_encode_seconds", labels,
+                        &encodeTime[i], timeBounds);
+    }
+
+    AppendHeader(&buf, "tvnc_rtsp_encode_seconds", "histogram",
+                 "Time taken to encode each frame of the H.264/RTSP streams");
+    AppendHistogram(&buf, "tvnc_rtsp_encode_seconds", "", &rtspEncodeTime,
+                    timeBounds);
+
+    AppendHeader(&buf, "tvnc_rtsp_frames_encoded_total", "counter",
+                 "Frames encoded, summed over all H.264/RTSP streams");
+    Append(&buf, "tvnc_rtsp_frames_encoded_total %lld\n", rtspFramesEncoded);
+
+    AppendHeader(&buf, "tvnc_rtsp_frames_dropped_total", "counter",
+                 "Frames that the H.264/RTSP encoders failed to encode or "
+                 "send");
+    Append(&buf, "tvnc_rtsp_frames_dropped_total %lld\n", rtspEncodeFailures);
+
+    snprintf(str, sizeof(str), HEADER_STR "Content-Length: %lu\r\n\r\n",
+             (unsigned long)buf.len);
+    if (WriteExact(httpClient, str, strlen(str)) > 0)
+        WriteExact(httpClient, buf.data, buf.len);
+    free(buf.data);
+}
+
+
+/*
+ * rfbMetricsInit starts collecting the H.264/RTSP encoder statistics.
+ */
+
+Bool rfbMetricsInit(ScreenPtr pScreen)
+{
+    if (!rfbMetrics)
+        return TRUE;
+    if (!AddCallback(&ShmEncodeCallback, rfbMetricsEncoded, NULL))
+        return FALSE;
+    return TRUE;
+}
@@ -559,6 +559,26 @@ static void vncUpdateScreenLayout(struct xorg_list *list)
 }
 
 
+/* Report the enabled outputs to the video encoder, which maintains one
+   encoder session per output */
+
+static void vncUpdateVideoOutputs(struct xorg_list *list)
+{
+  rfbScreenInfo *screen;
+
+  rtsp_layout_begin();
+  xorg_list_for_each_entry(screen, list, entry) {
+    if (screen->output &&
+        (!screen->output->crtc || !screen->output->crtc->mode))
+      continue;
+    rtsp_layout_add_output(screen->output ? screen->output->id : screen->s.id,
+                           screen->s.x, screen->s.y, screen->s.w,
+                           screen->s.h);
+  }
+  rtsp_layout_end();
+}
+
+
 static Bool rfbSendDesktopSizeAll(rfbClientPtr reqClient, int reason)
 {
   rfbClientPtr cl;
@@ -589,6 +609,7 @@ static Bool vncRRCrtcSet(ScreenPtr pScreen, RRCrtcPtr crtc, RRModePtr mode,
 
   vncUpdateScreenLayout(&rfbScreens);
   vncPrintScreenLayout(&rfbScreens);
+  vncUpdateVideoOutputs(&rfbScreens);
 
   return rfbSendDesktopSizeAll(NULL, rfbEDSReasonServer);
 }
@@ -612,6 +633,7 @@ static Bool vncRRScreenSetSize(ScreenPtr pScreen, CARD16 width, CARD16 height,
     return FALSE;
 
   vncUpdateScreenLayout(&rfbScreens);
+  vncUpdateVideoOutputs(&rfbScreens);
 
   return rfbSendDesktopSizeAll(NULL, rfbEDSReasonServer);
 }
@@ -640,6 +662,7 @@ Bool vncRRInit(ScreenPtr pScreen)
 
   rfbLog("New desktop size: %d x %d\n", rfbFB.width, rfbFB.height);
   vncPrintScreenLayout(&rfbScreens);
+  vncUpdateVideoOutputs(&rfbScreens);
 
   return TRUE;
 }
@@ -771,6 +794,7 @@ int ResizeDesktop(ScreenPtr pScreen, rfbClientPtr cl, int w, int h,
   rfbScreens.next->prev = &rfbScreens;
 
   vncPrintScreenLayout(&rfbScreens);
+  vncUpdateVideoOutputs(&rfbScreens);
 
   if (!rfbSendDesktopSizeAll(cl, rfbEDSReasonClient))
     return rfbEDSResultInvalid;
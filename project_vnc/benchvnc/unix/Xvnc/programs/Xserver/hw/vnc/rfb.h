@@ -56,6 +56,7 @@
 #endif
 #include "mipointer.h"
 #include "input.h"
+#include "rtspoutputs.h"
 #ifdef XVNC_AuthPAM
 #ifdef __APPLE__
 #include <AvailabilityMacros.h>
@@ -74,6 +75,10 @@
 #define MAX_AUTH_CAPS 16
 #define MAX_VENCRYPT_SUBTYPES 16
 
+/* Number of buckets in each histogram exported by metrics.c, including the
+   +Inf bucket */
+#define METRICS_BUCKETS 12
+
 /* Protect ourself against a denial of service */
 #define MAX_CUTTEXT_LEN (1 * 1024 * 1024)
 
@@ -84,6 +89,19 @@
 extern const char *display;
 
 
+/*
+ * Histogram with fixed bucket boundaries (see metrics.c.)  counts[i] is the
+ * number of observations that fell into bucket i, not the cumulative count.
+ */
+
+typedef struct
+{
+    long long counts[METRICS_BUCKETS];
+    long long total;
+    double sum;
+} rfbHistogram;
+
+
 /*
  * Per-screen (framebuffer) structure.  There is only one of these, since we
  * don't allow the X server to have multiple screens.
@@ -149,11 +167,6 @@ typedef struct
     CloseScreenProcPtr                  CloseScreen;
     CreateGCProcPtr                     CreateGC;
     CopyWindowProcPtr                   CopyWindow;
-    ClearToBackgroundProcPtr            ClearToBackground;
-#ifdef RENDER
-    CompositeProcPtr                    Composite;
-    GlyphsProcPtr                       Glyphs;
-#endif
     InstallColormapProcPtr              InstallColormap;
     UninstallColormapProcPtr            UninstallColormap;
     ListInstalledColormapsProcPtr       ListInstalledColormaps;
@@ -330,6 +343,18 @@ typedef struct rfbClientRec {
     Bool deferredUpdateScheduled;
     OsTimerPtr deferredUpdateTimer;
     double deferredUpdateStart;
+    double deferUpdateTime;             /* deferral of the pending update (ms) */
+
+    /* State of the adaptive deferral algorithm (see draw.c.)  Times are in
+       seconds, and smoothed durations are in milliseconds (< 0 = unknown.) */
+
+    double burstStart, burstEnd;        /* first/last change in current burst */
+    double burstTime;                   /* smoothed burst duration */
+    double drawInterval;                /* smoothed interval between bursts */
+    double sendTime;                    /* smoothed time to send an update */
+    double lastUpdateEnd;
+    double lastInputTime;
+    Bool inputPending;
 
     /* translateFn points to the translation function which is used to copy
        and translate a rectangle from the framebuffer to an output buffer. */
@@ -348,12 +373,15 @@ typedef struct rfbClientRec {
     long long rfbLastRectBytesSent;
     long long rfbCursorShapeBytesSent;
     int rfbCursorShapeUpdatesSent;
+    int rfbCursorCacheHits;
     long long rfbCursorPosBytesSent;
     int rfbCursorPosUpdatesSent;
     int rfbFramebufferUpdateMessagesSent;
     long long rfbRawBytesEquivalent;
     int rfbKeyEventsRcvd;
     int rfbPointerEventsRcvd;
+    int rfbUpdatesDeferred;
+    rfbHistogram rfbUpdateBytes;
 
     /* zlib encoding -- necessary compression state info per client */
 
@@ -391,11 +419,21 @@ typedef struct rfbClientRec {
                                        extension */
     Bool enableGII;                 /* client supports GII extension */
     Bool useRichCursorEncoding;     /* rfbEncodingRichCursor is preferred */
+    Bool enableCursorCache;         /* client supports CursorCache encoding */
+    Bool enableVideoRegion;         /* client supports VideoRegion encoding
+                                       (hybrid H.264/RFB mode) */
+    Bool pendingVideoRegion;        /* video region should be sent */
     Bool cursorWasChanged;          /* cursor shape update should be sent */
     Bool cursorWasMoved;            /* cursor position update should be sent */
 
     int cursorX, cursorY;           /* client's cursor position */
 
+    /* Hashes of the cursor shapes stored in the client's cursor cache, along
+       with the time at which each slot was last used (0 = empty) */
+    CARD64 cursorCacheHash[rfbCursorCacheSize];
+    unsigned int cursorCacheTime[rfbCursorCacheSize];
+    unsigned int cursorCacheClock;
+
     Bool firstUpdate;
     OsTimerPtr alrTimer;
     RegionRec lossyRegion, alrRegion, alrEligibleRegion;
@@ -434,6 +472,20 @@ typedef struct rfbClientRec {
     Bool pendingDesktopResize;
     int reason, result;
 
+    /* Asynchronous sender thread.  Once the client reaches the RFB_NORMAL
+       state, WriteExact() appends to sendHead/sendTail, and the sender thread
+       writes the queued data to the socket, so a slow viewer can't stall the
+       X server. */
+
+    Bool senderRunning, senderExit;
+    pthread_t senderThread;
+    pthread_mutex_t senderMutex;
+    pthread_cond_t senderCond;
+    struct _rfbSendBuf *sendHead, *sendTail;
+    size_t sendQueued;
+    int senderError;                /* errno from the sender thread, or 0 */
+    int senderPipe[2];              /* wakes up the X server on error */
+
 #if USETLS
     rfbSslCtx *sslctx;
 #endif
@@ -458,8 +510,10 @@ typedef struct rfbClientRec {
     ((!(cl)->enableCursorShapeUpdates && !rfbFB.cursorIsDrawn) ||  \
      ((cl)->enableCursorShapeUpdates && (cl)->cursorWasChanged) ||  \
      ((cl)->enableCursorPosUpdates && (cl)->cursorWasMoved) ||  \
+     ((cl)->enableVideoRegion && (cl)->pendingVideoRegion) ||  \
      REGION_NOTEMPTY((pScreen), &(cl)->copyRegion) ||  \
-     REGION_NOTEMPTY((pScreen), &(cl)->modifiedRegion))
+     REGION_NOTEMPTY((pScreen), &(cl)->modifiedRegion) ||  \
+     rfbDamagePending())
 
 /*
  * This macro creates an empty region (ie. a region with no areas) if it is
@@ -644,6 +698,19 @@ extern void rfbUninstallColormap(ColormapPtr pmap);
 extern void rfbStoreColors(ColormapPtr pmap, int ndef, xColorItem *pdefs);
 
 
+/* coalesce.c */
+
+typedef struct {
+    int pixelCost;                      /* estimated bits per pixel */
+    int rectCost;                       /* estimated bits per rectangle */
+} rfbCoalesceCost;
+
+extern void rfbGetCoalesceCost(int encoding, rfbCoalesceCost *cost);
+extern Bool rfbCoalesceRegion(RegionPtr region, int maxRects,
+                              const rfbCoalesceCost *cost);
+extern void rfbWriteDamageTrace(RegionPtr region);
+
+
 /* corre.c */
 
 extern Bool rfbSendRectEncodingCoRRE(rfbClientPtr cl, int x, int y, int w,
@@ -652,6 +719,8 @@ extern Bool rfbSendRectEncodingCoRRE(rfbClientPtr cl, int x, int y, int w,
 
 /* cursor.c */
 
+extern void rfbResetCursorCache(rfbClientPtr cl);
+
 extern Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen);
 extern Bool rfbSendCursorPos(rfbClientPtr cl, ScreenPtr pScreen);
 
@@ -671,30 +740,23 @@ extern Bool rfbDCInitialize(ScreenPtr, miPointerScreenFuncPtr);
 /* draw.c */
 
 extern int rfbDeferUpdateTime;
+extern Bool rfbAdaptiveDefer;
 
 extern void ClipToScreen(ScreenPtr pScreen, RegionPtr pRegion);
 void PrintRegion(ScreenPtr pScreen, RegionPtr reg, const char *msg);
 
-#ifdef RENDER
-extern void rfbComposite(CARD8 op, PicturePtr pSrc, PicturePtr pMask,
-                         PicturePtr pDst, INT16 xSrc, INT16 ySrc, INT16 xMask,
-                         INT16 yMask, INT16 xDst, INT16 yDst, CARD16 width,
-                         CARD16 height);
-
-extern void rfbGlyphs(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
-                      PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
-                      int nlists, GlyphListPtr lists, GlyphPtr * glyphs);
-#endif
-
 extern Bool rfbCloseScreen(ScreenPtr);
 extern Bool rfbCreateGC(GCPtr);
 extern void rfbPaintWindowBackground(WindowPtr, RegionPtr, int what);
 extern void rfbPaintWindowBorder(WindowPtr, RegionPtr, int what);
 extern void rfbCopyWindow(WindowPtr, DDXPointRec, RegionPtr);
-extern void rfbClearToBackground(WindowPtr, int x, int y, int w,
-                                 int h, Bool generateExposures);
 extern RegionPtr rfbRestoreAreas(WindowPtr, RegionPtr);
 
+extern Bool rfbDamageInit(ScreenPtr pScreen);
+extern void rfbFlushDamage(ScreenPtr pScreen);
+extern void rfbAddCursorRegion(ScreenPtr pScreen, BoxPtr pBox);
+extern Bool rfbDamagePending(void);
+
 
 /* flowcontrol.c */
 
@@ -702,6 +764,7 @@ extern void HandleFence(rfbClientPtr cl, CARD32 flags, unsigned len,
                         const char *data);
 extern void rfbInitFlowControl(rfbClientPtr cl);
 extern Bool rfbIsCongested(rfbClientPtr cl);
+extern int rfbCongestionWindowSpare(rfbClientPtr cl);
 extern void rfbSendEndOfCU(rfbClientPtr cl);
 extern Bool rfbSendFence(rfbClientPtr cl, CARD32 flags, unsigned len,
                          const char *data);
@@ -722,6 +785,19 @@ extern char *httpDir;
 extern void httpInitSockets(void);
 
 
+/* hybrid.c */
+
+extern Bool rfbHybrid;
+extern RegionRec rfbVideoRegion;
+
+extern Bool rfbHybridInit(ScreenPtr pScreen);
+extern void rfbHybridStart(rfbClientPtr cl);
+extern Bool rfbHybridActive(void);
+extern void rfbHybridClipUpdate(rfbClientPtr cl, RegionPtr updateRegion,
+                                RegionPtr copyRegion, int dx, int dy);
+extern Bool rfbSendVideoRegion(rfbClientPtr cl);
+
+
 /* init.c */
 
 extern char *desktopName;
@@ -767,6 +843,16 @@ extern void KeyEvent(KeySym keySym, Bool down);
 extern void KbdReleaseAllKeys(void);
 
 
+/* metrics.c */
+
+extern Bool rfbMetrics;
+
+extern Bool rfbMetricsInit(ScreenPtr pScreen);
+extern void rfbMetricsRecordUpdate(rfbClientPtr cl, double encodeSeconds,
+                                   long long bytes);
+extern void rfbMetricsWrite(rfbClientPtr httpClient);
+
+
 /* nvctrlext.c */
 
 extern Bool noNVCTRLExtension;
@@ -839,6 +925,7 @@ extern Bool rfbVirtualTablet;
 /* Multithreading params specified on the command line or in the environment */
 extern Bool rfbMT;
 extern int rfbNumThreads;
+extern int rfbGetNumThreads(void);
 
 extern char *captureFile;
 
@@ -868,6 +955,7 @@ extern void rfbSendServerCutText(char *str, int len);
 
 rfbSslCtx *rfbssl_init(rfbClientPtr cl, Bool anon);
 int rfbssl_accept(rfbClientPtr cl);
+Bool rfbssl_ktls_send(rfbClientPtr cl);
 int rfbssl_pending(rfbClientPtr cl);
 int rfbssl_peek(rfbClientPtr cl, char *buf, int bufsize);
 int rfbssl_read(rfbClientPtr cl, char *buf, int bufsize);
@@ -878,15 +966,31 @@ char *rfbssl_geterr(void);
 #endif
 
 
+/* roi.c */
+
+extern Bool rfbRoi;
+
+extern Bool rfbRoiInit(ScreenPtr pScreen);
+
+
 /* rre.c */
 
 extern Bool rfbSendRectEncodingRRE(rfbClientPtr cl, int x, int y, int w,
                                    int h);
 
 
+/* scroll.c */
+
+extern Bool rfbScrollDetect;
+
+extern Bool rfbDetectScroll(rfbClientPtr cl, RegionPtr region,
+                            RegionPtr copyRegion, int *dx, int *dy);
+
+
 /* sockets.c */
 
 extern int rfbMaxClientWait;
+extern Bool rfbAsyncSend;
 
 extern int udpPort;
 extern int udpSock;
@@ -902,6 +1006,10 @@ extern void rfbCloseClient(rfbClientPtr cl);
 extern int rfbConnect(char *host, int port);
 extern void rfbCorkSock(int sock);
 extern void rfbUncorkSock(int sock);
+extern void rfbCorkClient(rfbClientPtr cl);
+extern void rfbUncorkClient(rfbClientPtr cl);
+extern void rfbStartSender(rfbClientPtr cl);
+extern Bool rfbSendQueueBusy(rfbClientPtr cl);
 
 extern int ReadExact(rfbClientPtr cl, char *buf, int len);
 extern int SkipExact(rfbClientPtr cl, int len);
@@ -913,10 +1021,33 @@ extern int ConnectToTcpAddr(char *host, int port);
 extern const char *sockaddr_string(rfbSockAddr *addr, char *buf, int len);
 
 
+/* simd.c */
+
+extern int (*rfbRunLength8) (CARD8 *data, int count, CARD8 value, CARD8 mask);
+extern int (*rfbRunLength16) (CARD16 *data, int count, CARD16 value,
+                              CARD16 mask);
+extern int (*rfbRunLength32) (CARD32 *data, int count, CARD32 value,
+                              CARD32 mask);
+extern Bool (*rfbIsSolid8) (CARD8 *ptr, int w, int h, int pitch, CARD8 color);
+extern Bool (*rfbIsSolid16) (CARD16 *ptr, int w, int h, int pitch,
+                             CARD16 color);
+extern Bool (*rfbIsSolid32) (CARD32 *ptr, int w, int h, int pitch,
+                             CARD32 color);
+extern void (*rfbPack24) (char *buf, int count, int rShift, int gShift,
+                          int bShift);
+
+extern rfbTranslateFnType rfbGetSIMDTranslateFn(rfbPixelFormat *in,
+                                                rfbPixelFormat *out,
+                                                const char **name);
+extern void rfbInitSIMD(void);
+
+
 /* stats.c */
 
 extern void rfbResetStats(rfbClientPtr cl);
 extern void rfbPrintStats(rfbClientPtr cl);
+extern const char *rfbEncodingName(int encoding);
+extern long long rfbTotalBytesSent(rfbClientPtr cl);
 
 
 /* strsep.c */
@@ -956,6 +1087,20 @@ extern Bool rfbSetClientColourMap(rfbClientPtr cl, int firstColour,
                                   int nColours);
 
 
+/* vncpresent.c */
+
+#ifdef PRESENT
+extern Bool vncPresentInit(ScreenPtr pScreen);
+#endif
+
+
+/* vncxv.c */
+
+#ifdef XV
+extern Bool vncXvInit(ScreenPtr pScreen);
+#endif
+
+
 /* zlib.c */
 
 /* Minimum zlib rectangle size in bytes.  Anything smaller will
@@ -43,8 +43,10 @@
 #include <sys/syscall.h>
 #include <arpa/inet.h>
 #include "windowstr.h"
+#include "inputstr.h"
 #include "timetrack.h"
 #include "rfb.h"
+#include "shmint.h"
 #include "sprite.h"
 
 /* #define GII_DEBUG */
@@ -176,10 +178,91 @@ long long gettime_nanoTime(void)
 
 /*
  * Auto Lossless Refresh
+ *
+ * Once the framebuffer has been idle for rfbAutoLosslessRefresh seconds, the
+ * lossy regions are refined in the background.  Each invocation of
+ * alrCallback() sends one batch of tiles, chosen in order of their distance
+ * from the pointer, and the size of the batch is limited by the spare room in
+ * the client's congestion window.  The refresh is suspended for another idle
+ * period as soon as new changes or input events arrive, so it delays an
+ * interactive update by no more than one batch.
  */
 
+#define ALR_TILE_SIZE       64
+#define ALR_MIN_PIXELS      (ALR_TILE_SIZE * ALR_TILE_SIZE * 4)
+#define ALR_MAX_PIXELS      (ALR_TILE_SIZE * ALR_TILE_SIZE * 64)
+/* Batch size for clients that don't support flow control */
+#define ALR_BATCH_PIXELS    (ALR_TILE_SIZE * ALR_TILE_SIZE * 16)
+#define ALR_BATCH_INTERVAL  5    /* ms */
+#define ALR_RETRY_INTERVAL  20   /* ms, if the connection is congested */
+
 static Bool putImageOnly = TRUE, alrCopyRect = TRUE;
 
+typedef struct {
+    BoxRec box;
+    int distance;
+} ALRTile;
+
+static int CompareALRTiles(const void *arg1, const void *arg2)
+{
+    return ((const ALRTile *)arg1)->distance -
+           ((const ALRTile *)arg2)->distance;
+}
+
+
+/* Add the tiles of pRegion that are nearest to the pointer, up to maxPixels
+   pixels, to pBatch. */
+
+static void SelectALRBatch(RegionPtr pRegion, int maxPixels, RegionPtr pBatch)
+{
+    BoxPtr rects = REGION_RECTS(pRegion);
+    int nRects = REGION_NUM_RECTS(pRegion), nTiles = 0, maxTiles = 0;
+    int i, x, y, px = 0, py = 0, pixels = 0;
+    ALRTile *tiles = NULL;
+
+    if (inputInfo.pointer)
+        GetSpritePosition(inputInfo.pointer, &px, &py);
+
+    for (i = 0; i < nRects; i++) {
+        for (y = rects[i].y1 - rects[i].y1 % ALR_TILE_SIZE; y < rects[i].y2;
+             y += ALR_TILE_SIZE) {
+            for (x = rects[i].x1 - rects[i].x1 % ALR_TILE_SIZE;
+                 x < rects[i].x2; x += ALR_TILE_SIZE) {
+                ALRTile *tile;
+
+                if (nTiles == maxTiles) {
+                    maxTiles = maxTiles ? maxTiles * 2 : 256;
+                    tiles = (ALRTile *)rfbRealloc(tiles,
+                                                  maxTiles * sizeof(ALRTile));
+                }
+                tile = &tiles[nTiles++];
+                tile->box.x1 = max(x, rects[i].x1);
+                tile->box.y1 = max(y, rects[i].y1);
+                tile->box.x2 = min(x + ALR_TILE_SIZE, rects[i].x2);
+                tile->box.y2 = min(y + ALR_TILE_SIZE, rects[i].y2);
+                tile->distance =
+                    abs((tile->box.x1 + tile->box.x2) / 2 - px) +
+                    abs((tile->box.y1 + tile->box.y2) / 2 - py);
+            }
+        }
+    }
+
+    qsort(tiles, nTiles, sizeof(ALRTile), CompareALRTiles);
+
+    for (i = 0; i < nTiles && pixels < maxPixels; i++) {
+        RegionRec tileRegion;
+
+        REGION_INIT(pScreen, &tileRegion, &tiles[i].box, 0);
+        REGION_UNION(pScreen, pBatch, pBatch, &tileRegion);
+        REGION_UNINIT(pScreen, &tileRegion);
+        pixels += (tiles[i].box.x2 - tiles[i].box.x1) *
+                  (tiles[i].box.y2 - tiles[i].box.y1);
+    }
+
+    free(tiles);
+}
+
+
 CARD32 alrCallback(OsTimerPtr timer, CARD32 time, pointer arg)
 {
     RegionRec copyRegionSave, modifiedRegionSave, requestedRegionSave,
@@ -187,71 +270,149 @@ CARD32 alrCallback(OsTimerPtr timer, CARD32 time, pointer arg)
     rfbClientPtr cl = (rfbClientPtr)arg;
     int tightCompressLevelSave, tightQualityLevelSave, copyDXSave, copyDYSave,
         tightSubsampLevelSave;
-    RegionRec tmpRegion;
+    RegionRec tmpRegion, batchRegion;
+    CARD32 idleTime = (CARD32)(rfbAutoLosslessRefresh * 1000.0), interval = 0;
+    double inputIdleTime;
+    int spare, maxPixels, updatesSent;
+    Bool sent;
+
+    /* The client's regions are replaced while the refresh is sent, so any
+       pending changes must be distributed to them first. */
+    rfbFlushDamage(screenInfo.screens[0]);
+
+    /* After the first update, the whole lossy region is eligible. */
+    if (cl->firstUpdate) {
+        REGION_UNION(pScreen, &cl->alrRegion, &cl->alrRegion,
+                     &cl->lossyRegion);
+        cl->firstUpdate = FALSE;
+    }
+
+    /* Interactive updates take precedence, so wait for another idle period if
+       the framebuffer has changed or the user has resumed typing or moving
+       the pointer. */
+    if (REGION_NOTEMPTY(pScreen, &cl->modifiedRegion) ||
+        REGION_NOTEMPTY(pScreen, &cl->copyRegion)) {
+        cl->alrTimer = TimerSet(cl->alrTimer, 0, idleTime, alrCallback, cl);
+        return 0;
+    }
+    inputIdleTime = (gettime() - cl->lastInputTime) * 1000.;
+    if (inputIdleTime < (double)idleTime) {
+        cl->alrTimer = TimerSet(cl->alrTimer, 0,
+                                idleTime - (CARD32)inputIdleTime + 1,
+                                alrCallback, cl);
+        return 0;
+    }
 
     REGION_INIT(pScreen, &tmpRegion, NullBox, 0);
-    if (putImageOnly && !cl->firstUpdate)
+    if (putImageOnly)
         REGION_INTERSECT(pScreen, &tmpRegion, &cl->alrRegion,
                          &cl->lossyRegion);
     else
         REGION_COPY(pScreen, &tmpRegion, &cl->lossyRegion);
-    if (cl->firstUpdate) cl->firstUpdate = FALSE;
-
-    if (REGION_NOTEMPTY(pScreen, &tmpRegion)) {
-
-        tightCompressLevelSave = cl->tightCompressLevel;
-        tightQualityLevelSave = cl->tightQualityLevel;
-        tightSubsampLevelSave = cl->tightSubsampLevel;
-        copyDXSave = cl->copyDX;
-        copyDYSave = cl->copyDY;
-        REGION_INIT(pScreen, &copyRegionSave, NullBox, 0);
-        REGION_COPY(pScreen, &copyRegionSave, &cl->copyRegion);
-        REGION_INIT(pScreen, &modifiedRegionSave, NullBox, 0);
-        REGION_COPY(pScreen, &modifiedRegionSave, &cl->modifiedRegion);
-        REGION_INIT(pScreen, &requestedRegionSave, NullBox, 0);
-        REGION_COPY(pScreen, &requestedRegionSave, &cl->requestedRegion);
-        REGION_INIT(pScreen, &ifRegionSave, NullBox, 0);
-        REGION_COPY(pScreen, &ifRegionSave, &cl->ifRegion);
-
-        cl->tightCompressLevel = 1;
-        cl->tightQualityLevel = rfbALRQualityLevel;
-        cl->tightSubsampLevel = rfbALRSubsampLevel;
-        cl->copyDX = cl->copyDY = 0;
-        REGION_EMPTY(pScreen, &cl->copyRegion);
-        REGION_EMPTY(pScreen, &cl->modifiedRegion);
-        REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
-                     &tmpRegion);
-        REGION_EMPTY(pScreen, &cl->requestedRegion);
-        REGION_UNION(pScreen, &cl->requestedRegion, &cl->requestedRegion,
-                     &tmpRegion);
-        if (cl->compareFB) {
-            REGION_EMPTY(pScreen, &cl->ifRegion);
-            REGION_UNION(pScreen, &cl->ifRegion, &cl->ifRegion,
-                         &tmpRegion);
-        }
+    /* The H.264 streams carry the video region. */
+    if (cl->enableVideoRegion)
+        REGION_SUBTRACT(pScreen, &tmpRegion, &tmpRegion, &rfbVideoRegion);
 
-        if (!rfbSendFramebufferUpdate(cl)) return 0;
-
-        REGION_EMPTY(pScreen, &cl->lossyRegion);
+    if (!REGION_NOTEMPTY(pScreen, &tmpRegion)) {
         REGION_EMPTY(pScreen, &cl->alrRegion);
-        cl->tightCompressLevel = tightCompressLevelSave;
-        cl->tightQualityLevel = tightQualityLevelSave;
-        cl->tightSubsampLevel = tightSubsampLevelSave;
-        cl->copyDX = copyDXSave;
-        cl->copyDY = copyDYSave;
-        REGION_COPY(pScreen, &cl->copyRegion, &copyRegionSave);
-        REGION_COPY(pScreen, &cl->modifiedRegion, &modifiedRegionSave);
-        REGION_COPY(pScreen, &cl->requestedRegion, &requestedRegionSave);
+        REGION_UNINIT(pScreen, &tmpRegion);
+        return 0;
+    }
+
+    /* Use only the bandwidth that interactive updates aren't using. */
+    spare = rfbCongestionControl ? rfbCongestionWindowSpare(cl) : -1;
+    if (spare == 0 || rfbSendQueueBusy(cl)) {
+        cl->alrTimer = TimerSet(cl->alrTimer, 0, ALR_RETRY_INTERVAL,
+                                alrCallback, cl);
+        REGION_UNINIT(pScreen, &tmpRegion);
+        return 0;
+    }
+    /* Lossless Tight encoding with compression level 1 generally produces
+       less than 1 byte per pixel. */
+    if (spare < 0)
+        maxPixels = ALR_BATCH_PIXELS;
+    else
+        maxPixels = min(max(spare, ALR_MIN_PIXELS), ALR_MAX_PIXELS);
+
+    REGION_INIT(pScreen, &batchRegion, NullBox, 0);
+    SelectALRBatch(&tmpRegion, maxPixels, &batchRegion);
+
+    tightCompressLevelSave = cl->tightCompressLevel;
+    tightQualityLevelSave = cl->tightQualityLevel;
+    tightSubsampLevelSave = cl->tightSubsampLevel;
+    copyDXSave = cl->copyDX;
+    copyDYSave = cl->copyDY;
+    REGION_INIT(pScreen, &copyRegionSave, NullBox, 0);
+    REGION_COPY(pScreen, &copyRegionSave, &cl->copyRegion);
+    REGION_INIT(pScreen, &modifiedRegionSave, NullBox, 0);
+    REGION_COPY(pScreen, &modifiedRegionSave, &cl->modifiedRegion);
+    REGION_INIT(pScreen, &requestedRegionSave, NullBox, 0);
+    REGION_COPY(pScreen, &requestedRegionSave, &cl->requestedRegion);
+    REGION_INIT(pScreen, &ifRegionSave, NullBox, 0);
+    REGION_COPY(pScreen, &ifRegionSave, &cl->ifRegion);
+
+    cl->tightCompressLevel = 1;
+    cl->tightQualityLevel = rfbALRQualityLevel;
+    cl->tightSubsampLevel = rfbALRSubsampLevel;
+    cl->copyDX = cl->copyDY = 0;
+    REGION_EMPTY(pScreen, &cl->copyRegion);
+    REGION_COPY(pScreen, &cl->modifiedRegion, &batchRegion);
+    REGION_COPY(pScreen, &cl->requestedRegion, &batchRegion);
+    if (cl->compareFB)
+        REGION_COPY(pScreen, &cl->ifRegion, &batchRegion);
+
+    /* rfbSendFramebufferUpdate() can return TRUE without sending anything (if
+       a fence is pending, for instance), in which case the batch must remain
+       in the lossy region. */
+    updatesSent = cl->rfbFramebufferUpdateMessagesSent;
+    if (!rfbSendFramebufferUpdate(cl)) {
+        /* The client is gone. */
         REGION_UNINIT(pScreen, &copyRegionSave);
         REGION_UNINIT(pScreen, &modifiedRegionSave);
         REGION_UNINIT(pScreen, &requestedRegionSave);
-        if (cl->compareFB) {
-            REGION_COPY(pScreen, &cl->ifRegion, &ifRegionSave);
-            REGION_UNINIT(pScreen, &ifRegionSave);
-        }
-    }
-
+        REGION_UNINIT(pScreen, &ifRegionSave);
+        REGION_UNINIT(pScreen, &batchRegion);
+        REGION_UNINIT(pScreen, &tmpRegion);
+        return 0;
+    }
+    sent = cl->rfbFramebufferUpdateMessagesSent != updatesSent;
+
+    if (sent) {
+        REGION_SUBTRACT(pScreen, &cl->lossyRegion, &cl->lossyRegion,
+                        &batchRegion);
+        REGION_SUBTRACT(pScreen, &cl->alrRegion, &cl->alrRegion,
+                        &batchRegion);
+        REGION_SUBTRACT(pScreen, &tmpRegion, &tmpRegion, &batchRegion);
+        if (REGION_NOTEMPTY(pScreen, &tmpRegion))
+            interval = ALR_BATCH_INTERVAL;
+        else
+            REGION_EMPTY(pScreen, &cl->alrRegion);
+    } else
+        interval = ALR_RETRY_INTERVAL;
+
+    cl->tightCompressLevel = tightCompressLevelSave;
+    cl->tightQualityLevel = tightQualityLevelSave;
+    cl->tightSubsampLevel = tightSubsampLevelSave;
+    cl->copyDX = copyDXSave;
+    cl->copyDY = copyDYSave;
+    REGION_COPY(pScreen, &cl->copyRegion, &copyRegionSave);
+    REGION_COPY(pScreen, &cl->modifiedRegion, &modifiedRegionSave);
+    REGION_COPY(pScreen, &cl->requestedRegion, &requestedRegionSave);
+    REGION_UNINIT(pScreen, &copyRegionSave);
+    REGION_UNINIT(pScreen, &modifiedRegionSave);
+    REGION_UNINIT(pScreen, &requestedRegionSave);
+    if (cl->compareFB)
+        REGION_COPY(pScreen, &cl->ifRegion, &ifRegionSave);
+    REGION_UNINIT(pScreen, &ifRegionSave);
+
+    REGION_UNINIT(pScreen, &batchRegion);
     REGION_UNINIT(pScreen, &tmpRegion);
+
+    /* rfbSendFramebufferUpdate() may have restarted the idle timer. */
+    if (interval)
+        cl->alrTimer = TimerSet(cl->alrTimer, 0, interval, alrCallback, cl);
+    else
+        TimerCancel(cl->alrTimer);
     return 0;
 }
 
@@ -367,6 +528,50 @@ rfbClientPtr rfbReverseConnection(char *host, int port, int id)
 }
 
 
+/*
+ * rfbGetNumThreads determines the number of encoding threads from the -nomt
+ * and -nthreads options and the TVNC_MT and TVNC_NTHREADS environment
+ * variables.  The same number of threads is used for rendering, so the
+ * options and environment variables are only parsed once.
+ */
+
+int rfbGetNumThreads(void)
+{
+    static Bool initialized = FALSE;
+    int np = sysconf(_SC_NPROCESSORS_CONF);
+    char *env;
+
+    if (initialized)
+        return rfbNumThreads;
+    initialized = TRUE;
+
+    if ((env = getenv("TVNC_MT")) != NULL && !strcmp(env, "0"))
+        rfbMT = FALSE;
+
+    if ((env = getenv("TVNC_NTHREADS")) != NULL && strlen(env) >= 1) {
+        int temp = atoi(env);
+        if (temp >= 1 && temp <= MAX_ENCODING_THREADS)
+            rfbNumThreads = temp;
+        else
+            rfbLog("WARNING: Invalid value of TVNC_NTHREADS (%s) ignored\n",
+                   env);
+    }
+
+    if (np == -1 && rfbMT) {
+        rfbLog("WARNING: Could not determine CPU count.  Multithreaded encoding disabled.\n");
+        rfbMT = FALSE;
+    }
+    if (!rfbMT) rfbNumThreads = 1;
+    else if (rfbNumThreads < 1) rfbNumThreads = min(np, 4);
+    if (rfbNumThreads > np) {
+        rfbLog("NOTICE: Encoding thread count has been clamped to CPU count\n");
+        rfbNumThreads = np;
+    }
+
+    return rfbNumThreads;
+}
+
+
 /*
  * rfbNewClient is called when a new connection has been made by whatever
  * means.
@@ -381,7 +586,6 @@ static rfbClientPtr rfbNewClient(int sock)
     socklen_t addrlen = sizeof(struct sockaddr_storage);
     char addrStr[INET6_ADDRSTRLEN];
     char *env = NULL;
-    int np = sysconf(_SC_NPROCESSORS_CONF);
 
     if (rfbClientHead == NULL) {
         /* no other clients - make sure we don't think any keys are pressed */
@@ -427,6 +631,8 @@ static rfbClientPtr rfbNewClient(int sock)
     REGION_INIT(pScreen, &cl->requestedRegion, NullBox, 0);
 
     cl->deferredUpdateStart = gettime();
+    cl->deferUpdateTime = (double)rfbDeferUpdateTime;
+    cl->burstTime = cl->drawInterval = cl->sendTime = -1.;
 
     cl->format = rfbServerFormat;
     cl->translateFn = rfbTranslateNone;
@@ -436,6 +642,11 @@ static rfbClientPtr rfbNewClient(int sock)
     cl->tightQualityLevel = -1;
     cl->imageQualityLevel = -1;
 
+    /* The new client's modified region already covers the whole screen, so
+       the pending changes belong only to the existing clients.  This also
+       registers the Damage object on the screen pixmap. */
+    rfbFlushDamage(screenInfo.screens[0]);
+
     cl->next = rfbClientHead;
     cl->prev = NULL;
     if (rfbClientHead)
@@ -488,28 +699,7 @@ static rfbClientPtr rfbNewClient(int sock)
         REGION_INIT(pScreen, &cl->alrEligibleRegion, NullBox, 0);
     }
 
-    if ((env = getenv("TVNC_MT")) != NULL && !strcmp(env, "0"))
-        rfbMT = FALSE;
-
-    if ((env = getenv("TVNC_NTHREADS")) != NULL && strlen(env) >= 1) {
-        int temp = atoi(env);
-        if (temp >= 1 && temp <= MAX_ENCODING_THREADS)
-            rfbNumThreads = temp;
-        else
-            rfbLog("WARNING: Invalid value of TVNC_NTHREADS (%s) ignored\n",
-                   env);
-    }
-
-    if (np == -1 && rfbMT) {
-        rfbLog("WARNING: Could not determine CPU count.  Multithreaded encoding disabled.\n");
-        rfbMT = FALSE;
-    }
-    if (!rfbMT) rfbNumThreads = 1;
-    else if (rfbNumThreads < 1) rfbNumThreads = min(np, 4);
-    if (rfbNumThreads > np) {
-        rfbLog("NOTICE: Encoding thread count has been clamped to CPU count\n");
-        rfbNumThreads = np;
-    }
+    rfbGetNumThreads();
 
     if (rfbIdleTimeout > 0)
         IdleTimerCancel();
@@ -620,7 +810,7 @@ void rfbProcessClientMessage(rfbClientPtr cl)
 {
     rfbClientPtr cl2;
 
-    rfbCorkSock(cl->sock);
+    rfbCorkClient(cl);
 
     if (cl->pendingSyncFence) {
       cl->syncFence = TRUE;
@@ -668,7 +858,7 @@ void rfbProcessClientMessage(rfbClientPtr cl)
       cl->syncFence = FALSE;
     }
 
-    rfbUncorkSock(cl->sock);
+    rfbUncorkClient(cl);
 }
 
 
@@ -774,6 +964,7 @@ static void rfbProcessClientInitMessage(rfbClientPtr cl)
 
     /* Dispatch client input to rfbProcessClientNormalMessage(). */
     cl->state = RFB_NORMAL;
+    rfbStartSender(cl);
 
     if (!cl->reverseConnection &&
         (rfbNeverShared || (!rfbAlwaysShared && !ci.shared))) {
@@ -810,12 +1001,13 @@ static void rfbProcessClientInitMessage(rfbClientPtr cl)
 
 /* Update these constants on changing capability lists below! */
 #define N_SMSG_CAPS  0
-#define N_CMSG_CAPS  0
-#define N_ENC_CAPS  17
+#define N_CMSG_CAPS  1
+#define N_ENC_CAPS  19
 
 void rfbSendInteractionCaps(rfbClientPtr cl)
 {
     rfbInteractionCapsMsg intr_caps;
+    rfbCapabilityInfo cmsg_list[N_CMSG_CAPS];
     rfbCapabilityInfo enc_list[N_ENC_CAPS];
     int i;
 
@@ -841,19 +1033,20 @@ void rfbSendInteractionCaps(rfbClientPtr cl)
 
     /* Supported client->server message types. */
     /* For future file transfer support:
-    i = 0;
     SetCapInfo(&cmsg_list[i++], rfbFileListRequest,        rfbTightVncVendor);
     SetCapInfo(&cmsg_list[i++], rfbFileDownloadRequest,    rfbTightVncVendor);
     SetCapInfo(&cmsg_list[i++], rfbFileUploadRequest,      rfbTightVncVendor);
     SetCapInfo(&cmsg_list[i++], rfbFileUploadData,         rfbTightVncVendor);
     SetCapInfo(&cmsg_list[i++], rfbFileDownloadCancel,     rfbTightVncVendor);
     SetCapInfo(&cmsg_list[i++], rfbFileUploadFailed,       rfbTightVncVendor);
+    */
+    i = 0;
+    SetCapInfo(&cmsg_list[i++], rfbRequestKeyframe,        rfbTurboVncVendor);
     if (i != N_CMSG_CAPS) {
         rfbLog("rfbSendInteractionCaps: assertion failed, i != N_CMSG_CAPS\n");
         rfbCloseClient(cl);
         return;
     }
-    */
 
     /* Encoding types. */
     i = 0;
@@ -872,6 +1065,8 @@ void rfbSendInteractionCaps(rfbClientPtr cl)
     SetCapInfo(&enc_list[i++],  rfbEncodingXCursor,        rfbTightVncVendor);
     SetCapInfo(&enc_list[i++],  rfbEncodingRichCursor,     rfbTightVncVendor);
     SetCapInfo(&enc_list[i++],  rfbEncodingPointerPos,     rfbTightVncVendor);
+    SetCapInfo(&enc_list[i++],  rfbEncodingCursorCache,    rfbTurboVncVendor);
+    SetCapInfo(&enc_list[i++],  rfbEncodingVideoRegion,    rfbTurboVncVendor);
     SetCapInfo(&enc_list[i++],  rfbEncodingLastRect,       rfbTightVncVendor);
     SetCapInfo(&enc_list[i++],  rfbGIIServer,              rfbGIIVendor);
     if (i != N_ENC_CAPS) {
@@ -883,6 +1078,8 @@ void rfbSendInteractionCaps(rfbClientPtr cl)
     /* Send header and capability lists */
     if (WriteExact(cl, (char *)&intr_caps,
                    sz_rfbInteractionCapsMsg) < 0 ||
+        WriteExact(cl, (char *)&cmsg_list[0],
+                   sz_rfbCapabilityInfo * N_CMSG_CAPS) < 0 ||
         WriteExact(cl, (char *)&enc_list[0],
                    sz_rfbCapabilityInfo * N_ENC_CAPS) < 0) {
         rfbLogPerror("rfbSendInteractionCaps: write");
@@ -892,6 +1089,7 @@ void rfbSendInteractionCaps(rfbClientPtr cl)
 
     /* Dispatch client input to rfbProcessClientNormalMessage(). */
     cl->state = RFB_NORMAL;
+    rfbStartSender(cl);
 }
 
 
@@ -944,6 +1142,7 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
         cl->readyForSetColourMapEntries = TRUE;
 
         rfbSetTranslateFunction(cl);
+        rfbResetCursorCache(cl);
         return;
 
 
@@ -972,6 +1171,9 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
         cl->useCopyRect = FALSE;
         cl->enableCursorShapeUpdates = FALSE;
         cl->enableCursorPosUpdates = FALSE;
+        cl->enableCursorCache = FALSE;
+        rfbResetCursorCache(cl);
+        cl->enableVideoRegion = FALSE;
         cl->enableLastRectEncoding = FALSE;
         cl->tightCompressLevel = TIGHT_DEFAULT_COMPRESSION;
         cl->tightSubsampLevel = TIGHT_DEFAULT_SUBSAMP;
@@ -1071,6 +1273,21 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
                     cl->cursorY = -1;
                 }
                 break;
+            case rfbEncodingCursorCache:
+                if (!cl->enableCursorCache) {
+                    rfbLog("Enabling cursor shape cache for client %s\n",
+                           cl->host);
+                    cl->enableCursorCache = TRUE;
+                }
+                break;
+            case rfbEncodingVideoRegion:
+                if (rfbHybrid && !cl->enableVideoRegion) {
+                    rfbLog("Enabling hybrid H.264/RFB mode for client %s\n",
+                           cl->host);
+                    cl->enableVideoRegion = TRUE;
+                    rfbHybridStart(cl);
+                }
+                break;
             case rfbEncodingLastRect:
                 if (!cl->enableLastRectEncoding) {
                     rfbLog("Enabling LastRect protocol extension for client "
@@ -1181,6 +1398,11 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
             cl->enableCursorPosUpdates = FALSE;
         }
 
+        if (cl->enableCursorCache && !cl->enableCursorShapeUpdates) {
+            rfbLog("Disabling cursor shape cache for client %s\n", cl->host);
+            cl->enableCursorCache = FALSE;
+        }
+
         if (cl->enableFence && firstFence)
             rfbSendFence(cl, rfbFenceFlagRequest, 0, NULL);
 
@@ -1247,7 +1469,8 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
 
         if (FB_UPDATE_PENDING(cl) &&
             (!cl->deferredUpdateScheduled || rfbDeferUpdateTime == 0 ||
-             gettime() - cl->deferredUpdateStart >= (double)rfbDeferUpdateTime)) {
+             (gettime() - cl->deferredUpdateStart) * 1000. >=
+             cl->deferUpdateTime)) {
             rfbSendFramebufferUpdate(cl);
             cl->deferredUpdateScheduled = FALSE;
         }
@@ -1279,6 +1502,8 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
               timeTracker[timeheader].array[1] = (t2_microTime - t1_microTime) < 0 ? 0 : (t2_microTime - t1_microTime);//ntp
               timeTracker[timeheader].array[2] = (long long)gettime_nanoTime();//input recv
             #endif
+            cl->lastInputTime = gettime();
+            cl->inputPending = TRUE;
             KeyEvent((KeySym)Swap32IfLE(msg.ke.key), msg.ke.down);
         }
         return;
@@ -1318,6 +1543,8 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
             #endif
             cl->cursorX = (int)Swap16IfLE(msg.pe.x);
             cl->cursorY = (int)Swap16IfLE(msg.pe.y);
+            cl->lastInputTime = gettime();
+            cl->inputPending = TRUE;
             PtrAddEvent(msg.pe.buttonMask, cl->cursorX, cl->cursorY, cl);
             //fprintf(stderr,"Pointer Events: x: %d, y: %d\n", cl->cursorX, cl->cursorY);
         }
@@ -1404,6 +1631,29 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
         return;
     }
 
+    case rfbRequestKeyframe:
+    {
+        static CARD32 lastLogTime = 0;
+        CARD32 id, now;
+
+        READ(((char *)&msg) + 1, sz_rfbRequestKeyframeMsg - 1)
+
+        /* A viewer on a lossy network may request keyframes frequently, so
+           log at most one request every 10 seconds. */
+        id = Swap32IfLE(msg.rk.id);
+        now = GetTimeInMillis();
+        if (lastLogTime == 0 || now - lastLogTime >= 10000) {
+            if (id == rfbKeyframeAllOutputs)
+                rfbLog("Client requested a keyframe on all video streams\n");
+            else
+                rfbLog("Client requested a keyframe on the video stream for output %u\n",
+                       (unsigned int)id);
+            lastLogTime = now;
+        }
+        ShmRequestKeyframe(id);
+        return;
+    }
+
     case rfbFence:
     {
         CARD32 flags;
@@ -1872,7 +2122,9 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     int dx, dy;
     Bool sendCursorShape = FALSE;
     Bool sendCursorPos = FALSE;
-    double tUpdateStart = 0.0;
+    Bool sendVideoRegion = FALSE;
+    double tUpdateStart = 0.0, tMetricsStart = 0.0;
+    long long bytesStart = 0;
 
     TimerCancel(cl->updateTimer);
 
@@ -1886,6 +2138,9 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
 
     if (cl->state != RFB_NORMAL) return TRUE;
 
+    /* Distribute the changes that have been drawn since the last update. */
+    rfbFlushDamage(pScreen);
+
     if (rfbProfile) {
         tUpdateStart = gettime();
         if (tStart < 0.) tStart = tUpdateStart;
@@ -1894,7 +2149,9 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     /* Check that we actually have some space on the link and retry in a
        bit if things are congested. */
 
-    if (rfbCongestionControl && rfbIsCongested(cl)) {
+    if ((rfbCongestionControl && rfbIsCongested(cl)) ||
+        rfbSendQueueBusy(cl)) {
+        cl->rfbUpdatesDeferred++;
         cl->updateTimer = TimerSet(cl->updateTimer, 0, 50, updateCallback, cl);
         return TRUE;
     }
@@ -1903,17 +2160,19 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
        messages.  We need to aggregate these in order to not clog up TCP's
        congestion window. */
 
-    rfbCorkSock(cl->sock);
+    rfbCorkClient(cl);
 
     if (cl->pendingDesktopResize) {
         if (!rfbSendDesktopSize(cl)) return FALSE;
         cl->pendingDesktopResize = FALSE;
     }
 
-    // Block Updates ALTER
-    rfbFB.blockUpdates = TRUE;
-    if (rfbFB.blockUpdates) {
-        rfbUncorkSock(cl->sock);
+    /* The H.264/RTSP streams carry the framebuffer, so RFB updates are
+       blocked unless the client composites the streams with RFB updates
+       (hybrid mode) or the streams are disabled.  The changes remain in the
+       client's regions. */
+    if (!cl->enableVideoRegion && ShmEncodingEnabled()) {
+        rfbUncorkClient(cl);
         return TRUE;
     }
 
@@ -1966,8 +2225,11 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     REGION_INTERSECT(pScreen, updateRegion, &cl->requestedRegion,
                      updateRegion);
 
+    if (cl->pendingVideoRegion)
+        sendVideoRegion = TRUE;
+
     if (!REGION_NOTEMPTY(pScreen, updateRegion) &&
-        !sendCursorShape && !sendCursorPos) {
+        !sendCursorShape && !sendCursorPos && !sendVideoRegion) {
         REGION_UNINIT(pScreen, updateRegion);
         return TRUE;
     }
@@ -2017,6 +2279,18 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     cl->copyDX = 0;
     cl->copyDY = 0;
 
+    /* The H.264 streams carry the video region, so leave it out of the RFB
+       update. */
+    rfbHybridClipUpdate(cl, updateRegion, &updateCopyRegion, dx, dy);
+    if (!REGION_NOTEMPTY(pScreen, updateRegion) &&
+        !REGION_NOTEMPTY(pScreen, &updateCopyRegion) &&
+        !sendCursorShape && !sendCursorPos && !sendVideoRegion) {
+        REGION_UNINIT(pScreen, updateRegion);
+        REGION_UNINIT(pScreen, &updateCopyRegion);
+        rfbUncorkClient(cl);
+        return TRUE;
+    }
+
     /*
      * Now send the update.
      */
@@ -2038,14 +2312,19 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     
     fu->sendL_uTime = Swap64IfLE(gettime_microTime());
 
-    if (REGION_NUM_RECTS(updateRegion) > rfbCombineRect) {
-        RegionRec combinedUpdateRegion;
-        REGION_INIT(pScreen, &combinedUpdateRegion,
-                    REGION_EXTENTS(pScreen, updateRegion), 1);
-        REGION_UNINIT(pScreen, updateRegion);
-        REGION_INIT(pScreen, updateRegion,
-                    REGION_EXTENTS(pScreen, &combinedUpdateRegion), 1);
-        REGION_UNINIT(pScreen, &combinedUpdateRegion);
+    /* Merge rectangles where the pixels that a merge adds are cheaper to
+       encode than the rectangle that it saves, and send no more than
+       rfbCombineRect rectangles. */
+    rfbWriteDamageTrace(updateRegion);
+    if (REGION_NUM_RECTS(updateRegion) > 1) {
+        rfbCoalesceCost cost;
+
+        rfbGetCoalesceCost(cl->preferredEncoding, &cost);
+        if (!rfbCoalesceRegion(updateRegion, rfbCombineRect, &cost)) {
+            BoxRec extents = *REGION_EXTENTS(pScreen, updateRegion);
+
+            REGION_RESET(pScreen, updateRegion, &extents);
+        }
     }
 
     if (updateRegion->extents.x2 > pScreen->width ||
@@ -2056,6 +2335,17 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
                updateRegion->extents.y2 - updateRegion->extents.y1);
         ClipToScreen(pScreen, updateRegion);
     }
+
+    /* If the application redrew scrolled content rather than copying it, then
+       send the scrolled part of the update using CopyRect.  This has to happen
+       before the interframe comparison below modifies the comparison
+       buffer. */
+    if (cl->compareFB && !cl->firstCompare && rfbScrollDetect &&
+        !REGION_NOTEMPTY(pScreen, &updateCopyRegion) &&
+        rfbDetectScroll(cl, updateRegion, &updateCopyRegion, &dx, &dy))
+        REGION_SUBTRACT(pScreen, updateRegion, updateRegion,
+                        &updateCopyRegion);
+
     if (cl->compareFB) {
         updateRegion = &cl->ifRegion;
         if (rfbInterframeDebug)
@@ -2155,6 +2445,11 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
 
     cl->rfbFramebufferUpdateMessagesSent++;
 
+    if (rfbMetrics) {
+        tMetricsStart = gettime();
+        bytesStart = rfbTotalBytesSent(cl);
+    }
+
     if (cl->preferredEncoding == rfbEncodingCoRRE) {
         nUpdateRegionRects = 0;
 
@@ -2199,7 +2494,8 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     if (nUpdateRegionRects != 0xFFFF) {
         fu->nRects = Swap16IfLE(REGION_NUM_RECTS(&updateCopyRegion) +
                                 nUpdateRegionRects +
-                                !!sendCursorShape + !!sendCursorPos);
+                                !!sendCursorShape + !!sendCursorPos +
+                                !!sendVideoRegion);
     } else {
         fu->nRects = 0xFFFF;
     }
@@ -2221,6 +2517,11 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
             goto abort;
     }
 
+    if (sendVideoRegion) {
+        if (!rfbSendVideoRegion(cl))
+            goto abort;
+    }
+
     if (REGION_NOTEMPTY(pScreen, &updateCopyRegion)) {
         if (!rfbSendCopyRegion(cl, &updateCopyRegion, dx, dy))
             goto abort;
@@ -2313,6 +2614,10 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
 
     cl->captureEnable = FALSE;
 
+    if (rfbMetrics)
+        rfbMetricsRecordUpdate(cl, gettime() - tMetricsStart,
+                               rfbTotalBytesSent(cl) - bytesStart);
+
     if (!rfbSendRTTPing(cl))
         goto abort;
 
@@ -2352,7 +2657,7 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
             (CARD32)(rfbAutoLosslessRefresh * 1000.0), alrCallback, cl);
     }
 
-    rfbUncorkSock(cl->sock);
+    rfbUncorkClient(cl);
     return TRUE;
 
     abort:
@@ -241,6 +241,12 @@ int rfbssl_read(rfbClientPtr cl, char *buf, int bufsize)
 }
 
 
+Bool rfbssl_ktls_send(rfbClientPtr cl)
+{
+    return FALSE;
+}
+
+
 int rfbssl_pending(rfbClientPtr cl)
 {
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
@@ -46,6 +46,12 @@ static void rfbErr(const char *format, ...);
 #ifndef OPENSSL_INIT_LOAD_SSL_STRINGS
 #define OPENSSL_INIT_LOAD_SSL_STRINGS 0x00200000L
 #endif
+#ifndef SSL_OP_ENABLE_KTLS
+#define SSL_OP_ENABLE_KTLS ((uint64_t)1 << 3)
+#endif
+#ifndef BIO_CTRL_GET_KTLS_SEND
+#define BIO_CTRL_GET_KTLS_SEND 73
+#endif
 
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
 #define CONST const
@@ -67,6 +73,7 @@ typedef int (*DSA_generate_parameters_ex_type) (DSA *, int,
 typedef DSA *(*DSA_new_type) (void);
 typedef unsigned long (*ERR_get_error_type) (void);
 typedef char *(*ERR_error_string_type) (unsigned long, char *);
+typedef long (*BIO_ctrl_type) (BIO *, int, long, void *);
 
 struct rfbcrypto_functions {
     DH_free_type DH_free;
@@ -77,6 +84,7 @@ struct rfbcrypto_functions {
     DSA_new_type DSA_new;
     ERR_get_error_type ERR_get_error;
     ERR_error_string_type ERR_error_string;
+    BIO_ctrl_type BIO_ctrl;
 };
 
 static struct rfbcrypto_functions crypto = {
@@ -84,7 +92,7 @@ static struct rfbcrypto_functions crypto = {
     NULL
 #else
     DH_free, DH_generate_key, DSA_dup_DH, DSA_free, DSA_generate_parameters_ex,
-    DSA_new, ERR_get_error, ERR_error_string
+    DSA_new, ERR_get_error, ERR_error_string, BIO_ctrl
 #endif
 };
 
@@ -109,6 +117,8 @@ typedef int (*SSL_CTX_use_certificate_file_type) (SSL_CTX *, const char *,
                                                   int);
 typedef int (*SSL_CTX_use_PrivateKey_file_type) (SSL_CTX *, const char *, int);
 typedef CONST SSL_METHOD *(*SSLv23_server_method_type) (void);
+typedef BIO *(*SSL_get_wbio_type) (const SSL *);
+typedef uint64_t (*SSL_CTX_set_options_type) (SSL_CTX *, uint64_t);
 
 struct rfbssl_functions {
     SSL_accept_type SSL_accept;
@@ -131,6 +141,8 @@ struct rfbssl_functions {
     SSL_CTX_use_certificate_file_type SSL_CTX_use_certificate_file;
     SSL_CTX_use_PrivateKey_file_type SSL_CTX_use_PrivateKey_file;
     SSLv23_server_method_type SSLv23_server_method;
+    SSL_get_wbio_type SSL_get_wbio;
+    SSL_CTX_set_options_type SSL_CTX_set_options;
 };
 
 static struct rfbssl_functions ssl = {
@@ -153,9 +165,15 @@ static struct rfbssl_functions ssl = {
 #endif
     SSL_CTX_use_certificate_file, SSL_CTX_use_PrivateKey_file,
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
-    TLS_server_method
+    TLS_server_method,
 #else
-    SSLv23_server_method
+    SSLv23_server_method,
+#endif
+    SSL_get_wbio,
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_options
+#else
+    NULL
 #endif
 #endif
 };
@@ -245,6 +263,12 @@ static int loadFunctions(void)
         if (!ssl.SSLv23_server_method) {
             LOADSYM(ssl, SSLv23_server_method);
         }
+        LOADSYM(ssl, SSL_get_wbio);
+        /* OpenSSL 3.0 and later can offload TLS record encryption to the
+           kernel, and SSL_CTX_set_options() became a function in the same
+           version. */
+        if (ssl.OPENSSL_init_ssl)
+            LOADSYMOPT(ssl, SSL_CTX_set_options, "SSL_CTX_set_options");
         rfbLog("Successfully loaded symbols from %s\n", libName);
     }
 
@@ -285,6 +309,7 @@ static int loadFunctions(void)
         LOADSYM(crypto, DH_generate_key);
         LOADSYM(crypto, ERR_get_error);
         LOADSYM(crypto, ERR_error_string);
+        LOADSYM(crypto, BIO_ctrl);
         rfbLog("Successfully loaded symbols from %s\n", libName);
     }
 
@@ -299,8 +324,20 @@ static char errStr[BUFSIZE] = "No error";
 struct rfbssl_ctx {
     SSL_CTX *ssl_ctx;
     SSL     *ssl;
+    Bool    ktlsSend;  /* The kernel encrypts the records that we send. */
+    /* With kTLS, the client's sender thread writes to the socket while
+       SSL_read() on the main thread may write post-handshake records (such as
+       a TLS 1.3 KeyUpdate response) to it, so both hold this mutex. */
+    pthread_mutex_t writeMutex;
 };
 
+/* Allow OpenSSL to install the session keys in the kernel after the handshake
+   (kernel TLS), so that the kernel encrypts outgoing records and data can be
+   written to the socket directly.  If the kernel doesn't support kTLS (for
+   instance, because the tls module isn't loaded) or doesn't support the
+   negotiated cipher, then OpenSSL encrypts the records as usual. */
+static Bool rfbKTLS = TRUE;
+
 
 static void rfbErr(const char *format, ...)
 {
@@ -331,6 +368,7 @@ rfbSslCtx *rfbssl_init(rfbClientPtr cl, Bool anon)
 {
     char *keyfile;
     struct rfbssl_ctx *ctx = NULL;
+    char *env;
     DH *dh = NULL;
     DSA *dsa = NULL;
     int flags = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3;
@@ -340,6 +378,9 @@ rfbSslCtx *rfbssl_init(rfbClientPtr cl, Bool anon)
         return NULL;
 #endif
 
+    if ((env = getenv("TVNC_KTLS")) != NULL && !strcmp(env, "0"))
+        rfbKTLS = FALSE;
+
     if (ssl.OPENSSL_init_ssl)
         ssl.OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS |
                              OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
@@ -355,11 +396,14 @@ rfbSslCtx *rfbssl_init(rfbClientPtr cl, Bool anon)
     }
 
     ctx = rfbAlloc0(sizeof(struct rfbssl_ctx));
+    pthread_mutex_init(&ctx->writeMutex, NULL);
     if ((ctx->ssl_ctx = ssl.SSL_CTX_new(ssl.SSLv23_server_method())) == NULL) {
         rfbssl_error("SSL_CTX_new()");
         goto bailout;
     }
     ssl.SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_OPTIONS, flags, NULL);
+    if (rfbKTLS && ssl.SSL_CTX_set_options)
+        ssl.SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_ENABLE_KTLS);
     if (anon) {
         if ((dsa = crypto.DSA_new()) == NULL) {
             rfbssl_error("DSA_new()");
@@ -428,6 +472,7 @@ rfbSslCtx *rfbssl_init(rfbClientPtr cl, Bool anon)
             ssl.SSL_free(ctx->ssl);
         if (ctx->ssl_ctx)
             ssl.SSL_CTX_free(ctx->ssl_ctx);
+        pthread_mutex_destroy(&ctx->writeMutex);
         free(ctx);
     }
     return NULL;
@@ -455,6 +500,18 @@ int rfbssl_accept(rfbClientPtr cl)
         return -1;
     }
 
+    if (rfbKTLS) {
+        BIO *wbio = ssl.SSL_get_wbio(ctx->ssl);
+
+        ctx->ktlsSend =
+            wbio && crypto.BIO_ctrl(wbio, BIO_CTRL_GET_KTLS_SEND, 0, NULL) > 0;
+        if (ctx->ktlsSend)
+            rfbLog("Using kernel TLS offload for client %s\n", cl->host);
+        else
+            rfbLog("Kernel TLS offload not available for client %s\n",
+                   cl->host);
+    }
+
     return 0;
 }
 
@@ -469,6 +526,16 @@ int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
         return -1;
 #endif
 
+    /* The kernel owns the send state of the TLS session, so the data can be
+       written without going through OpenSSL.  This also means that
+       EWOULDBLOCK is handled by the caller rather than by spinning here. */
+    if (ctx->ktlsSend) {
+        pthread_mutex_lock(&ctx->writeMutex);
+        ret = write(cl->sock, buf, bufsize);
+        pthread_mutex_unlock(&ctx->writeMutex);
+        return ret;
+    }
+
     while ((ret = ssl.SSL_write(ctx->ssl, buf, bufsize)) <= 0) {
         if (ssl.SSL_get_error(ctx->ssl, ret) != SSL_ERROR_WANT_WRITE)
             break;
@@ -488,8 +555,13 @@ int rfbssl_read(rfbClientPtr cl, char *buf, int bufsize)
         return -1;
 #endif
 
-    while ((ret = ssl.SSL_read(ctx->ssl, buf, bufsize)) <= 0) {
-        if (ssl.SSL_get_error(ctx->ssl, ret) != SSL_ERROR_WANT_READ)
+    for (;;) {
+        if (ctx->ktlsSend)
+            pthread_mutex_lock(&ctx->writeMutex);
+        ret = ssl.SSL_read(ctx->ssl, buf, bufsize);
+        if (ctx->ktlsSend)
+            pthread_mutex_unlock(&ctx->writeMutex);
+        if (ret > 0 || ssl.SSL_get_error(ctx->ssl, ret) != SSL_ERROR_WANT_READ)
             break;
     }
 
@@ -497,6 +569,14 @@ int rfbssl_read(rfbClientPtr cl, char *buf, int bufsize)
 }
 
 
+Bool rfbssl_ktls_send(rfbClientPtr cl)
+{
+    struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
+
+    return ctx && ctx->ktlsSend;
+}
+
+
 int rfbssl_pending(rfbClientPtr cl)
 {
     struct rfbssl_ctx *ctx = (struct rfbssl_ctx *)cl->sslctx;
@@ -523,6 +603,7 @@ void rfbssl_destroy(rfbClientPtr cl)
     if (ctx->ssl_ctx)
         ssl.SSL_CTX_free(ctx->ssl_ctx);
 
+    pthread_mutex_destroy(&ctx->writeMutex);
     free(ctx);
 }
 
@@ -0,0 +1,292 @@
+/*
+ * roi.c - tell the video encoders which parts of the screen deserve more bits
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * The H.264 encoders use constant bit rate rate control, so without any hints,
+ * they spread the bits evenly over the frame.  Before each frame is encoded,
+ * Xext/shm.c calls ShmRoiCallback, and we answer with a list of regions of
+ * interest (ROIs):
+ *
+ * - the area around the pointer, where the user is most likely looking,
+ * - the parts of the screen that changed since the last captured frame, and
+ * - within those, 16x16 blocks that look like text or other synthetic content
+ *   (many sharp edges between runs of identical pixels), which suffers the
+ *   most from quantization.
+ *
+ * The ROIs are attached to each frame as AVRegionOfInterest side data, which
+ * encoders such as libx264 turn into a quantizer offset map, so at the same
+ * bit rate, they take bits from the static parts of the screen and give them
+ * to text and UI elements.  h264_nvenc ignores the side data, so unless
+ * ShmEncoderSupportsRois() says otherwise, none of this is enabled.  The ROIs
+ * are only computed for frames that are actually encoded.  Changes are
+ * tracked using a Damage object on the screen pixmap, which is emptied each
+ * time the encoders capture a frame (ShmCaptureCallback.)
+ *
+ * While a hybrid client is connected (see hybrid.c), the client displays RFB
+ * updates everywhere except the video region, so the encoders are told to
+ * spend as few bits as possible outside of the video region instead.
+ */
+
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "rfb.h"
+#include "inputstr.h"
+#include "damage.h"
+#include "shmint.h"
+
+
+Bool rfbRoi = TRUE;
+
+#define BLOCK_SIZE      16
+#define CURSOR_SIZE     128   /* Width and height of the pointer ROI */
+#define MAX_TEXT_AREA   (3840 * 2160)  /* Don't scan larger damage areas */
+
+#define QOFFSET_CURSOR   -30
+#define QOFFSET_DAMAGE   -10
+#define QOFFSET_HIDDEN   100
+#define QOFFSET_TEXT     -40
+#define QOFFSET_VIDEO    0
+
+#define EDGE_THRESHOLD   64   /* Luma difference that counts as a sharp edge */
+
+static DamagePtr roiDamage = NULL;
+static PixmapPtr roiPixmap = NULL;
+
+
+static void AddRoi(ShmRoiInfoPtr info, BoxPtr box, int qoffset)
+{
+    if (info->nRois >= SHM_MAX_ROIS || box->x2 <= box->x1 ||
+        box->y2 <= box->y1)
+        return;
+    info->rois[info->nRois].box = *box;
+    info->rois[info->nRois].qoffset = qoffset;
+    info->nRois++;
+}
+
+
+/* Add the rectangles of a region as ROIs, or its extents if there are too
+   many rectangles to fit. */
+
+static void AddRegionRois(ShmRoiInfoPtr info, RegionPtr region, int qoffset,
+                          int reserve)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    BoxPtr boxes = REGION_RECTS(region);
+    int i, n = REGION_NUM_RECTS(region);
+
+    if (n == 0)
+        return;
+    if (n > SHM_MAX_ROIS - info->nRois - reserve) {
+        AddRoi(info, REGION_EXTENTS(pScreen, region), qoffset);
+        return;
+    }
+    for (i = 0; i < n; i++)
+        AddRoi(info, &boxes[i], qoffset);
+}
+
+
+static inline int Luma(CARD32 pix)
+{
+    return ((pix >> rfbServerFormat.redShift & 0xFF) * 2 +
+            (pix >> rfbServerFormat.greenShift & 0xFF) * 5 +
+            (pix >> rfbServerFormat.blueShift & 0xFF)) >> 3;
+}
+
+
+/* Returns TRUE if the block looks like text or other synthetic content:
+   many sharp edges, with most of the remaining pixels identical to their
+   neighbors.  Photographic content and video rarely have runs of identical
+   pixels, and flat areas have no edges.  Every other row is sampled. */
+
+static Bool IsTextBlock(int x, int y, int w, int h)
+{
+    int pitch = rfbFB.paddedWidthInBytes, i, j, edges = 0, flat = 0,
+        samples = 0;
+
+    for (j = 0; j < h; j += 2) {
+        CARD32 *row = (CARD32 *)&rfbFB.pfbMemory[(y + j) * pitch + x * 4];
+
+        for (i = 1; i < w; i++) {
+            if (row[i] == row[i - 1])
+                flat++;
+            else if (abs(Luma(row[i]) - Luma(row[i - 1])) > EDGE_THRESHOLD)
+                edges++;
+        }
+        samples += w - 1;
+    }
+
+    return edges >= samples / 16 && flat >= samples / 2;
+}
+
+
+/* Find the text blocks within the damaged region, and merge them into
+   textRegion. */
+
+static void FindText(RegionPtr damage, RegionPtr textRegion)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    BoxPtr boxes = REGION_RECTS(damage);
+    int i, n = REGION_NUM_RECTS(damage);
+    long area = 0;
+
+    for (i = 0; i < n; i++)
+        area += (long)(boxes[i].x2 - boxes[i].x1) *
+                (boxes[i].y2 - boxes[i].y1);
+    if (area > MAX_TEXT_AREA)
+        return;
+
+    for (i = 0; i < n; i++) {
+        int x, y, x1 = max(boxes[i].x1, 0), y1 = max(boxes[i].y1, 0);
+        int x2 = min(boxes[i].x2, rfbFB.width);
+        int y2 = min(boxes[i].y2, rfbFB.height);
+
+        /* Merge horizontal runs of text blocks before adding them to the
+           region, so that pixman has less to do.  The last iteration of the
+           inner loop starts at or past x2, so that it ends any open run even
+           if the width isn't a multiple of the block size. */
+        for (y = y1; y < y2; y += BLOCK_SIZE) {
+            int h = min(BLOCK_SIZE, y2 - y), runStart = -1;
+
+            for (x = x1; x < x2 + BLOCK_SIZE; x += BLOCK_SIZE) {
+                Bool text = x < x2 &&
+                            IsTextBlock(x, y, min(BLOCK_SIZE, x2 - x), h);
+
+                if (text && runStart < 0)
+                    runStart = x;
+                else if (!text && runStart >= 0) {
+                    BoxRec run;
+                    RegionRec tmpRegion;
+
+                    run.x1 = runStart;  run.y1 = y;
+                    run.x2 = min(x, x2);  run.y2 = y + h;
+                    REGION_INIT(pScreen, &tmpRegion, &run, 1);
+                    REGION_UNION(pScreen, textRegion, textRegion, &tmpRegion);
+                    REGION_UNINIT(pScreen, &tmpRegion);
+                    runStart = -1;
+                }
+            }
+        }
+    }
+}
+
+
+static void rfbRoiCallback(CallbackListPtr *list, void *closure, void *data)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    ShmRoiInfoPtr info = (ShmRoiInfoPtr)data;
+    PixmapPtr pPixmap = (*pScreen->GetScreenPixmap) (pScreen);
+    RegionPtr damage;
+    RegionRec textRegion, otherRegion;
+    BoxRec cursorBox;
+    int x, y;
+
+    /* The screen pixmap is replaced when the screen is resized. */
+    if (pPixmap != roiPixmap) {
+        if (roiPixmap)
+            DamageUnregister(roiDamage);
+        roiPixmap = pPixmap;
+        if (roiPixmap)
+            DamageRegister(&roiPixmap->drawable, roiDamage);
+    }
+
+    if (rfbHybridActive()) {
+        BoxRec screenBox;
+
+        screenBox.x1 = screenBox.y1 = 0;
+        screenBox.x2 = rfbFB.width;  screenBox.y2 = rfbFB.height;
+        AddRegionRois(info, &rfbVideoRegion, QOFFSET_VIDEO, 1);
+        AddRoi(info, &screenBox, QOFFSET_HIDDEN);
+        return;
+    }
+
+    cursorBox.x1 = cursorBox.y1 = cursorBox.x2 = cursorBox.y2 = 0;
+    if (inputInfo.pointer) {
+        GetSpritePosition(inputInfo.pointer, &x, &y);
+        cursorBox.x1 = max(x - CURSOR_SIZE / 2, 0);
+        cursorBox.y1 = max(y - CURSOR_SIZE / 2, 0);
+        cursorBox.x2 = min(x + CURSOR_SIZE / 2, rfbFB.width);
+        cursorBox.y2 = min(y + CURSOR_SIZE / 2, rfbFB.height);
+    }
+
+    damage = DamageRegion(roiDamage);
+    if (!REGION_NOTEMPTY(pScreen, damage)) {
+        AddRoi(info, &cursorBox, QOFFSET_CURSOR);
+        return;
+    }
+
+    REGION_INIT(pScreen, &textRegion, NullBox, 0);
+    REGION_INIT(pScreen, &otherRegion, NullBox, 0);
+    if (rfbServerFormat.bitsPerPixel == 32)
+        FindText(damage, &textRegion);
+    REGION_SUBTRACT(pScreen, &otherRegion, damage, &textRegion);
+
+    /* Where ROIs overlap, the encoders use the first one, so they are listed
+       from the highest priority to the lowest, and slots are kept for the
+       pointer ROI and at least one damage ROI. */
+    AddRegionRois(info, &textRegion, QOFFSET_TEXT, 2);
+    AddRoi(info, &cursorBox, QOFFSET_CURSOR);
+    AddRegionRois(info, &otherRegion, QOFFSET_DAMAGE, 0);
+
+    REGION_UNINIT(pScreen, &textRegion);
+    REGION_UNINIT(pScreen, &otherRegion);
+}
+
+
+static void rfbRoiCaptured(CallbackListPtr *list, void *closure, void *data)
+{
+    if (roiDamage)
+        DamageEmpty(roiDamage);
+}
+
+
+Bool rfbRoiInit(ScreenPtr pScreen)
+{
+    char *env;
+
+    if ((env = getenv("TVNC_RTSPROI")) != NULL && !strcmp(env, "0"))
+        rfbRoi = FALSE;
+    if (!rfbRoi)
+        return TRUE;
+    if (!ShmEncoderSupportsRois()) {
+        rfbLog("The video encoder does not support regions of interest\n");
+        rfbRoi = FALSE;
+        return TRUE;
+    }
+
+    if (!DamageSetup(pScreen))
+        return FALSE;
+    roiDamage = DamageCreate(NULL, NULL, DamageReportNone, TRUE, pScreen,
+                             pScreen);
+    if (!roiDamage)
+        return FALSE;
+    roiPixmap = NULL;
+
+    if (!AddCallback(&ShmRoiCallback, rfbRoiCallback, NULL) ||
+        !AddCallback(&ShmCaptureCallback, rfbRoiCaptured, NULL))
+        return FALSE;
+
+    rfbLog("Encoder regions of interest enabled\n");
+    return TRUE;
+}
@@ -0,0 +1,276 @@
+/*
+ * scroll.c - detect scrolled content and send it using CopyRect
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * The X server only tells us about a scroll if the application performs it
+ * with CopyArea (see rfbCopyArea() and rfbCopyRegion() in draw.c.)  Web
+ * browsers and many terminals instead redraw the scrolled content with
+ * PutImage, so the whole viewport would be re-encoded.  When interframe
+ * comparison is enabled, the comparison buffer holds the framebuffer as the
+ * viewer last saw it, so we can find scrolled content by comparing the new
+ * framebuffer with that buffer.
+ *
+ * For the largest rectangle in an update, we hash each row of the rectangle in
+ * both buffers and vote on the vertical offset by matching each changed row of
+ * the new framebuffer with the uniquely-hashed row of the comparison buffer
+ * that has the same hash.  If no vertical offset wins, then we do the same
+ * with the columns of the rectangle to look for a horizontal offset.  The
+ * winning offset is then verified row by row with memcmp(), and the runs of
+ * rows that match are sent as a CopyRect region.  The rest of the update is
+ * sent normally.
+ */
+
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "rfb.h"
+
+
+Bool rfbScrollDetect = TRUE;
+
+#define MIN_SCROLL_WIDTH   64   /* Minimum width of a scrolled area (pixels) */
+#define MIN_SCROLL_HEIGHT  64   /* Minimum height of a scrolled area (pixels) */
+#define MIN_RUN            16   /* Minimum number of matching rows in a run */
+#define MIN_VOTES           8   /* Minimum number of rows that agree on an
+                                   offset */
+
+#define HASH_EMPTY  -1
+#define HASH_DUP    -2
+
+#define HASH_STEP(h, v)  (((h) ^ (CARD32)(v)) * 0x01000193)
+
+
+static CARD32 HashRow(const unsigned char *p, int len)
+{
+    CARD32 h = 0x811C9DC5, v;
+
+    for (; len >= 4; p += 4, len -= 4) {
+        memcpy(&v, p, 4);
+        h = HASH_STEP(h, v);
+    }
+    while (len--)
+        h = HASH_STEP(h, *p++);
+    return h;
+}
+
+
+static inline CARD32 GetPixel(const unsigned char *p, int ps)
+{
+    CARD32 v = 0;
+
+    memcpy(&v, p, ps);
+    return v;
+}
+
+
+/* Hash each row (vertical == TRUE) or each column of the w x h rectangle that
+   starts at buf. */
+
+static void HashLines(const unsigned char *buf, int pitch, int ps, int w,
+                      int h, Bool vertical, CARD32 *hashes)
+{
+    int x, y;
+
+    if (vertical) {
+        for (y = 0; y < h; y++, buf += pitch)
+            hashes[y] = HashRow(buf, w * ps);
+        return;
+    }
+
+    for (x = 0; x < w; x++)
+        hashes[x] = 0x811C9DC5;
+    for (y = 0; y < h; y++, buf += pitch) {
+        const unsigned char *p = buf;
+
+        if (ps == 4) {
+            for (x = 0; x < w; x++, p += 4)
+                hashes[x] = HASH_STEP(hashes[x], *(const CARD32 *)p);
+        } else {
+            for (x = 0; x < w; x++, p += ps)
+                hashes[x] = HASH_STEP(hashes[x], GetPixel(p, ps));
+        }
+    }
+}
+
+
+/* Find the offset d (0 < |d| < n) by which the most lines of the new buffer
+   appear to have moved relative to the old buffer.  Returns 0 if no offset is
+   supported by enough lines. */
+
+static int FindOffset(const CARD32 *newHashes, const CARD32 *oldHashes, int n)
+{
+    int tableSize = 1, mask, *table, *votes, i, best = 0, bestVotes = 0;
+
+    while (tableSize < n * 2) tableSize <<= 1;
+    mask = tableSize - 1;
+    table = (int *)rfbAlloc(tableSize * sizeof(int));
+    votes = (int *)rfbAlloc((n * 2 + 1) * sizeof(int));
+    for (i = 0; i < tableSize; i++) table[i] = HASH_EMPTY;
+    memset(votes, 0, (n * 2 + 1) * sizeof(int));
+
+    /* Index the old lines by hash.  Lines that aren't unique (for instance,
+       blank lines) can't tell us anything about the offset. */
+    for (i = 0; i < n; i++) {
+        int slot = oldHashes[i] & mask;
+
+        while (table[slot] != HASH_EMPTY &&
+               (table[slot] == HASH_DUP ||
+                oldHashes[table[slot]] != oldHashes[i]))
+            slot = (slot + 1) & mask;
+        table[slot] = table[slot] == HASH_EMPTY ? i : HASH_DUP;
+    }
+
+    for (i = 0; i < n; i++) {
+        int slot = newHashes[i] & mask;
+
+        if (newHashes[i] == oldHashes[i])
+            continue;
+        while (table[slot] != HASH_EMPTY) {
+            if (table[slot] >= 0 && oldHashes[table[slot]] == newHashes[i]) {
+                int d = i - table[slot];
+
+                if (++votes[d + n] > bestVotes) {
+                    bestVotes = votes[d + n];
+                    best = d;
+                }
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    free(table);
+    free(votes);
+    return bestVotes >= MIN_VOTES ? best : 0;
+}
+
+
+/* Add to copyRegion the runs of rows within the rectangle for which the new
+   framebuffer contains the old framebuffer moved by (dx, dy). */
+
+static void VerifyOffset(rfbClientPtr cl, BoxPtr box, int dx, int dy,
+                         RegionPtr copyRegion)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    int pitch = rfbFB.paddedWidthInBytes;
+    int ps = rfbServerFormat.bitsPerPixel / 8;
+    int x1 = max(box->x1, box->x1 + dx), x2 = min(box->x2, box->x2 + dx);
+    int y1 = max(box->y1, box->y1 + dy), y2 = min(box->y2, box->y2 + dy);
+    int y, runStart = -1;
+
+    if (x2 - x1 < MIN_SCROLL_WIDTH)
+        return;
+
+    for (y = y1; y <= y2; y++) {
+        Bool match = FALSE;
+
+        if (y < y2)
+            match = !memcmp(&rfbFB.pfbMemory[y * pitch + x1 * ps],
+                            &cl->compareFB[(y - dy) * pitch + (x1 - dx) * ps],
+                            (x2 - x1) * ps);
+        if (match && runStart < 0)
+            runStart = y;
+        else if (!match && runStart >= 0) {
+            if (y - runStart >= MIN_RUN) {
+                BoxRec run;
+                RegionRec tmpRegion;
+
+                run.x1 = x1;  run.y1 = runStart;
+                run.x2 = x2;  run.y2 = y;
+                REGION_INIT(pScreen, &tmpRegion, &run, 1);
+                REGION_UNION(pScreen, copyRegion, copyRegion, &tmpRegion);
+                REGION_UNINIT(pScreen, &tmpRegion);
+            }
+            runStart = -1;
+        }
+    }
+}
+
+
+/*
+ * Look for content in the update region that the viewer already has, but at a
+ * different position.  If any is found, then copyRegion is set to the
+ * destination of the copy, *dx and *dy are set to the offset of the copy, and
+ * TRUE is returned.  The caller is responsible for removing copyRegion from
+ * the update region and sending it using CopyRect.  cl->compareFB must hold
+ * the viewer's current framebuffer contents.
+ */
+
+Bool rfbDetectScroll(rfbClientPtr cl, RegionPtr region, RegionPtr copyRegion,
+                     int *dx, int *dy)
+{
+    ScreenPtr pScreen = screenInfo.screens[0];
+    int pitch = rfbFB.paddedWidthInBytes;
+    int ps = rfbServerFormat.bitsPerPixel / 8;
+    BoxPtr boxes = REGION_RECTS(region), box = NULL;
+    CARD32 *newHashes, *oldHashes;
+    long area = 0;
+    int i, w, h, offset;
+    const unsigned char *newPtr, *oldPtr;
+
+    if (!cl->compareFB || ps < 1 || ps > 4)
+        return FALSE;
+
+    for (i = 0; i < REGION_NUM_RECTS(region); i++) {
+        long a = (long)(boxes[i].x2 - boxes[i].x1) *
+                 (boxes[i].y2 - boxes[i].y1);
+
+        if (boxes[i].x2 - boxes[i].x1 >= MIN_SCROLL_WIDTH &&
+            boxes[i].y2 - boxes[i].y1 >= MIN_SCROLL_HEIGHT &&
+            boxes[i].x2 <= rfbFB.width && boxes[i].y2 <= rfbFB.height &&
+            a > area) {
+            area = a;
+            box = &boxes[i];
+        }
+    }
+    if (!box)
+        return FALSE;
+
+    w = box->x2 - box->x1;
+    h = box->y2 - box->y1;
+    newPtr = (unsigned char *)&rfbFB.pfbMemory[box->y1 * pitch + box->x1 * ps];
+    oldPtr = (unsigned char *)&cl->compareFB[box->y1 * pitch + box->x1 * ps];
+    newHashes = (CARD32 *)rfbAlloc(max(w, h) * sizeof(CARD32));
+    oldHashes = (CARD32 *)rfbAlloc(max(w, h) * sizeof(CARD32));
+
+    *dx = *dy = 0;
+    HashLines(newPtr, pitch, ps, w, h, TRUE, newHashes);
+    HashLines(oldPtr, pitch, ps, w, h, TRUE, oldHashes);
+    offset = FindOffset(newHashes, oldHashes, h);
+    if (offset)
+        *dy = offset;
+    else {
+        HashLines(newPtr, pitch, ps, w, h, FALSE, newHashes);
+        HashLines(oldPtr, pitch, ps, w, h, FALSE, oldHashes);
+        *dx = FindOffset(newHashes, oldHashes, w);
+    }
+    free(newHashes);
+    free(oldHashes);
+    if (!*dx && !*dy)
+        return FALSE;
+
+    REGION_EMPTY(pScreen, copyRegion);
+    VerifyOffset(cl, box, *dx, *dy, copyRegion);
+    return REGION_NOTEMPTY(pScreen, copyRegion);
+}
@@ -0,0 +1,536 @@
+/*
+ * simd.c - SIMD-accelerated pixel scanning and translation routines
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "rfb.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+/*
+ * Scalar implementations.  These define the reference behavior, and the SIMD
+ * implementations must produce byte-for-byte identical results.
+ */
+
+#define DEFINE_RUN_LENGTH_FUNCTION_C(bpp)                                 \
+                                                                          \
+static int RunLength##bpp##_C(CARD##bpp *data, int count, CARD##bpp value,\
+                              CARD##bpp mask)                             \
+{                                                                         \
+    int i;                                                                \
+                                                                          \
+    for (i = 0; i < count && (data[i] & mask) == value; i++);             \
+    return i;                                                             \
+}                                                                         \
+                                                                          \
+static Bool IsSolid##bpp##_C(CARD##bpp *ptr, int w, int h, int pitch,     \
+                             CARD##bpp color)                             \
+{                                                                         \
+    int dx, dy;                                                           \
+                                                                          \
+    for (dy = 0; dy < h; dy++) {                                          \
+        for (dx = 0; dx < w; dx++) {                                      \
+            if (ptr[dx] != color)                                         \
+                return FALSE;                                             \
+        }                                                                 \
+        ptr = (CARD##bpp *)((CARD8 *)ptr + pitch);                        \
+    }                                                                     \
+    return TRUE;                                                          \
+}
+
+DEFINE_RUN_LENGTH_FUNCTION_C(8)
+DEFINE_RUN_LENGTH_FUNCTION_C(16)
+DEFINE_RUN_LENGTH_FUNCTION_C(32)
+
+
+static void Pack24_C(char *buf, int count, int rShift, int gShift,
+                     int bShift)
+{
+    CARD32 *buf32 = (CARD32 *)buf;
+    CARD32 pix;
+
+    while (count--) {
+        pix = *buf32++;
+        *buf++ = (char)(pix >> rShift);
+        *buf++ = (char)(pix >> gShift);
+        *buf++ = (char)(pix >> bShift);
+    }
+}
+
+
+/*
+ * Pixel format translation fast paths.  These handle the common case of a
+ * 32-bit server framebuffer with 8-bit color channels and a true-color client
+ * pixel format, and they produce exactly the same output as the table-driven
+ * translation functions in translate.c.  Each channel value is rescaled using
+ * the same rounding as rfbInitOneRGBTable*():
+ *
+ *   out = (in * outMax + 127) / 255
+ *
+ * and the division by 255 is computed as (x + 1 + (x >> 8)) >> 8, which is
+ * exact for all x <= 255 * 255 + 127.
+ */
+
+#define SCALE_CHANNEL(pix, inShift, outMax, outShift)  \
+    (((((pix) >> (inShift) & 255) * (outMax) + 127) / 255) << (outShift))
+
+#define SCALE_PIXEL(pix, in, out)  \
+    (SCALE_CHANNEL(pix, in->redShift, out->redMax, out->redShift) |  \
+     SCALE_CHANNEL(pix, in->greenShift, out->greenMax, out->greenShift) |  \
+     SCALE_CHANNEL(pix, in->blueShift, out->blueMax, out->blueShift))
+
+static void TranslateScale32to8_C(CARD32 *ip, CARD8 *op, int count,
+                                  rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    while (count--) {
+        *op++ = (CARD8)SCALE_PIXEL(*ip, in, out);
+        ip++;
+    }
+}
+
+static void TranslateScale32to16_C(CARD32 *ip, CARD16 *op, int count,
+                                   rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    Bool swap = (out->bigEndian != in->bigEndian);
+    CARD16 pix;
+
+    while (count--) {
+        pix = (CARD16)SCALE_PIXEL(*ip, in, out);
+        *op++ = swap ? Swap16(pix) : pix;
+        ip++;
+    }
+}
+
+static void TranslatePermute32_C(CARD32 *ip, CARD32 *op, int count,
+                                 rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    Bool swap = (out->bigEndian != in->bigEndian);
+    CARD32 pix;
+
+    while (count--) {
+        pix = ((*ip >> in->redShift & 255) << out->redShift) |
+              ((*ip >> in->greenShift & 255) << out->greenShift) |
+              ((*ip >> in->blueShift & 255) << out->blueShift);
+        *op++ = swap ? Swap32(pix) : pix;
+        ip++;
+    }
+}
+
+
+#ifdef SIMD_X86
+
+/*
+ * The x86 implementations are built with function-level target attributes, so
+ * the rest of the server does not need to be compiled with -mavx2 and will
+ * still run on CPUs that lack these instruction set extensions.  Each
+ * function compares one vector's worth of pixels at a time and uses the
+ * byte mask from movemask to locate the first mismatching pixel.
+ */
+
+#define DEFINE_RUN_LENGTH_FUNCTION_SIMD(bpp, isa, tgt, pfx, vec, bits)    \
+                                                                          \
+__attribute__((target(tgt)))                                              \
+static int RunLength##bpp##_##isa(CARD##bpp *data, int count,             \
+                                  CARD##bpp value, CARD##bpp mask)        \
+{                                                                         \
+    const int n = sizeof(vec) / (bpp / 8);                                \
+    const unsigned int all = (unsigned int)((1ULL << sizeof(vec)) - 1);   \
+    vec v = pfx##_set1_epi##bpp(value), m = pfx##_set1_epi##bpp(mask);    \
+    unsigned int eq;                                                      \
+    int i;                                                                \
+                                                                          \
+    for (i = 0; i + n <= count; i += n) {                                 \
+        vec d = pfx##_and_si##bits(                                       \
+            pfx##_loadu_si##bits((vec *)&data[i]), m);                    \
+        eq = (unsigned int)pfx##_movemask_epi8(pfx##_cmpeq_epi##bpp(d, v));\
+        if (eq != all)                                                    \
+            return i + __builtin_ctz(~eq) / (bpp / 8);                    \
+    }                                                                     \
+    for (; i < count && (data[i] & mask) == value; i++);                  \
+    return i;                                                             \
+}                                                                         \
+                                                                          \
+__attribute__((target(tgt)))                                              \
+static Bool IsSolid##bpp##_##isa(CARD##bpp *ptr, int w, int h, int pitch, \
+                                 CARD##bpp color)                         \
+{                                                                         \
+    int dy;                                                               \
+                                                                          \
+    for (dy = 0; dy < h; dy++) {                                          \
+        if (RunLength##bpp##_##isa(ptr, w, color, (CARD##bpp)~0) < w)     \
+            return FALSE;                                                 \
+        ptr = (CARD##bpp *)((CARD8 *)ptr + pitch);                        \
+    }                                                                     \
+    return TRUE;                                                          \
+}
+
+DEFINE_RUN_LENGTH_FUNCTION_SIMD(8, SSE2, "sse2", _mm, __m128i, 128)
+DEFINE_RUN_LENGTH_FUNCTION_SIMD(16, SSE2, "sse2", _mm, __m128i, 128)
+DEFINE_RUN_LENGTH_FUNCTION_SIMD(32, SSE2, "sse2", _mm, __m128i, 128)
+DEFINE_RUN_LENGTH_FUNCTION_SIMD(8, AVX2, "avx2", _mm256, __m256i, 256)
+DEFINE_RUN_LENGTH_FUNCTION_SIMD(16, AVX2, "avx2", _mm256, __m256i, 256)
+DEFINE_RUN_LENGTH_FUNCTION_SIMD(32, AVX2, "avx2", _mm256, __m256i, 256)
+
+
+/*
+ * Pack four 32-bit pixels into 12 bytes with a single byte shuffle.  The
+ * conversion is done in place, and the output pointer never overtakes the
+ * input pointer, so the 16-byte store only ever overwrites pixels that have
+ * already been loaded.
+ */
+
+__attribute__((target("ssse3")))
+static void Pack24_SSSE3(char *buf, int count, int rShift, int gShift,
+                         int bShift)
+{
+    CARD32 *buf32 = (CARD32 *)buf;
+    char r = rShift / 8, g = gShift / 8, b = bShift / 8;
+    __m128i shuf = _mm_setr_epi8(r, g, b, r + 4, g + 4, b + 4,
+                                 r + 8, g + 8, b + 8, r + 12, g + 12, b + 12,
+                                 -1, -1, -1, -1);
+    CARD32 pix;
+    int i;
+
+    if ((rShift | gShift | bShift) & 7 || rShift > 24 || gShift > 24 ||
+        bShift > 24) {
+        Pack24_C(buf, count, rShift, gShift, bShift);
+        return;
+    }
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((__m128i *)&buf32[i]);
+        _mm_storeu_si128((__m128i *)buf, _mm_shuffle_epi8(pixels, shuf));
+        buf += 12;
+    }
+    for (; i < count; i++) {
+        pix = buf32[i];
+        *buf++ = (char)(pix >> rShift);
+        *buf++ = (char)(pix >> gShift);
+        *buf++ = (char)(pix >> bShift);
+    }
+}
+
+
+/*
+ * Rescale the channels of 8 (SSE2) or 16 (AVX2) 32-bit pixels into 16-bit
+ * lanes.  The 32-bit to 16-bit pack is done per 128-bit lane in AVX2, so the
+ * AVX2 version has to restore the pixel order afterward.
+ */
+
+#define SSSE3_FIXUP(v)  (v)
+#define AVX2_FIXUP(v)  _mm256_permute4x64_epi64(v, 0xD8)
+
+#define SSSE3_STORE8(p, v)  \
+    _mm_storel_epi64((__m128i *)(p), _mm_packus_epi16(v, _mm_setzero_si128()))
+#define AVX2_STORE8(p, v)  \
+    _mm_storeu_si128((__m128i *)(p), _mm256_castsi256_si128(  \
+        AVX2_FIXUP(_mm256_packus_epi16(v, _mm256_setzero_si256()))))
+
+#define DEFINE_TRANSLATE_FUNCTIONS_SIMD(isa, tgt, pfx, vec, bits)         \
+                                                                          \
+typedef struct {                                                          \
+    __m128i inShift[3], outShift[3];                                      \
+    vec outMax[3];                                                        \
+} ScaleParams##isa;                                                       \
+                                                                          \
+__attribute__((target(tgt)))                                              \
+static void InitScaleParams##isa(ScaleParams##isa *sp,                    \
+                                 rfbPixelFormat *in, rfbPixelFormat *out) \
+{                                                                         \
+    sp->inShift[0] = _mm_cvtsi32_si128(in->redShift);                     \
+    sp->inShift[1] = _mm_cvtsi32_si128(in->greenShift);                   \
+    sp->inShift[2] = _mm_cvtsi32_si128(in->blueShift);                    \
+    sp->outShift[0] = _mm_cvtsi32_si128(out->redShift);                   \
+    sp->outShift[1] = _mm_cvtsi32_si128(out->greenShift);                 \
+    sp->outShift[2] = _mm_cvtsi32_si128(out->blueShift);                  \
+    sp->outMax[0] = pfx##_set1_epi16(out->redMax);                        \
+    sp->outMax[1] = pfx##_set1_epi16(out->greenMax);                      \
+    sp->outMax[2] = pfx##_set1_epi16(out->blueMax);                       \
+}                                                                         \
+                                                                          \
+__attribute__((target(tgt), always_inline))                               \
+static inline vec Scale32##isa(CARD32 *ip, ScaleParams##isa *sp)          \
+{                                                                         \
+    const int n = sizeof(vec) / 4;                                        \
+    vec p0 = pfx##_loadu_si##bits((vec *)ip);                             \
+    vec p1 = pfx##_loadu_si##bits((vec *)(ip + n));                       \
+    vec mask = pfx##_set1_epi32(255), round = pfx##_set1_epi16(127);      \
+    vec one = pfx##_set1_epi16(1), result = pfx##_setzero_si##bits();     \
+    int i;                                                                \
+                                                                          \
+    for (i = 0; i < 3; i++) {                                             \
+        vec c = isa##_FIXUP(pfx##_packs_epi32(                            \
+            pfx##_and_si##bits(pfx##_srl_epi32(p0, sp->inShift[i]), mask),\
+            pfx##_and_si##bits(pfx##_srl_epi32(p1, sp->inShift[i]),       \
+                               mask)));                                   \
+                                                                          \
+        c = pfx##_add_epi16(pfx##_mullo_epi16(c, sp->outMax[i]), round);  \
+        c = pfx##_srli_epi16(                                             \
+            pfx##_add_epi16(pfx##_add_epi16(c, one),                      \
+                            pfx##_srli_epi16(c, 8)), 8);                  \
+        result = pfx##_or_si##bits(result,                                \
+                                   pfx##_sll_epi16(c, sp->outShift[i]));  \
+    }                                                                     \
+    return result;                                                        \
+}                                                                         \
+                                                                          \
+__attribute__((target(tgt)))                                              \
+static void TranslateScale32to8_##isa(char *table, rfbPixelFormat *in,    \
+                                      rfbPixelFormat *out, char *iptr,    \
+                                      char *optr,                         \
+                                      int bytesBetweenInputLines,         \
+                                      int width, int height)              \
+{                                                                         \
+    const int n = sizeof(vec) / 2;                                        \
+    CARD8 *op = (CARD8 *)optr;                                            \
+    ScaleParams##isa sp;                                                  \
+    int x;                                                                \
+                                                                          \
+    InitScaleParams##isa(&sp, in, out);                                   \
+    while (height > 0) {                                                  \
+        CARD32 *ip = (CARD32 *)iptr;                                      \
+                                                                          \
+        for (x = 0; x + n <= width; x += n)                               \
+            isa##_STORE8(&op[x], Scale32##isa(&ip[x], &sp));          \
+        TranslateScale32to8_C(&ip[x], &op[x], width - x, in, out);        \
+        iptr += bytesBetweenInputLines;                                   \
+        op += width;                                                      \
+        height--;                                                         \
+    }                                                                     \
+}                                                                         \
+                                                                          \
+__attribute__((target(tgt)))                                              \
+static void TranslateScale32to16_##isa(char *table, rfbPixelFormat *in,   \
+                                       rfbPixelFormat *out, char *iptr,   \
+                                       char *optr,                        \
+                                       int bytesBetweenInputLines,        \
+                                       int width, int height)             \
+{                                                                         \
+    const int n = sizeof(vec) / 2;                                        \
+    Bool swap = (out->bigEndian != in->bigEndian);                        \
+    CARD16 *op = (CARD16 *)optr;                                          \
+    ScaleParams##isa sp;                                                  \
+    int x;                                                                \
+                                                                          \
+    InitScaleParams##isa(&sp, in, out);                                   \
+    while (height > 0) {                                                  \
+        CARD32 *ip = (CARD32 *)iptr;                                      \
+                                                                          \
+        for (x = 0; x + n <= width; x += n) {                             \
+            vec v = Scale32##isa(&ip[x], &sp);                        \
+            if (swap)                                                     \
+                v = pfx##_or_si##bits(pfx##_slli_epi16(v, 8),             \
+                                      pfx##_srli_epi16(v, 8));            \
+            pfx##_storeu_si##bits((vec *)&op[x], v);                      \
+        }                                                                 \
+        TranslateScale32to16_C(&ip[x], &op[x], width - x, in, out);       \
+        iptr += bytesBetweenInputLines;                                   \
+        op += width;                                                      \
+        height--;                                                         \
+    }                                                                     \
+}                                                                         \
+                                                                          \
+__attribute__((target(tgt)))                                              \
+static void TranslatePermute32_##isa(char *table, rfbPixelFormat *in,     \
+                                     rfbPixelFormat *out, char *iptr,     \
+                                     char *optr,                          \
+                                     int bytesBetweenInputLines,          \
+                                     int width, int height)               \
+{                                                                         \
+    const int n = sizeof(vec) / 4;                                        \
+    Bool swap = (out->bigEndian != in->bigEndian);                        \
+    CARD32 *op = (CARD32 *)optr;                                          \
+    char shuf[sizeof(vec)];                                               \
+    vec mask;                                                             \
+    int x;                                                                \
+                                                                          \
+    /* Output byte k of each pixel comes from input byte shuf[k], or is   \
+       zero if shuf[k] is negative. */                                    \
+    memset(shuf, -1, sizeof(shuf));                                       \
+    for (x = 0; x < (int)sizeof(vec); x += 4) {                           \
+        int r = out->redShift / 8, g = out->greenShift / 8,               \
+            b = out->blueShift / 8;                                       \
+        if (swap) { r = 3 - r;  g = 3 - g;  b = 3 - b; }                  \
+        shuf[x + r] = (char)((x & 15) + in->redShift / 8);                \
+        shuf[x + g] = (char)((x & 15) + in->greenShift / 8);              \
+        shuf[x + b] = (char)((x & 15) + in->blueShift / 8);               \
+    }                                                                     \
+    mask = pfx##_loadu_si##bits((vec *)shuf);                             \
+                                                                          \
+    while (height > 0) {                                                  \
+        CARD32 *ip = (CARD32 *)iptr;                                      \
+                                                                          \
+        for (x = 0; x + n <= width; x += n)                               \
+            pfx##_storeu_si##bits((vec *)&op[x], pfx##_shuffle_epi8(      \
+                pfx##_loadu_si##bits((vec *)&ip[x]), mask));              \
+        TranslatePermute32_C(&ip[x], &op[x], width - x, in, out);         \
+        iptr += bytesBetweenInputLines;                                   \
+        op += width;                                                      \
+        height--;                                                         \
+    }                                                                     \
+}
+
+DEFINE_TRANSLATE_FUNCTIONS_SIMD(SSSE3, "ssse3", _mm, __m128i, 128)
+DEFINE_TRANSLATE_FUNCTIONS_SIMD(AVX2, "avx2", _mm256, __m256i, 256)
+
+#endif  /* SIMD_X86 */
+
+
+/*
+ * Dispatch table.  The scalar implementations are used until rfbInitSIMD() is
+ * called, so it is always safe to call through these pointers.
+ */
+
+int (*rfbRunLength8) (CARD8 *, int, CARD8, CARD8) = RunLength8_C;
+int (*rfbRunLength16) (CARD16 *, int, CARD16, CARD16) = RunLength16_C;
+int (*rfbRunLength32) (CARD32 *, int, CARD32, CARD32) = RunLength32_C;
+Bool (*rfbIsSolid8) (CARD8 *, int, int, int, CARD8) = IsSolid8_C;
+Bool (*rfbIsSolid16) (CARD16 *, int, int, int, CARD16) = IsSolid16_C;
+Bool (*rfbIsSolid32) (CARD32 *, int, int, int, CARD32) = IsSolid32_C;
+void (*rfbPack24) (char *, int, int, int, int) = Pack24_C;
+
+static enum { SIMD_NONE, SIMD_SSSE3, SIMD_AVX2 } translateSIMD = SIMD_NONE;
+
+
+/*
+ * Select the best implementation supported by the CPU.  Setting the
+ * TVNC_SIMD environment variable to 0 forces the scalar code paths, and
+ * setting it to sse2 disables the AVX2 code paths.  This is useful for
+ * comparing the output of the different implementations using session
+ * capture (-capture.)
+ */
+
+void rfbInitSIMD(void)
+{
+    static Bool initialized = FALSE;
+    const char *simdName = "no";
+    char *env;
+    Bool allowAVX2 = TRUE;
+
+    if (initialized) return;
+    initialized = TRUE;
+
+    if ((env = getenv("TVNC_SIMD")) != NULL) {
+        if (!strcmp(env, "0")) {
+            rfbLog("SIMD acceleration disabled\n");
+            return;
+        }
+        if (!strcasecmp(env, "sse2"))
+            allowAVX2 = FALSE;
+    }
+
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (allowAVX2 && __builtin_cpu_supports("avx2")) {
+        rfbRunLength8 = RunLength8_AVX2;
+        rfbRunLength16 = RunLength16_AVX2;
+        rfbRunLength32 = RunLength32_AVX2;
+        rfbIsSolid8 = IsSolid8_AVX2;
+        rfbIsSolid16 = IsSolid16_AVX2;
+        rfbIsSolid32 = IsSolid32_AVX2;
+        simdName = "AVX2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        rfbRunLength8 = RunLength8_SSE2;
+        rfbRunLength16 = RunLength16_SSE2;
+        rfbRunLength32 = RunLength32_SSE2;
+        rfbIsSolid8 = IsSolid8_SSE2;
+        rfbIsSolid16 = IsSolid16_SSE2;
+        rfbIsSolid32 = IsSolid32_SSE2;
+        simdName = "SSE2";
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        rfbPack24 = Pack24_SSSE3;
+        translateSIMD = SIMD_SSSE3;
+    }
+    if (allowAVX2 && __builtin_cpu_supports("avx2"))
+        translateSIMD = SIMD_AVX2;
+#endif
+
+    rfbLog("Using %s SIMD extensions for pixel scanning\n", simdName);
+}
+
+
+/*
+ * Return a SIMD-accelerated translation function for the given input (server)
+ * and output (client) pixel formats, or NULL if there isn't one.  The
+ * returned function does not use the lookup table, but the table-driven
+ * translation functions remain the reference implementation.
+ */
+
+rfbTranslateFnType rfbGetSIMDTranslateFn(rfbPixelFormat *in,
+                                         rfbPixelFormat *out,
+                                         const char **name)
+{
+#ifdef SIMD_X86
+    Bool avx2 = (translateSIMD == SIMD_AVX2);
+
+    if (translateSIMD == SIMD_NONE)
+        return NULL;
+
+    /* Both formats must be true color, and each input channel must be 8 bits
+       wide. */
+    if (in->bitsPerPixel != 32 || !in->trueColour || !out->trueColour ||
+        in->redMax != 255 || in->greenMax != 255 || in->blueMax != 255 ||
+        in->redShift > 24 || in->greenShift > 24 || in->blueShift > 24)
+        return NULL;
+
+    if (out->bitsPerPixel == 32) {
+        /* Reorder and/or byte swap 8-bit channels */
+        if (out->redMax != 255 || out->greenMax != 255 ||
+            out->blueMax != 255 ||
+            ((in->redShift | in->greenShift | in->blueShift |
+              out->redShift | out->greenShift | out->blueShift) & 7) ||
+            out->redShift > 24 || out->greenShift > 24 ||
+            out->blueShift > 24)
+            return NULL;
+        *name = avx2 ? "AVX2 32-bit channel shuffle" :
+                       "SSSE3 32-bit channel shuffle";
+        return avx2 ? TranslatePermute32_AVX2 : TranslatePermute32_SSSE3;
+    }
+
+    /* Rescale to 8-bit or 16-bit pixels.  The scaled channel values must fit
+       in the output pixel, and the intermediate products must fit in 16
+       bits. */
+    if (out->redMax > 255 || out->greenMax > 255 || out->blueMax > 255 ||
+        out->redMax == 0 || out->greenMax == 0 || out->blueMax == 0 ||
+        out->redShift >= out->bitsPerPixel ||
+        out->greenShift >= out->bitsPerPixel ||
+        out->blueShift >= out->bitsPerPixel ||
+        (out->redMax << out->redShift) >= (1 << out->bitsPerPixel) ||
+        (out->greenMax << out->greenShift) >= (1 << out->bitsPerPixel) ||
+        (out->blueMax << out->blueShift) >= (1 << out->bitsPerPixel))
+        return NULL;
+
+    if (out->bitsPerPixel == 16) {
+        *name = avx2 ? "AVX2 32-bit to 16-bit" : "SSSE3 32-bit to 16-bit";
+        return avx2 ? TranslateScale32to16_AVX2 : TranslateScale32to16_SSSE3;
+    } else if (out->bitsPerPixel == 8) {
+        *name = avx2 ? "AVX2 32-bit to 8-bit" : "SSSE3 32-bit to 8-bit";
+        return avx2 ? TranslateScale32to8_AVX2 : TranslateScale32to8_SSSE3;
+    }
+#endif
+
+    return NULL;
+}
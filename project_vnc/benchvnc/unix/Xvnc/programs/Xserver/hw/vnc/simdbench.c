@@ -0,0 +1,504 @@
+/*
+ * simdbench.c - verify and benchmark the SIMD pixel scanning and translation
+ *               paths
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * Usage: simdbench [width height [seconds]]
+ *
+ * This program first checks that each dispatched pixel scanning kernel
+ * (rfbRunLength*(), rfbIsSolid*(), and rfbPack24()) returns exactly the same
+ * result as the scalar reference implementation, using random data with odd
+ * counts, every remainder of the count modulo the vector width, and unaligned
+ * start addresses.  Then, for each pixel format translation that has a SIMD
+ * fast path, it checks that the fast path produces exactly the same output as
+ * the table-driven translation function that Xvnc would otherwise use, and it
+ * measures the throughput of both.  A duration of 0 seconds skips the
+ * throughput measurements.
+ *
+ * The kernels are selected in the same way as in Xvnc, so the program should
+ * be run once with the default settings (AVX2, if supported by the CPU) and
+ * once with TVNC_SIMD=sse2 in order to verify both sets of kernels.  The exit
+ * status is non-zero if any output does not match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include "rfb.h"
+
+
+/* simd.c and the translation templates need these server functions. */
+
+void rfbLog(char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void *rfbAlloc(size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+
+#define CONCAT2(a, b) a##b
+#define CONCAT2E(a, b) CONCAT2(a, b)
+#define CONCAT4(a, b, c, d) a##b##c##d
+#define CONCAT4E(a, b, c, d) CONCAT4(a, b, c, d)
+
+#define IN 32
+#define OUT 8
+#include "tableinittctemplate.c"
+#include "tabletranstemplate.c"
+#undef OUT
+#define OUT 16
+#include "tableinittctemplate.c"
+#include "tabletranstemplate.c"
+#undef OUT
+#define OUT 32
+#include "tableinittctemplate.c"
+#include "tabletranstemplate.c"
+#undef OUT
+#undef IN
+
+typedef void (*InitTableFn) (char **table, rfbPixelFormat *in,
+                             rfbPixelFormat *out);
+
+
+/*
+ * Pixel scanning kernel checks
+ */
+
+/* The widest vector (AVX2) in bytes.  Each check covers all start offsets
+   within a vector and all counts up to three vectors' worth of pixels, so
+   every remainder of the count modulo the SSE2 and AVX2 vector widths is
+   tested. */
+#define VEC_BYTES 32
+#define GUARD (VEC_BYTES * 2)
+
+/* The dispatch table points to the scalar implementations until
+   rfbInitSIMD() is called, so these are saved beforehand and used as the
+   reference. */
+static int (*refRunLength8) (CARD8 *, int, CARD8, CARD8);
+static int (*refRunLength16) (CARD16 *, int, CARD16, CARD16);
+static int (*refRunLength32) (CARD32 *, int, CARD32, CARD32);
+static Bool (*refIsSolid8) (CARD8 *, int, int, int, CARD8);
+static Bool (*refIsSolid16) (CARD16 *, int, int, int, CARD16);
+static Bool (*refIsSolid32) (CARD32 *, int, int, int, CARD32);
+static void (*refPack24) (char *, int, int, int, int);
+
+static int checks, errors;
+
+
+static CARD32 Rand32(void)
+{
+    return ((CARD32)rand() << 16) ^ (CARD32)rand();
+}
+
+
+static void ReportKernel(const char *name, Bool simd, int prevErrors)
+{
+    if (!simd)
+        printf("  %-12s scalar (nothing to compare)\n", name);
+    else if (errors > prevErrors)
+        printf("  %-12s %d MISMATCHES\n", name, errors - prevErrors);
+    else
+        printf("  %-12s OK\n", name);
+}
+
+
+#define DEFINE_CHECK_FUNCTIONS(bpp)                                       \
+                                                                          \
+/* Return a random bit that is set in the mask, which must be non-zero */ \
+static CARD##bpp RandomBit##bpp(CARD##bpp mask)                           \
+{                                                                         \
+    CARD##bpp bit;                                                        \
+                                                                          \
+    do {                                                                  \
+        bit = (CARD##bpp)(1U << (rand() % bpp));                          \
+    } while (!(bit & mask));                                              \
+    return bit;                                                           \
+}                                                                         \
+                                                                          \
+/* Fill the buffer with pixels that match the value under the mask but    \
+   have random bits outside of it. */                                     \
+static void FillRun##bpp(CARD##bpp *data, int count, CARD##bpp value,     \
+                         CARD##bpp mask)                                  \
+{                                                                         \
+    int i;                                                                \
+                                                                          \
+    for (i = 0; i < count; i++)                                           \
+        data[i] = value | ((CARD##bpp)Rand32() & ~mask);                  \
+}                                                                         \
+                                                                          \
+static void CompareRunLength##bpp(CARD##bpp *data, int count,             \
+                                  CARD##bpp value, CARD##bpp mask,        \
+                                  int offset)                             \
+{                                                                         \
+    int expected = refRunLength##bpp(data, count, value, mask);           \
+    int actual = rfbRunLength##bpp(data, count, value, mask);             \
+                                                                          \
+    checks++;                                                             \
+    if (actual != expected && errors++ < 10)                              \
+        printf("    RunLength" #bpp "(offset=%d, count=%d, "              \
+               "value=0x%x, mask=0x%x) = %d, expected %d\n", offset,      \
+               count, (unsigned int)value, (unsigned int)mask, actual,    \
+               expected);                                                 \
+}                                                                         \
+                                                                          \
+/* Run length with a mismatching pixel at each position and with no       \
+   mismatch.  The pixels beyond the count also match, so a kernel that    \
+   reads past the count will return too large a value. */                 \
+static void CheckRunLength##bpp(CARD##bpp *buf, int offset, int count,    \
+                                CARD##bpp mask)                           \
+{                                                                         \
+    CARD##bpp *data = buf + offset, save;                                 \
+    CARD##bpp value = (CARD##bpp)Rand32() & mask;                         \
+    int pos;                                                              \
+                                                                          \
+    FillRun##bpp(data, count + GUARD, value, mask);                       \
+    CompareRunLength##bpp(data, count, value, mask, offset);              \
+    if (!mask)                                                            \
+        return;                                                           \
+    for (pos = 0; pos < count; pos++) {                                   \
+        save = data[pos];                                                 \
+        data[pos] ^= RandomBit##bpp(mask);                                \
+        CompareRunLength##bpp(data, count, value, mask, offset);          \
+        data[pos] = save;                                                 \
+    }                                                                     \
+}                                                                         \
+                                                                          \
+static void CheckRunLengthKernel##bpp(CARD##bpp *buf)                     \
+{                                                                         \
+    const int n = VEC_BYTES / (bpp / 8);                                  \
+    int offset, count, i, prevErrors = errors;                            \
+    CARD##bpp mask;                                                       \
+                                                                          \
+    /* All offsets and counts, with a full mask and a random mask */      \
+    for (offset = 0; offset < n; offset++) {                              \
+        for (count = 0; count <= n * 3 + 1; count++) {                    \
+            CheckRunLength##bpp(buf, offset, count, (CARD##bpp)~0);       \
+            CheckRunLength##bpp(buf, offset, count,                       \
+                                (CARD##bpp)Rand32());                     \
+        }                                                                 \
+    }                                                                     \
+                                                                          \
+    /* Every 8-bit mask value.  For 16-bit and 32-bit pixels, every       \
+       single-bit mask, every mask with contiguous low or high bits set,  \
+       and random masks. */                                               \
+    for (i = 0; i < (bpp == 8 ? 256 : bpp * 3 + 256); i++) {              \
+        if (bpp == 8 || i >= bpp * 3)                                     \
+            mask = (CARD##bpp)(bpp == 8 ? (CARD32)i : Rand32());          \
+        else if (i < bpp)                                                 \
+            mask = (CARD##bpp)(1U << i);                                  \
+        else if (i < bpp * 2)                                             \
+            mask = (CARD##bpp)((2U << (i - bpp)) - 1);                    \
+        else                                                              \
+            mask = (CARD##bpp)~((1U << (i - bpp * 2)) - 1);               \
+        for (count = 1; count <= n * 3 + 1; count += 3)                   \
+            CheckRunLength##bpp(buf, rand() % n, count, mask);            \
+    }                                                                     \
+                                                                          \
+    ReportKernel("RunLength" #bpp,                                        \
+                 rfbRunLength##bpp != refRunLength##bpp, prevErrors);     \
+}                                                                         \
+                                                                          \
+static void CompareIsSolid##bpp(CARD##bpp *data, int w, int h, int pitch, \
+                                CARD##bpp color, int offset)              \
+{                                                                         \
+    Bool expected = refIsSolid##bpp(data, w, h, pitch, color);            \
+    Bool actual = rfbIsSolid##bpp(data, w, h, pitch, color);              \
+                                                                          \
+    checks++;                                                             \
+    if (actual != expected && errors++ < 10)                              \
+        printf("    IsSolid" #bpp "(offset=%d, w=%d, h=%d, pitch=%d) "    \
+               "= %d, expected %d\n", offset, w, h, pitch, actual,        \
+               expected);                                                 \
+}                                                                         \
+                                                                          \
+/* Solid rectangle with a mismatching pixel at each position and with no  \
+   mismatch.  The padding at the end of each row and the pixels beyond    \
+   the last row never match, so a kernel that reads past the width will   \
+   return FALSE. */                                                       \
+static void CheckIsSolidKernel##bpp(CARD##bpp *buf)                       \
+{                                                                         \
+    const int n = VEC_BYTES / (bpp / 8);                                  \
+    int offset, w, h, x, y, stride, i, prevErrors = errors;               \
+    CARD##bpp *data, color, save;                                         \
+                                                                          \
+    for (offset = 0; offset < n; offset++) {                              \
+        for (w = 0; w <= n * 2 + 1; w++) {                                \
+            for (h = 1; h <= 3; h++) {                                    \
+                stride = w + 1 + rand() % n;                              \
+                data = buf + offset;                                      \
+                color = (CARD##bpp)Rand32();                              \
+                for (i = 0; i < stride * (h + 1); i++)                    \
+                    data[i] = (CARD##bpp)(color + 1);                     \
+                for (y = 0; y < h; y++)                                   \
+                    for (x = 0; x < w; x++)                               \
+                        data[y * stride + x] = color;                     \
+                CompareIsSolid##bpp(data, w, h, stride * (bpp / 8),       \
+                                    color, offset);                       \
+                for (i = 0; i < w * h; i++) {                             \
+                    x = i % w;  y = i / w;                                \
+                    save = data[y * stride + x];                          \
+                    data[y * stride + x] ^= RandomBit##bpp(~0);           \
+                    CompareIsSolid##bpp(data, w, h, stride * (bpp / 8),   \
+                                        color, offset);                   \
+                    data[y * stride + x] = save;                          \
+                }                                                         \
+            }                                                             \
+        }                                                                 \
+    }                                                                     \
+                                                                          \
+    ReportKernel("IsSolid" #bpp, rfbIsSolid##bpp != refIsSolid##bpp,      \
+                 prevErrors);                                             \
+}
+
+DEFINE_CHECK_FUNCTIONS(8)
+DEFINE_CHECK_FUNCTIONS(16)
+DEFINE_CHECK_FUNCTIONS(32)
+
+
+/* Pack every combination of byte-aligned channel shifts, plus shifts that
+   are not byte-aligned (which the SIMD implementation passes to the scalar
+   implementation), with all start offsets within a vector and all counts up
+   to three vectors' worth of pixels.  Only the first count * 3 bytes of the
+   output are defined, but the bytes beyond count * 4 must not be touched. */
+
+#define PACK24_MAX_COUNT (VEC_BYTES / 4 * 3 + 1)
+
+static void CheckPack24Kernel(char *buf, char *ref)
+{
+    static const int oddShifts[][3] = {
+        { 10, 5, 0 }, { 11, 5, 0 }, { 0, 3, 6 }, { 0, 5, 10 }, { 5, 13, 21 }
+    };
+    const int nOdd = sizeof(oddShifts) / sizeof(oddShifts[0]);
+    const int size = PACK24_MAX_COUNT * 4 + GUARD;
+    int s, shift[3], offset, count, i, end, prevErrors = errors;
+
+    for (s = 0; s < 64 + nOdd; s++) {
+        for (i = 0; i < 3; i++)
+            shift[i] = s < 64 ? (s >> (i * 2) & 3) * 8 : oddShifts[s - 64][i];
+
+        for (offset = 0; offset < 16; offset++) {
+            for (count = 0; count <= PACK24_MAX_COUNT; count++) {
+                for (i = 0; i < size; i++)
+                    buf[i] = ref[i] = (char)rand();
+                refPack24(&ref[offset], count, shift[0], shift[1], shift[2]);
+                (*rfbPack24) (&buf[offset], count, shift[0], shift[1],
+                              shift[2]);
+                end = offset + count * 4;
+                checks++;
+                if ((memcmp(buf, ref, offset + count * 3) ||
+                     memcmp(&buf[end], &ref[end], size - end)) &&
+                    errors++ < 10)
+                    printf("    Pack24(offset=%d, count=%d, shifts=%d/%d/%d): "
+                           "output does not match\n", offset, count,
+                           shift[0], shift[1], shift[2]);
+            }
+        }
+    }
+
+    ReportKernel("Pack24", rfbPack24 != refPack24, prevErrors);
+}
+
+
+static Bool CheckKernels(void)
+{
+    /* Large enough for IsSolid8() with the widest row, the maximum padding,
+       and a guard row */
+    char *buf = (char *)rfbAlloc(VEC_BYTES * 16 * 4);
+    char *ref = (char *)rfbAlloc(VEC_BYTES * 16 * 4);
+
+    printf("Pixel scanning kernels:\n");
+    CheckRunLengthKernel8((CARD8 *)buf);
+    CheckRunLengthKernel16((CARD16 *)buf);
+    CheckRunLengthKernel32((CARD32 *)buf);
+    CheckIsSolidKernel8((CARD8 *)buf);
+    CheckIsSolidKernel16((CARD16 *)buf);
+    CheckIsSolidKernel32((CARD32 *)buf);
+    CheckPack24Kernel(buf, ref);
+    printf("  %d cases checked\n", checks);
+
+    free(buf);  free(ref);
+    return errors == 0;
+}
+
+static const struct {
+    const char *name;
+    rfbPixelFormat format;
+} tests[] = {
+    { "32-bit BGRX -> 16-bit RGB565",
+      { 16, 16, 0, 1, 31, 63, 31, 11, 5, 0 } },
+    { "32-bit BGRX -> 16-bit RGB565 (big endian)",
+      { 16, 16, 1, 1, 31, 63, 31, 11, 5, 0 } },
+    { "32-bit BGRX -> 16-bit RGB555",
+      { 16, 15, 0, 1, 31, 31, 31, 10, 5, 0 } },
+    { "32-bit BGRX -> 8-bit BGR233",
+      { 8, 8, 0, 1, 7, 7, 3, 0, 3, 6 } },
+    { "32-bit BGRX -> 32-bit RGBX",
+      { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16 } },
+    { "32-bit BGRX -> 32-bit XRGB (byte-swapped)",
+      { 32, 24, 1, 1, 255, 255, 255, 16, 8, 0 } }
+};
+
+static rfbPixelFormat serverFormat = {
+    32, 24, 0, 1, 255, 255, 255, 16, 8, 0
+};
+
+
+static double GetTime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec * 0.000001;
+}
+
+
+/* Translate the frame repeatedly for the given number of seconds, and return
+   the throughput in Mpixels/sec. */
+
+static double Benchmark(rfbTranslateFnType fn, char *table,
+                        rfbPixelFormat *out, char *src, char *dst, int pitch,
+                        int w, int h, double seconds)
+{
+    double start = GetTime(), elapsed;
+    long iter = 0;
+
+    do {
+        (*fn) (table, &serverFormat, out, src, dst, pitch, w, h);
+        iter++;
+    } while ((elapsed = GetTime() - start) < seconds);
+
+    return (double)w * (double)h * (double)iter / elapsed / 1000000.;
+}
+
+
+int main(int argc, char **argv)
+{
+    /* Use an odd width and a padded pitch, so that the scalar code that
+       handles the end of each row is exercised as well. */
+    int w = 1917, h = 1080, pitch, i, retval = 0;
+    double seconds = 1.0;
+    char *src, *dst, *ref;
+
+    if (argc >= 3) {
+        w = atoi(argv[1]);
+        h = atoi(argv[2]);
+    }
+    if (argc >= 4)
+        seconds = atof(argv[3]);
+    if (w < 1 || h < 1 || seconds < 0.) {
+        fprintf(stderr, "USAGE: %s [width height [seconds]]\n", argv[0]);
+        return 1;
+    }
+
+    pitch = (w + 3) * 4;
+    src = (char *)rfbAlloc(pitch * h);
+    dst = (char *)rfbAlloc(w * h * 4);
+    ref = (char *)rfbAlloc(w * h * 4);
+    srand(0);
+    for (i = 0; i < pitch * h; i++)
+        src[i] = (char)rand();
+
+    refRunLength8 = rfbRunLength8;
+    refRunLength16 = rfbRunLength16;
+    refRunLength32 = rfbRunLength32;
+    refIsSolid8 = rfbIsSolid8;
+    refIsSolid16 = rfbIsSolid16;
+    refIsSolid32 = rfbIsSolid32;
+    refPack24 = rfbPack24;
+
+    rfbInitSIMD();
+
+    if (!CheckKernels())
+        retval = 1;
+
+    for (i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+        rfbPixelFormat out = tests[i].format;
+        rfbTranslateFnType tableFn = NULL, simdFn;
+        InitTableFn initFn = NULL;
+        const char *simdName = NULL;
+        char *table = NULL;
+        int size = w * h * out.bitsPerPixel / 8;
+        double tableSpeed, simdSpeed;
+
+        switch (out.bitsPerPixel) {
+            case 8:
+                initFn = rfbInitTrueColourRGBTables8;
+                tableFn = rfbTranslateWithRGBTables32to8;
+                break;
+            case 16:
+                initFn = rfbInitTrueColourRGBTables16;
+                tableFn = rfbTranslateWithRGBTables32to16;
+                break;
+            case 32:
+                initFn = rfbInitTrueColourRGBTables32;
+                tableFn = rfbTranslateWithRGBTables32to32;
+                break;
+        }
+        (*initFn) (&table, &serverFormat, &out);
+
+        printf("%s:\n", tests[i].name);
+        tableSpeed = Benchmark(tableFn, table, &out, src, ref, pitch, w, h,
+                               seconds);
+        if (seconds > 0.)
+            printf("  Table lookup:  %8.2f Mpixels/sec\n", tableSpeed);
+
+        simdFn = rfbGetSIMDTranslateFn(&serverFormat, &out, &simdName);
+        if (!simdFn) {
+            printf("  No SIMD fast path\n");
+            free(table);
+            continue;
+        }
+
+        memset(dst, 0, size);
+        (*simdFn) (NULL, &serverFormat, &out, src, dst, pitch, w, h);
+        if (memcmp(dst, ref, size)) {
+            printf("  %s: OUTPUT DOES NOT MATCH\n", simdName);
+            retval = 1;
+        } else if (seconds == 0.) {
+            printf("  %s:  OK\n", simdName);
+        } else {
+            simdSpeed = Benchmark(simdFn, NULL, &out, src, dst, pitch, w, h,
+                                  seconds);
+            printf("  %s:  %8.2f Mpixels/sec (%.2fx)\n", simdName, simdSpeed,
+                   simdSpeed / tableSpeed);
+        }
+        free(table);
+    }
+
+    free(src);  free(dst);  free(ref);
+    return retval;
+}
@@ -69,6 +69,23 @@ int deny_severity = LOG_WARNING;
 
 int rfbMaxClientWait = 20000;   /* time (ms) after which we decide client has
                                    gone away - needed to stop us hanging */
+Bool rfbAsyncSend = TRUE;       /* write to RFB clients from a sender thread */
+
+/* Data written to a client while its sender thread is running is coalesced
+   into buffers of at least SEND_BUF_SIZE bytes.  Framebuffer updates are
+   deferred while more than SEND_QUEUE_BUSY bytes are waiting to be sent, and
+   a client that falls more than SEND_QUEUE_MAX bytes behind is disconnected,
+   just as if a synchronous write had timed out. */
+
+#define SEND_BUF_SIZE  65536
+#define SEND_QUEUE_BUSY  (2 * 1024 * 1024)
+#define SEND_QUEUE_MAX  (256 * 1024 * 1024)
+
+typedef struct _rfbSendBuf {
+    struct _rfbSendBuf *next;
+    int len, size;
+    char data[1];
+} rfbSendBuf;
 
 int rfbPort = 0;
 int rfbListenSock = -1;
@@ -81,6 +98,8 @@ static rfbSockAddr udpRemoteAddr;
 extern unsigned long long sendBytes;
 
 static void rfbSockNotify(int fd, int ready, void *data);
+static void rfbStopSender(rfbClientPtr cl);
+static int WriteSock(rfbClientPtr cl, char *buf, int len);
 
 
 /*
@@ -112,12 +131,16 @@ const char *sockaddr_string(rfbSockAddr *addr, char *buf, int len)
 void rfbInitSockets()
 {
     static Bool done = FALSE;
+    char *env;
 
     if (done)
         return;
 
     done = TRUE;
 
+    if ((env = getenv("TVNC_ASYNCSEND")) != NULL && !strcmp(env, "0"))
+        rfbAsyncSend = FALSE;
+
     if (inetdSock != -1) {
         const int one = 1;
 
@@ -318,6 +341,27 @@ void rfbUncorkSock(int sock)
 }
 
 
+/*
+ * rfbCorkClient and rfbUncorkClient bracket a group of messages sent to a
+ * client.  Once the client has a sender thread, the messages are only queued
+ * while the socket is corked, so the sender thread corks the socket around
+ * each batch of queued data that it writes instead.
+ */
+
+void rfbCorkClient(rfbClientPtr cl)
+{
+    if (!cl->senderRunning)
+        rfbCorkSock(cl->sock);
+}
+
+
+void rfbUncorkClient(rfbClientPtr cl)
+{
+    if (!cl->senderRunning)
+        rfbUncorkSock(cl->sock);
+}
+
+
 void rfbDisconnectUDPSock()
 {
     udpSockConnected = FALSE;
@@ -337,6 +381,7 @@ void rfbCloseClient(rfbClientPtr cl)
 {
     int sock = cl->sock;
 
+    rfbStopSender(cl);
 #if USETLS
     if (cl->sslctx) {
         shutdown(sock, SHUT_RDWR);
@@ -477,14 +522,245 @@ int SkipExact(rfbClientPtr cl, int len)
 
 
 /*
- * WriteExact writes an exact number of bytes on a TCP socket.  Returns 1 if
- * those bytes have been written, or -1 if an error occurred (errno is set to
- * ETIMEDOUT if it timed out).
+ * The asynchronous sender thread.  WriteExact() hands the data to be written
+ * to the thread through a queue of rfbSendBuf structures, so that the X server
+ * never blocks on a client socket once the client has reached the RFB_NORMAL
+ * state.  If a write fails or times out, then the thread records the error and
+ * wakes up the X server through a pipe, and rfbSenderNotify() closes the
+ * connection.  TLS connections are always written synchronously, since the TLS
+ * session state isn't thread-safe.
+ */
+
+static void FreeSendBufs(rfbSendBuf *buf)
+{
+    rfbSendBuf *next;
+
+    for (; buf; buf = next) {
+        next = buf->next;
+        free(buf);
+    }
+}
+
+
+static void *SenderThreadFunc(void *param)
+{
+    rfbClientPtr cl = (rfbClientPtr)param;
+    rfbSendBuf *buf, *next;
+
+    pthread_mutex_lock(&cl->senderMutex);
+    while (!cl->senderExit) {
+        if (!cl->sendHead) {
+            pthread_cond_wait(&cl->senderCond, &cl->senderMutex);
+            continue;
+        }
+        buf = cl->sendHead;
+        cl->sendHead = cl->sendTail = NULL;
+        pthread_mutex_unlock(&cl->senderMutex);
+
+        rfbCorkSock(cl->sock);
+        for (; buf; buf = next) {
+            next = buf->next;
+            if (WriteSock(cl, buf->data, buf->len) < 0) {
+                int err = errno ? errno : EIO;
+
+                FreeSendBufs(buf);
+                pthread_mutex_lock(&cl->senderMutex);
+                cl->senderError = err;
+                pthread_mutex_unlock(&cl->senderMutex);
+                if (write(cl->senderPipe[1], "", 1) < 0) {}
+                return NULL;
+            }
+            pthread_mutex_lock(&cl->senderMutex);
+            cl->sendQueued -= buf->len;
+            pthread_mutex_unlock(&cl->senderMutex);
+            free(buf);
+        }
+        rfbUncorkSock(cl->sock);
+
+        pthread_mutex_lock(&cl->senderMutex);
+    }
+    pthread_mutex_unlock(&cl->senderMutex);
+    return NULL;
+}
+
+
+static void rfbSenderNotify(int fd, int ready, void *data)
+{
+    rfbClientPtr cl = (rfbClientPtr)data;
+    char byte;
+
+    if (read(fd, &byte, 1) < 0) {}
+    errno = cl->senderError;
+    rfbLogPerror("rfbSenderThread: write");
+    rfbCloseClient(cl);
+}
+
+
+void rfbStartSender(rfbClientPtr cl)
+{
+    int err;
+
+    if (!rfbAsyncSend || cl->senderRunning)
+        return;
+#if USETLS
+    /* Unless the kernel is encrypting the data, TLS records have to be written
+       by the thread that owns the TLS session. */
+    if (cl->sslctx && !rfbssl_ktls_send(cl))
+        return;
+#endif
+
+    if (pipe(cl->senderPipe) < 0) {
+        rfbLogPerror("rfbStartSender: pipe");
+        return;
+    }
+    pthread_mutex_init(&cl->senderMutex, NULL);
+    pthread_cond_init(&cl->senderCond, NULL);
+    cl->sendHead = cl->sendTail = NULL;
+    cl->sendQueued = 0;
+    cl->senderError = 0;
+    cl->senderExit = FALSE;
+
+    if ((err = pthread_create(&cl->senderThread, NULL, SenderThreadFunc,
+                              cl)) != 0) {
+        rfbLog("Could not start sender thread for client %s: %s\n", cl->host,
+               strerror(err));
+        pthread_mutex_destroy(&cl->senderMutex);
+        pthread_cond_destroy(&cl->senderCond);
+        close(cl->senderPipe[0]);
+        close(cl->senderPipe[1]);
+        return;
+    }
+
+    SetNotifyFd(cl->senderPipe[0], rfbSenderNotify, X_NOTIFY_READ, cl);
+    cl->senderRunning = TRUE;
+}
+
+
+/*
+ * rfbStopSender discards any data that hasn't been sent yet, so it should only
+ * be called when the connection is being closed.
+ */
+
+static void rfbStopSender(rfbClientPtr cl)
+{
+    if (!cl->senderRunning)
+        return;
+
+    pthread_mutex_lock(&cl->senderMutex);
+    cl->senderExit = TRUE;
+    pthread_cond_signal(&cl->senderCond);
+    pthread_mutex_unlock(&cl->senderMutex);
+
+    /* Unblock the thread if it is waiting for the socket to become writable */
+    shutdown(cl->sock, SHUT_RDWR);
+    pthread_join(cl->senderThread, NULL);
+    cl->senderRunning = FALSE;
+
+    FreeSendBufs(cl->sendHead);
+    cl->sendHead = cl->sendTail = NULL;
+    RemoveNotifyFd(cl->senderPipe[0]);
+    close(cl->senderPipe[0]);
+    close(cl->senderPipe[1]);
+    pthread_mutex_destroy(&cl->senderMutex);
+    pthread_cond_destroy(&cl->senderCond);
+}
+
+
+/*
+ * rfbSendQueueBusy returns TRUE if the sender thread has a backlog large
+ * enough that another framebuffer update should be deferred.
+ */
+
+Bool rfbSendQueueBusy(rfbClientPtr cl)
+{
+    Bool busy;
+
+    if (!cl->senderRunning)
+        return FALSE;
+
+    pthread_mutex_lock(&cl->senderMutex);
+    busy = (cl->sendQueued > SEND_QUEUE_BUSY);
+    pthread_mutex_unlock(&cl->senderMutex);
+    return busy;
+}
+
+
+static int QueueSend(rfbClientPtr cl, char *buf, int len)
+{
+    rfbSendBuf *sb;
+
+    pthread_mutex_lock(&cl->senderMutex);
+
+    if (cl->senderError) {
+        errno = cl->senderError;
+        pthread_mutex_unlock(&cl->senderMutex);
+        return -1;
+    }
+    if (cl->sendQueued + len > SEND_QUEUE_MAX) {
+        pthread_mutex_unlock(&cl->senderMutex);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    /* The sender thread detaches the whole queue before writing it, so the
+       tail buffer can safely be appended to. */
+    sb = cl->sendTail;
+    if (!sb || sb->size - sb->len < len) {
+        int size = max(len, SEND_BUF_SIZE);
+
+        pthread_mutex_unlock(&cl->senderMutex);
+        sb = (rfbSendBuf *)rfbAlloc(sizeof(rfbSendBuf) + size - 1);
+        sb->next = NULL;
+        sb->len = 0;
+        sb->size = size;
+        pthread_mutex_lock(&cl->senderMutex);
+        if (cl->sendTail)
+            cl->sendTail->next = sb;
+        else
+            cl->sendHead = sb;
+        cl->sendTail = sb;
+    }
+    memcpy(&sb->data[sb->len], buf, len);
+    sb->len += len;
+    cl->sendQueued += len;
+
+    pthread_cond_signal(&cl->senderCond);
+    pthread_mutex_unlock(&cl->senderMutex);
+    return 1;
+}
+
+
+/*
+ * WriteExact writes an exact number of bytes on a TCP socket, or queues them
+ * for the client's sender thread.  Returns 1 if those bytes have been written
+ * or queued, or -1 if an error occurred (errno is set to ETIMEDOUT if it timed
+ * out).
  */
 
 int WriteExact(rfbClientPtr cl, char *buf, int len)
 {
-    int n, bytesWritten = 0;
+    if (cl->senderRunning) {
+        if (QueueSend(cl, buf, len) < 0)
+            return -1;
+    } else if (WriteSock(cl, buf, len) < 0)
+        return -1;
+
+    sendBytes += len;
+    gettimeofday(&cl->lastWrite, NULL);
+    cl->sockOffset += len;
+
+    return 1;
+}
+
+
+/*
+ * WriteSock does the actual work of WriteExact(), on either the main thread
+ * or the client's sender thread.
+ */
+
+static int WriteSock(rfbClientPtr cl, char *buf, int len)
+{
+    int n;
     fd_set fds;
     struct timeval tv;
     int totalTimeWaited = 0;
@@ -504,12 +780,10 @@ int WriteExact(rfbClientPtr cl, char *buf, int len)
 
             buf += n;
             len -= n;
-            bytesWritten += n;
-            sendBytes += n;
 
         } else if (n == 0) {
 
-            rfbLog("WriteExact: write returned 0?\n");
+            rfbLog("WriteSock: write returned 0?\n");
             exit(1);
 
         } else {
@@ -529,7 +803,7 @@ int WriteExact(rfbClientPtr cl, char *buf, int len)
               n = select(sock + 1, NULL, &fds, NULL, &tv);
             } while (n < 0 && errno == EINTR);
             if (n < 0) {
-                rfbLogPerror("WriteExact: select");
+                rfbLogPerror("WriteSock: select");
                 return n;
             }
             if (n == 0) {
@@ -544,9 +818,6 @@ int WriteExact(rfbClientPtr cl, char *buf, int len)
         }
     }
 
-    gettimeofday(&cl->lastWrite, NULL);
-    cl->sockOffset += bytesWritten;
-
     return 1;
 }
 
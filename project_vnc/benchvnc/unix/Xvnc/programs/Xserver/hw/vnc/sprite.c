@@ -900,6 +900,7 @@ rfbSpriteRemoveCursor(DeviceIntPtr pDev, ScreenPtr pScreen)
     }
     rfbSpriteEnableDamage(pScreen, pScreenPriv);
     DamageDrawInternal(pScreen, FALSE);
+    rfbAddCursorRegion(pScreen, &pCursorInfo->saved);
 
     rfbFB.dontSendFramebufferUpdate = FALSE;
 }
@@ -981,6 +982,7 @@ rfbSpriteRestoreCursor(DeviceIntPtr pDev, ScreenPtr pScreen)
     }
     rfbSpriteEnableDamage(pScreen, pScreenPriv);
     DamageDrawInternal(pScreen, FALSE);
+    rfbAddCursorRegion(pScreen, &pCursorInfo->saved);
 
     rfbFB.dontSendFramebufferUpdate = FALSE;
 }
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "rfb.h"
 
 static char *encNames[MAX_ENCODINGS] = {
@@ -46,12 +47,39 @@ void rfbResetStats(rfbClientPtr cl)
     cl->rfbLastRectBytesSent = 0;
     cl->rfbCursorShapeBytesSent = 0;
     cl->rfbCursorShapeUpdatesSent = 0;
+    cl->rfbCursorCacheHits = 0;
     cl->rfbCursorPosBytesSent = 0;
     cl->rfbCursorPosUpdatesSent = 0;
     cl->rfbFramebufferUpdateMessagesSent = 0;
     cl->rfbRawBytesEquivalent = 0;
     cl->rfbKeyEventsRcvd = 0;
     cl->rfbPointerEventsRcvd = 0;
+    cl->rfbUpdatesDeferred = 0;
+    memset(&cl->rfbUpdateBytes, 0, sizeof(rfbHistogram));
+}
+
+
+const char *rfbEncodingName(int encoding)
+{
+    if (encoding < 0 || encoding >= MAX_ENCODINGS)
+        return "[Unknown]";
+    return encNames[encoding];
+}
+
+
+/* Returns the number of bytes sent to the client in framebuffer updates. */
+
+long long rfbTotalBytesSent(rfbClientPtr cl)
+{
+    int i;
+    long long totalBytesSent = 0;
+
+    for (i = 0; i < MAX_ENCODINGS; i++)
+        totalBytesSent += cl->rfbBytesSent[i];
+    totalBytesSent += (cl->rfbCursorShapeBytesSent +
+                       cl->rfbCursorPosBytesSent +
+                       cl->rfbLastRectBytesSent);
+    return totalBytesSent;
 }
 
 
@@ -59,7 +87,7 @@ void rfbPrintStats(rfbClientPtr cl)
 {
     int i;
     int totalRectanglesSent = 0;
-    long long totalBytesSent = 0;
+    long long totalBytesSent = rfbTotalBytesSent(cl);
 
     rfbLog("Statistics:\n");
 
@@ -67,16 +95,11 @@ void rfbPrintStats(rfbClientPtr cl)
         rfbLog("  key events received %d, pointer events %d\n",
                 cl->rfbKeyEventsRcvd, cl->rfbPointerEventsRcvd);
 
-    for (i = 0; i < MAX_ENCODINGS; i++) {
+    for (i = 0; i < MAX_ENCODINGS; i++)
         totalRectanglesSent += cl->rfbRectanglesSent[i];
-        totalBytesSent += cl->rfbBytesSent[i];
-    }
     totalRectanglesSent += (cl->rfbCursorShapeUpdatesSent +
                             cl->rfbCursorPosUpdatesSent +
                             cl->rfbLastRectMarkersSent);
-    totalBytesSent += (cl->rfbCursorShapeBytesSent +
-                       cl->rfbCursorPosBytesSent +
-                       cl->rfbLastRectBytesSent);
 
     rfbLog("  framebuffer updates %d, rectangles %d, bytes %d\n",
             cl->rfbFramebufferUpdateMessagesSent, totalRectanglesSent,
@@ -90,6 +113,9 @@ void rfbPrintStats(rfbClientPtr cl)
         rfbLog("    cursor shape updates %d, bytes %d\n",
                 cl->rfbCursorShapeUpdatesSent, cl->rfbCursorShapeBytesSent);
 
+    if (cl->rfbCursorCacheHits != 0)
+        rfbLog("    cursor cache hits %d\n", cl->rfbCursorCacheHits);
+
     if (cl->rfbCursorPosUpdatesSent != 0)
         rfbLog("    cursor position updates %d, bytes %d\n",
                cl->rfbCursorPosUpdatesSent, cl->rfbCursorPosBytesSent);
@@ -96,7 +96,7 @@ static int qualityLevel;
 static int subsampLevel;
 
 static const int subsampLevel2tjsubsamp[TVNC_SAMPOPT] = {
-    TJ_444, TJ_420, TJ_422, TJ_GRAYSCALE
+    TJSAMP_444, TJSAMP_420, TJSAMP_422, TJSAMP_GRAY
 };
 
 
@@ -138,6 +138,8 @@ typedef struct _threadparam {
     CARD32 monoBackground, monoForeground;
     PALETTE palette;
     tjhandle j;
+    unsigned char *jpegSrcBuf;
+    int jpegSrcBufSize;
     int bytessent, rectsent;
     int streamId, baseStreamId, nStreams;
     pthread_mutex_t ready, done;
@@ -286,6 +288,8 @@ static void InitThreads(void)
     int err = 0, i;
     if (threadInit) return;
 
+    rfbInitSIMD();
+
     memset(tparam, 0, sizeof(threadparam) * MAX_ENCODING_THREADS);
     tparam[0].ublen = &ublen;
     tparam[0].updateBuf = updateBuf;
@@ -293,6 +297,11 @@ static void InitThreads(void)
         tparam[i].ublen = &tparam[i]._ublen;
         tparam[i].id = i;
     }
+    /* Create the TurboJPEG compressor instances up front, so the first JPEG
+       rectangle sent to the first viewer doesn't pay the setup cost.  If this
+       fails, then SendJpegRect() will try again and report the error. */
+    for (i = 0; i < rfbNumThreads; i++)
+        tparam[i].j = tjInitCompress();
     rfbLog("Using %d thread%s for Tight encoding\n", rfbNumThreads,
            rfbNumThreads == 1 ? "" : "s");
     if (rfbNumThreads > 1) {
@@ -337,6 +346,7 @@ void ShutdownTightThreads(void)
         if (tparam[i].tightAfterBuf) free(tparam[i].tightAfterBuf);
         if (tparam[i].tightBeforeBuf) free(tparam[i].tightBeforeBuf);
         if (i != 0 && tparam[i].updateBuf) free(tparam[i].updateBuf);
+        if (tparam[i].jpegSrcBuf) free(tparam[i].jpegSrcBuf);
         if (tparam[i].j) tjDestroy(tparam[i].j);
         if (!REGION_NAR(&tparam[i].losslessRegion))
             REGION_UNINIT(pScreen, &tparam[i].losslessRegion);
@@ -714,7 +724,6 @@ static Bool CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,  \
 {                                                                             \
     CARD##bpp *fbptr;                                                         \
     CARD##bpp colorValue;                                                     \
-    int dx, dy;                                                               \
                                                                               \
     fbptr =                                                                   \
         (CARD##bpp *)&cl->fb[y * rfbFB.paddedWidthInBytes + x * (bpp / 8)];   \
@@ -723,13 +732,8 @@ static Bool CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,  \
     if (needSameColor && (CARD32)colorValue != *colorPtr)                     \
         return FALSE;                                                         \
                                                                               \
-    for (dy = 0; dy < h; dy++) {                                              \
-        for (dx = 0; dx < w; dx++) {                                          \
-            if (colorValue != fbptr[dx])                                      \
-                return FALSE;                                                 \
-        }                                                                     \
-        fbptr = (CARD##bpp *)((CARD8 *)fbptr + rfbFB.paddedWidthInBytes);     \
-    }                                                                         \
+    if (!rfbIsSolid##bpp(fbptr, w, h, rfbFB.paddedWidthInBytes, colorValue))  \
+        return FALSE;                                                         \
                                                                               \
     *colorPtr = (CARD32)colorValue;                                           \
     return TRUE;                                                              \
@@ -1233,7 +1237,7 @@ static void FillPalette8(threadparam *t, int count)
     t->paletteNumColors = 0;
 
     c0 = data[0];
-    for (i = 1; i < count && data[i] == c0; i++);
+    i = 1 + rfbRunLength8(&data[1], count - 1, c0, (CARD8)~0);
     if (i == count) {
         t->paletteNumColors = 1;
         return;                 /* Solid rectangle */
@@ -1272,10 +1276,10 @@ static void FillPalette##bpp(threadparam *t, int count)                 \
 {                                                                       \
     CARD##bpp *data = (CARD##bpp *)t->tightBeforeBuf;                   \
     CARD##bpp c0, c1, ci;                                               \
-    int i, n0, n1, ni;                                                  \
+    int i, n, n0, n1, ni;                                               \
                                                                         \
     c0 = data[0];                                                       \
-    for (i = 1; i < count && data[i] == c0; i++);                       \
+    i = 1 + rfbRunLength##bpp(&data[1], count - 1, c0, (CARD##bpp)~0);  \
     if (i >= count) {                                                   \
         t->paletteNumColors = 1;   /* Solid rectangle */                \
         return;                                                         \
@@ -1316,14 +1320,14 @@ static void FillPalette##bpp(threadparam *t, int count)                 \
                                                                         \
     ni = 1;                                                             \
     for (i++; i < count; i++) {                                         \
-        if (data[i] == ci) {                                            \
-            ni++;                                                       \
-        } else {                                                        \
-            if (!PaletteInsert(t, ci, (CARD32)ni, bpp))                 \
-                return;                                                 \
-            ci = data[i];                                               \
-            ni = 1;                                                     \
-        }                                                               \
+        n = rfbRunLength##bpp(&data[i], count - i, ci, (CARD##bpp)~0);  \
+        ni += n;  i += n;                                               \
+        if (i >= count)                                                 \
+            break;                                                      \
+        if (!PaletteInsert(t, ci, (CARD32)ni, bpp))                     \
+            return;                                                     \
+        ci = data[i];                                                   \
+        ni = 1;                                                         \
     }                                                                   \
     PaletteInsert(t, ci, (CARD32)ni, bpp);                              \
 }
@@ -1338,7 +1342,7 @@ static void FastFillPalette##bpp(threadparam *t, CARD##bpp *data,         \
                                  int w, int pitch, int h)                 \
 {                                                                         \
     CARD##bpp c0, c1, ci, mask, c0t, c1t, cit;                            \
-    int i, j, i2 = 0, j2, n0, n1, ni;                                     \
+    int i, j, i2 = 0, j2, n, n0, n1, ni;                                  \
     rfbClientPtr cl = t->cl;                                              \
                                                                           \
     if (cl->translateFn != rfbTranslateNone) {                            \
@@ -1349,12 +1353,10 @@ static void FastFillPalette##bpp(threadparam *t, CARD##bpp *data,         \
                                                                           \
     c0 = data[0] & mask;                                                  \
     for (j = 0; j < h; j++) {                                             \
-        for (i = 0; i < w; i++) {                                         \
-            if ((data[j * pitch + i] & mask) != c0)                       \
-                goto done;                                                \
-        }                                                                 \
+        i = rfbRunLength##bpp(&data[j * pitch], w, c0, mask);             \
+        if (i < w)                                                        \
+            break;                                                        \
     }                                                                     \
-    done:                                                                 \
     if (j >= h) {                                                         \
         t->paletteNumColors = 1;   /* Solid rectangle */                  \
         return;                                                           \
@@ -1407,18 +1409,18 @@ static void FastFillPalette##bpp(threadparam *t, CARD##bpp *data,         \
     i2++;  if (i2 >= w) { i2 = 0;  j2++; }                                \
     for (j = j2; j < h; j++) {                                            \
         for (i = i2; i < w; i++) {                                        \
-            if ((data[j * pitch + i] & mask) == ci) {                     \
-                ni++;                                                     \
-            } else {                                                      \
-                (*cl->translateFn) (cl->translateLookupTable,             \
-                                    &rfbServerFormat, &cl->format,        \
-                                    (char *)&ci, (char *)&cit, bpp / 8,   \
-                                    1, 1);                                \
-                if (!PaletteInsert(t, cit, (CARD32)ni, bpp))              \
-                    return;                                               \
-                ci = data[j * pitch + i] & mask;                          \
-                ni = 1;                                                   \
-            }                                                             \
+            n = rfbRunLength##bpp(&data[j * pitch + i], w - i, ci, mask); \
+            ni += n;  i += n;                                             \
+            if (i >= w)                                                   \
+                break;                                                    \
+            (*cl->translateFn) (cl->translateLookupTable,                 \
+                                &rfbServerFormat, &cl->format,            \
+                                (char *)&ci, (char *)&cit, bpp / 8,       \
+                                1, 1);                                    \
+            if (!PaletteInsert(t, cit, (CARD32)ni, bpp))                  \
+                return;                                                   \
+            ci = data[j * pitch + i] & mask;                              \
+            ni = 1;                                                       \
         }                                                                 \
         i2 = 0;                                                           \
     }                                                                     \
@@ -1521,12 +1523,8 @@ static int PaletteInsert(threadparam *t, CARD32 rgb, int numPixels, int bpp)
 
 static void Pack24(char *buf, rfbPixelFormat *fmt, int count)
 {
-    CARD32 *buf32;
-    CARD32 pix;
     int r_shift, g_shift, b_shift;
 
-    buf32 = (CARD32 *)buf;
-
     if (!rfbServerFormat.bigEndian == !fmt->bigEndian) {
         r_shift = fmt->redShift;
         g_shift = fmt->greenShift;
@@ -1537,12 +1535,7 @@ static void Pack24(char *buf, rfbPixelFormat *fmt, int count)
         b_shift = 24 - fmt->blueShift;
     }
 
-    while (count--) {
-        pix = *buf32++;
-        *buf++ = (char)(pix >> r_shift);
-        *buf++ = (char)(pix >> g_shift);
-        *buf++ = (char)(pix >> b_shift);
-    }
+    (*rfbPack24) (buf, count, r_shift, g_shift, b_shift);
 }
 
 
@@ -1642,16 +1635,24 @@ DEFINE_MONO_ENCODE_FUNCTION(32)
 
 #define DEFINE_RGB_CONVERT_FUNCTION(bpp)                                   \
                                                                            \
-static unsigned char *ConvertRGB##bpp(rfbClientPtr cl, int x, int y,       \
+static unsigned char *ConvertRGB##bpp(threadparam *t, int x, int y,        \
                                       int w, int h)                        \
 {                                                                          \
     CARD##bpp *srcptr, pix;                                                \
-    unsigned char *dst, *tmpbuf;                                           \
+    unsigned char *dst;                                                    \
     int inRed, inGreen, inBlue, i, j, ps = bpp / 8;                        \
+    rfbClientPtr cl = t->cl;                                               \
                                                                            \
-    tmpbuf = (unsigned char *)rfbAlloc(w * h * 3);                         \
+    if (t->jpegSrcBufSize < w * h * 3) {                                   \
+        t->jpegSrcBufSize = w * h * 3;                                     \
+        if (t->jpegSrcBuf == NULL)                                         \
+            t->jpegSrcBuf = (unsigned char *)rfbAlloc(t->jpegSrcBufSize);  \
+        else                                                               \
+            t->jpegSrcBuf = (unsigned char *)rfbRealloc(t->jpegSrcBuf,     \
+                                                        t->jpegSrcBufSize);\
+    }                                                                      \
     srcptr = (CARD##bpp *)&cl->fb[y * rfbFB.paddedWidthInBytes + x * ps];  \
-    dst = tmpbuf;                                                          \
+    dst = t->jpegSrcBuf;                                                   \
     for (j = 0; j < h; j++) {                                              \
         CARD##bpp *srcptr2 = srcptr;                                       \
         unsigned char *dst2 = dst;                                         \
@@ -1676,13 +1677,33 @@ static unsigned char *ConvertRGB##bpp(rfbClientPtr cl, int x, int y,       \
         srcptr += rfbFB.paddedWidthInBytes / ps;                           \
         dst += w * 3;                                                      \
     }                                                                      \
-    return tmpbuf;                                                         \
+    return t->jpegSrcBuf;                                                  \
 }
 
 DEFINE_RGB_CONVERT_FUNCTION(16)
 DEFINE_RGB_CONVERT_FUNCTION(32)
 
 
+/*
+ * Map the server's pixel format to a TurboJPEG pixel format, so that 24-bit
+ * and 32-bit framebuffers can be compressed in place.
+ */
+
+static int TJPixelFormat(int ps)
+{
+    Bool bgr;
+
+    bgr = (rfbServerFormat.redShift == 16 && rfbServerFormat.blueShift == 0);
+    if (rfbServerFormat.bigEndian) bgr = !bgr;
+
+    if (ps == 3)
+        return bgr ? TJPF_BGR : TJPF_RGB;
+    if (rfbServerFormat.bigEndian)
+        return bgr ? TJPF_XBGR : TJPF_XRGB;
+    return bgr ? TJPF_BGRX : TJPF_RGBX;
+}
+
+
 /*
  * JPEG compression stuff.
  */
@@ -1690,13 +1711,11 @@ DEFINE_RGB_CONVERT_FUNCTION(32)
 static Bool SendJpegRect(threadparam *t, int x, int y, int w, int h,
                          int quality)
 {
-    unsigned char *srcbuf;
+    unsigned char *srcbuf, *jpegBuf;
     int ps = rfbServerFormat.bitsPerPixel / 8;
     int subsamp = subsampLevel2tjsubsamp[subsampLevel];
-    unsigned long size = 0;
-    int flags = 0, pitch;
-    unsigned char *tmpbuf = NULL;
-    unsigned long jpegDstDataLen;
+    unsigned long size = 0, bufSize;
+    int pitch, pixelFormat;
     rfbClientPtr cl = t->cl;
 
     if (rfbServerFormat.bitsPerPixel == 8) {
@@ -1710,50 +1729,45 @@ static Bool SendJpegRect(threadparam *t, int x, int y, int w, int h,
     }
     if (!t->j) {
         if ((t->j = tjInitCompress()) == NULL) {
-            rfbLog("JPEG Error: %s\n", tjGetErrorStr());
+            rfbLog("JPEG Error: %s\n", tjGetErrorStr2(NULL));
             return 0;
         }
     }
 
-    if (t->tightAfterBufSize < TJBUFSIZE(w, h)) {
+    /* The JPEG image is compressed directly into tightAfterBuf, which is
+       grown to the worst-case JPEG size ahead of time so that TurboJPEG never
+       needs to reallocate it. */
+    bufSize = tjBufSize(w, h, subsamp);
+    if (t->tightAfterBufSize < (int)bufSize) {
         if (t->tightAfterBuf == NULL)
-            t->tightAfterBuf = (char *)rfbAlloc(TJBUFSIZE(w, h));
+            t->tightAfterBuf = (char *)rfbAlloc(bufSize);
         else
-            t->tightAfterBuf = (char *)rfbRealloc(t->tightAfterBuf,
-                                                  TJBUFSIZE(w, h));
-        t->tightAfterBufSize = TJBUFSIZE(w, h);
+            t->tightAfterBuf = (char *)rfbRealloc(t->tightAfterBuf, bufSize);
+        t->tightAfterBufSize = (int)bufSize;
     }
 
     if (ps == 2) {
-        tmpbuf = ConvertRGB16(cl, x, y, w, h);
-        srcbuf = tmpbuf;
+        srcbuf = ConvertRGB16(t, x, y, w, h);
         pitch = w * 3;
-        ps = 3;
+        pixelFormat = TJPF_RGB;
     } else if (rfbServerFormat.depth == 30) {
-        tmpbuf = ConvertRGB32(cl, x, y, w, h);
-        srcbuf = tmpbuf;
+        srcbuf = ConvertRGB32(t, x, y, w, h);
         pitch = w * 3;
-        ps = 3;
+        pixelFormat = TJPF_RGB;
     } else {
-        if (rfbServerFormat.bigEndian && ps == 4) flags |= TJ_ALPHAFIRST;
-        if (rfbServerFormat.redShift == 16 && rfbServerFormat.blueShift == 0)
-            flags |= TJ_BGR;
-        if (rfbServerFormat.bigEndian) flags ^= TJ_BGR;
         srcbuf = (unsigned char *)
             &cl->fb[y * rfbFB.paddedWidthInBytes + x * ps];
         pitch = rfbFB.paddedWidthInBytes;
+        pixelFormat = TJPixelFormat(ps);
     }
 
-    if (tjCompress(t->j, srcbuf, w, pitch, h, ps,
-                   (unsigned char *)t->tightAfterBuf, &size, subsamp, quality,
-                   flags) == -1) {
-      rfbLog("JPEG Error: %s\n", tjGetErrorStr());
-      if (tmpbuf) { free(tmpbuf);  tmpbuf = NULL; }
-      return 0;
+    jpegBuf = (unsigned char *)t->tightAfterBuf;
+    size = (unsigned long)t->tightAfterBufSize;
+    if (tjCompress2(t->j, srcbuf, w, pitch, h, pixelFormat, &jpegBuf, &size,
+                    subsamp, quality, TJFLAG_NOREALLOC) == -1) {
+        rfbLog("JPEG Error: %s\n", tjGetErrorStr2(t->j));
+        return 0;
     }
-    jpegDstDataLen = (int)size;
-
-    if (tmpbuf) { free(tmpbuf);  tmpbuf = NULL; }
 
     if (!CheckUpdateBuf(t, TIGHT_MIN_TO_COMPRESS + 1))
         return FALSE;
@@ -1763,5 +1777,5 @@ static Bool SendJpegRect(threadparam *t, int x, int y, int w, int h,
 
     ADD_TO_LOSSY_REGION(x, y, w, h);
 
-    return SendCompressedData(t, t->tightAfterBuf, jpegDstDataLen);
+    return SendCompressedData(t, t->tightAfterBuf, (int)size);
 }
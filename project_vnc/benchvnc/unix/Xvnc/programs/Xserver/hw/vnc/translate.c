@@ -182,6 +182,9 @@ void rfbTranslateNone(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
 
 Bool rfbSetTranslateFunction(rfbClientPtr cl)
 {
+    rfbTranslateFnType simdFn;
+    const char *simdName = NULL;
+
     rfbLog("Pixel format for client %s:\n", cl->host);
     PrintPixelFormat(&cl->format);
 
@@ -283,8 +286,19 @@ Bool rfbSetTranslateFunction(rfbClientPtr cl)
         return TRUE;
     }
 
-    if ((rfbServerFormat.bitsPerPixel < 16) ||
-        (!rfbEconomicTranslate && (rfbServerFormat.bitsPerPixel == 16))) {
+    rfbInitSIMD();
+    simdFn = rfbGetSIMDTranslateFn(&rfbServerFormat, &cl->format, &simdName);
+
+    if (simdFn) {
+
+        /* use a SIMD fast path, which doesn't need a lookup table */
+
+        rfbLog("  using %s translation\n", simdName);
+        cl->translateFn = simdFn;
+
+    } else if ((rfbServerFormat.bitsPerPixel < 16) ||
+               (!rfbEconomicTranslate &&
+                (rfbServerFormat.bitsPerPixel == 16))) {
 
         /* we can use a single lookup table for <= 16 bpp */
 
@@ -0,0 +1,291 @@
+/*
+ * vncpresent.c - Present extension backend driven by the video encoder clock
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * Without a backend, the Present extension falls back to a timer-based fake
+ * vblank that runs at 60 Hz with no relation to when the H.264 encoders
+ * capture frames, so applications that sync to vblank render out of phase with
+ * the encoders and add up to a frame of latency.  This backend instead derives
+ * the MSC (vblank counter) and UST (vblank time) from the encoders' frame
+ * clock.  Each time the encoders capture a frame (see ShmCaptureCallback in
+ * Xext/shm.c), that is a vblank, and pending Present requests for that MSC
+ * are completed right away.  If nothing is captured for slightly more than a
+ * frame interval (for instance, because nothing on the screen is changing),
+ * then a timer generates the vblanks instead, so the MSC keeps advancing at
+ * the encoder frame rate.
+ *
+ * In just-in-time mode (TVNC_PRESENTJIT), the vblank for the next frame is
+ * signalled a fixed number of microseconds before that frame is expected to be
+ * captured, so that an application which renders on vblank finishes just in
+ * time for the capture rather than waiting most of a frame interval for it.
+ */
+
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "rfb.h"
+#include "present.h"
+#include "shmint.h"
+
+
+#define DEFAULT_FPS  60
+
+typedef struct _vncVblank {
+    struct xorg_list list;
+    uint64_t event_id, msc;
+} vncVblank;
+
+static struct xorg_list vblankQueue;
+static uint64_t curMSC = 0, curUST = 0;
+static uint64_t interval = 1000000 / DEFAULT_FPS;  /* us */
+static int jitLead = 0;                             /* us, 0 = disabled */
+static OsTimerPtr vblankTimer = NULL, jitTimer = NULL;
+
+
+static void NotifyVblanks(uint64_t msc, uint64_t ust)
+{
+    vncVblank *vblank, *tmp;
+
+    xorg_list_for_each_entry_safe(vblank, tmp, &vblankQueue, list) {
+        if (vblank->msc <= msc) {
+            xorg_list_del(&vblank->list);
+            present_event_notify(vblank->event_id, ust, msc);
+            free(vblank);
+        }
+    }
+}
+
+
+static CARD32 vblankTimerCallback(OsTimerPtr timer, CARD32 time, void *arg);
+static CARD32 jitTimerCallback(OsTimerPtr timer, CARD32 time, void *arg);
+
+/* Return the number of milliseconds until the given UST, rounded up. */
+
+static CARD32 MillisUntil(uint64_t ust, uint64_t now)
+{
+    return ust > now ? (CARD32)((ust - now + 999) / 1000) : 1;
+}
+
+
+/* Advance the clock by the given number of frames and complete the requests
+   for the new MSC.  The fallback timer is set a quarter of a frame interval
+   after the next vblank is due, so that a capture that is slightly behind
+   schedule still generates the vblank.  The timer is set relative to the time
+   the next vblank is due, not relative to now, so the timer-generated vblanks
+   run at exactly the frame rate. */
+
+static void Vblank(uint64_t ust, uint64_t frames)
+{
+    uint64_t now = GetTimeInMicros(), next;
+
+    curMSC += frames;
+    curUST = ust;
+    NotifyVblanks(curMSC, curUST);
+
+    next = curUST + interval;
+    vblankTimer = TimerSet(vblankTimer, 0, MillisUntil(next + interval / 4, now),
+                           vblankTimerCallback, NULL);
+    if (jitLead > 0 && (uint64_t)jitLead < interval)
+        jitTimer = TimerSet(jitTimer, 0, MillisUntil(next - jitLead, now),
+                            jitTimerCallback, NULL);
+}
+
+
+static CARD32 vblankTimerCallback(OsTimerPtr timer, CARD32 time, void *arg)
+{
+    uint64_t now = GetTimeInMicros(), frames = 1;
+
+    /* Nothing was captured since the last vblank, so generate the vblanks
+       that were due, based on the time that has actually elapsed. */
+    if (now > curUST + interval)
+        frames = (now - curUST) / interval;
+    Vblank(curUST + frames * interval, frames);
+    return 0;
+}
+
+
+static CARD32 jitTimerCallback(OsTimerPtr timer, CARD32 time, void *arg)
+{
+    /* Let the applications that are waiting for the next frame start drawing
+       it now, so that it is ready when the encoders capture it. */
+    NotifyVblanks(curMSC + 1, curUST + interval);
+    return 0;
+}
+
+
+static void vncPresentCaptured(CallbackListPtr *callbacks, void *data,
+                               void *callData)
+{
+    uint64_t ust = *(CARD64 *)callData;
+
+    /* The encoders never capture more often than once per frame interval, so
+       a capture that follows a timer-generated vblank closely belongs to the
+       same frame.  In that case, just move the clock's phase to the capture
+       time. */
+    if (ust < curUST + interval / 2) {
+        curUST = ust;
+        return;
+    }
+    Vblank(ust, 1);
+}
+
+
+static RRCrtcPtr vncPresentGetCrtc(WindowPtr pWin)
+{
+    rrScrPrivPtr rp = rrGetScrPriv(pWin->drawable.pScreen);
+    RRCrtcPtr best = NULL;
+    long bestArea = 0;
+    int i;
+
+    if (!rp)
+        return NULL;
+
+    /* Use the CRTC that shows the largest part of the window. */
+    for (i = 0; i < rp->numCrtcs; i++) {
+        RRCrtcPtr crtc = rp->crtcs[i];
+        int x1, y1, x2, y2;
+        long area;
+
+        if (!crtc->mode)
+            continue;
+        x1 = max(pWin->drawable.x, crtc->x);
+        y1 = max(pWin->drawable.y, crtc->y);
+        x2 = min(pWin->drawable.x + pWin->drawable.width,
+                 crtc->x + (int)crtc->mode->mode.width);
+        y2 = min(pWin->drawable.y + pWin->drawable.height,
+                 crtc->y + (int)crtc->mode->mode.height);
+        if (x2 <= x1 || y2 <= y1)
+            continue;
+        area = (long)(x2 - x1) * (y2 - y1);
+        if (area > bestArea) {
+            bestArea = area;
+            best = crtc;
+        }
+    }
+
+    return best;
+}
+
+
+static int vncPresentGetUstMsc(RRCrtcPtr crtc, uint64_t *ust, uint64_t *msc)
+{
+    *ust = curUST;
+    *msc = curMSC;
+    return Success;
+}
+
+
+static Bool vncPresentQueueVblank(RRCrtcPtr crtc, uint64_t event_id,
+                                  uint64_t msc)
+{
+    vncVblank *vblank;
+
+    if (msc <= curMSC) {
+        present_event_notify(event_id, curUST, curMSC);
+        return TRUE;
+    }
+
+    if ((vblank = (vncVblank *)malloc(sizeof(vncVblank))) == NULL)
+        return FALSE;
+    vblank->event_id = event_id;
+    vblank->msc = msc;
+    xorg_list_add(&vblank->list, &vblankQueue);
+    return TRUE;
+}
+
+
+static void vncPresentAbortVblank(RRCrtcPtr crtc, uint64_t event_id,
+                                  uint64_t msc)
+{
+    vncVblank *vblank, *tmp;
+
+    xorg_list_for_each_entry_safe(vblank, tmp, &vblankQueue, list) {
+        if (vblank->event_id == event_id) {
+            xorg_list_del(&vblank->list);
+            free(vblank);
+            break;
+        }
+    }
+}
+
+
+static void vncPresentFlush(WindowPtr pWin)
+{
+}
+
+
+static present_screen_info_rec vncPresentInfo = {
+    .version = PRESENT_SCREEN_INFO_VERSION,
+    .get_crtc = vncPresentGetCrtc,
+    .get_ust_msc = vncPresentGetUstMsc,
+    .queue_vblank = vncPresentQueueVblank,
+    .abort_vblank = vncPresentAbortVblank,
+    .flush = vncPresentFlush,
+    .capabilities = PresentCapabilityNone,
+    .check_flip = NULL,
+    .flip = NULL,
+    .unflip = NULL
+};
+
+
+/*
+ * Called from rfbScreenInit(), before the Present extension is initialized
+ * (otherwise, the extension would install the fake vblank backend.)
+ */
+
+Bool vncPresentInit(ScreenPtr pScreen)
+{
+    char *env;
+    int fps;
+
+    /* TVNC_RTSPFPS is a list of per-output frame rates.  The vblank clock
+       follows the first output. */
+    fps = (int)rtsp_get_env_param("TVNC_RTSPFPS", 0, DEFAULT_FPS);
+    interval = 1000000 / fps;
+
+    if ((env = getenv("TVNC_PRESENTJIT")) != NULL && strlen(env) >= 1) {
+        int temp = atoi(env);
+        if (temp >= 0 && (uint64_t)temp < interval)
+            jitLead = temp;
+        else
+            rfbLog("WARNING: Invalid value of TVNC_PRESENTJIT (%s) ignored\n",
+                   env);
+    }
+
+    xorg_list_init(&vblankQueue);
+    if (!AddCallback(&ShmCaptureCallback, vncPresentCaptured, NULL))
+        return FALSE;
+    if (!present_screen_init(pScreen, &vncPresentInfo))
+        return FALSE;
+
+    curUST = GetTimeInMicros();
+    Vblank(curUST, 1);
+
+    if (jitLead > 0)
+        rfbLog("Present vblank clock: %d Hz, just-in-time lead %d us\n", fps,
+               jitLead);
+    else
+        rfbLog("Present vblank clock: %d Hz\n", fps);
+    return TRUE;
+}
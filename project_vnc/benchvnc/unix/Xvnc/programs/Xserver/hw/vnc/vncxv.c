@@ -0,0 +1,382 @@
+/*
+ * vncxv.c - XVideo adaptor that feeds YUV images to the video encoders
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * Without an Xv adaptor, video players draw each frame with (Shm)PutImage, so
+ * they convert the decoded YUV frame to RGB, and the H.264 encoders then
+ * convert the framebuffer back to YUV.  This adaptor accepts I420, YV12, NV12,
+ * and YUY2 images through XvPutImage and XvShmPutImage.  Each image is scaled
+ * and converted into the framebuffer with libswscale, so that RFB viewers and
+ * the parts of the screen that the video doesn't cover are still correct, and
+ * its planes are then handed to the encoders (see ShmEncodeXvImage() in
+ * Xext/shm.c.)  The RandR outputs that the video window covers are encoded
+ * straight from those planes, with no color conversion at all if the image is
+ * I420 or YV12 at the output's resolution.
+ */
+
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#ifdef XV
+
+#include <stdlib.h>
+#include <string.h>
+#include "rfb.h"
+#include "extinit.h"
+#include "xvdix.h"
+#include "shmint.h"
+#include <X11/extensions/Xv.h>
+#include <libswscale/swscale.h>
+
+
+#define NUM_PORTS         8
+#define MAX_IMAGE_WIDTH   8192
+#define MAX_IMAGE_HEIGHT  8192
+
+#define FOURCC_YUY2  0x32595559
+#define FOURCC_YV12  0x32315659
+#define FOURCC_I420  0x30323449
+#define FOURCC_NV12  0x3231564E
+
+#define XVIMAGE_GUID(a, b, c, d)  \
+    { a, b, c, d, 0x00, 0x00, 0x00, 0x10, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, \
+      0x9B, 0x71 }
+
+static const XvImageRec vncXvImages[] = {
+    { FOURCC_YUY2, XvYUV, LSBFirst, XVIMAGE_GUID('Y', 'U', 'Y', '2'), 16,
+      XvPacked, 1, 0, 0, 0, 0, 8, 8, 8, 1, 2, 2, 1, 1, 1,
+      { 'Y', 'U', 'Y', 'V' }, XvTopToBottom },
+    { FOURCC_YV12, XvYUV, LSBFirst, XVIMAGE_GUID('Y', 'V', '1', '2'), 12,
+      XvPlanar, 3, 0, 0, 0, 0, 8, 8, 8, 1, 2, 2, 1, 2, 2,
+      { 'Y', 'V', 'U' }, XvTopToBottom },
+    { FOURCC_I420, XvYUV, LSBFirst, XVIMAGE_GUID('I', '4', '2', '0'), 12,
+      XvPlanar, 3, 0, 0, 0, 0, 8, 8, 8, 1, 2, 2, 1, 2, 2,
+      { 'Y', 'U', 'V' }, XvTopToBottom },
+    { FOURCC_NV12, XvYUV, LSBFirst, XVIMAGE_GUID('N', 'V', '1', '2'), 12,
+      XvPlanar, 2, 0, 0, 0, 0, 8, 8, 8, 1, 2, 2, 1, 2, 2,
+      { 'Y', 'U', 'V' }, XvTopToBottom }
+};
+
+#define NUM_IMAGES  (sizeof(vncXvImages) / sizeof(XvImageRec))
+
+typedef struct {
+    struct SwsContext *swsCtx;
+    unsigned char *buf;           /* Scaled RGB image */
+    size_t bufSize;
+} vncXvPortRec, *vncXvPortPtr;
+
+static XvAdaptorPtr vncXvAdaptor = NULL;
+static CloseScreenProcPtr vncXvCloseScreenProc = NULL;
+static enum AVPixelFormat vncXvDstFormat;
+
+
+/* Compute the size of a width x height image, and (if pitches and offsets
+   aren't NULL) the pitch and offset of each of its planes.  This is also used
+   to find the planes of the images that clients send, so it must agree with
+   what the client was told. */
+
+static int vncXvQueryImageAttributes(XvPortPtr pPort, XvImagePtr pImage,
+                                     CARD16 *width, CARD16 *height,
+                                     int *pitches, int *offsets)
+{
+    int size, tmp;
+
+    if (*width > MAX_IMAGE_WIDTH) *width = MAX_IMAGE_WIDTH;
+    if (*height > MAX_IMAGE_HEIGHT) *height = MAX_IMAGE_HEIGHT;
+    *width = (*width + 1) & ~1;
+    if (offsets) offsets[0] = 0;
+
+    switch (pImage->id) {
+        case FOURCC_YV12:
+        case FOURCC_I420:
+            *height = (*height + 1) & ~1;
+            size = (*width + 3) & ~3;
+            if (pitches) pitches[0] = size;
+            size *= *height;
+            if (offsets) offsets[1] = size;
+            tmp = ((*width >> 1) + 3) & ~3;
+            if (pitches) pitches[1] = pitches[2] = tmp;
+            tmp *= (*height >> 1);
+            size += tmp;
+            if (offsets) offsets[2] = size;
+            size += tmp;
+            break;
+        case FOURCC_NV12:
+            *height = (*height + 1) & ~1;
+            size = (*width + 3) & ~3;
+            if (pitches) pitches[0] = pitches[1] = size;
+            size *= *height;
+            if (offsets) offsets[1] = size;
+            size += ((*width + 3) & ~3) * (*height >> 1);
+            break;
+        default:  /* FOURCC_YUY2 */
+            size = *width * 2;
+            if (pitches) pitches[0] = size;
+            size *= *height;
+            break;
+    }
+
+    return size;
+}
+
+
+static int vncXvPutImage(DrawablePtr pDraw, XvPortPtr pPort, GCPtr pGC,
+                         INT16 vid_x, INT16 vid_y, CARD16 vid_w, CARD16 vid_h,
+                         INT16 drw_x, INT16 drw_y, CARD16 drw_w, CARD16 drw_h,
+                         XvImagePtr pImage, unsigned char *data, Bool sync,
+                         CARD16 width, CARD16 height)
+{
+    vncXvPortPtr pPriv = (vncXvPortPtr)pPort->devPriv.ptr;
+    const unsigned char *planes[3] = { NULL, NULL, NULL };
+    int pitches[3] = { 0, 0, 0 }, offsets[3] = { 0, 0, 0 };
+    unsigned char *dst[1];
+    int dstPitch[1];
+    enum AVPixelFormat format;
+    CARD16 w = width, h = height;
+    size_t size;
+
+    if (vid_x < 0 || vid_y < 0 || vid_x + vid_w > width ||
+        vid_y + vid_h > height)
+        return BadValue;
+
+    /* Chroma is subsampled horizontally in all of the formats, so the source
+       rectangle has to start on an even pixel. */
+    vid_w += vid_x & 1;  vid_x &= ~1;
+    if (pImage->id != FOURCC_YUY2) {
+        vid_h += vid_y & 1;  vid_y &= ~1;
+    }
+    if (vid_w < 2 || vid_h < 2 || drw_w < 1 || drw_h < 1)
+        return Success;
+
+    vncXvQueryImageAttributes(pPort, pImage, &w, &h, pitches, offsets);
+
+    switch (pImage->id) {
+        case FOURCC_YV12:
+            /* YV12 is I420 with the U and V planes swapped */
+            format = AV_PIX_FMT_YUV420P;
+            planes[0] = data + vid_y * pitches[0] + vid_x;
+            planes[1] = data + offsets[2] + vid_y / 2 * pitches[2] + vid_x / 2;
+            planes[2] = data + offsets[1] + vid_y / 2 * pitches[1] + vid_x / 2;
+            break;
+        case FOURCC_I420:
+            format = AV_PIX_FMT_YUV420P;
+            planes[0] = data + vid_y * pitches[0] + vid_x;
+            planes[1] = data + offsets[1] + vid_y / 2 * pitches[1] + vid_x / 2;
+            planes[2] = data + offsets[2] + vid_y / 2 * pitches[2] + vid_x / 2;
+            break;
+        case FOURCC_NV12:
+            format = AV_PIX_FMT_NV12;
+            planes[0] = data + vid_y * pitches[0] + vid_x;
+            planes[1] = data + offsets[1] + vid_y / 2 * pitches[1] + vid_x;
+            break;
+        case FOURCC_YUY2:
+            format = AV_PIX_FMT_YUYV422;
+            planes[0] = data + vid_y * pitches[0] + vid_x * 2;
+            break;
+        default:
+            return BadMatch;
+    }
+
+    /* Scale and convert the image into the framebuffer */
+    size = (size_t)drw_w * drw_h * 4;
+    if (size > pPriv->bufSize) {
+        free(pPriv->buf);
+        pPriv->buf = (unsigned char *)rfbAlloc(size);
+        pPriv->bufSize = size;
+    }
+    if ((pPriv->swsCtx = sws_getCachedContext(pPriv->swsCtx, vid_w, vid_h,
+                                              format, drw_w, drw_h,
+                                              vncXvDstFormat,
+                                              SWS_FAST_BILINEAR, NULL, NULL,
+                                              NULL)) == NULL) {
+        rfbLog("Xv: Could not initialize scaling context\n");
+        return BadAlloc;
+    }
+    dst[0] = pPriv->buf;
+    dstPitch[0] = drw_w * 4;
+    sws_scale(pPriv->swsCtx, planes, pitches, 0, vid_h, dst, dstPitch);
+    (*pGC->ops->PutImage) (pDraw, pGC, pDraw->depth, drw_x, drw_y, drw_w,
+                           drw_h, 0, ZPixmap, (char *)pPriv->buf);
+
+    ShmEncodeXvImage(pDraw, drw_x, drw_y, drw_w, drw_h, planes, pitches,
+                     format, vid_w, vid_h);
+
+    return Success;
+}
+
+
+static int vncXvStopVideo(XvPortPtr pPort, DrawablePtr pDraw)
+{
+    vncXvPortPtr pPriv = (vncXvPortPtr)pPort->devPriv.ptr;
+
+    free(pPriv->buf);
+    pPriv->buf = NULL;
+    pPriv->bufSize = 0;
+    return Success;
+}
+
+
+static int vncXvQueryBestSize(XvPortPtr pPort, CARD8 motion, CARD16 vid_w,
+                              CARD16 vid_h, CARD16 drw_w, CARD16 drw_h,
+                              unsigned int *p_w, unsigned int *p_h)
+{
+    /* Any size can be scaled to any other size. */
+    *p_w = drw_w;
+    *p_h = drw_h;
+    return Success;
+}
+
+
+/* This adaptor has no attributes and no video or still ports. */
+
+static int vncXvSetPortAttribute(XvPortPtr pPort, Atom attribute,
+                                 INT32 value)
+{
+    return BadMatch;
+}
+
+static int vncXvGetPortAttribute(XvPortPtr pPort, Atom attribute,
+                                 INT32 *value)
+{
+    return BadMatch;
+}
+
+static int vncXvNoVideo(DrawablePtr pDraw, XvPortPtr pPort, GCPtr pGC,
+                        INT16 vid_x, INT16 vid_y, CARD16 vid_w, CARD16 vid_h,
+                        INT16 drw_x, INT16 drw_y, CARD16 drw_w, CARD16 drw_h)
+{
+    return BadMatch;
+}
+
+
+static Bool vncXvCloseScreen(ScreenPtr pScreen)
+{
+    if (vncXvAdaptor) {
+        vncXvPortPtr ports = (vncXvPortPtr)vncXvAdaptor->devPriv.ptr;
+        int i;
+
+        for (i = 0; i < vncXvAdaptor->nPorts; i++) {
+            if (ports[i].swsCtx) sws_freeContext(ports[i].swsCtx);
+            free(ports[i].buf);
+        }
+        XvFreeAdaptor(vncXvAdaptor);
+        free(vncXvAdaptor);
+        vncXvAdaptor = NULL;
+    }
+
+    pScreen->CloseScreen = vncXvCloseScreenProc;
+    return (*pScreen->CloseScreen) (pScreen);
+}
+
+
+/*
+ * Register the adaptor with the Xv extension.  Returns FALSE only if an
+ * allocation fails.  The adaptor is not registered if the framebuffer isn't
+ * 32-bit true color or the XVideo extension has been disabled.
+ */
+
+Bool vncXvInit(ScreenPtr pScreen)
+{
+    XvScreenPtr pxvs;
+    XvAdaptorPtr pa;
+    vncXvPortPtr ports;
+    int i;
+
+    if (noXvExtension)
+        return TRUE;
+    if (rfbServerFormat.bitsPerPixel != 32 || !rfbServerFormat.trueColour ||
+        rfbServerFormat.greenShift != 8 ||
+        (rfbServerFormat.redShift != 16 && rfbServerFormat.blueShift != 16)) {
+        rfbLog("Xv: Framebuffer is not 32-bit RGB.  Disabling Xv adaptor.\n");
+        return TRUE;
+    }
+    vncXvDstFormat = rfbServerFormat.redShift == 16 ? AV_PIX_FMT_0RGB32 :
+                     AV_PIX_FMT_0BGR32;
+
+    if (XvScreenInit(pScreen) != Success)
+        return FALSE;
+    pxvs = (XvScreenPtr)dixLookupPrivate(&pScreen->devPrivates,
+                                         XvGetScreenKey());
+
+    pa = (XvAdaptorPtr)rfbAlloc0(sizeof(XvAdaptorRec));
+    pa->type = XvInputMask | XvImageMask;
+    pa->name = strdup("TurboVNC Video Encoder");
+    pa->pScreen = pScreen;
+
+    pa->nEncodings = 1;
+    pa->pEncodings = (XvEncodingPtr)rfbAlloc0(sizeof(XvEncodingRec));
+    pa->pEncodings[0].id = 0;
+    pa->pEncodings[0].pScreen = pScreen;
+    pa->pEncodings[0].name = strdup("XV_IMAGE");
+    pa->pEncodings[0].width = MAX_IMAGE_WIDTH;
+    pa->pEncodings[0].height = MAX_IMAGE_HEIGHT;
+    pa->pEncodings[0].rate.numerator = 1;
+    pa->pEncodings[0].rate.denominator = 1;
+
+    pa->nFormats = 1;
+    pa->pFormats = (XvFormatPtr)rfbAlloc0(sizeof(XvFormatRec));
+    pa->pFormats[0].depth = rfbServerFormat.depth;
+    pa->pFormats[0].visual = pScreen->rootVisual;
+
+    pa->nImages = NUM_IMAGES;
+    pa->pImages = (XvImagePtr)rfbAlloc(sizeof(vncXvImages));
+    memcpy(pa->pImages, vncXvImages, sizeof(vncXvImages));
+
+    pa->nPorts = NUM_PORTS;
+    pa->pPorts = (XvPortPtr)rfbAlloc0(NUM_PORTS * sizeof(XvPortRec));
+    ports = (vncXvPortPtr)rfbAlloc0(NUM_PORTS * sizeof(vncXvPortRec));
+    pa->devPriv.ptr = ports;
+    for (i = 0; i < NUM_PORTS; i++) {
+        XvPortPtr pPort = &pa->pPorts[i];
+
+        pPort->id = FakeClientID(0);
+        pPort->pAdaptor = pa;
+        pPort->time = currentTime;
+        pPort->devPriv.ptr = &ports[i];
+        if (!AddResource(pPort->id, XvGetRTPort(), pPort))
+            return FALSE;
+    }
+    pa->base_id = pa->pPorts[0].id;
+
+    pa->ddPutVideo = vncXvNoVideo;
+    pa->ddPutStill = vncXvNoVideo;
+    pa->ddGetVideo = vncXvNoVideo;
+    pa->ddGetStill = vncXvNoVideo;
+    pa->ddStopVideo = vncXvStopVideo;
+    pa->ddSetPortAttribute = vncXvSetPortAttribute;
+    pa->ddGetPortAttribute = vncXvGetPortAttribute;
+    pa->ddQueryBestSize = vncXvQueryBestSize;
+    pa->ddPutImage = vncXvPutImage;
+    pa->ddQueryImageAttributes = vncXvQueryImageAttributes;
+
+    pxvs->nAdaptors = 1;
+    pxvs->pAdaptors = pa;
+    vncXvAdaptor = pa;
+
+    vncXvCloseScreenProc = pScreen->CloseScreen;
+    pScreen->CloseScreen = vncXvCloseScreen;
+
+    rfbLog("Xv adaptor: %d ports, I420/YV12/NV12/YUY2 images\n", NUM_PORTS);
+    return TRUE;
+}
+
+#endif  /* XV */
@@ -0,0 +1,581 @@
+/*
+ * tvncload - generate reproducible synthetic workloads for benchmarking
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+/*
+ * tvncload draws one of several synthetic workloads into a window at a target
+ * frame rate, so that encoder and scheduler changes can be benchmarked without
+ * real applications.  The output depends only on the frame number and the
+ * random seed, so runs are reproducible.
+ *
+ * tvncload also speaks the input-to-display latency protocol of the TurboVNC
+ * Server's time tracker.  For the first core key or motion event generated by
+ * each RFB input event, Xvnc replaces the event's timestamp with the ID of the
+ * RFB event.  When tvncload receives such an event, it immediately draws a new
+ * frame and then puts a small MIT-SHM image whose first 12 bytes are
+ * 0xdeadbeef, the event ID, and the index of the event's time tracker slot
+ * (all big endian.)  ProcShmPutImage() recognizes that image and records the
+ * time at which the response to the event was drawn.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/select.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#ifdef USE_GLX
+#include <GL/gl.h>
+#include <GL/glx.h>
+#endif
+
+
+/* Must match NUM_ROW in the server's include/timetrack.h.  The server records
+   RFB input event n in time tracker slot ((n - 1) % (NUM_ROW - 1)) + 1. */
+#define NUM_ROW  1000
+
+#define STAMP_WIDTH  4
+#define MARKER_SIZE  32
+
+enum { WL_VIDEO, WL_TEXT, WL_DRAG, WL_WIDGETS, WL_GL, NUM_WORKLOADS };
+
+static const char *workloadNames[NUM_WORKLOADS] = {
+  "video", "text", "drag", "widgets", "gl"
+};
+
+static const char *words[] = {
+  "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "render",
+  "frame", "buffer", "encode", "update", "region", "latency", "pixel",
+  "window", "server", "viewer", "stream", "tile", "scroll", "display"
+};
+
+static char *programName;
+static Display *dpy;
+static Window win, dragWin;
+static GC gc;
+static Visual *visual;
+static int depth, width = 0, height = 0, workload = WL_VIDEO;
+static unsigned int seed = 1;
+static unsigned long black, white;
+
+/* Full-window image used by the video workload, and the small image used to
+   stamp frames with input event IDs */
+static XImage *image = NULL, *stampImage = NULL;
+static XShmSegmentInfo shminfo, stampShminfo;
+
+static XFontStruct *font = NULL;
+static int dragX = 0, dragY = 0, dragDX = 7, dragDY = 5, dragW, dragH;
+
+#define WIDGET_W  96
+#define WIDGET_H  24
+#define WIDGETS_PER_FRAME  3
+
+#ifdef USE_GLX
+static GLXContext ctx = NULL;
+#endif
+
+
+static void usage(void)
+{
+  fprintf(stderr, "\nUSAGE: %s [options]\n\n", programName);
+  fprintf(stderr, "-display <d> = X display on which to draw the workload (default: read from\n"
+                  "               the DISPLAY environment variable)\n");
+  fprintf(stderr, "-workload <w> = workload to generate:\n"
+                  "                video = full-window video-like noise (MIT-SHM images)\n"
+                  "                text = scrolling text (CopyArea + core text)\n"
+                  "                drag = a window dragged across the screen\n"
+                  "                widgets = sparse updates to small widgets\n");
+#ifdef USE_GLX
+  fprintf(stderr, "                gl = OpenGL buffer swaps\n");
+#endif
+  fprintf(stderr, "                (default: video)\n");
+  fprintf(stderr, "-fps <f> = target frame rate (default: 30)\n");
+  fprintf(stderr, "-geometry <w>x<h> = window size (default: size of the screen)\n");
+  fprintf(stderr, "-duration <s> = exit after <s> seconds (default: run until killed)\n");
+  fprintf(stderr, "-seed <n> = random seed (default: 1)\n");
+  fprintf(stderr, "-nostamp = do not stamp the response to each input event with its ID\n\n");
+  exit(1);
+}
+
+
+static double gettime(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.;
+}
+
+
+static unsigned int xorshift(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+
+static XImage *createShmImage(int w, int h, XShmSegmentInfo *info)
+{
+  XImage *img = XShmCreateImage(dpy, visual, depth, ZPixmap, NULL, info, w,
+                                h);
+
+  if (!img || img->bits_per_pixel != 32) {
+    fprintf(stderr, "%s: could not create a 32-bit MIT-SHM image\n",
+            programName);
+    exit(1);
+  }
+  info->shmid = shmget(IPC_PRIVATE, img->bytes_per_line * h,
+                       IPC_CREAT | 0600);
+  if (info->shmid == -1) {
+    perror("shmget");
+    exit(1);
+  }
+  info->shmaddr = img->data = shmat(info->shmid, NULL, 0);
+  if (info->shmaddr == (char *)-1) {
+    perror("shmat");
+    exit(1);
+  }
+  info->readOnly = False;
+  if (!XShmAttach(dpy, info)) {
+    fprintf(stderr, "%s: XShmAttach() failed\n", programName);
+    exit(1);
+  }
+  XSync(dpy, False);
+  /* The segment is destroyed when both processes have detached from it. */
+  shmctl(info->shmid, IPC_RMID, NULL);
+  memset(img->data, 0, img->bytes_per_line * h);
+  return img;
+}
+
+
+static void destroyShmImage(XImage *img, XShmSegmentInfo *info)
+{
+  if (!img) return;
+  XShmDetach(dpy, info);
+  XSync(dpy, False);
+  shmdt(info->shmaddr);
+  img->data = NULL;
+  XDestroyImage(img);
+}
+
+
+/* Put the stamp image, which tells the server that the response to input
+   event eventID has been drawn. */
+
+static void stamp(unsigned int eventID)
+{
+  unsigned char *data = (unsigned char *)stampImage->data;
+  unsigned int slot = eventID ? (eventID - 1) % (NUM_ROW - 1) + 1 : 1;
+
+  data[0] = 0xde;  data[1] = 0xad;  data[2] = 0xbe;  data[3] = 0xef;
+  data[4] = eventID >> 24;  data[5] = eventID >> 16;
+  data[6] = eventID >> 8;  data[7] = eventID;
+  data[8] = slot >> 24;  data[9] = slot >> 16;
+  data[10] = slot >> 8;  data[11] = slot;
+  XShmPutImage(dpy, win, gc, stampImage, 0, 0, 0, 0, STAMP_WIDTH, 1, False);
+}
+
+
+static void drawVideo(int frame)
+{
+  int x, y;
+
+  for (y = 0; y < height; y++) {
+    unsigned int *row =
+      (unsigned int *)&image->data[y * image->bytes_per_line];
+
+    for (x = 0; x < width; x++) {
+      unsigned int r = (x * 2 + frame * 3) & 0xbf,
+        g = (y * 2 + frame * 5) & 0xbf, b = (x + y + frame) & 0xbf;
+
+      row[x] = ((r << 16) | (g << 8) | b) + (xorshift() & 0x3f3f3f);
+    }
+  }
+  XShmPutImage(dpy, win, gc, image, 0, 0, 0, 0, width, height, False);
+}
+
+
+static void drawText(int frame)
+{
+  int lineHeight = font->ascent + font->descent, len;
+  char str[1024];
+
+  XCopyArea(dpy, win, win, gc, 0, lineHeight, width, height - lineHeight, 0,
+            0);
+  XSetForeground(dpy, gc, white);
+  XFillRectangle(dpy, win, gc, 0, height - lineHeight, width, lineHeight);
+  XSetForeground(dpy, gc, black);
+
+  len = snprintf(str, sizeof(str), "%08d ", frame);
+  while (len < (int)sizeof(str) - 16 &&
+         XTextWidth(font, str, len) < width) {
+    const char *word = words[xorshift() % (sizeof(words) / sizeof(char *))];
+
+    len += snprintf(&str[len], sizeof(str) - len, " %s", word);
+  }
+  XDrawString(dpy, win, gc, 4, height - font->descent, str, len);
+}
+
+
+static void drawDrag(int frame)
+{
+  dragX += dragDX;  dragY += dragDY;
+  if (dragX < 0 || dragX + dragW > width) {
+    dragDX = -dragDX;  dragX += dragDX * 2;
+  }
+  if (dragY < 0 || dragY + dragH > height) {
+    dragDY = -dragDY;  dragY += dragDY * 2;
+  }
+  XMoveWindow(dpy, dragWin, dragX, dragY);
+}
+
+
+static void drawWidgets(int frame)
+{
+  int cols = width / WIDGET_W, rows = height / WIDGET_H, i;
+  char str[32];
+
+  if (cols < 1 || rows < 1) return;
+
+  for (i = 0; i < WIDGETS_PER_FRAME; i++) {
+    int widget = xorshift() % (cols * rows);
+    int x = (widget % cols) * WIDGET_W, y = (widget / cols) * WIDGET_H;
+
+    XSetForeground(dpy, gc, 0xc0c0c0 | (xorshift() & 0x3f3f3f));
+    XFillRectangle(dpy, win, gc, x + 2, y + 2, WIDGET_W - 4, WIDGET_H - 4);
+    XSetForeground(dpy, gc, black);
+    XDrawRectangle(dpy, win, gc, x + 2, y + 2, WIDGET_W - 5, WIDGET_H - 5);
+    snprintf(str, sizeof(str), "%d", frame);
+    XDrawString(dpy, win, gc, x + 8, y + WIDGET_H - 8, str, strlen(str));
+  }
+}
+
+
+#ifdef USE_GLX
+static void drawGL(int frame)
+{
+  int i;
+
+  glClearColor((frame % 64) / 255.f, 0.1f, 0.2f, 1.f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glLoadIdentity();
+  glRotatef((float)frame * 2.f, 0.f, 0.f, 1.f);
+  glBegin(GL_TRIANGLES);
+  for (i = 0; i < 64; i++) {
+    float x = (float)(i % 8) / 4.f - 1.f, y = (float)(i / 8) / 4.f - 1.f;
+
+    glColor3f((float)i / 64.f, (float)((i + frame) % 64) / 64.f, 0.5f);
+    glVertex2f(x, y);
+    glVertex2f(x + 0.2f, y);
+    glVertex2f(x, y + 0.2f);
+  }
+  glEnd();
+  glXSwapBuffers(dpy, win);
+}
+#endif
+
+
+static void drawFrame(int frame)
+{
+  switch (workload) {
+    case WL_VIDEO:    drawVideo(frame);  break;
+    case WL_TEXT:     drawText(frame);  break;
+    case WL_DRAG:     drawDrag(frame);  break;
+    case WL_WIDGETS:  drawWidgets(frame);  break;
+#ifdef USE_GLX
+    case WL_GL:       drawGL(frame);  break;
+#endif
+  }
+}
+
+
+static void createDragWindow(void)
+{
+  XSetWindowAttributes attr;
+  Pixmap pixmap;
+  int y;
+
+  dragW = width / 3;  dragH = height / 3;
+  pixmap = XCreatePixmap(dpy, win, dragW, dragH, depth);
+  XSetForeground(dpy, gc, white);
+  XFillRectangle(dpy, pixmap, gc, 0, 0, dragW, dragH);
+  XSetForeground(dpy, gc, 0x3060a0);
+  XFillRectangle(dpy, pixmap, gc, 0, 0, dragW, 20);
+  XSetForeground(dpy, gc, black);
+  for (y = 40; y < dragH; y += 16) {
+    const char *word = words[xorshift() % (sizeof(words) / sizeof(char *))];
+
+    XDrawString(dpy, pixmap, gc, 8, y, word, strlen(word));
+  }
+
+  attr.background_pixmap = pixmap;
+  attr.border_pixel = black;
+  dragWin = XCreateWindow(dpy, win, 0, 0, dragW, dragH, 1, depth,
+                          InputOutput, visual, CWBackPixmap | CWBorderPixel,
+                          &attr);
+  XFreePixmap(dpy, pixmap);
+  XMapWindow(dpy, dragWin);
+}
+
+
+static void createWindow(void)
+{
+  int screen = DefaultScreen(dpy);
+  XSetWindowAttributes attr;
+  unsigned long mask = CWBackPixel | CWOverrideRedirect | CWEventMask;
+  XGCValues gcv;
+
+  visual = DefaultVisual(dpy, screen);
+  depth = DefaultDepth(dpy, screen);
+  black = BlackPixel(dpy, screen);
+  white = WhitePixel(dpy, screen);
+  attr.background_pixel = workload == WL_WIDGETS ? 0x808080 : white;
+  attr.override_redirect = True;
+  attr.event_mask = KeyPressMask | ButtonPressMask | PointerMotionMask |
+                    ExposureMask;
+
+#ifdef USE_GLX
+  if (workload == WL_GL) {
+    int attribs[] = { GLX_RGBA, GLX_DOUBLEBUFFER, GLX_RED_SIZE, 8,
+                      GLX_GREEN_SIZE, 8, GLX_BLUE_SIZE, 8, None };
+    XVisualInfo *vi = glXChooseVisual(dpy, screen, attribs);
+
+    if (!vi) {
+      fprintf(stderr, "%s: no suitable GLX visual\n", programName);
+      exit(1);
+    }
+    visual = vi->visual;
+    depth = vi->depth;
+    attr.colormap = XCreateColormap(dpy, RootWindow(dpy, screen), visual,
+                                    AllocNone);
+    attr.border_pixel = 0;
+    mask |= CWColormap | CWBorderPixel;
+    if (!(ctx = glXCreateContext(dpy, vi, NULL, True))) {
+      fprintf(stderr, "%s: could not create OpenGL context\n", programName);
+      exit(1);
+    }
+    XFree(vi);
+  }
+#endif
+
+  win = XCreateWindow(dpy, RootWindow(dpy, screen), 0, 0, width, height, 0,
+                      depth, InputOutput, visual, mask, &attr);
+  XStoreName(dpy, win, "tvncload");
+
+  gcv.graphics_exposures = False;
+  gc = XCreateGC(dpy, win, GCGraphicsExposures, &gcv);
+
+  /* The stamp image is also used by the other workloads, so the server must
+     support MIT-SHM regardless. */
+  if (!XShmQueryExtension(dpy)) {
+    fprintf(stderr, "%s: the X server does not support MIT-SHM\n",
+            programName);
+    exit(1);
+  }
+  stampImage = createShmImage(STAMP_WIDTH, 1, &stampShminfo);
+
+  switch (workload) {
+    case WL_VIDEO:
+      image = createShmImage(width, height, &shminfo);
+      break;
+    case WL_TEXT:
+    case WL_WIDGETS:
+      if (!(font = XLoadQueryFont(dpy, "fixed"))) {
+        fprintf(stderr, "%s: could not load font \"fixed\"\n", programName);
+        exit(1);
+      }
+      XSetFont(dpy, gc, font->fid);
+      break;
+    case WL_DRAG:
+      createDragWindow();
+      break;
+  }
+
+  XMapRaised(dpy, win);
+#ifdef USE_GLX
+  if (ctx) glXMakeCurrent(dpy, win, ctx);
+#endif
+  XSync(dpy, False);
+  XSetInputFocus(dpy, win, RevertToPointerRoot, CurrentTime);
+}
+
+
+int main(int argc, char **argv)
+{
+  char *displayname = NULL;
+  double fps = 30., duration = 0., startTime, nextFrame, interval;
+  int i, frame = 0, lateFrames = 0, nStamped = 0, doStamp = 1;
+  int markerX = 0, markerY = 0, markerOn = 0;
+
+  programName = argv[0];
+
+  for (i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "-disp", 5)) {
+      if (++i >= argc) usage();
+      displayname = argv[i];
+    } else if (!strncmp(argv[i], "-w", 2)) {
+      int w;
+
+      if (++i >= argc) usage();
+      for (w = 0; w < NUM_WORKLOADS; w++)
+        if (!strcasecmp(argv[i], workloadNames[w])) break;
+#ifndef USE_GLX
+      if (w == WL_GL) {
+        fprintf(stderr, "ERROR: %s was built without OpenGL support.\n",
+                programName);
+        exit(1);
+      }
+#endif
+      if (w >= NUM_WORKLOADS) usage();
+      workload = w;
+    } else if (!strncmp(argv[i], "-f", 2)) {
+      if (++i >= argc) usage();
+      fps = atof(argv[i]);
+      if (fps <= 0.) {
+        fprintf(stderr, "ERROR: frame rate must be greater than 0.\n");
+        exit(1);
+      }
+    } else if (!strncmp(argv[i], "-g", 2)) {
+      if (++i >= argc) usage();
+      if (sscanf(argv[i], "%dx%d", &width, &height) != 2 || width < 1 ||
+          height < 1)
+        usage();
+    } else if (!strncmp(argv[i], "-du", 3)) {
+      if (++i >= argc) usage();
+      duration = atof(argv[i]);
+    } else if (!strncmp(argv[i], "-s", 2)) {
+      if (++i >= argc) usage();
+      seed = strtoul(argv[i], NULL, 10);
+      if (seed == 0) seed = 1;
+    } else if (!strncmp(argv[i], "-nos", 4)) {
+      doStamp = 0;
+    } else usage();
+  }
+
+  if (!(dpy = XOpenDisplay(displayname))) {
+    fprintf(stderr, "%s: unable to open display \"%s\"\n", programName,
+            XDisplayName(displayname));
+    exit(1);
+  }
+  if (width == 0) {
+    width = DisplayWidth(dpy, DefaultScreen(dpy));
+    height = DisplayHeight(dpy, DefaultScreen(dpy));
+  }
+
+  createWindow();
+
+  interval = 1. / fps;
+  startTime = nextFrame = gettime();
+
+  while (1) {
+    double now = gettime();
+    int react = 0;
+    unsigned int eventID = 0;
+
+    if (duration > 0. && now - startTime >= duration)
+      break;
+
+    while (XPending(dpy)) {
+      XEvent ev;
+
+      XNextEvent(dpy, &ev);
+      switch (ev.type) {
+        case KeyPress:
+          /* Xvnc stores the RFB event ID in the timestamp. */
+          eventID = ev.xkey.time;
+          react = 1;
+          break;
+        case MotionNotify:
+          eventID = ev.xmotion.time;
+          markerX = ev.xmotion.x;  markerY = ev.xmotion.y;
+          react = 1;
+          break;
+        case ButtonPress:
+          markerX = ev.xbutton.x;  markerY = ev.xbutton.y;
+          react = 1;
+          break;
+      }
+    }
+
+    if (!react && now < nextFrame) {
+      fd_set fds;
+      struct timeval tv;
+      double timeout = nextFrame - now;
+
+      FD_ZERO(&fds);
+      FD_SET(ConnectionNumber(dpy), &fds);
+      tv.tv_sec = (long)timeout;
+      tv.tv_usec = (long)((timeout - (double)tv.tv_sec) * 1000000.);
+      select(ConnectionNumber(dpy) + 1, &fds, NULL, NULL, &tv);
+      continue;
+    }
+
+    drawFrame(frame++);
+
+    /* Respond visibly to input by toggling a marker at the pointer position,
+       then stamp the response. */
+    if (react) {
+      markerOn = !markerOn;
+      XSetForeground(dpy, gc, markerOn ? 0xff0000 : 0x0000ff);
+      XFillRectangle(dpy, win, gc, markerX - MARKER_SIZE / 2,
+                     markerY - MARKER_SIZE / 2, MARKER_SIZE, MARKER_SIZE);
+      if (doStamp && eventID) {
+        stamp(eventID);
+        nStamped++;
+      }
+    }
+
+    /* Wait for the X server to process the frame, so that requests don't
+       pile up if the server can't keep up with the target frame rate. */
+    XSync(dpy, False);
+
+    if (!react) {
+      nextFrame += interval;
+      now = gettime();
+      if (now - nextFrame > interval) {
+        nextFrame = now;
+        lateFrames++;
+      }
+    }
+  }
+
+  fprintf(stderr, "%s: %s workload, %d frames in %.2f seconds (%.2f fps), "
+          "%d late, %d input events stamped\n", programName,
+          workloadNames[workload], frame, gettime() - startTime,
+          (double)frame / (gettime() - startTime), lateFrames, nStamped);
+
+  destroyShmImage(image, &shminfo);
+  destroyShmImage(stampImage, &stampShminfo);
+#ifdef USE_GLX
+  if (ctx) {
+    glXMakeCurrent(dpy, None, NULL);
+    glXDestroyContext(dpy, ctx);
+  }
+#endif
+  if (font) XFreeFont(dpy, font);
+  XCloseDisplay(dpy);
+
+  return 0;
+}
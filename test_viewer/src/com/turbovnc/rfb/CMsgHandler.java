@@ -75,6 +75,7 @@ public abstract class CMsgHandler {
 
   public abstract void setCursor(int width, int height, Point hotspot,
                                  int[] data, byte[] mask);
+  public abstract void setVideoRegion(Rect[] rects);
   public abstract void serverInit();
 
   public abstract void framebufferUpdateStart();
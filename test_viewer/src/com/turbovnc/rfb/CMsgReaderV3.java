@@ -53,10 +53,15 @@ public class CMsgReaderV3 extends CMsgReader {
         serverMsgCaps.add(cap);
       }
       List<byte[]> clientMsgCaps = new ArrayList<byte[]>();
+      handler.cp.supportsKeyframeRequest = false;
       for (int i = 0; i < nClientMsg; i++) {
         byte[] cap = new byte[16];
         is.readBytes(cap, 0, 16);
         clientMsgCaps.add(cap);
+        // The first 4 bytes of each capability are the message type.
+        if (cap[0] == 0 && cap[1] == 0 && cap[2] == 0 &&
+            (cap[3] & 0xff) == RFB.REQUEST_KEYFRAME)
+          handler.cp.supportsKeyframeRequest = true;
       }
       List<byte[]> supportedEncodings = new ArrayList<byte[]>();
       for (int i = 0; i < nEncodings; i++) {
@@ -128,6 +133,9 @@ public class CMsgReaderV3 extends CMsgReader {
         case RFB.ENCODING_CLIENT_REDIRECT:
           readClientRedirect(x, y, w, h);
           break;
+        case RFB.ENCODING_VIDEO_REGION:
+          readVideoRegion();
+          break;
         default:
           readRect(new Rect(x, y, x + w, y + h), encoding);	//ALTER
           break;
@@ -325,6 +333,21 @@ public class CMsgReaderV3 extends CMsgReader {
     }
   }
 
+  void readVideoRegion() {
+    int nRects = is.readU32();
+    Rect[] rects = new Rect[nRects];
+
+    for (int i = 0; i < nRects; i++) {
+      int rx = is.readU16();
+      int ry = is.readU16();
+      int rw = is.readU16();
+      int rh = is.readU16();
+
+      rects[i] = new Rect(rx, ry, rx + rw, ry + rh);
+    }
+    handler.setVideoRegion(rects);
+  }
+
   void readClientRedirect(int x, int y, int w, int h) {
     int port = is.readU16();
     String host = is.readString();
@@ -69,6 +69,8 @@ public abstract class CMsgWriter {
       encodings[nEncodings++] = RFB.ENCODING_DESKTOP_NAME;
     if (cp.supportsClientRedirect)
       encodings[nEncodings++] = RFB.ENCODING_CLIENT_REDIRECT;
+    if (cp.supportsVideoRegion)
+      encodings[nEncodings++] = RFB.ENCODING_VIDEO_REGION;
 
     encodings[nEncodings++] = RFB.ENCODING_LAST_RECT;
     if (opts.continuousUpdates) {
@@ -107,6 +107,18 @@ public class CMsgWriterV3 extends CMsgWriter {
     endMsg();
   }
 
+  public synchronized void writeRequestKeyframe(int id) {
+    if (!cp.supportsKeyframeRequest)
+      throw new ErrorException("Server does not support keyframe requests");
+
+    startMsg(RFB.REQUEST_KEYFRAME);
+    os.pad(3);
+
+    os.writeU32(id);
+
+    endMsg();
+  }
+
   public synchronized void writeGIIVersion() {
     if (!cp.supportsGII)
       throw new ErrorException("Server does not support GII");
@@ -35,6 +35,8 @@ public class ConnParams {
     supportsContinuousUpdates = false;
     supportsClientRedirect = false;
     supportsGII = false;
+    supportsVideoRegion = false;
+    supportsKeyframeRequest = false;
     name = null;  nEncodings = 0;  encodings = null;
     verStrPos = 0;
     screenLayout = new ScreenSet();
@@ -129,6 +131,8 @@ public class ConnParams {
   public boolean supportsContinuousUpdates;
   public boolean supportsLastRect;
   public boolean supportsGII;
+  public boolean supportsVideoRegion;
+  public boolean supportsKeyframeRequest;
 
   public boolean supportsSetDesktopSize;
   // CHECKSTYLE VisibilityModifier:ON
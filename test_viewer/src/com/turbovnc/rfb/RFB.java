@@ -177,8 +177,12 @@ public final class RFB {
   public static final int CLIENT_CUT_TEXT            = 6;
 
   public static final int ENABLE_CONTINUOUS_UPDATES  = 150;
+  public static final int REQUEST_KEYFRAME           = 160;
   public static final int SET_DESKTOP_SIZE           = 251;
 
+  // RequestKeyframe
+  public static final int KEYFRAME_ALL_OUTPUTS = 0xFFFFFFFF;
+
   // Server -> Client and Client -> Server
   public static final int FENCE = 248;
   public static final int GII   = 253;
@@ -235,6 +239,7 @@ public final class RFB {
   public static final int ENCODING_X_CURSOR              = -240;
   public static final int ENCODING_RICH_CURSOR           = -239;
   public static final int ENCODING_NEW_FB_SIZE           = -223;
+  public static final int ENCODING_VIDEO_REGION          = -222;
 
   // TightVNC-specific
   public static final int ENCODING_COMPRESS_LEVEL_0 = -256;
@@ -104,6 +104,9 @@ public class CConn extends CConnection implements UserPasswdGetter,
     cp.supportsExtendedDesktopSize = true;
     cp.supportsClientRedirect = VncViewer.clientRedirect.getValue();
     cp.supportsDesktopRename = true;
+    // The RTSP thread decodes the H.264 streams, so the server can send the
+    // rest of the desktop using RFB (hybrid mode.)
+    cp.supportsVideoRegion = true;
     menu = new F8Menu(this);
 
     if (VncViewer.noUnixLogin.getValue()) {
@@ -762,6 +765,11 @@ public class CConn extends CConnection implements UserPasswdGetter,
     desktop.setCursor(width, height, hotspot, data, mask);
   }
 
+  // RFB thread
+  public void setVideoRegion(Rect[] rects) {
+    desktop.setVideoRegion(rects);
+  }
+
   // RFB thread
   public void fence(int flags, int len, byte[] data) {
     // can't call super.super.fence(flags, len, data);
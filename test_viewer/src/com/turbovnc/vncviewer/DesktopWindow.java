@@ -35,6 +35,7 @@ import java.awt.image.*;
 import java.awt.datatransfer.DataFlavor;
 import java.awt.datatransfer.Transferable;
 import java.awt.datatransfer.Clipboard;
+import java.awt.geom.Area;
 import java.io.BufferedReader;
 import java.lang.reflect.*;
 import java.nio.*;
@@ -58,7 +59,7 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
   }
   
   
-  BufferedImage BImage;	//	ALTER
+  volatile BufferedImage BImage;	//	ALTER
   
   // RFB thread
   DesktopWindow(int width, int height, PixelFormat serverPF, CConn cc_) {
@@ -126,6 +127,136 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
     viewport.setChild(this);
   }
 
+  // RFB thread
+  // Within the video region, the H.264 stream (BImage) is displayed instead of
+  // the RFB framebuffer.  Until the server sends a video region, it isn't in
+  // hybrid mode, and the H.264 stream covers the whole desktop.
+  public void setVideoRegion(Rect[] rects) {
+    Area area = new Area();
+
+    for (int i = 0; i < rects.length; i++)
+      area.add(new Area(new Rectangle(rects[i].tl.x, rects[i].tl.y,
+                                      rects[i].width(), rects[i].height())));
+    videoRegion = area;
+    repaint();
+  }
+
+  // RTSP thread: Display a new decoded H.264 frame.  In hybrid mode, only the
+  // bounds of the video region are repainted, since the RFB framebuffer is
+  // displayed everywhere else.
+  public void presentFrame(BufferedImage frame) {
+    Area video = videoRegion;
+
+    BImage = frame;
+    frameCount++;
+    if (video == null)
+      queueRepaint(new Rectangle(0, 0, getWidth(), getHeight()));
+    else if (!video.isEmpty())
+      queueRepaint(toWindow(video.getBounds()));
+  }
+
+  // Convert a rectangle in framebuffer coordinates to window coordinates.
+  private Rectangle toWindow(Rectangle r) {
+    int x = r.x, y = r.y, width = r.width, height = r.height;
+
+    if (cc.cp.width != scaledWidth || cc.cp.height != scaledHeight) {
+      x = (int)Math.floor(r.x * scaleWidthRatio);
+      y = (int)Math.floor(r.y * scaleHeightRatio);
+      // Need one extra pixel to account for rounding.
+      width = (int)Math.ceil(r.width * scaleWidthRatio) + 1;
+      height = (int)Math.ceil(r.height * scaleHeightRatio) + 1;
+    }
+    if (cc.viewport != null) {
+      if (cc.viewport.dx > 0)
+        x += cc.viewport.dx;
+      if (cc.viewport.dy > 0)
+        y += cc.viewport.dy;
+    }
+    return new Rectangle(x, y, width, height);
+  }
+
+  // Add a rectangle (in window coordinates) to the area that the EDT will
+  // paint next, and schedule that paint unless one is already pending.  Thus,
+  // if the EDT falls behind, then successive RFB updates and H.264 frames are
+  // presented with a single paint rather than with one paint apiece.
+  private void queueRepaint(Rectangle r) {
+    synchronized(repaintLock) {
+      if (pendingRepaint != null) {
+        pendingRepaint.add(r);
+        return;
+      }
+      pendingRepaint = r;
+    }
+    SwingUtilities.invokeLater(presentRunnable);
+  }
+
+  // EDT
+  private final Runnable presentRunnable = new Runnable() {
+    public void run() {
+      Rectangle r;
+      synchronized(repaintLock) {
+        r = pendingRepaint;
+        pendingRepaint = null;
+      }
+      if (r == null)
+        return;
+      if (!swingDB)
+        RepaintManager.currentManager(DesktopWindow.this)
+          .setDoubleBufferingEnabled(false);
+      paintImmediately(r);
+    }
+  };
+
+  // EDT: Copy the latest H.264 frame into a VolatileImage (accelerated, where
+  // available), so that the frame is uploaded once rather than every time
+  // the window is painted.  In hybrid mode, only the video region is copied.
+  // count is the value of frameCount read before frame, so a frame that
+  // arrives during the paint is uploaded again by the paint that it schedules.
+  // Returns the frame itself if the VolatileImage can't be used.
+  private Image syncVideoImage(BufferedImage frame, long count, Area video) {
+    GraphicsConfiguration gc = getGraphicsConfiguration();
+    int w = frame.getWidth(), h = frame.getHeight();
+    int status = VolatileImage.IMAGE_INCOMPATIBLE;
+
+    if (!useVolatile || gc == null)
+      return frame;
+    if (vFrame != null && vFrame.getWidth() == w && vFrame.getHeight() == h)
+      status = vFrame.validate(gc);
+    if (status == VolatileImage.IMAGE_INCOMPATIBLE) {
+      if (vFrame != null) {
+        vFrame.flush();
+        vFrame = null;
+      }
+      try {
+        vFrame = gc.createCompatibleVolatileImage(w, h);
+      } catch (Exception e) {
+        vlog.debug("Could not create VolatileImage: " + e.getMessage());
+      }
+      if (vFrame == null) {
+        useVolatile = false;
+        return frame;
+      }
+      vFrame.validate(gc);
+    }
+
+    if (status != VolatileImage.IMAGE_OK || count != uploadedFrame ||
+        video != uploadedRegion) {
+      Graphics2D vg = vFrame.createGraphics();
+      if (video != null)
+        vg.clip(video);
+      vg.drawImage(frame, 0, 0, null);
+      vg.dispose();
+      uploadedFrame = count;
+      uploadedRegion = video;
+    }
+
+    if (vFrame.contentsLost()) {
+      uploadedFrame = -1;
+      return frame;
+    }
+    return vFrame;
+  }
+
   // RFB thread
   public void setCursor(int w, int h, Point hotspot,
                         int[] data, byte[] mask) {
@@ -268,8 +399,8 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
           RepaintManager.currentManager(this).setDoubleBufferingEnabled(false);
         if (cc.viewer.benchFile != null)
           paintImmediately(x, y, width, height);
-//        else										ALTER
-//          repaint(x, y, width, height);			ALTER
+        else if (videoRegion != null)					// ALTER
+          queueRepaint(new Rectangle(x, y, width, height));	// ALTER
       } else {
         int x = r.tl.x;
         int y = r.tl.y;
@@ -283,8 +414,8 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
           RepaintManager.currentManager(this).setDoubleBufferingEnabled(false);
         if (cc.viewer.benchFile != null)
           paintImmediately(x, y, r.width(), r.height());
-//        else										ALTER
-//          repaint(x, y, r.width(), r.height());	ALTER
+        else if (videoRegion != null)					// ALTER
+          queueRepaint(new Rectangle(x, y, r.width(), r.height()));	// ALTER
       }
       damage.clear();
     }
@@ -406,8 +537,16 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
   public void paintComponent(Graphics g) {
 	  
 	// --------------------------------------------------------------------------
-		if (BImage != null) {										// ALTER
-		    g.drawImage(BImage, 0, 0, null);						// ALTER
+		long count = frameCount;									// ALTER
+		BufferedImage frame = BImage;								// ALTER
+		Area video = videoRegion;									// ALTER
+		Image vframe = null;										// ALTER
+		if (frame != null)											// ALTER
+		    vframe = syncVideoImage(frame, count, video);			// ALTER
+		if (frame != null && video == null) {						// ALTER
+		    g.drawImage(vframe, 0, 0, null);						// ALTER
+		    if (!swingDB)											// ALTER
+		      RepaintManager.currentManager(this).setDoubleBufferingEnabled(true);	// ALTER
 		    return;													// ALTER
 		}															// ALTER
 	// --------------------------------------------------------------------------
@@ -429,6 +568,14 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
       g2.drawImage(im.getImage(), r.x, r.y, r.x + r.width, r.y + r.height,
                    r.x, r.y, r.x + r.width, r.y + r.height, null);
     }
+    if (frame != null && !video.isEmpty()) {
+      Graphics2D g3 = (Graphics2D)g2.create();
+      if (cc.cp.width != scaledWidth || cc.cp.height != scaledHeight)
+        g3.scale(scaleWidthRatio, scaleHeightRatio);
+      g3.clip(video);
+      g3.drawImage(vframe, 0, 0, null);
+      g3.dispose();
+    }
     g2.dispose();
     if (!swingDB)
       RepaintManager.currentManager(this).setDoubleBufferingEnabled(true);
@@ -844,6 +991,17 @@ class DesktopWindow extends JPanel implements Runnable, MouseListener,
 
   int lastX, lastY;  // EDT only
   Rect damage = new Rect();
+  volatile Area videoRegion;
+
+  // The most recent H.264 frame is presented through a VolatileImage, and RFB
+  // updates and H.264 frames are coalesced into a single pending paint.
+  boolean useVolatile = true;                           // EDT only
+  VolatileImage vFrame;                                 // EDT only
+  long uploadedFrame = -1;                              // EDT only
+  Area uploadedRegion;                                  // EDT only
+  volatile long frameCount;
+  final Object repaintLock = new Object();
+  Rectangle pendingRepaint;     // protected by repaintLock
 
   static LogWriter vlog = new LogWriter("DesktopWindow");
 }
@@ -1,19 +1,45 @@
 package com.turbovnc.vncviewer;
 
+import org.bytedeco.ffmpeg.avutil.LogCallback;
 import org.bytedeco.ffmpeg.global.avcodec;
+import org.bytedeco.ffmpeg.global.avutil;
+import org.bytedeco.javacpp.BytePointer;
 import org.bytedeco.javacv.FFmpegFrameGrabber;
 import org.bytedeco.javacv.Frame;
 import org.bytedeco.javacv.FrameGrabber.Exception;
 import org.bytedeco.javacv.Java2DFrameConverter;
 
+import com.turbovnc.rfb.RFB;
+
 public class RtspRunnable implements Runnable {
 
+	// Minimum time between keyframe requests, in nanoseconds
+	static final long KEYFRAME_REQUEST_INTERVAL = 1000000000L;
+	// Number of consecutive grabber errors after which the stream is abandoned
+	static final int MAX_GRAB_ERRORS = 10;
+
+	// The H.264 decoder conceals damaged macroblocks rather than failing, so
+	// grab() still returns a frame when packets are lost.  The decoder does log
+	// an error, though, so watch FFmpeg's log for errors instead.
+	static class DecodeErrorCallback extends LogCallback {
+		volatile String error;
+
+		@Override
+		public void call(int level, BytePointer msg) {
+			if (level <= avutil.AV_LOG_ERROR)
+				error = msg.getString().trim();
+		}
+	}
+
+	static DecodeErrorCallback decodeErrors;
+
 	FFmpegFrameGrabber grabber;
 	Frame frame;
 	Java2DFrameConverter converter;
 	DesktopWindow desktop;
 	String servername;
 	boolean running;
+	long lastKeyframeRequest;
 
 	public RtspRunnable(DesktopWindow _desktop, String _servername) {
 		desktop = _desktop;
@@ -26,29 +52,79 @@ public class RtspRunnable implements Runnable {
 		// grabber.setVideoOption();
 
 		running = true;
+
+		synchronized (RtspRunnable.class) {
+			if (decodeErrors == null) {
+				decodeErrors = new DecodeErrorCallback();
+				decodeErrors.retainReference();
+				avutil.setLogCallback(decodeErrors);
+			}
+		}
+	}
+
+	// Ask the server to encode its next frame as a keyframe, so that the
+	// decoder can recover from lost or corrupted packets without reconnecting.
+	// Errors are reported only when a request is sent, so a burst of errors
+	// produces one line rather than one per frame.
+	void requestKeyframe(String reason) {
+		long now = System.nanoTime();
+		if (lastKeyframeRequest != 0 &&
+		    now - lastKeyframeRequest < KEYFRAME_REQUEST_INTERVAL)
+			return;
+		lastKeyframeRequest = now;
+
+		CConn cc = desktop.cc;
+		if (cc.writer() == null || !cc.cp.supportsKeyframeRequest) {
+			System.err.println("Video stream error: " + reason);
+			return;
+		}
+		System.err.println("Video stream error (requesting keyframe): " + reason);
+		try {
+			cc.writer().writeRequestKeyframe(RFB.KEYFRAME_ALL_OUTPUTS);
+		} catch (java.lang.Exception e) {
+			System.err.println("Could not request keyframe: " + e.getMessage());
+		}
 	}
 
 	@Override
 	public void run() {
 		try {
-			
+
 			int framenum = 0;
 			long fps_start = System.nanoTime();
 			long decode_start;
 			long end = 0;
 			int i = 0;			//frame count to decode frame
 			int bufsize = 3;	//size of h.264 buffer, drops duplicate frames
-			
+			int errors = 0;		//consecutive grabber errors
+
 			grabber.start();
-			while (running && (frame = grabber.grab()) != null) {
+			while (running) {
+				try {
+					decodeErrors.error = null;
+					frame = grabber.grab();
+					errors = 0;
+				} catch (Exception e) {
+					// The decoder has lost track of the stream.  Request a
+					// keyframe and keep reading, unless the stream is gone.
+					if (++errors >= MAX_GRAB_ERRORS)
+						throw e;
+					requestKeyframe(e.getMessage());
+					continue;
+				}
+				if (frame == null)
+					break;
+				String error = decodeErrors.error;
+				if (error != null)
+					requestKeyframe(error);
+
 				if(i==0) {
 
 					// Decode frame
 					// Uncomment to get frame time to calculate input latency
 					// and to get decode time.
 //					decode_start = System.nanoTime();
-					desktop.BImage = converter.convert(frame);
-					desktop.repaint();
+					desktop.presentFrame(converter.convert(frame));
 //					System.out.println((System.nanoTime() - decode_start) + "decode time");
 //					System.out.println(System.nanoTime() + "frame time");
 
@@ -61,7 +137,7 @@ public class RtspRunnable implements Runnable {
 						framenum = 0;
 					}
 				}
-				
+
 				i++;
 				i = i % bufsize;
 			}